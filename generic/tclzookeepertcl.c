@@ -57,6 +57,17 @@ Zookeeper_Init(Tcl_Interp *interp)
     /* Create the create command  */
     Tcl_CreateObjCommand(interp, "::zookeeper::zookeeper", (Tcl_ObjCmdProc *) zootcl_zookeeperObjCmd, (ClientData)NULL, (Tcl_CmdDeleteProc *)NULL);
 
+    /* And the accessor for stat objects */
+    Tcl_RegisterObjType (&zootcl_statObjType);
+    Tcl_CreateObjCommand(interp, "::zookeeper::stat", (Tcl_ObjCmdProc *) zootcl_statObjCmd, (ClientData)NULL, (Tcl_CmdDeleteProc *)NULL);
+
+    /* And the path helpers */
+    Tcl_RegisterObjType (&zootcl_pathObjType);
+    Tcl_CreateObjCommand(interp, "::zookeeper::path", (Tcl_ObjCmdProc *) zootcl_pathObjCmd, (ClientData)NULL, (Tcl_CmdDeleteProc *)NULL);
+
+    /* And readers of mirror files */
+    Tcl_CreateObjCommand(interp, "::zookeeper::mirror", (Tcl_ObjCmdProc *) zootcl_mirrorObjCmd, (ClientData)NULL, (Tcl_CmdDeleteProc *)NULL);
+
     Tcl_Export (interp, namespace, "*", 0);
 
     return TCL_OK;
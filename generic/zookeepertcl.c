@@ -10,8 +10,16 @@
 
 #include "zookeepertcl.h"
 #include <assert.h>
+#include <stddef.h>
+#include <ctype.h>
+#include <limits.h>
+#include <stdint.h>
 #include <stdlib.h>
 #include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 #include <arpa/inet.h>
 #include <sys/socket.h>
 #include <netinet/in.h>
@@ -23,10 +31,406 @@ zootcl_EventProc (Tcl_Event *tevPtr, int flags);
 int 
 zootcl_DeleteEventsForDeletedObject (Tcl_Event *tevPtr, ClientData clientData);
 
+void
+zootcl_lock_cleanup (zootcl_objectClientData *zo);
+
+void
+zootcl_election_cleanup (zootcl_objectClientData *zo);
+
+void
+zootcl_queue_cleanup (zootcl_objectClientData *zo);
+
+void
+zootcl_registry_cleanup (zootcl_objectClientData *zo);
+
+void
+zootcl_children_cleanup (zootcl_objectClientData *zo);
+
+void
+zootcl_trace_cleanup (zootcl_objectClientData *zo);
+
+void
+zootcl_hotkeys_cleanup (zootcl_objectClientData *zo);
+
+void
+zootcl_mirror_cleanup (zootcl_objectClientData *zo);
+
+void
+zootcl_hotkeys_count (zootcl_objectClientData *zo, int op, const char *path);
+
+void
+zootcl_async_cleanup (zootcl_objectClientData *zo);
+
+void
+zootcl_async_answered (zootcl_objectClientData *zo);
+
+int
+zootcl_request_answered (zootcl_objectClientData *zo, int requestId);
+
+int
+zootcl_time_remaining (const Tcl_Time *deadline, Tcl_Time *remainingPtr);
+
+void
+zootcl_deadline (Tcl_Time *deadline, int ms);
+
 #ifdef THREADED
 // This is not apparently normally called from THREADED.
 ZOOAPI int zookeeper_process(zhandle_t *zh, int events);
+#else
+/*
+ * Single-threaded client
+ *
+ * Built with --enable-singlethreaded we link zookeeper_st, which has no
+ * IO or completion thread.  The Tcl event loop drives the client through
+ * our event source and completions and watchers run right in the
+ * interpreter's thread.
+ *
+ * zookeeper_st doesn't have the synchronous calls, so the ones we use
+ * are provided below on top of the asynchronous ones.  They run the
+ * client themselves until their answer comes back.
+ */
+#include <poll.h>
+
+/*
+ *--------------------------------------------------------------
+ *
+ * zootcl_drive -- do one round of IO for the client, waiting up to
+ *   timeout (or as long as the client lets us if NULL) for its socket
+ *
+ * Results:
+ *      the status of zookeeper_interest or zookeeper_process
+ *
+ *--------------------------------------------------------------
+ */
+static int
+zootcl_drive (zhandle_t *zh, const Tcl_Time *timeout)
+{
+	int fd;
+	int interest;
+	int events = 0;
+	struct timeval tv;
+
+	int status = zookeeper_interest (zh, &fd, &interest, &tv);
+	if (status != ZOK && status != ZNOTHING) {
+		return status;
+	}
+
+	int ms = tv.tv_sec * 1000 + tv.tv_usec / 1000;
+	if (timeout != NULL && timeout->sec * 1000 + timeout->usec / 1000 < ms) {
+		ms = timeout->sec * 1000 + timeout->usec / 1000;
+	}
+
+	if (fd == -1) {
+		// not connected, the client wants to be called back after a bit
+		Tcl_Sleep (ms);
+	} else {
+		struct pollfd pfd;
+
+		pfd.fd = fd;
+		pfd.events = ((interest & ZOOKEEPER_READ) ? POLLIN : 0) | ((interest & ZOOKEEPER_WRITE) ? POLLOUT : 0);
+		pfd.revents = 0;
+		if (poll (&pfd, 1, ms) > 0) {
+			if (pfd.revents & (POLLIN | POLLHUP | POLLERR)) {
+				events |= ZOOKEEPER_READ;
+			}
+			if (pfd.revents & POLLOUT) {
+				events |= ZOOKEEPER_WRITE;
+			}
+		}
+	}
+
+	return zookeeper_process (zh, events);
+}
+
+typedef struct zootcl_syncCall {
+	int done;
+	int abandoned;
+	int rc;
+	// what the particular call wants filled in
+	char *buffer;
+	int *bufferLen;
+	struct Stat *stat;
+	struct String_vector *strings;
+	char *pathBuffer;
+	int pathBufferLen;
+} zootcl_syncCall;
+
+static zootcl_syncCall *
+zootcl_sync_call_new (void)
+{
+	zootcl_syncCall *call = (zootcl_syncCall *)ckalloc (sizeof (zootcl_syncCall));
+
+	memset (call, 0, sizeof (zootcl_syncCall));
+	return call;
+}
+
+/*
+ *--------------------------------------------------------------
+ *
+ * zootcl_sync_finish -- called by each sync completion once it's
+ *   been given the answer
+ *
+ * Results:
+ *      1 if the caller is still waiting and the results should be
+ *      filled in, 0 if it gave up and the call has been freed
+ *
+ *--------------------------------------------------------------
+ */
+static int
+zootcl_sync_finish (zootcl_syncCall *call, int rc)
+{
+	if (call->abandoned) {
+		ckfree (call);
+		return 0;
+	}
+	call->rc = rc;
+	call->done = 1;
+	return 1;
+}
+
+/*
+ *--------------------------------------------------------------
+ *
+ * zootcl_sync_wait -- run the client until the request given to
+ *   the asynchronous call that returned status has been answered
+ *
+ * Results:
+ *      the status of the request.  call is freed.
+ *
+ *--------------------------------------------------------------
+ */
+static int
+zootcl_sync_wait (zhandle_t *zh, zootcl_syncCall *call, int status)
+{
+	if (status != ZOK) {
+		// the request was never sent
+		ckfree (call);
+		return status;
+	}
+
+	while (!call->done) {
+		status = zootcl_drive (zh, NULL);
+		if (status == ZINVALIDSTATE && !call->done) {
+			// the session is over and no answer is coming
+			call->abandoned = 1;
+			return status;
+		}
+	}
+
+	status = call->rc;
+	ckfree (call);
+	return status;
+}
+
+static void
+zootcl_sync_void_completion (int rc, const void *data)
+{
+	zootcl_sync_finish ((zootcl_syncCall *)data, rc);
+}
+
+static void
+zootcl_sync_stat_completion (int rc, const struct Stat *stat, const void *data)
+{
+	zootcl_syncCall *call = (zootcl_syncCall *)data;
+
+	if (zootcl_sync_finish (call, rc) && rc == ZOK && call->stat != NULL) {
+		*call->stat = *stat;
+	}
+}
+
+static void
+zootcl_sync_data_completion (int rc, const char *value, int valueLen, const struct Stat *stat, const void *data)
+{
+	zootcl_syncCall *call = (zootcl_syncCall *)data;
+
+	if (!zootcl_sync_finish (call, rc) || rc != ZOK) {
+		return;
+	}
+
+	if (call->stat != NULL) {
+		*call->stat = *stat;
+	}
+
+	// like zoo_get, a NULL value comes back as a length of -1
+	if (value == NULL || valueLen < 0) {
+		*call->bufferLen = -1;
+		return;
+	}
+	if (valueLen < *call->bufferLen) {
+		*call->bufferLen = valueLen;
+	}
+	memcpy (call->buffer, value, *call->bufferLen);
+}
+
+static void
+zootcl_sync_strings_completion (int rc, const struct String_vector *strings, const void *data)
+{
+	zootcl_syncCall *call = (zootcl_syncCall *)data;
+	int i;
+
+	if (!zootcl_sync_finish (call, rc) || rc != ZOK) {
+		return;
+	}
+
+	// the caller frees these with deallocate_String_vector
+	call->strings->count = strings->count;
+	call->strings->data = (char **)calloc (strings->count, sizeof (char *));
+	for (i = 0; i < strings->count; i++) {
+		call->strings->data[i] = strdup (strings->data[i]);
+	}
+}
+
+static void
+zootcl_sync_string_completion (int rc, const char *value, const void *data)
+{
+	zootcl_syncCall *call = (zootcl_syncCall *)data;
+
+	if (!zootcl_sync_finish (call, rc) || rc != ZOK || call->pathBufferLen <= 0) {
+		return;
+	}
+
+	int length = strlen (value);
+	if (length >= call->pathBufferLen) {
+		length = call->pathBufferLen - 1;
+	}
+	memcpy (call->pathBuffer, value, length);
+	call->pathBuffer[length] = '\0';
+}
+
+static int
+zootcl_sync_create (zhandle_t *zh, const char *path, const char *value, int valueLen, const struct ACL_vector *acl, int flags, char *pathBuffer, int pathBufferLen)
+{
+	zootcl_syncCall *call = zootcl_sync_call_new ();
+
+	call->pathBuffer = pathBuffer;
+	call->pathBufferLen = pathBufferLen;
+	return zootcl_sync_wait (zh, call, zoo_acreate (zh, path, value, valueLen, acl, flags, zootcl_sync_string_completion, call));
+}
+
+static int
+zootcl_sync_delete (zhandle_t *zh, const char *path, int version)
+{
+	zootcl_syncCall *call = zootcl_sync_call_new ();
+
+	return zootcl_sync_wait (zh, call, zoo_adelete (zh, path, version, zootcl_sync_void_completion, call));
+}
+
+static int
+zootcl_sync_wexists (zhandle_t *zh, const char *path, watcher_fn watcher, void *watcherCtx, struct Stat *stat)
+{
+	zootcl_syncCall *call = zootcl_sync_call_new ();
+
+	call->stat = stat;
+	return zootcl_sync_wait (zh, call, zoo_awexists (zh, path, watcher, watcherCtx, zootcl_sync_stat_completion, call));
+}
+
+static int
+zootcl_sync_exists (zhandle_t *zh, const char *path, int watch, struct Stat *stat)
+{
+	zootcl_syncCall *call = zootcl_sync_call_new ();
+
+	call->stat = stat;
+	return zootcl_sync_wait (zh, call, zoo_aexists (zh, path, watch, zootcl_sync_stat_completion, call));
+}
+
+static int
+zootcl_sync_wget (zhandle_t *zh, const char *path, watcher_fn watcher, void *watcherCtx, char *buffer, int *bufferLen, struct Stat *stat)
+{
+	zootcl_syncCall *call = zootcl_sync_call_new ();
+
+	call->buffer = buffer;
+	call->bufferLen = bufferLen;
+	call->stat = stat;
+	return zootcl_sync_wait (zh, call, zoo_awget (zh, path, watcher, watcherCtx, zootcl_sync_data_completion, call));
+}
+
+static int
+zootcl_sync_get (zhandle_t *zh, const char *path, int watch, char *buffer, int *bufferLen, struct Stat *stat)
+{
+	zootcl_syncCall *call = zootcl_sync_call_new ();
+
+	call->buffer = buffer;
+	call->bufferLen = bufferLen;
+	call->stat = stat;
+	return zootcl_sync_wait (zh, call, zoo_aget (zh, path, watch, zootcl_sync_data_completion, call));
+}
+
+static int
+zootcl_sync_wget_children (zhandle_t *zh, const char *path, watcher_fn watcher, void *watcherCtx, struct String_vector *strings)
+{
+	zootcl_syncCall *call = zootcl_sync_call_new ();
+
+	call->strings = strings;
+	return zootcl_sync_wait (zh, call, zoo_awget_children (zh, path, watcher, watcherCtx, zootcl_sync_strings_completion, call));
+}
+
+static int
+zootcl_sync_get_children (zhandle_t *zh, const char *path, int watch, struct String_vector *strings)
+{
+	zootcl_syncCall *call = zootcl_sync_call_new ();
+
+	call->strings = strings;
+	return zootcl_sync_wait (zh, call, zoo_aget_children (zh, path, watch, zootcl_sync_strings_completion, call));
+}
+
+static int
+zootcl_sync_set2 (zhandle_t *zh, const char *path, const char *buffer, int bufferLen, int version, struct Stat *stat)
+{
+	zootcl_syncCall *call = zootcl_sync_call_new ();
+
+	call->stat = stat;
+	return zootcl_sync_wait (zh, call, zoo_aset (zh, path, buffer, bufferLen, version, zootcl_sync_stat_completion, call));
+}
+
+static int
+zootcl_sync_multi (zhandle_t *zh, int count, const zoo_op_t *ops, zoo_op_result_t *results)
+{
+	zootcl_syncCall *call = zootcl_sync_call_new ();
+
+	return zootcl_sync_wait (zh, call, zoo_amulti (zh, count, ops, results, zootcl_sync_void_completion, call));
+}
+
+#define zoo_create zootcl_sync_create
+#define zoo_delete zootcl_sync_delete
+#define zoo_exists zootcl_sync_exists
+#define zoo_wexists zootcl_sync_wexists
+#define zoo_get zootcl_sync_get
+#define zoo_wget zootcl_sync_wget
+#define zoo_get_children zootcl_sync_get_children
+#define zoo_wget_children zootcl_sync_wget_children
+#define zoo_set2 zootcl_sync_set2
+#define zoo_multi zootcl_sync_multi
+#endif
+
+/*
+ *--------------------------------------------------------------
+ *
+ * zootcl_condition_wait -- wait on a condition that's signalled from
+ *   a watcher or completion, like Tcl_ConditionWait.  mutex must be
+ *   held.
+ *
+ *   in the single-threaded build nothing else will run the client, so
+ *   we do it ourselves while we wait, with the mutex released.
+ *
+ *   as with Tcl_ConditionWait this can return before the condition is
+ *   signalled, callers check for what they're waiting on and loop.
+ *
+ *--------------------------------------------------------------
+ */
+static void
+zootcl_condition_wait (zhandle_t *zh, Tcl_Condition *cond, Tcl_Mutex *mutex, const Tcl_Time *timeout)
+{
+#ifdef THREADED
+	Tcl_ConditionWait (cond, mutex, timeout);
+#else
+	Tcl_MutexUnlock (mutex);
+	if (zootcl_drive (zh, timeout) == ZINVALIDSTATE) {
+		// the session's gone, don't spin
+		Tcl_Sleep ((timeout == NULL || timeout->sec > 0) ? 1000 : timeout->usec / 1000);
+	}
+	Tcl_MutexLock (mutex);
 #endif
+}
 
 /*
  *--------------------------------------------------------------
@@ -52,6 +456,10 @@ const char *zootcl_state_to_string (int state)
 		return "associating";
 	if (state == ZOO_CONNECTED_STATE)
 		return "connected";
+#ifdef ZOOTCL_ZOO_35
+	if (state == ZOO_READONLY_STATE)
+		return "connectedreadonly";
+#endif
 	if (state == ZOO_EXPIRED_SESSION_STATE)
 		return "expired";
 	if (state == ZOO_AUTH_FAILED_STATE)
@@ -182,6 +590,14 @@ const char *zootcl_error_to_code_string (int status)
 		case ZSESSIONMOVED:
 			return "ZSESSIONMOVED";
 
+#ifdef ZOOTCL_ZOO_35
+		case ZNOTREADONLY:
+			return "ZNOTREADONLY";
+#endif
+
+		case ZOOTCL_UNCHANGED:
+			return "ZUNCHANGED";
+
 		default:
 			return "ZUNKNOWN";
 	}
@@ -252,41 +668,444 @@ int zootcl_stat_to_array (Tcl_Interp *interp, char *arrayName, struct Stat *stat
 }
 
 /*
- * 
+ * Stat object type
+ *
+ * A Tcl value wrapping a struct Stat.  It reads like a dict of the
+ * same elements zootcl_stat_to_array sets, but the string rep is only
+ * made if someone asks for it and zookeeper::stat get picks fields
+ * straight out of the struct.
  */
+static CONST char *zootcl_statFields[] = {
+	"czxid",
+	"mzxid",
+	"ctime",
+	"mtime",
+	"version",
+	"cversion",
+	"aversion",
+	"ephemeralOwner",
+	"dataLength",
+	"numChildren",
+	"pzxid",
+	NULL
+};
+
+enum zootcl_statField {
+	STAT_CZXID,
+	STAT_MZXID,
+	STAT_CTIME,
+	STAT_MTIME,
+	STAT_VERSION,
+	STAT_CVERSION,
+	STAT_AVERSION,
+	STAT_EPHEMERALOWNER,
+	STAT_DATALENGTH,
+	STAT_NUMCHILDREN,
+	STAT_PZXID,
+	STAT_NFIELDS
+};
+
+static void zootcl_stat_free_internal_rep (Tcl_Obj *objPtr);
+static void zootcl_stat_dup_internal_rep (Tcl_Obj *srcPtr, Tcl_Obj *dupPtr);
+static void zootcl_stat_update_string (Tcl_Obj *objPtr);
+static int zootcl_stat_set_from_any (Tcl_Interp *interp, Tcl_Obj *objPtr);
+
+Tcl_ObjType zootcl_statObjType = {
+	"zookeeper_stat",
+	zootcl_stat_free_internal_rep,
+	zootcl_stat_dup_internal_rep,
+	zootcl_stat_update_string,
+	zootcl_stat_set_from_any
+};
+
+#define ZOOTCL_STAT(objPtr) ((struct Stat *)(objPtr)->internalRep.twoPtrValue.ptr1)
+
+static Tcl_WideInt
+zootcl_stat_field (const struct Stat *stat, int field)
+{
+	switch ((enum zootcl_statField) field) {
+		case STAT_CZXID: return stat->czxid;
+		case STAT_MZXID: return stat->mzxid;
+		case STAT_CTIME: return stat->ctime;
+		case STAT_MTIME: return stat->mtime;
+		case STAT_VERSION: return stat->version;
+		case STAT_CVERSION: return stat->cversion;
+		case STAT_AVERSION: return stat->aversion;
+		case STAT_EPHEMERALOWNER: return stat->ephemeralOwner;
+		case STAT_DATALENGTH: return stat->dataLength;
+		case STAT_NUMCHILDREN: return stat->numChildren;
+		case STAT_PZXID: return stat->pzxid;
+		case STAT_NFIELDS: break;
+	}
+	return 0;
+}
+
+static void
+zootcl_stat_set_field (struct Stat *stat, int field, Tcl_WideInt value)
+{
+	switch ((enum zootcl_statField) field) {
+		case STAT_CZXID: stat->czxid = value; break;
+		case STAT_MZXID: stat->mzxid = value; break;
+		case STAT_CTIME: stat->ctime = value; break;
+		case STAT_MTIME: stat->mtime = value; break;
+		case STAT_VERSION: stat->version = (int32_t)value; break;
+		case STAT_CVERSION: stat->cversion = (int32_t)value; break;
+		case STAT_AVERSION: stat->aversion = (int32_t)value; break;
+		case STAT_EPHEMERALOWNER: stat->ephemeralOwner = value; break;
+		case STAT_DATALENGTH: stat->dataLength = (int32_t)value; break;
+		case STAT_NUMCHILDREN: stat->numChildren = (int32_t)value; break;
+		case STAT_PZXID: stat->pzxid = value; break;
+		case STAT_NFIELDS: break;
+	}
+}
+
+static void
+zootcl_stat_free_internal_rep (Tcl_Obj *objPtr)
+{
+	ckfree ((char *)ZOOTCL_STAT (objPtr));
+	objPtr->typePtr = NULL;
+}
+
+static void
+zootcl_stat_dup_internal_rep (Tcl_Obj *srcPtr, Tcl_Obj *dupPtr)
+{
+	struct Stat *stat = (struct Stat *)ckalloc (sizeof (struct Stat));
+
+	*stat = *ZOOTCL_STAT (srcPtr);
+	dupPtr->internalRep.twoPtrValue.ptr1 = stat;
+	dupPtr->typePtr = &zootcl_statObjType;
+}
+
+static void
+zootcl_stat_update_string (Tcl_Obj *objPtr)
+{
+	struct Stat *stat = ZOOTCL_STAT (objPtr);
+	Tcl_DString ds;
+	char number[32];
+	int field;
+
+	Tcl_DStringInit (&ds);
+	for (field = 0; field < STAT_NFIELDS; field++) {
+		snprintf (number, sizeof (number), "%" TCL_LL_MODIFIER "d", (Tcl_WideInt)zootcl_stat_field (stat, field));
+		Tcl_DStringAppendElement (&ds, zootcl_statFields[field]);
+		Tcl_DStringAppendElement (&ds, number);
+	}
+
+	objPtr->length = Tcl_DStringLength (&ds);
+	objPtr->bytes = ckalloc (objPtr->length + 1);
+	memcpy (objPtr->bytes, Tcl_DStringValue (&ds), objPtr->length + 1);
+	Tcl_DStringFree (&ds);
+}
+
 /*
  *--------------------------------------------------------------
  *
- * get_in_addr - given a sockaddr struct pointer, return whether
- *  we need a sockaddr_in or a sockaddr_in6
- *
- * http://beej.us/guide/bgnet/examples/client.c
- *
- * Results:
- *      returns pointer to correct sockaddr_in depending on 
- *      whether sa is IPv4 or IPv6
- *
- * Side effects:
- *		none
+ * zootcl_stat_set_from_any -- turn a list of key-value pairs with
+ *   all the stat elements in it back into a stat, for when a stat
+ *   has lost its internal rep
  *
  *--------------------------------------------------------------
  */
-void *get_in_addr(struct sockaddr *sa)
+static int
+zootcl_stat_set_from_any (Tcl_Interp *interp, Tcl_Obj *objPtr)
 {
-    if (sa->sa_family == AF_INET)
-        return &(((struct sockaddr_in*)sa)->sin_addr);
-    return &(((struct sockaddr_in6*)sa)->sin6_addr);
+	struct Stat stat;
+	Tcl_Obj **listObjv;
+	int listObjc;
+	int seen = 0;
+	int i;
+
+	memset (&stat, 0, sizeof (stat));
+
+	// make sure there's a string rep to fall back on before the
+	// list rep we're about to make is thrown away
+	Tcl_GetString (objPtr);
+
+	if (Tcl_ListObjGetElements (interp, objPtr, &listObjc, &listObjv) != TCL_OK) {
+		return TCL_ERROR;
+	}
+
+	if (listObjc % 2 != 0) {
+		goto bad;
+	}
+
+	for (i = 0; i < listObjc; i += 2) {
+		Tcl_WideInt value;
+		int field;
+
+		if (Tcl_GetIndexFromObj (interp, listObjv[i], zootcl_statFields, "stat field", TCL_EXACT, &field) != TCL_OK) {
+			return TCL_ERROR;
+		}
+		if (Tcl_GetWideIntFromObj (interp, listObjv[i + 1], &value) != TCL_OK) {
+			return TCL_ERROR;
+		}
+		zootcl_stat_set_field (&stat, field, value);
+		seen |= 1 << field;
+	}
+
+	if (seen != (1 << STAT_NFIELDS) - 1) {
+		goto bad;
+	}
+
+	if (objPtr->typePtr != NULL && objPtr->typePtr->freeIntRepProc != NULL) {
+		objPtr->typePtr->freeIntRepProc (objPtr);
+	}
+
+	struct Stat *statPtr = (struct Stat *)ckalloc (sizeof (struct Stat));
+	*statPtr = stat;
+	objPtr->internalRep.twoPtrValue.ptr1 = statPtr;
+	objPtr->typePtr = &zootcl_statObjType;
+	return TCL_OK;
+
+  bad:
+	if (interp != NULL) {
+		Tcl_SetObjResult (interp, Tcl_ObjPrintf ("\"%s\" isn't a zookeeper stat", Tcl_GetString (objPtr)));
+	}
+	return TCL_ERROR;
 }
 
 /*
  *--------------------------------------------------------------
  *
- * zootcl_set_tcl_return_code -- given a zookeeper status
- *   return TCL_OK if it's ZOK else set an error result and
- *   return TCL_ERROR
+ * zootcl_new_stat_obj -- given a zookeeper Stat struct return
+ *   a new stat object
  *
  * Results:
- *      returns TCL_OK or TCL_ERROR
+ *      returns a new Tcl object with no string rep
+ *
+ *--------------------------------------------------------------
+ */
+Tcl_Obj *zootcl_new_stat_obj (const struct Stat *stat)
+{
+	Tcl_Obj *objPtr = Tcl_NewObj ();
+	struct Stat *statPtr = (struct Stat *)ckalloc (sizeof (struct Stat));
+
+	*statPtr = *stat;
+	Tcl_InvalidateStringRep (objPtr);
+	objPtr->internalRep.twoPtrValue.ptr1 = statPtr;
+	objPtr->typePtr = &zootcl_statObjType;
+	return objPtr;
+}
+
+/*
+ *--------------------------------------------------------------
+ *
+ * zootcl_stat_key_objs -- return this thread's shared objects for
+ *   the names of the stat fields, so callbacks don't have to make
+ *   new ones every time
+ *
+ *--------------------------------------------------------------
+ */
+typedef struct zootcl_statKeys {
+	Tcl_Obj *keys[STAT_NFIELDS];
+	int initialized;
+} zootcl_statKeys;
+
+static Tcl_ThreadDataKey zootcl_statKeysKey;
+
+static void
+zootcl_stat_keys_exit (ClientData clientData)
+{
+	zootcl_statKeys *sk = (zootcl_statKeys *)clientData;
+	int field;
+
+	for (field = 0; field < STAT_NFIELDS; field++) {
+		Tcl_DecrRefCount (sk->keys[field]);
+	}
+	sk->initialized = 0;
+}
+
+Tcl_Obj **
+zootcl_stat_key_objs (void)
+{
+	zootcl_statKeys *sk = (zootcl_statKeys *)Tcl_GetThreadData (&zootcl_statKeysKey, sizeof (zootcl_statKeys));
+	int field;
+
+	if (!sk->initialized) {
+		for (field = 0; field < STAT_NFIELDS; field++) {
+			sk->keys[field] = Tcl_NewStringObj (zootcl_statFields[field], -1);
+			Tcl_IncrRefCount (sk->keys[field]);
+		}
+		sk->initialized = 1;
+		Tcl_CreateThreadExitHandler (zootcl_stat_keys_exit, (ClientData)sk);
+	}
+	return sk->keys;
+}
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * zootcl_statObjCmd --
+ *
+ *      implement the zookeeper::stat command
+ *
+ *      zookeeper::stat get stat field
+ *
+ * Results:
+ *      A standard Tcl result.
+ *
+ *----------------------------------------------------------------------
+ */
+int
+zootcl_statObjCmd(ClientData clientData, Tcl_Interp *interp, int objc, Tcl_Obj *CONST objv[])
+{
+	static CONST char *actions[] = {
+		"get",
+		NULL
+	};
+
+	int actionIndex;
+	int field;
+
+	if (objc != 4) {
+		Tcl_WrongNumArgs (interp, 1, objv, "get stat field");
+		return TCL_ERROR;
+	}
+
+	if (Tcl_GetIndexFromObj (interp, objv[1], actions, "action", TCL_EXACT, &actionIndex) != TCL_OK) {
+		return TCL_ERROR;
+	}
+
+	if (objv[2]->typePtr != &zootcl_statObjType && zootcl_stat_set_from_any (interp, objv[2]) != TCL_OK) {
+		return TCL_ERROR;
+	}
+
+	if (Tcl_GetIndexFromObj (interp, objv[3], zootcl_statFields, "stat field", TCL_EXACT, &field) != TCL_OK) {
+		return TCL_ERROR;
+	}
+
+	Tcl_SetObjResult (interp, Tcl_NewWideIntObj (zootcl_stat_field (ZOOTCL_STAT (objv[2]), field)));
+	return TCL_OK;
+}
+
+/*
+ *--------------------------------------------------------------
+ *
+ * zootcl_client_id_to_obj -- given a zookeeper client id
+ *   return a Tcl list of the session id and the session
+ *   password, the latter hex encoded since it is binary
+ *
+ * Results:
+ *      returns a new Tcl list object
+ *
+ * Side effects:
+ *      None.
+ *
+ *--------------------------------------------------------------
+ */
+Tcl_Obj *zootcl_client_id_to_obj (const clientid_t *cid)
+{
+	char passwd[sizeof (cid->passwd) * 2 + 1];
+	Tcl_Obj *listObjv[2];
+	int i;
+
+	for (i = 0; i < (int)sizeof (cid->passwd); i++) {
+		snprintf (&passwd[i * 2], 3, "%02x", (unsigned char)cid->passwd[i]);
+	}
+
+	listObjv[0] = Tcl_NewWideIntObj ((Tcl_WideInt)cid->client_id);
+	listObjv[1] = Tcl_NewStringObj (passwd, -1);
+	return Tcl_NewListObj (2, listObjv);
+}
+
+/*
+ *--------------------------------------------------------------
+ *
+ * zootcl_obj_to_client_id -- given a Tcl list of a session id
+ *   and hex encoded password as produced by zootcl_client_id_to_obj,
+ *   fill in a zookeeper client id
+ *
+ * Results:
+ *      returns TCL_OK or TCL_ERROR with an error message in the
+ *      interpreter result
+ *
+ * Side effects:
+ *      None.
+ *
+ *--------------------------------------------------------------
+ */
+int zootcl_obj_to_client_id (Tcl_Interp *interp, Tcl_Obj *obj, clientid_t *cid)
+{
+	int listObjc;
+	Tcl_Obj **listObjv;
+	Tcl_WideInt sessionId;
+	int passwdLen;
+	int i;
+
+	if (Tcl_ListObjGetElements (interp, obj, &listObjc, &listObjv) == TCL_ERROR) {
+		return TCL_ERROR;
+	}
+
+	if (listObjc != 2) {
+		Tcl_SetObjResult (interp, Tcl_NewStringObj ("session must be a list of session id and password", -1));
+		return TCL_ERROR;
+	}
+
+	if (Tcl_GetWideIntFromObj (interp, listObjv[0], &sessionId) == TCL_ERROR) {
+		return TCL_ERROR;
+	}
+
+	char *passwd = Tcl_GetStringFromObj (listObjv[1], &passwdLen);
+	if (passwdLen != sizeof (cid->passwd) * 2) {
+		Tcl_SetObjResult (interp, Tcl_NewStringObj ("malformed session password", -1));
+		return TCL_ERROR;
+	}
+
+	memset (cid, 0, sizeof (clientid_t));
+	cid->client_id = (int64_t)sessionId;
+	for (i = 0; i < (int)sizeof (cid->passwd); i++) {
+		unsigned char hi = (unsigned char)passwd[i * 2];
+		unsigned char lo = (unsigned char)passwd[i * 2 + 1];
+
+		// exactly two hex digits per byte, nothing sscanf would skip
+		if (!isxdigit (hi) || !isxdigit (lo)) {
+			Tcl_SetObjResult (interp, Tcl_NewStringObj ("malformed session password", -1));
+			return TCL_ERROR;
+		}
+		hi = isdigit (hi) ? hi - '0' : tolower (hi) - 'a' + 10;
+		lo = isdigit (lo) ? lo - '0' : tolower (lo) - 'a' + 10;
+		cid->passwd[i] = (char)((hi << 4) | lo);
+	}
+
+	return TCL_OK;
+}
+
+/*
+ * 
+ */
+/*
+ *--------------------------------------------------------------
+ *
+ * get_in_addr - given a sockaddr struct pointer, return whether
+ *  we need a sockaddr_in or a sockaddr_in6
+ *
+ * http://beej.us/guide/bgnet/examples/client.c
+ *
+ * Results:
+ *      returns pointer to correct sockaddr_in depending on 
+ *      whether sa is IPv4 or IPv6
+ *
+ * Side effects:
+ *		none
+ *
+ *--------------------------------------------------------------
+ */
+void *get_in_addr(struct sockaddr *sa)
+{
+    if (sa->sa_family == AF_INET)
+        return &(((struct sockaddr_in*)sa)->sin_addr);
+    return &(((struct sockaddr_in6*)sa)->sin6_addr);
+}
+
+/*
+ *--------------------------------------------------------------
+ *
+ * zootcl_set_tcl_return_code -- given a zookeeper status
+ *   return TCL_OK if it's ZOK else set an error result and
+ *   return TCL_ERROR
+ *
+ * Results:
+ *      returns TCL_OK or TCL_ERROR
  *
  * Side effects:
  *      May set an error message into the Tcl result and
@@ -300,7 +1119,7 @@ zootcl_set_tcl_return_code (Tcl_Interp *interp, int status) {
 		return TCL_OK;
 	}
 	const char *stateString = zootcl_error_to_code_string (status);
-	const char *messageString = zerror (status);
+	const char *messageString = (status == ZOOTCL_UNCHANGED) ? "znode unchanged" : zerror (status);
 
 	// NB this needs to be spruced up to set errorCode and a
 	// better error message and stuff
@@ -309,6 +1128,245 @@ zootcl_set_tcl_return_code (Tcl_Interp *interp, int status) {
 	return TCL_ERROR;
 }
 
+/*
+ * Metrics
+ *
+ * Counters are bumped on whatever thread sees the thing happen, the
+ * completion thread for answers and watch events, so they're kept
+ * under a mutex.  Each object has its own and every count is added to
+ * the process-wide set as well.
+ */
+TCL_DECLARE_MUTEX(zootcl_metricsMutex)
+
+static zootcl_metrics zootcl_globalMetrics;
+
+#define ZOOTCL_COUNT(zo, field, n) zootcl_count ((zo), offsetof (zootcl_metrics, field), (n))
+
+static void
+zootcl_count (zootcl_objectClientData *zo, size_t offset, Tcl_WideInt n)
+{
+	Tcl_MutexLock (&zootcl_metricsMutex);
+	*(Tcl_WideInt *)((char *)&zo->metrics + offset) += n;
+	*(Tcl_WideInt *)((char *)&zootcl_globalMetrics + offset) += n;
+	Tcl_MutexUnlock (&zootcl_metricsMutex);
+}
+
+static int
+zootcl_status_slot (int status)
+{
+	if (status == ZOOTCL_UNCHANGED) {
+		return ZOOTCL_STATUS_SLOTS - 1;
+	}
+	if (status > 0 || -status >= ZOOTCL_STATUS_SLOTS - 1) {
+		// shows up as ZUNKNOWN
+		return ZOOTCL_STATUS_SLOTS - 2;
+	}
+	return -status;
+}
+
+/*
+ *--------------------------------------------------------------
+ *
+ * zootcl_count_request -- count a request answered with status,
+ *   along with the bytes of data it brought back
+ *
+ *--------------------------------------------------------------
+ */
+static void
+zootcl_count_request (zootcl_objectClientData *zo, enum zootcl_requestKind kind, int status, int bytesReceived)
+{
+	int slot = zootcl_status_slot (status);
+
+	Tcl_MutexLock (&zootcl_metricsMutex);
+	zo->metrics.requests[kind][slot]++;
+	zootcl_globalMetrics.requests[kind][slot]++;
+	if (bytesReceived > 0) {
+		zo->metrics.bytesReceived += bytesReceived;
+		zootcl_globalMetrics.bytesReceived += bytesReceived;
+	}
+	Tcl_MutexUnlock (&zootcl_metricsMutex);
+}
+
+/*
+ *--------------------------------------------------------------
+ *
+ * zootcl_count_sent -- count a request that has gone to zookeeper,
+ *   the watch it sets and the data it carries
+ *
+ *--------------------------------------------------------------
+ */
+static void
+zootcl_count_sent (zootcl_objectClientData *zo, int watch, int bytesSent)
+{
+	if (watch) {
+		ZOOTCL_COUNT (zo, watchesRegistered, 1);
+	}
+	if (bytesSent > 0) {
+		ZOOTCL_COUNT (zo, bytesSent, bytesSent);
+	}
+}
+
+/*
+ * Tracing
+ *
+ * With tracing on, each request and event an object handles is written
+ * to a ring of records.  Records are only ever written in the object's
+ * thread, as requests are made and events dispatched, so the ring needs
+ * no lock; the completion thread just stamps the time into the event it
+ * queues.
+ */
+static void zootcl_trace_stream (ClientData clientData);
+
+static Tcl_WideInt
+zootcl_trace_clock (void)
+{
+	Tcl_Time now;
+
+	Tcl_GetTime (&now);
+	return (Tcl_WideInt)now.sec * 1000000 + now.usec;
+}
+
+// the time now if the object is tracing, else 0
+static Tcl_WideInt
+zootcl_trace_now (zootcl_objectClientData *zo)
+{
+	return zo->tracing ? zootcl_trace_clock () : 0;
+}
+
+/*
+ *--------------------------------------------------------------
+ *
+ * zootcl_trace_next -- take the next record in the ring, overwriting
+ *   the oldest once it's full, and see it gets streamed
+ *
+ *--------------------------------------------------------------
+ */
+static zootcl_traceRecord *
+zootcl_trace_next (zootcl_objectClientData *zo)
+{
+	zootcl_traceRing *ring = zo->trace;
+	zootcl_traceRecord *rec = &ring->records[ring->next % ring->size];
+
+	ring->next++;
+	if (ring->callbacksObj != NULL && !ring->streamPending) {
+		ring->streamPending = 1;
+		Tcl_DoWhenIdle (zootcl_trace_stream, (ClientData)zo);
+	}
+	return rec;
+}
+
+// note when and on what path an -async request was made
+static void
+zootcl_trace_start (zootcl_objectClientData *zo, zootcl_callbackContext *ztc, const char *path)
+{
+	ztc->submitTime = zootcl_trace_now (zo);
+	ztc->pathHash = ztc->submitTime ? zootcl_path_hash (path, strlen (path)) : 0;
+}
+
+// on the completion thread, pass the trace details of the request
+// being answered along in its event
+static void
+zootcl_trace_completed (zootcl_callbackEvent *evPtr, const zootcl_callbackContext *ztc)
+{
+	evPtr->trace.kind = ztc->kind;
+	evPtr->trace.submitTime = ztc->submitTime;
+	evPtr->trace.completeTime = ztc->submitTime ? zootcl_trace_clock () : 0;
+	evPtr->trace.pathHash = ztc->pathHash;
+}
+
+// on the completion thread, note when a watch or session event came in
+static void
+zootcl_trace_fired (zootcl_callbackEvent *evPtr, const char *path)
+{
+	evPtr->trace.submitTime = 0;
+	evPtr->trace.completeTime = zootcl_trace_now (evPtr->zo);
+	evPtr->trace.pathHash = evPtr->trace.completeTime ? zootcl_path_hash (path, strlen (path)) : 0;
+}
+
+/*
+ *--------------------------------------------------------------
+ *
+ * zootcl_trace_event -- record an event being dispatched
+ *
+ *--------------------------------------------------------------
+ */
+static void
+zootcl_trace_event (zootcl_objectClientData *zo, const zootcl_callbackEvent *evPtr)
+{
+	Tcl_WideInt now = zootcl_trace_clock ();
+	Tcl_WideInt completed = evPtr->trace.completeTime ? evPtr->trace.completeTime : now;
+	zootcl_traceRecord *rec = zootcl_trace_next (zo);
+
+	rec->async = 1;
+	rec->pathHash = evPtr->trace.pathHash;
+	rec->dispatchUs = (int)(now - completed);
+
+	if (evPtr->callbackType == WATCHER_CALLBACK || evPtr->callbackType == INTERNAL_INIT_CALLBACK) {
+		rec->op = (evPtr->callbackType == WATCHER_CALLBACK) ? TRACE_WATCH : TRACE_SESSION;
+		rec->time = completed;
+		rec->rc = evPtr->watcher.type;
+		rec->state = evPtr->watcher.state;
+		rec->completeUs = 0;
+	} else {
+		rec->op = evPtr->trace.kind;
+		rec->time = evPtr->trace.submitTime ? evPtr->trace.submitTime : completed;
+		rec->rc = evPtr->data.rc;
+		rec->state = 0;
+		rec->completeUs = (int)(completed - rec->time);
+	}
+}
+
+/*
+ *--------------------------------------------------------------
+ *
+ * zootcl_trace_sync -- record a synchronous request made at start
+ *
+ *--------------------------------------------------------------
+ */
+static void
+zootcl_trace_sync (zootcl_objectClientData *zo, enum zootcl_requestKind kind, const char *path, Tcl_WideInt start, int status)
+{
+	if (!zo->tracing) {
+		return;
+	}
+
+	Tcl_WideInt now = zootcl_trace_clock ();
+	zootcl_traceRecord *rec = zootcl_trace_next (zo);
+
+	rec->time = start ? start : now;
+	rec->op = kind;
+	rec->async = 0;
+	rec->pathHash = zootcl_path_hash (path, strlen (path));
+	rec->rc = status;
+	rec->state = 0;
+	rec->completeUs = (int)(now - rec->time);
+	rec->dispatchUs = 0;
+}
+
+/*
+ *--------------------------------------------------------------
+ *
+ * zootcl_queue_event -- queue an event to the object's thread and
+ *   wake anything awaiting requests on it
+ *
+ *--------------------------------------------------------------
+ */
+TCL_DECLARE_MUTEX(zootcl_awaitMutex)
+
+static void
+zootcl_queue_event (zootcl_objectClientData *zo, zootcl_callbackEvent *evPtr)
+{
+	ZOOTCL_COUNT (zo, eventsQueued, 1);
+	Tcl_ThreadQueueEvent (zo->threadId, (Tcl_Event *)evPtr, TCL_QUEUE_TAIL);
+
+	Tcl_MutexLock (&zootcl_awaitMutex);
+	zo->eventsQueued++;
+	Tcl_ConditionNotify (&zo->eventQueued);
+	Tcl_MutexUnlock (&zootcl_awaitMutex);
+
+	Tcl_ThreadAlert (zo->threadId);
+}
+
 /*
  *--------------------------------------------------------------
  *
@@ -331,6 +1389,9 @@ zootcl_data_completion_callback (int rc, const char *value, int valueLen, const
 
 	evPtr->callbackType = DATA_CALLBACK;
 	evPtr->commandObj = ztc->callbackObj;
+	evPtr->requestId = ztc->requestId;
+	zootcl_count_request (ztc->zo, ztc->kind, rc, (value != NULL) ? valueLen : 0);
+	zootcl_trace_completed (evPtr, ztc);
 
 	evPtr->data.rc = rc;
 
@@ -350,8 +1411,7 @@ zootcl_data_completion_callback (int rc, const char *value, int valueLen, const
     evPtr->zo = ztc->zo;
 	ckfree(ztc);
 
-	Tcl_ThreadQueueEvent (evPtr->zo->threadId, (Tcl_Event *)evPtr, TCL_QUEUE_TAIL);
-	Tcl_ThreadAlert (evPtr->zo->threadId);
+	zootcl_queue_event (evPtr->zo, evPtr);
 }
 
 /*
@@ -376,6 +1436,9 @@ zootcl_string_completion_callback (int rc, const char *value, const void *contex
 
 	evPtr->callbackType = STRING_CALLBACK;
 	evPtr->commandObj = ztc->callbackObj;
+	evPtr->requestId = ztc->requestId;
+	zootcl_count_request (ztc->zo, ztc->kind, rc, 0);
+	zootcl_trace_completed (evPtr, ztc);
 	evPtr->data.rc = rc;
 
 	// if value is NULL then there is no value associated with this znode
@@ -389,8 +1452,7 @@ zootcl_string_completion_callback (int rc, const char *value, const void *contex
     evPtr->zo = ztc->zo;
 	ckfree(ztc);
 
-	Tcl_ThreadQueueEvent (evPtr->zo->threadId, (Tcl_Event *)evPtr, TCL_QUEUE_TAIL);
-	Tcl_ThreadAlert (evPtr->zo->threadId);
+	zootcl_queue_event (evPtr->zo, evPtr);
 }
 
 /*
@@ -411,6 +1473,9 @@ zootcl_strings_completion_callback (int rc, const struct String_vector *strings,
 
 	evPtr->callbackType = STRING_CALLBACK;
 	evPtr->commandObj = ztc->callbackObj;
+	evPtr->requestId = ztc->requestId;
+	zootcl_count_request (ztc->zo, ztc->kind, rc, 0);
+	zootcl_trace_completed (evPtr, ztc);
 	evPtr->data.rc = rc;
  	evPtr->zo = ztc->zo;
 	ckfree(ztc);
@@ -430,35 +1495,85 @@ zootcl_strings_completion_callback (int rc, const struct String_vector *strings,
 
 	evPtr->data.dataObj = listObj;
 
-	Tcl_ThreadQueueEvent (evPtr->zo->threadId, (Tcl_Event *)evPtr, TCL_QUEUE_TAIL);
-	Tcl_ThreadAlert (evPtr->zo->threadId);
+	zootcl_queue_event (evPtr->zo, evPtr);
 }
 
 /*
  *--------------------------------------------------------------
  *
- * zootcl_void_completion_callback -- void completion callback function
+ * zootcl_ifnewer_completion_callback -- completion of the exists
+ *   check of an async get or children -ifnewer
+ *
+ * if the znode has changed since the zxid we were given, go on and
+ * read it, handing the real completion callback the context we were
+ * given.  otherwise answer with ZUNCHANGED straight away.
  *
  *--------------------------------------------------------------
  */
 void
-zootcl_void_completion_callback (int rc, const void *context)
+zootcl_ifnewer_completion_callback (int rc, const struct Stat *stat, const void *context)
 {
-	zootcl_callbackEvent *evPtr;
-	zootcl_callbackContext *ztc = (zootcl_callbackContext *)context;
+	zootcl_ifNewerContext *inc = (zootcl_ifNewerContext *)context;
+	zootcl_callbackContext *ztc = (zootcl_callbackContext *)ckalloc (sizeof (zootcl_callbackContext));
+
+	ztc->zo = inc->zo;
+	ztc->callbackObj = inc->callbackObj;
+	ztc->requestId = inc->requestId;
+	ztc->kind = inc->children ? REQ_CHILDREN : REQ_GET;
+	ztc->submitTime = inc->submitTime;
+	ztc->pathHash = inc->pathHash;
+
+	if (rc == ZOK) {
+		Tcl_WideInt zxid = inc->children ? stat->pzxid : stat->mzxid;
+
+		if (zxid <= inc->zxid) {
+			rc = ZOOTCL_UNCHANGED;
+		} else if (inc->children) {
+			rc = zoo_aget_children (inc->zo->zh, inc->path, 0, zootcl_strings_completion_callback, ztc);
+		} else {
+			rc = zoo_aget (inc->zo->zh, inc->path, 0, zootcl_data_completion_callback, ztc);
+		}
+	}
 
-	evPtr = ckalloc (sizeof (zootcl_callbackEvent));
-	evPtr->event.proc = zootcl_EventProc;
+	if (rc != ZOK) {
+		if (inc->children) {
+			zootcl_strings_completion_callback (rc, NULL, ztc);
+		} else {
+			zootcl_data_completion_callback (rc, NULL, -1, NULL, ztc);
+		}
+	}
+
+	ckfree (inc->path);
+	ckfree (inc);
+}
+
+/*
+ *--------------------------------------------------------------
+ *
+ * zootcl_void_completion_callback -- void completion callback function
+ *
+ *--------------------------------------------------------------
+ */
+void
+zootcl_void_completion_callback (int rc, const void *context)
+{
+	zootcl_callbackEvent *evPtr;
+	zootcl_callbackContext *ztc = (zootcl_callbackContext *)context;
+
+	evPtr = ckalloc (sizeof (zootcl_callbackEvent));
+	evPtr->event.proc = zootcl_EventProc;
 
 	evPtr->callbackType = VOID_CALLBACK;
 	evPtr->commandObj = ztc->callbackObj;
+	evPtr->requestId = ztc->requestId;
+	zootcl_count_request (ztc->zo, ztc->kind, rc, 0);
+	zootcl_trace_completed (evPtr, ztc);
 	evPtr->data.dataObj = NULL;
 	evPtr->data.rc = rc;
     evPtr->zo = ztc->zo;
 	ckfree(ztc);
 
-	Tcl_ThreadQueueEvent (evPtr->zo->threadId, (Tcl_Event *)evPtr, TCL_QUEUE_TAIL);
-	Tcl_ThreadAlert (evPtr->zo->threadId);
+	zootcl_queue_event (evPtr->zo, evPtr);
 }
 
 /*
@@ -479,6 +1594,9 @@ zootcl_stat_completion_callback (int rc, const struct Stat *stat, const void *co
 
 	evPtr->callbackType = STAT_CALLBACK;
 	evPtr->commandObj = ztc->callbackObj;
+	evPtr->requestId = ztc->requestId;
+	zootcl_count_request (ztc->zo, ztc->kind, rc, 0);
+	zootcl_trace_completed (evPtr, ztc);
 
 	evPtr->data.rc = rc;
 	evPtr->data.dataObj = NULL;
@@ -490,8 +1608,7 @@ zootcl_stat_completion_callback (int rc, const struct Stat *stat, const void *co
     evPtr->zo = ztc->zo;
 	ckfree(ztc);
 
-	Tcl_ThreadQueueEvent (evPtr->zo->threadId, (Tcl_Event *)evPtr, TCL_QUEUE_TAIL);
-	Tcl_ThreadAlert (evPtr->zo->threadId);
+	zootcl_queue_event (evPtr->zo, evPtr);
 }
 
 /*
@@ -512,8 +1629,34 @@ zootcl_queue_null_event (zootcl_syncCallbackContext *zsc)
 	evPtr = ckalloc (sizeof (zootcl_callbackEvent));
 	evPtr->event.proc = zootcl_EventProc;
 	evPtr->callbackType = NULL_CALLBACK;
-	Tcl_ThreadQueueEvent (zsc->zo->threadId, (Tcl_Event *)evPtr, TCL_QUEUE_TAIL);
-	Tcl_ThreadAlert (zsc->zo->threadId);
+	evPtr->zo = zsc->zo;
+	zootcl_queue_event (zsc->zo, evPtr);
+}
+
+
+/*
+ *--------------------------------------------------------------
+ *
+ * zootcl_queue_recipe_event -- queue an event to the interpreter's
+ * thread that invokes a C recipe's event proc there
+ *
+ *--------------------------------------------------------------
+ */
+void
+zootcl_queue_recipe_event (zootcl_objectClientData *zo, zootcl_RecipeProc *proc, ClientData clientData, int type, int state)
+{
+	zootcl_callbackEvent *evPtr;
+
+	evPtr = ckalloc (sizeof (zootcl_callbackEvent));
+	evPtr->event.proc = zootcl_EventProc;
+	evPtr->callbackType = RECIPE_CALLBACK;
+	evPtr->zo = zo;
+	evPtr->commandObj = NULL;
+	evPtr->recipe.proc = proc;
+	evPtr->recipe.clientData = clientData;
+	evPtr->recipe.type = type;
+	evPtr->recipe.state = state;
+	zootcl_queue_event (zo, evPtr);
 }
 
 
@@ -658,18 +1801,351 @@ void zootcl_watcher (zhandle_t *zh, int type, int state, const char *path, void*
     evPtr->zo = (zootcl_objectClientData *)zoo_get_context (zh);
 	evPtr->commandObj = (Tcl_Obj *)context;
 
+	if (type != ZOO_SESSION_EVENT) {
+		ZOOTCL_COUNT (evPtr->zo, watchesFired, 1);
+	}
+	zootcl_trace_fired (evPtr, path);
+
 	evPtr->watcher.type = type;
 	evPtr->watcher.state = state;
 
 	evPtr->watcher.path = ckalloc (strlen (path) + 1);
 	strcpy (evPtr->watcher.path, path);
 
-	Tcl_ThreadQueueEvent (evPtr->zo->threadId, (Tcl_Event *)evPtr, TCL_QUEUE_TAIL);
-	Tcl_ThreadAlert (evPtr->zo->threadId);
+	zootcl_queue_event (evPtr->zo, evPtr);
 
 	// printf("**** zootcl_watcher invoked type '%s' state '%s' path '%s' command '%s'; event queued\n", zootcl_type_to_string (type), zootcl_state_to_string (state), path, Tcl_GetString (evPtr->commandObj));
 }
 
+/*
+ * Watch filters
+ *
+ * A -watchfilter on a -watch is checked on the completion thread, so
+ * events the script doesn't care about never wake the interpreter.  It
+ * can pick the event types to deliver, the states to deliver session
+ * events for, and for data watches whether a changed event should be
+ * dropped if the data turns out to be the same.  That last one refetches
+ * the data with the watch left up again, and keeps going until the data
+ * really changes.
+ *
+ * Like a plain -watch, the event is delivered at most once.  Session
+ * events other than expiry don't use up a watch, so they don't count.
+ */
+TCL_DECLARE_MUTEX(zootcl_watchFilterMutex)
+
+static CONST char *zootcl_eventTypeNames[] = {
+	"created",
+	"deleted",
+	"changed",
+	"child",
+	"session",
+	"not_watching",
+	NULL
+};
+
+static CONST char *zootcl_stateNames[] = {
+	"closed",
+	"connecting",
+	"associating",
+	"connected",
+	"connectedreadonly",
+	"expired",
+	"auth_failed",
+	NULL
+};
+
+static int
+zootcl_name_index (CONST char **names, const char *name)
+{
+	int i;
+
+	for (i = 0; names[i] != NULL; i++) {
+		if (strcmp (names[i], name) == 0) {
+			return i;
+		}
+	}
+	return -1;
+}
+
+/*
+ *--------------------------------------------------------------
+ *
+ * zootcl_data_hash -- FNV-1a hash of znode data, length -1 being
+ *   a NULL value
+ *
+ *--------------------------------------------------------------
+ */
+static Tcl_WideInt
+zootcl_data_hash (const char *data, int dataLen)
+{
+	Tcl_WideUInt hash = 14695981039346656037ULL;
+	int i;
+
+	if (data == NULL || dataLen < 0) {
+		return (Tcl_WideInt)~hash;
+	}
+	for (i = 0; i < dataLen; i++) {
+		hash = (hash ^ (unsigned char)data[i]) * 1099511628211ULL;
+	}
+	return (Tcl_WideInt)hash;
+}
+
+/*
+ *--------------------------------------------------------------
+ *
+ * zootcl_new_watch_filter -- make a watch filter from a
+ *   -watchfilter spec, a list of
+ *
+ *     types {created deleted changed child session not_watching}
+ *     states {closed connecting associating connected ...}
+ *     ifchanged boolean
+ *
+ *   keys that are left out let everything through
+ *
+ * Results:
+ *      the filter, holding a reference for the caller and one for the
+ *      watch, or NULL with an error in the interpreter
+ *
+ *--------------------------------------------------------------
+ */
+static zootcl_watchFilter *
+zootcl_new_watch_filter (Tcl_Interp *interp, Tcl_Obj *specObj, zhandle_t *zh, Tcl_Obj *commandObj, const char *path, int allowIfChanged)
+{
+	static CONST char *keys[] = {
+		"types",
+		"states",
+		"ifchanged",
+		NULL
+	};
+
+	enum keys {
+		KEY_TYPES,
+		KEY_STATES,
+		KEY_IFCHANGED
+	};
+
+	int specObjc;
+	Tcl_Obj **specObjv;
+	int typeMask = ~0;
+	int stateMask = ~0;
+	int ifChanged = 0;
+	int i;
+
+	if (Tcl_ListObjGetElements (interp, specObj, &specObjc, &specObjv) == TCL_ERROR) {
+		return NULL;
+	}
+
+	if (specObjc % 2 != 0) {
+		Tcl_SetObjResult (interp, Tcl_NewStringObj ("-watchfilter must be a list of key-value pairs", -1));
+		return NULL;
+	}
+
+	for (i = 0; i < specObjc; i += 2) {
+		int keyIndex;
+		int listObjc;
+		Tcl_Obj **listObjv;
+		int j;
+		int index;
+
+		if (Tcl_GetIndexFromObj (interp, specObjv[i], keys, "filter key", TCL_EXACT, &keyIndex) != TCL_OK) {
+			return NULL;
+		}
+
+		switch ((enum keys) keyIndex) {
+			case KEY_TYPES:
+			case KEY_STATES:
+			{
+				CONST char **names = ((enum keys) keyIndex == KEY_TYPES) ? zootcl_eventTypeNames : zootcl_stateNames;
+				int mask = 0;
+
+				if (Tcl_ListObjGetElements (interp, specObjv[i + 1], &listObjc, &listObjv) == TCL_ERROR) {
+					return NULL;
+				}
+				for (j = 0; j < listObjc; j++) {
+					if (Tcl_GetIndexFromObj (interp, listObjv[j], names, ((enum keys) keyIndex == KEY_TYPES) ? "event type" : "state", TCL_EXACT, &index) != TCL_OK) {
+						return NULL;
+					}
+					mask |= (1 << index);
+				}
+
+				if ((enum keys) keyIndex == KEY_TYPES) {
+					typeMask = mask;
+				} else {
+					stateMask = mask;
+				}
+				break;
+			}
+
+			case KEY_IFCHANGED:
+			{
+				if (Tcl_GetBooleanFromObj (interp, specObjv[i + 1], &ifChanged) == TCL_ERROR) {
+					return NULL;
+				}
+				if (ifChanged && !allowIfChanged) {
+					Tcl_SetObjResult (interp, Tcl_NewStringObj ("-watchfilter ifchanged only applies to get", -1));
+					return NULL;
+				}
+				break;
+			}
+		}
+	}
+
+	zootcl_watchFilter *wf = (zootcl_watchFilter *)ckalloc (sizeof (zootcl_watchFilter));
+	memset (wf, 0, sizeof (zootcl_watchFilter));
+	wf->zh = zh;
+	wf->commandObj = commandObj;
+	wf->path = ckalloc (strlen (path) + 1);
+	strcpy (wf->path, path);
+	wf->typeMask = typeMask;
+	wf->stateMask = stateMask;
+	wf->ifChanged = ifChanged;
+	wf->refCount = 2;
+	return wf;
+}
+
+static void
+zootcl_watch_filter_release (zootcl_watchFilter *wf)
+{
+	Tcl_MutexLock (&zootcl_watchFilterMutex);
+	int refCount = --wf->refCount;
+	Tcl_MutexUnlock (&zootcl_watchFilterMutex);
+
+	if (refCount == 0) {
+		ckfree (wf->path);
+		ckfree (wf);
+	}
+}
+
+/*
+ *--------------------------------------------------------------
+ *
+ * zootcl_watch_filter_registered -- called by the subcommand that set
+ *   up a filtered watch once the request is done, to give up its
+ *   reference.  watchSet says whether zookeeper left the watch; data
+ *   is the znode's data if it was read, for ifchanged.
+ *
+ *--------------------------------------------------------------
+ */
+static void
+zootcl_watch_filter_registered (zootcl_watchFilter *wf, int watchSet, int haveData, const char *data, int dataLen)
+{
+	if (haveData) {
+		Tcl_MutexLock (&zootcl_watchFilterMutex);
+		if (!wf->hashValid) {
+			wf->hash = zootcl_data_hash (data, dataLen);
+			wf->hashValid = 1;
+		}
+		Tcl_MutexUnlock (&zootcl_watchFilterMutex);
+	}
+
+	if (!watchSet) {
+		zootcl_watch_filter_release (wf);
+	}
+	zootcl_watch_filter_release (wf);
+}
+
+/*
+ *--------------------------------------------------------------
+ *
+ * zootcl_watch_filter_deliver -- pass an event on to the interpreter
+ *   if the filter wants it and the watch hasn't delivered one yet
+ *
+ *--------------------------------------------------------------
+ */
+static void
+zootcl_watch_filter_deliver (zootcl_watchFilter *wf, int type, int state, const char *path)
+{
+	int typeIndex = zootcl_name_index (zootcl_eventTypeNames, zootcl_type_to_string (type));
+	int stateIndex = zootcl_name_index (zootcl_stateNames, zootcl_state_to_string (state));
+
+	if (typeIndex >= 0 && !(wf->typeMask & (1 << typeIndex))) {
+		return;
+	}
+	if (type == ZOO_SESSION_EVENT && stateIndex >= 0 && !(wf->stateMask & (1 << stateIndex))) {
+		return;
+	}
+
+	Tcl_MutexLock (&zootcl_watchFilterMutex);
+	int delivered = wf->delivered;
+	if (type != ZOO_SESSION_EVENT) {
+		wf->delivered = 1;
+	}
+	Tcl_MutexUnlock (&zootcl_watchFilterMutex);
+
+	if (!delivered) {
+		zootcl_watcher (wf->zh, type, state, path, (void *)wf->commandObj);
+	}
+}
+
+static void zootcl_filtered_watcher (zhandle_t *zh, int type, int state, const char *path, void *context);
+
+/*
+ *--------------------------------------------------------------
+ *
+ * zootcl_watch_filter_refetched -- completion of an ifchanged
+ *   refetch.  if the data's the same the event is dropped and the new
+ *   watch carries on, else the changed event is delivered.
+ *
+ *--------------------------------------------------------------
+ */
+static void
+zootcl_watch_filter_refetched (int rc, const char *value, int valueLen, const struct Stat *stat, const void *data)
+{
+	zootcl_watchFilter *wf = (zootcl_watchFilter *)data;
+
+	if (rc == ZOK) {
+		Tcl_WideInt hash = zootcl_data_hash (value, valueLen);
+
+		Tcl_MutexLock (&zootcl_watchFilterMutex);
+		int same = wf->hashValid && wf->hash == hash;
+		wf->hash = hash;
+		wf->hashValid = 1;
+		Tcl_MutexUnlock (&zootcl_watchFilterMutex);
+
+		// the watch is up again either way and holds the reference
+		if (!same) {
+			zootcl_watch_filter_deliver (wf, ZOO_CHANGED_EVENT, ZOO_CONNECTED_STATE, wf->path);
+		}
+		return;
+	}
+
+	// we couldn't tell, so let it through.  no watch was left.
+	zootcl_watch_filter_deliver (wf, ZOO_CHANGED_EVENT, ZOO_CONNECTED_STATE, wf->path);
+	zootcl_watch_filter_release (wf);
+}
+
+/*
+ *--------------------------------------------------------------
+ *
+ * zootcl_filtered_watcher -- watcher callback function of a watch
+ *   with a filter
+ *
+ *--------------------------------------------------------------
+ */
+static void
+zootcl_filtered_watcher (zhandle_t *zh, int type, int state, const char *path, void *context)
+{
+	zootcl_watchFilter *wf = (zootcl_watchFilter *)context;
+
+	Tcl_MutexLock (&zootcl_watchFilterMutex);
+	int delivered = wf->delivered;
+	Tcl_MutexUnlock (&zootcl_watchFilterMutex);
+
+	if (type == ZOO_CHANGED_EVENT && wf->ifChanged && !delivered && (wf->typeMask & (1 << zootcl_name_index (zootcl_eventTypeNames, "changed")))) {
+		// the refetch takes over the watch's reference
+		if (zoo_awget (zh, wf->path, zootcl_filtered_watcher, (void *)wf, zootcl_watch_filter_refetched, (void *)wf) == ZOK) {
+			return;
+		}
+	}
+
+	zootcl_watch_filter_deliver (wf, type, state, path);
+
+	// anything but a session event still connected uses up the watch
+	if (type != ZOO_SESSION_EVENT || state == ZOO_EXPIRED_SESSION_STATE) {
+		zootcl_watch_filter_release (wf);
+	}
+}
+
 /*
  *--------------------------------------------------------------
  *
@@ -694,6 +2170,17 @@ void zootcl_init_callback (zhandle_t *zh, int type, int state, const char *path,
 
     assert (zo->zookeeper_object_magic == ZOOKEEPER_OBJECT_MAGIC);
 
+	if (type == ZOO_SESSION_EVENT) {
+		if (state == ZOO_CONNECTED_STATE) {
+			if (zo->everConnected) {
+				ZOOTCL_COUNT (zo, reconnects, 1);
+			}
+			zo->everConnected = 1;
+		} else if (state == ZOO_EXPIRED_SESSION_STATE) {
+			ZOOTCL_COUNT (zo, sessionExpirations, 1);
+		}
+	}
+
 	// if there's no callback function, return
 	if (zo->initCallbackObj == NULL) {
 		return;
@@ -705,6 +2192,7 @@ void zootcl_init_callback (zhandle_t *zh, int type, int state, const char *path,
 	evPtr->callbackType = INTERNAL_INIT_CALLBACK;
     evPtr->zo = zo;
 	evPtr->commandObj = zo->initCallbackObj;
+	zootcl_trace_fired (evPtr, path);
 
 	evPtr->watcher.type = type;
 	evPtr->watcher.state = state;
@@ -712,12 +2200,75 @@ void zootcl_init_callback (zhandle_t *zh, int type, int state, const char *path,
 	evPtr->watcher.path = ckalloc (strlen (path) + 1);
 	strcpy (evPtr->watcher.path, path);
 
-	Tcl_ThreadQueueEvent (evPtr->zo->threadId, (Tcl_Event *)evPtr, TCL_QUEUE_TAIL);
-	Tcl_ThreadAlert (evPtr->zo->threadId);
+	zootcl_queue_event (evPtr->zo, evPtr);
 
 	// printf("**** zootcl_watcher invoked type '%s' state '%s' path '%s' command '%s'; event queued\n", zootcl_type_to_string (type), zootcl_state_to_string (state), path, Tcl_GetString (evPtr->commandObj));
 }
 
+/*
+ * Event source
+ *
+ * In the single-threaded build every thread that has zookeeper objects
+ * has one event source, shared by all of them.  Each pass through the
+ * notifier only looks at the sessions on the thread's ready list, the
+ * ones that have done IO, been given requests or come due for a ping
+ * or timeout check, so idle sessions cost nothing there.  When a
+ * session next comes due is kept with a Tcl timer.
+ *
+ * The threaded client does its IO on its own threads and hands results
+ * over through the thread's event queue, so it needs no event source.
+ */
+#ifndef THREADED
+typedef struct zootcl_eventSource {
+	int sessions;                       // zookeeper objects in this thread
+	zootcl_objectClientData *readyHead; // the ones that need a look
+} zootcl_eventSource;
+
+static Tcl_ThreadDataKey zootcl_eventSourceKey;
+
+void zootcl_EventSetupProc (ClientData clientData, int flags);
+void zootcl_EventCheckProc (ClientData clientData, int flags);
+#endif
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * zootcl_session_ready --
+ *
+ *    put a session on its thread's ready list so the event source
+ *    asks the client what it wants before the notifier next blocks.
+ *    anything that may have handed the client work from the
+ *    interpreter's thread calls this.
+ *
+ *    does nothing in the threaded build.
+ *
+ *----------------------------------------------------------------------
+ */
+void
+zootcl_session_ready (zootcl_objectClientData *zo)
+{
+#ifndef THREADED
+	zootcl_eventSource *es = (zootcl_eventSource *)Tcl_GetThreadData (&zootcl_eventSourceKey, sizeof (zootcl_eventSource));
+
+	if (zo->ready) {
+		return;
+	}
+	zo->ready = 1;
+	zo->readyNext = es->readyHead;
+	es->readyHead = zo;
+#endif
+}
+
+#ifndef THREADED
+static void
+zootcl_interest_timer (ClientData clientData)
+{
+	zootcl_objectClientData *zo = (zootcl_objectClientData *)clientData;
+
+	zo->interestTimer = NULL;
+	zootcl_session_ready (zo);
+}
+
 /*
  *----------------------------------------------------------------------
  *
@@ -726,7 +2277,7 @@ void zootcl_init_callback (zhandle_t *zh, int type, int state, const char *path,
  *    this routine is called by Tcl when our channel handler for
  *    the zookeeper socket has something to do
  *
- *    it is set up by the async check
+ *    it is set up by zootcl_session_interest
  *
  * Results:
  *    invokes zookeeper_process to notify zookeeper that an event
@@ -753,35 +2304,55 @@ zootcl_socket_ready (ClientData clientData, int mask)
 		events |= ZOOKEEPER_WRITE;
 	}
 
+	Tcl_WideInt traceStart = zootcl_trace_now (zo);
 	int status = zookeeper_process (zo->zh, events);
-	if ((status != ZOK) && (status != ZNOTHING)) {
-		if (status == ZCONNECTIONLOSS) {
-			// zootcl_init_callback (zo->zh, ZOO_SESSION_EVENT, 0, NULL, NULL);
-		}
+	if ((status != ZOK) && (status != ZNOTHING) && zo->tracing) {
+		zootcl_traceRecord *rec = zootcl_trace_next (zo);
+
+		rec->time = traceStart;
+		rec->op = TRACE_PROCESS;
+		rec->async = 0;
+		rec->pathHash = 0;
+		rec->rc = status;
+		rec->state = events;
+		rec->completeUs = (int)(zootcl_trace_clock () - traceStart);
+		rec->dispatchUs = 0;
+	} else if ((status != ZOK) && (status != ZNOTHING)) {
 		fprintf(stderr, "zookeeper_process abnormal status %s, readable %d, writable %d\n", zootcl_error_to_code_string (status), events & ZOOKEEPER_READ ? 1 : 0, events & ZOOKEEPER_WRITE ? 1:0);
 	}
-// fprintf(stderr,"zookeeper_process status %s, readable %d, writable %d\n", zootcl_error_to_code_string (status), events & ZOOKEEPER_READ ? 1 : 0, events & ZOOKEEPER_WRITE ? 1:0);
+
+	// what the client wants next has likely changed
+	zootcl_session_ready (zo);
 }
 
 /*
  *----------------------------------------------------------------------
  *
- * zootcl_EventCommonProc --
- *    This routine is a required argument to Tcl_CreateEventSource
+ * zootcl_session_interest --
  *
- *    This is a function we pass to Tcl_CreateEventSource that is
- *    invoked to see if any events have occurred and to queue them.
+ *    find out what the client of a session is interested in and
+ *    arrange for the event loop to notice it.
  *
- *    We get our events from a channel handler so this function is empty.
+ *    It uses zookeeper_interest to find out what zookeeper is interested
+ *    in.  (zookeeper_interest tells us the file descriptor of its socket,
+ *    flags indicating if it interesting in reading and/or writing, and
+ *    a UNIX timeval to tell us a timeout value to be used with the
+ *    select/poll system call.)
  *
  * Results:
+ *    * Makes a Tcl file channel corresponding to zookeeper's socket if it
+ *      doesn't already exist.
+ *    * Arranges a callback to zootcl_socket_ready if zookeeper is
+ *      interested in reads or writes.
+ *    * Sets a timer to look at the session again when zookeeper wants
+ *      to be checked back with, even if the socket stays quiet, since
+ *      zookeeper_interest is what sends pings and notices timeouts.
  *
  *----------------------------------------------------------------------
  */
-void
-zootcl_EventCommonProc (ClientData clientData, int flags, int doTime) {
-#ifndef TCL_THREADS
-    zootcl_objectClientData *zo = (zootcl_objectClientData *)clientData;
+static void
+zootcl_session_interest (zootcl_objectClientData *zo)
+{
 	int fd;
 	int interest;
 	struct timeval tv;
@@ -792,37 +2363,29 @@ zootcl_EventCommonProc (ClientData clientData, int flags, int doTime) {
 
 	// find out what zookeeper is interested in
 	int status = zookeeper_interest (zh, &fd, &interest, &tv);
-// fprintf(stderr, "zootcl_EventCommonProc: status %s, fd %d, interest read %d, write %d, secs %d, usecs %d\n", zootcl_error_to_code_string (status), fd, interest & ZOOKEEPER_READ ? 1 : 0, interest & ZOOKEEPER_WRITE ? 1 : 0, tv.tv_sec, tv.tv_usec);
 
 	if ((zo->currentFD != -1) && (fd != zo->currentFD)) {
-// fprintf(stderr,"fd changed from %d to %d!\n", zo->currentFD, fd);
 		Tcl_DeleteChannelHandler (zo->channel, zootcl_socket_ready, (ClientData)zo);
 		Tcl_DetachChannel (zo->interp, zo->channel);
 		zo->channel = NULL;
 		zo->currentFD = -1;
 	}
 
-	if ((status != ZOK) && (status != ZNOTHING)) {
-// fprintf(stderr, "zootcl_EventCommonProc: status %s, fd %d, interest read %d, write %d, secs %d, usecs %d\n", zootcl_error_to_code_string (status), fd, interest & ZOOKEEPER_READ ? 1 : 0, interest & ZOOKEEPER_WRITE ? 1 : 0, tv.tv_sec, tv.tv_usec);
-		return;
+	if (zo->interestTimer != NULL) {
+		Tcl_DeleteTimerHandler (zo->interestTimer);
+		zo->interestTimer = NULL;
 	}
 
-	if (doTime && tv.tv_sec > 1) {
-		/*
-		tv.tv_usec -= 500000;
-		if (tv.tv_usec < 0) {
-			tv.tv_usec += 1000000;
-			tv.tv_sec--;
+	if ((status != ZOK) && (status != ZNOTHING)) {
+		// the session is closed or expired, there's nothing more to do
+		if (status != ZINVALIDSTATE) {
+			zo->interestTimer = Tcl_CreateTimerHandler (ZOOTCL_RECIPE_RETRY_MS, zootcl_interest_timer, (ClientData)zo);
 		}
-		*/
-
-		// convert the struct timeval time-until-zookeeper-wants-another-check
-		// to a Tcl_Time
-		Tcl_Time time = {tv.tv_sec, tv.tv_usec};
-		// Tcl_Time time = {1, 0};
-		Tcl_SetMaxBlockTime (&time);
+		return;
 	}
 
+	zo->interestTimer = Tcl_CreateTimerHandler (tv.tv_sec * 1000 + tv.tv_usec / 1000, zootcl_interest_timer, (ClientData)zo);
+
 	// if fd is -1 there is no connection
 	if (fd == -1) return;
 
@@ -850,68 +2413,224 @@ zootcl_EventCommonProc (ClientData clientData, int flags, int doTime) {
 	if (zo->channel == NULL) {
 		zo->channel = Tcl_MakeFileChannel (((void *)(intptr_t) fd), (TCL_READABLE|TCL_WRITABLE));
 		zo->currentFD = fd;
-		// assert (Tcl_SetChannelOption (NULL, zo->channel, "-blocking", "0") == TCL_OK);
 	}
 	Tcl_CreateChannelHandler (zo->channel, (readOrWrite | TCL_EXCEPTION), zootcl_socket_ready, (ClientData)zo);
-#endif
 }
 
 /*
  *----------------------------------------------------------------------
  *
- * zootcl_EventCheckProc --
- *    This routine is a required argument to Tcl_CreateEventSource
+ * zootcl_EventCommonProc --
+ *    The body of the thread's event source setup and check procs.
  *
- *    This is a function we pass to Tcl_CreateEventSource that is
- *    invoked to see if any events have occurred and to queue them.
+ *    The events themselves come from channel handlers and timers, so
+ *    all this does is bring the sessions on the ready list up to date.
  *
- *    We get our events from a channel handler so this function is empty.
+ *----------------------------------------------------------------------
+ */
+void
+zootcl_EventCommonProc (ClientData clientData, int flags) {
+	zootcl_eventSource *es = (zootcl_eventSource *)clientData;
+
+	while (es->readyHead != NULL) {
+		zootcl_objectClientData *zo = es->readyHead;
+
+		es->readyHead = zo->readyNext;
+		zo->readyNext = NULL;
+		zo->ready = 0;
+		zootcl_session_interest (zo);
+	}
+}
+
+/*
+ *----------------------------------------------------------------------
  *
- * Results:
+ * zootcl_EventCheckProc --
+ *    This routine is a required argument to Tcl_CreateEventSource
  *
  *----------------------------------------------------------------------
  */
 void
 zootcl_EventCheckProc (ClientData clientData, int flags) {
-	zootcl_EventCommonProc (clientData, flags, 0);
+	zootcl_EventCommonProc (clientData, flags);
 }
 
 /*
  *----------------------------------------------------------------------
  *
  * zootcl_EventSetupProc --
+ *    This routine is a required argument to Tcl_CreateEventSource
  *
- *    We used this opportunity to find out if zookeeper is interested in
- *    anything (i.e. has watches established or something) asynchronous
- *    and if so interacts with Tcl to have Tcl's event loop detect those
- *    events and call back to us to handle them.
- *
- *    It uses zookeeper_interest to find out what zookeeper is interested
- *    in.  (zookeeper_interest tells us the file descriptor of its socket,
- *    flags indicating if it interesting in reading and/or writing, and
- *    a UNIX timeval to tell us a timeout value to be used with the
- *    select/poll system call.)
- *
- *    Fortunately Tcl has Tcl_SetMaxBlockTime to set that time, so we translate
- *    from UNIX to Tcl and do that.  It forces the application to wake up after
- *    a specific amount of time even if no events have occurred.
- *
- *    If we determine that zookeeper has interest in reads and/or writes then
- *    we create a channel handler to invoke zookeeper_socket_ready for
- *    either or both of those conditions occur.
- *
- * Results:
- *    * Makes a Tcl file channel corresponding to zookeeper's socket if it
- *      doesn't already exist.
- *    * Sets the max block time for Tcl's event loop.
- *    * Arranges a callback to zookeeper_socket_ready if zookeeper is
- *      interested in reads or writes.
+ *    Runs before the notifier blocks, which is our chance to find out
+ *    what the ready sessions are waiting for.
  *
  *----------------------------------------------------------------------
  */
 void
 zootcl_EventSetupProc (ClientData clientData, int flags) {
-	zootcl_EventCommonProc (clientData, flags, 1);
+	zootcl_EventCommonProc (clientData, flags);
+}
+#endif
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * zootcl_session_register --
+ *
+ *    add a new zookeeper object to its thread's event source, creating
+ *    the source for the first one
+ *
+ *----------------------------------------------------------------------
+ */
+static void
+zootcl_session_register (zootcl_objectClientData *zo)
+{
+	zo->channel = NULL;
+	zo->currentFD = -1;
+	zo->ready = 0;
+	zo->readyNext = NULL;
+	zo->interestTimer = NULL;
+
+#ifndef THREADED
+	zootcl_eventSource *es = (zootcl_eventSource *)Tcl_GetThreadData (&zootcl_eventSourceKey, sizeof (zootcl_eventSource));
+
+	if (es->sessions++ == 0) {
+		Tcl_CreateEventSource (zootcl_EventSetupProc, zootcl_EventCheckProc, (ClientData) es);
+	}
+	zootcl_session_ready (zo);
+#endif
+}
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * zootcl_session_unregister --
+ *
+ *    take a zookeeper object that's going away off its thread's event
+ *    source, deleting the source after the last one
+ *
+ *----------------------------------------------------------------------
+ */
+static void
+zootcl_session_unregister (zootcl_objectClientData *zo)
+{
+#ifndef THREADED
+	zootcl_eventSource *es = (zootcl_eventSource *)Tcl_GetThreadData (&zootcl_eventSourceKey, sizeof (zootcl_eventSource));
+
+	if (zo->ready) {
+		zootcl_objectClientData **zop;
+
+		for (zop = &es->readyHead; *zop != zo; zop = &(*zop)->readyNext) {
+			continue;
+		}
+		*zop = zo->readyNext;
+		zo->ready = 0;
+	}
+
+	if (zo->interestTimer != NULL) {
+		Tcl_DeleteTimerHandler (zo->interestTimer);
+		zo->interestTimer = NULL;
+	}
+
+	if (zo->channel != NULL) {
+		Tcl_DeleteChannelHandler (zo->channel, zootcl_socket_ready, (ClientData)zo);
+		Tcl_DetachChannel (zo->interp, zo->channel);
+		zo->channel = NULL;
+	}
+
+	if (--es->sessions == 0) {
+		Tcl_DeleteEventSource (zootcl_EventSetupProc, zootcl_EventCheckProc, (ClientData) es);
+	}
+#endif
+}
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * zootcl_callback_prefix --
+ *
+ *    fill in the "zk objectName" key-value pair that leads off the
+ *    argument list of every callback we invoke
+ *
+ * Results:
+ *    Returns the number of list elements stored.
+ *
+ *----------------------------------------------------------------------
+ */
+int
+zootcl_callback_prefix (zootcl_objectClientData *zo, Tcl_Obj **listObjv) {
+	listObjv[0] = Tcl_NewStringObj ("zk", -1);
+	listObjv[1] = Tcl_NewObj();
+	Tcl_GetCommandFullName (zo->interp, zo->cmdToken, listObjv[1]);
+	return 2;
+}
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * zootcl_invoke_callback --
+ *
+ *    invoke a callback command, which may itself be a list of several
+ *    elements, with a key-value list object appended as its final
+ *    argument.
+ *
+ *    since we initiated the call there is nothing to traceback to, so
+ *    errors are reported as background errors.
+ *
+ *----------------------------------------------------------------------
+ */
+void
+zootcl_invoke_callback (zootcl_objectClientData *zo, Tcl_Obj *callbackObj, Tcl_Obj *listObj) {
+	Tcl_Interp *interp = zo->interp;
+	int tclReturnCode;
+
+	int callbackListObjc;
+	Tcl_Obj **callbackListObjv;
+
+	int evalObjc;
+	Tcl_Obj **evalObjv;
+
+	Tcl_IncrRefCount (listObj);
+
+	// crack the command object.  it may be a list of multiple elements
+	// and we want that to work, like it could be an object and a method or
+	// something.
+	if (Tcl_ListObjGetElements (interp, callbackObj, &callbackListObjc, &callbackListObjv) == TCL_ERROR) {
+		Tcl_BackgroundError (interp);
+		Tcl_DecrRefCount (listObj);
+		return;
+	}
+
+	// construct a new list with the command containing as many elements
+	// as it needs and the argument list as its final argument
+
+	evalObjc = callbackListObjc + 1;
+	evalObjv = (Tcl_Obj **)ckalloc (sizeof (Tcl_Obj *) * evalObjc);
+
+	int i;
+
+	for (i = 0; i < callbackListObjc; i++) {
+		evalObjv[i] = callbackListObjv[i];
+		Tcl_IncrRefCount (evalObjv[i]);
+	}
+
+	evalObjv[evalObjc - 1] = listObj;
+
+	tclReturnCode = Tcl_EvalObjv (interp, evalObjc, evalObjv, (TCL_EVAL_GLOBAL|TCL_EVAL_DIRECT));
+
+	// if we got a Tcl error, since we initiated the event, it doesn't
+	// have anything to traceback further from here to, we must initiate
+	// a background error, which will generally cause the bgerror proc
+	// to get invoked
+	if (tclReturnCode == TCL_ERROR) {
+		Tcl_BackgroundError (interp);
+	}
+
+	for (i = 0; i < evalObjc; i++) {
+		Tcl_DecrRefCount (evalObjv[i]);
+	}
+
+	ckfree ((char *)evalObjv);
 }
 
 /*
@@ -933,44 +2652,55 @@ zootcl_EventSetupProc (ClientData clientData, int flags) {
 int
 zootcl_EventProc (Tcl_Event *tevPtr, int flags) {
 	zootcl_callbackEvent *evPtr = (zootcl_callbackEvent *)tevPtr;
+
+	ZOOTCL_COUNT (evPtr->zo, eventsDispatched, 1);
 	if (evPtr->callbackType == NULL_CALLBACK) {
 		return 1;
 	}
 
 	zootcl_objectClientData *zo = evPtr->zo;
-	Tcl_Interp *interp = zo->interp;
-	int tclReturnCode;
-
-	int callbackListObjc;
-	Tcl_Obj **callbackListObjv;
-
-	int evalObjc;
-	Tcl_Obj **evalObjv;
 
     assert (zo->zookeeper_object_magic == ZOOKEEPER_OBJECT_MAGIC);
 
+	// callbacks and recipes run from here may make requests
+	zootcl_session_ready (zo);
+
 	// fprintf(stderr, "zootcl_EventProc invoked\n");
 
-	// crack the command object.  it may be a list of multiple elements
-	// and we want that to work, like it could be an object and a method or
-	// something.
-	if (Tcl_ListObjGetElements (interp, evPtr->commandObj, &callbackListObjc, &callbackListObjv) == TCL_ERROR) {
-		Tcl_BackgroundError (interp);
+	// recipes implemented in C get their events handed straight
+	// to them, there's no script to run
+	if (evPtr->callbackType == RECIPE_CALLBACK) {
+		(*evPtr->recipe.proc) (evPtr->recipe.clientData, evPtr->recipe.type, evPtr->recipe.state);
 		return 1;
 	}
 
+	if (zo->tracing) {
+		zootcl_trace_event (zo, evPtr);
+	}
+
+	// the answer to an -async request makes room for another, and
+	// is dropped if the request was cancelled
+	if (evPtr->callbackType != WATCHER_CALLBACK && evPtr->callbackType != INTERNAL_INIT_CALLBACK) {
+		zootcl_async_answered (zo);
+
+		if (!zootcl_request_answered (zo, evPtr->requestId)) {
+			if (evPtr->data.dataObj != NULL) {
+				Tcl_IncrRefCount (evPtr->data.dataObj);
+				Tcl_DecrRefCount (evPtr->data.dataObj);
+			}
+			return 1;
+		}
+	}
+
 	// construct callback argument as a list
 	Tcl_Obj *listObjv[40];
 	int element = 0;
 
-	listObjv[element++] = Tcl_NewStringObj ("zk", -1);
-	Tcl_Obj *commandObj = Tcl_NewObj();
-	Tcl_GetCommandFullName (interp, zo->cmdToken, commandObj);
-	listObjv[element++] = commandObj;
-
+	element += zootcl_callback_prefix (zo, listObjv);
 
 	switch(evPtr->callbackType) {
 		case NULL_CALLBACK:
+		case RECIPE_CALLBACK:
 			// should never reach here
 			assert(0 == 1);
 
@@ -978,6 +2708,9 @@ zootcl_EventProc (Tcl_Event *tevPtr, int flags) {
 		case WATCHER_CALLBACK:
 			if (evPtr->watcher.path != NULL) {
 					if (*evPtr->watcher.path != '\0') {
+						if (zo->hotkeys != NULL && evPtr->callbackType == WATCHER_CALLBACK) {
+							zootcl_hotkeys_count (zo, TRACE_WATCH, evPtr->watcher.path);
+						}
 						listObjv[element++] = Tcl_NewStringObj ("path", -1);
 						listObjv[element++] = Tcl_NewStringObj (evPtr->watcher.path, -1);
 					}
@@ -1011,80 +2744,24 @@ zootcl_EventProc (Tcl_Event *tevPtr, int flags) {
 			break;
 
 		case STAT_CALLBACK:
+		{
+			Tcl_Obj **keys = zootcl_stat_key_objs ();
+			int field;
+
 			listObjv[element++] = Tcl_NewStringObj ("status", -1);
 			listObjv[element++] = Tcl_NewStringObj (zootcl_error_to_code_string (evPtr->data.rc), -1);
 
 			if (evPtr->data.rc != ZOK) break;
 
-			listObjv[element++] = Tcl_NewStringObj ("czxid", -1);
-			listObjv[element++] = Tcl_NewLongObj (evPtr->data.stat.czxid);
-
-			listObjv[element++] = Tcl_NewStringObj ("mzxid", -1);
-			listObjv[element++] = Tcl_NewLongObj (evPtr->data.stat.mzxid);
-
-			listObjv[element++] = Tcl_NewStringObj ("ctime", -1);
-			listObjv[element++] = Tcl_NewLongObj (evPtr->data.stat.ctime);
-
-			listObjv[element++] = Tcl_NewStringObj ("mtime", -1);
-			listObjv[element++] = Tcl_NewLongObj (evPtr->data.stat.mtime);
-
-			listObjv[element++] = Tcl_NewStringObj ("version", -1);
-			listObjv[element++] = Tcl_NewIntObj (evPtr->data.stat.version);
-
-			listObjv[element++] = Tcl_NewStringObj ("cversion", -1);
-			listObjv[element++] = Tcl_NewIntObj (evPtr->data.stat.cversion);
-
-			listObjv[element++] = Tcl_NewStringObj ("aversion", -1);
-			listObjv[element++] = Tcl_NewIntObj (evPtr->data.stat.aversion);
-
-			listObjv[element++] = Tcl_NewStringObj ("ephemeralOwner", -1);
-			listObjv[element++] = Tcl_NewLongObj (evPtr->data.stat.ephemeralOwner);
-
-			listObjv[element++] = Tcl_NewStringObj ("dataLength", -1);
-			listObjv[element++] = Tcl_NewIntObj (evPtr->data.stat.dataLength);
-
-			listObjv[element++] = Tcl_NewStringObj ("numChildren", -1);
-			listObjv[element++] = Tcl_NewIntObj (evPtr->data.stat.numChildren);
-
-			listObjv[element++] = Tcl_NewStringObj ("pzxid", -1);
-			listObjv[element++] = Tcl_NewLongObj (evPtr->data.stat.pzxid);
+			for (field = 0; field < STAT_NFIELDS; field++) {
+				listObjv[element++] = keys[field];
+				listObjv[element++] = Tcl_NewWideIntObj (zootcl_stat_field (&evPtr->data.stat, field));
+			}
 			break;
+		}
 	}
 
-	Tcl_Obj *listObj = Tcl_NewListObj (element, listObjv);
-
-
-	// construct a new list with the command containing as many elements
-	// as it needs and the argument list as its final argument
-
-	evalObjc = callbackListObjc + 1;
-	evalObjv = (Tcl_Obj **)ckalloc (sizeof (Tcl_Obj *) * evalObjc);
-
-	int i;
-
-	for (i = 0; i < callbackListObjc; i++) {
-		evalObjv[i] = callbackListObjv[i];
-		Tcl_IncrRefCount (evalObjv[i]);
-	}
-
-	evalObjv[evalObjc - 1] = listObj;
-	Tcl_IncrRefCount (listObj);
-
-	tclReturnCode = Tcl_EvalObjv (interp, evalObjc, evalObjv, (TCL_EVAL_GLOBAL|TCL_EVAL_DIRECT));
-
-	// if we got a Tcl error, since we initiated the event, it doesn't
-	// have anything to traceback further from here to, we must initiate
-	// a background error, which will generally cause the bgerror proc
-	// to get invoked
-	if (tclReturnCode == TCL_ERROR) {
-		Tcl_BackgroundError (interp);
-	}
-
-	for (i = 0; i < evalObjc; i++) {
-		Tcl_DecrRefCount (evalObjv[i]);
-	}
-
-	ckfree ((char *)evalObjv);
+	zootcl_invoke_callback (zo, evPtr->commandObj, Tcl_NewListObj (element, listObjv));
 	return 1;
 }
 
@@ -1109,7 +2786,12 @@ zootcl_EventProc (Tcl_Event *tevPtr, int flags) {
 int zootcl_DeleteEventsForDeletedObject (Tcl_Event *tevPtr, ClientData clientData) {
 	zootcl_callbackEvent *zevPtr = (zootcl_callbackEvent *)tevPtr;
 	zootcl_objectClientData *zo = (zootcl_objectClientData *)clientData;    
-	return zo && zevPtr->zo == zo;
+
+	if (zo == NULL || tevPtr->proc != zootcl_EventProc || zevPtr->zo != zo) {
+		return 0;
+	}
+	ZOOTCL_COUNT (zo, eventsDropped, 1);
+	return 1;
 }
 
 /*
@@ -1135,740 +2817,9141 @@ zootcl_zookeeperObjectDelete (ClientData clientData)
 
 	Tcl_DeleteExitHandler (zootcl_zookeeperObjectDelete, clientData);
 	Tcl_DeleteThreadExitHandler (zootcl_zookeeperObjectDelete, clientData);
-	if (zo->channel != NULL) {
-		Tcl_DeleteChannelHandler (zo->channel, zootcl_socket_ready, (ClientData)zo);
-		Tcl_DetachChannel (zo->interp, zo->channel);
-	}
-	Tcl_DeleteEventSource (zootcl_EventSetupProc, zootcl_EventCheckProc, (ClientData) zo);
+	zootcl_session_unregister (zo);
 
 	// In some rare cases the init callback for zo may be hanging here
 	// so call zookeeper_close before invalidating the object.
 	zookeeper_close (zo->zh);
 
+	if (zo->hostsObj != NULL) {
+		Tcl_DecrRefCount (zo->hostsObj);
+	}
+
 	// we are freeing memory in a sec, clear the magic number
 	// so attempt to reuse a freed object will be an assertion
 	// failure
     	zo->zookeeper_object_magic = -1;
 
+	// the events failing these make are deleted right after
+	zootcl_async_cleanup (zo);
+
 	Tcl_DeleteEvents (zootcl_DeleteEventsForDeletedObject, clientData);
 
-    	ckfree((char *)clientData);
+	zootcl_lock_cleanup (zo);
+	zootcl_election_cleanup (zo);
+	zootcl_queue_cleanup (zo);
+	zootcl_registry_cleanup (zo);
+	zootcl_mirror_cleanup (zo);
+	zootcl_children_cleanup (zo);
+	zootcl_trace_cleanup (zo);
+	zootcl_hotkeys_cleanup (zo);
+
+	Tcl_DeleteHashTable (&zo->requests);
+	Tcl_ConditionFinalize (&zo->eventQueued);
+
+	// await may still be holding on to it
+	Tcl_EventuallyFree (clientData, TCL_DYNAMIC);
 }
 
 /*
- *----------------------------------------------------------------------
+ * Path object type
  *
- * zootcl_exists_subcommand --
+ * A Tcl value holding a znode path that has been checked and
+ * normalized, along with its hash and where its last component
+ * starts.  The internal reps are interned per thread so every object
+ * holding the same path shares one, which makes repeated operations on
+ * the same paths cheap and gives the rest of the code a stable key.
  *
- *      implement the "exists" methods of a zookeeper tcl command
- *      object
+ * Normalizing collapses repeated slashes and drops a trailing one;
+ * the string rep of the object is left as it was given.
+ */
+static void zootcl_path_free_internal_rep (Tcl_Obj *objPtr);
+static void zootcl_path_dup_internal_rep (Tcl_Obj *srcPtr, Tcl_Obj *dupPtr);
+static void zootcl_path_update_string (Tcl_Obj *objPtr);
+static int zootcl_path_set_from_any (Tcl_Interp *interp, Tcl_Obj *objPtr);
+
+Tcl_ObjType zootcl_pathObjType = {
+	"zookeeper_path",
+	zootcl_path_free_internal_rep,
+	zootcl_path_dup_internal_rep,
+	zootcl_path_update_string,
+	zootcl_path_set_from_any
+};
+
+#define ZOOTCL_PATH_REP(objPtr) ((zootcl_pathRep *)(objPtr)->internalRep.twoPtrValue.ptr1)
+
+typedef struct zootcl_pathIntern {
+	Tcl_HashTable paths;
+	int initialized;
+} zootcl_pathIntern;
+
+static Tcl_ThreadDataKey zootcl_pathInternKey;
+
+static void
+zootcl_path_intern_exit (ClientData clientData)
+{
+	zootcl_pathIntern *pi = (zootcl_pathIntern *)clientData;
+	Tcl_HashSearch search;
+	Tcl_HashEntry *hashEntry;
+
+	// any reps still out there outlive the table
+	for (hashEntry = Tcl_FirstHashEntry (&pi->paths, &search); hashEntry != NULL; hashEntry = Tcl_NextHashEntry (&search)) {
+		((zootcl_pathRep *)Tcl_GetHashValue (hashEntry))->internEntry = NULL;
+	}
+	Tcl_DeleteHashTable (&pi->paths);
+	pi->initialized = 0;
+}
+
+static Tcl_HashTable *
+zootcl_path_intern_table (void)
+{
+	zootcl_pathIntern *pi = (zootcl_pathIntern *)Tcl_GetThreadData (&zootcl_pathInternKey, sizeof (zootcl_pathIntern));
+
+	if (!pi->initialized) {
+		Tcl_InitHashTable (&pi->paths, TCL_STRING_KEYS);
+		pi->initialized = 1;
+		Tcl_CreateThreadExitHandler (zootcl_path_intern_exit, (ClientData)pi);
+	}
+	return &pi->paths;
+}
+
+static void
+zootcl_path_release (zootcl_pathRep *rep)
+{
+	if (--rep->refCount > 0) {
+		return;
+	}
+	if (rep->internEntry != NULL) {
+		Tcl_DeleteHashEntry (rep->internEntry);
+	}
+	ckfree ((char *)rep);
+}
+
+/*
+ *--------------------------------------------------------------
  *
- * Results:
- *      A standard Tcl result.
+ * zootcl_path_normalize -- check a znode path and normalize it
+ *   into dsPtr
  *
+ * Results:
+ *      NULL if it's good, else a description of what's wrong with it
  *
- *----------------------------------------------------------------------
+ *--------------------------------------------------------------
  */
-int
-zootcl_exists_subcommand(Tcl_Interp *interp, int objc, Tcl_Obj *CONST objv[], ZOOAPI zhandle_t *zh, zootcl_objectClientData *zo)
+static const char *
+zootcl_path_normalize (const char *path, int length, Tcl_DString *dsPtr)
 {
-	static CONST char *subOptions[] = {
-		"-watch",
-		"-async",
-		"-stat",
-		"-version",
-		NULL
-	};
+	int i = 0;
 
-	enum subOptions {
-		SUBOPT_WATCH,
-		SUBOPT_ASYNC,
-		SUBOPT_STAT,
-		SUBOPT_VERSION
-	};
+	if (length == 0) {
+		return "it's empty";
+	}
+	if (path[0] != '/') {
+		return "it doesn't start with /";
+	}
 
-	const char *path;
-	watcher_fn wfn = NULL;
+	while (i < length) {
+		int start;
 
-    assert (zo->zookeeper_object_magic == ZOOKEEPER_OBJECT_MAGIC);
+		// skip the slashes before a component
+		while (i < length && path[i] == '/') {
+			i++;
+		}
+		if (i == length) {
+			break;
+		}
 
-	if (objc < 3) {
-		Tcl_WrongNumArgs (interp, 2, objv, "path ?-watch code? ?-stat statArray? ?-async callback? ?-version versionVar?");
-		return TCL_ERROR;
-	}
+		start = i;
+		while (i < length && path[i] != '/') {
+			unsigned char c = (unsigned char)path[i];
 
-	path = Tcl_GetString (objv[2]);
+			// control characters, including NUL which Tcl encodes
+			// as C0 80, aren't allowed
+			if (c < 0x20 || c == 0x7f || (c == 0xc0 && i + 1 < length && (unsigned char)path[i + 1] == 0x80)) {
+				return "it contains a control character";
+			}
+			i++;
+		}
 
-	int i;
-	int suboptIndex = 0;
+		if ((i - start == 1 && path[start] == '.') || (i - start == 2 && path[start] == '.' && path[start + 1] == '.')) {
+			return "relative paths aren't allowed";
+		}
+
+		Tcl_DStringAppend (dsPtr, "/", 1);
+		Tcl_DStringAppend (dsPtr, path + start, i - start);
+	}
+
+	if (Tcl_DStringLength (dsPtr) == 0) {
+		Tcl_DStringAppend (dsPtr, "/", 1);
+	}
+	return NULL;
+}
+
+/*
+ *--------------------------------------------------------------
+ *
+ * zootcl_path_hash -- FNV-1a hash of a path
+ *
+ *--------------------------------------------------------------
+ */
+unsigned int
+zootcl_path_hash (const char *path, int length)
+{
+	unsigned int hash = 2166136261U;
+	int i;
+
+	for (i = 0; i < length; i++) {
+		hash = (hash ^ (unsigned char)path[i]) * 16777619U;
+	}
+	return hash;
+}
+
+/*
+ *--------------------------------------------------------------
+ *
+ * zootcl_path_intern -- find or make the shared rep of a normalized
+ *   path
+ *
+ * Results:
+ *      the rep, with a reference added for the caller
+ *
+ *--------------------------------------------------------------
+ */
+static zootcl_pathRep *
+zootcl_path_intern (const char *path, int length)
+{
+	Tcl_HashTable *table = zootcl_path_intern_table ();
+	Tcl_HashEntry *hashEntry;
+	zootcl_pathRep *rep;
+	Tcl_DString ds;
+	int isNew;
+	int i;
+
+	// path may be the front of a longer one, like the parent of a
+	// rep's path, but the table's keys are NUL-terminated strings
+	Tcl_DStringInit (&ds);
+	if (path[length] != '\0') {
+		Tcl_DStringAppend (&ds, path, length);
+		path = Tcl_DStringValue (&ds);
+	}
+
+	hashEntry = Tcl_CreateHashEntry (table, path, &isNew);
+	if (!isNew) {
+		Tcl_DStringFree (&ds);
+		rep = (zootcl_pathRep *)Tcl_GetHashValue (hashEntry);
+		rep->refCount++;
+		return rep;
+	}
+
+	rep = (zootcl_pathRep *)ckalloc (sizeof (zootcl_pathRep) + length);
+	rep->refCount = 1;
+	rep->length = length;
+	memcpy (rep->path, path, length);
+	rep->path[length] = '\0';
+	rep->internEntry = hashEntry;
+
+	rep->hash = zootcl_path_hash (path, length);
+	rep->tailOffset = 1;
+	for (i = 0; i < length; i++) {
+		if (path[i] == '/') {
+			rep->tailOffset = i + 1;
+		}
+	}
+
+	Tcl_SetHashValue (hashEntry, (ClientData)rep);
+	Tcl_DStringFree (&ds);
+	return rep;
+}
+
+static void
+zootcl_path_free_internal_rep (Tcl_Obj *objPtr)
+{
+	zootcl_path_release (ZOOTCL_PATH_REP (objPtr));
+	objPtr->typePtr = NULL;
+}
+
+static void
+zootcl_path_dup_internal_rep (Tcl_Obj *srcPtr, Tcl_Obj *dupPtr)
+{
+	zootcl_pathRep *rep = ZOOTCL_PATH_REP (srcPtr);
+
+	rep->refCount++;
+	dupPtr->internalRep.twoPtrValue.ptr1 = rep;
+	dupPtr->typePtr = &zootcl_pathObjType;
+}
+
+static void
+zootcl_path_update_string (Tcl_Obj *objPtr)
+{
+	zootcl_pathRep *rep = ZOOTCL_PATH_REP (objPtr);
+
+	objPtr->length = rep->length;
+	objPtr->bytes = ckalloc (rep->length + 1);
+	memcpy (objPtr->bytes, rep->path, rep->length + 1);
+}
+
+static int
+zootcl_path_set_from_any (Tcl_Interp *interp, Tcl_Obj *objPtr)
+{
+	Tcl_DString ds;
+	const char *problem;
+	int length;
+	char *path = Tcl_GetStringFromObj (objPtr, &length);
+
+	Tcl_DStringInit (&ds);
+	problem = zootcl_path_normalize (path, length, &ds);
+	if (problem != NULL) {
+		Tcl_DStringFree (&ds);
+		if (interp != NULL) {
+			Tcl_SetObjResult (interp, Tcl_ObjPrintf ("invalid znode path \"%s\": %s", path, problem));
+			Tcl_SetErrorCode (interp, "ZOOKEEPER", "ZBADARGUMENTS", zerror (ZBADARGUMENTS), (char *) NULL);
+		}
+		return TCL_ERROR;
+	}
+
+	zootcl_pathRep *rep = zootcl_path_intern (Tcl_DStringValue (&ds), Tcl_DStringLength (&ds));
+	Tcl_DStringFree (&ds);
+
+	if (objPtr->typePtr != NULL && objPtr->typePtr->freeIntRepProc != NULL) {
+		objPtr->typePtr->freeIntRepProc (objPtr);
+	}
+	objPtr->internalRep.twoPtrValue.ptr1 = rep;
+	objPtr->typePtr = &zootcl_pathObjType;
+	return TCL_OK;
+}
+
+/*
+ *--------------------------------------------------------------
+ *
+ * zootcl_get_path_rep -- get the path rep of an object, converting
+ *   it to a path if need be
+ *
+ * Results:
+ *      the rep, owned by the object, or NULL with an error in the
+ *      interpreter if it isn't a valid znode path
+ *
+ *--------------------------------------------------------------
+ */
+zootcl_pathRep *
+zootcl_get_path_rep (Tcl_Interp *interp, Tcl_Obj *objPtr)
+{
+	if (objPtr->typePtr != &zootcl_pathObjType && zootcl_path_set_from_any (interp, objPtr) != TCL_OK) {
+		return NULL;
+	}
+	return ZOOTCL_PATH_REP (objPtr);
+}
+
+/*
+ *--------------------------------------------------------------
+ *
+ * zootcl_path_string -- get the normalized znode path of an object
+ *
+ * Results:
+ *      the path, good for as long as the object keeps its internal
+ *      rep, or NULL with an error in the interpreter
+ *
+ *--------------------------------------------------------------
+ */
+const char *
+zootcl_path_string (Tcl_Interp *interp, Tcl_Obj *objPtr)
+{
+	zootcl_pathRep *rep = zootcl_get_path_rep (interp, objPtr);
+
+	return (rep == NULL) ? NULL : rep->path;
+}
+
+/*
+ *--------------------------------------------------------------
+ *
+ * zootcl_new_path_obj -- make a path object of an already
+ *   normalized path
+ *
+ *--------------------------------------------------------------
+ */
+static Tcl_Obj *
+zootcl_new_path_obj (const char *path, int length)
+{
+	Tcl_Obj *objPtr = Tcl_NewStringObj (path, length);
+
+	objPtr->internalRep.twoPtrValue.ptr1 = zootcl_path_intern (path, length);
+	objPtr->typePtr = &zootcl_pathObjType;
+	return objPtr;
+}
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * zootcl_pathObjCmd --
+ *
+ *      implement the zookeeper::path command
+ *
+ *      zookeeper::path normalize path
+ *      zookeeper::path join path name ?name ...?
+ *      zookeeper::path parent path
+ *      zookeeper::path tail path
+ *
+ * Results:
+ *      A standard Tcl result.
+ *
+ *----------------------------------------------------------------------
+ */
+int
+zootcl_pathObjCmd(ClientData clientData, Tcl_Interp *interp, int objc, Tcl_Obj *CONST objv[])
+{
+	static CONST char *actions[] = {
+		"normalize",
+		"join",
+		"parent",
+		"tail",
+		NULL
+	};
+
+	enum actions {
+		ACTION_NORMALIZE,
+		ACTION_JOIN,
+		ACTION_PARENT,
+		ACTION_TAIL
+	};
+
+	int actionIndex;
+	zootcl_pathRep *rep;
+	int i;
+
+	if (objc < 3) {
+		Tcl_WrongNumArgs (interp, 1, objv, "normalize|join|parent|tail path ?name ...?");
+		return TCL_ERROR;
+	}
+
+	if (Tcl_GetIndexFromObj (interp, objv[1], actions, "action", TCL_EXACT, &actionIndex) != TCL_OK) {
+		return TCL_ERROR;
+	}
+
+	if ((enum actions) actionIndex != ACTION_JOIN && objc != 3) {
+		Tcl_WrongNumArgs (interp, 2, objv, "path");
+		return TCL_ERROR;
+	}
+
+	rep = zootcl_get_path_rep (interp, objv[2]);
+	if (rep == NULL) {
+		return TCL_ERROR;
+	}
+
+	switch ((enum actions) actionIndex) {
+		case ACTION_NORMALIZE:
+		{
+			Tcl_SetObjResult (interp, zootcl_new_path_obj (rep->path, rep->length));
+			return TCL_OK;
+		}
+
+		case ACTION_JOIN:
+		{
+			Tcl_DString joined;
+			Tcl_DString ds;
+			const char *problem;
+
+			Tcl_DStringInit (&joined);
+			Tcl_DStringAppend (&joined, rep->path, rep->length);
+			for (i = 3; i < objc; i++) {
+				Tcl_DStringAppend (&joined, "/", 1);
+				Tcl_DStringAppend (&joined, Tcl_GetString (objv[i]), -1);
+			}
+
+			Tcl_DStringInit (&ds);
+			problem = zootcl_path_normalize (Tcl_DStringValue (&joined), Tcl_DStringLength (&joined), &ds);
+			if (problem != NULL) {
+				Tcl_SetObjResult (interp, Tcl_ObjPrintf ("invalid znode path \"%s\": %s", Tcl_DStringValue (&joined), problem));
+				Tcl_SetErrorCode (interp, "ZOOKEEPER", "ZBADARGUMENTS", zerror (ZBADARGUMENTS), (char *) NULL);
+				Tcl_DStringFree (&joined);
+				Tcl_DStringFree (&ds);
+				return TCL_ERROR;
+			}
+
+			Tcl_SetObjResult (interp, zootcl_new_path_obj (Tcl_DStringValue (&ds), Tcl_DStringLength (&ds)));
+			Tcl_DStringFree (&joined);
+			Tcl_DStringFree (&ds);
+			return TCL_OK;
+		}
+
+		case ACTION_PARENT:
+		{
+			// the parent of the root is the root, like file dirname
+			int length = (rep->tailOffset > 1) ? rep->tailOffset - 1 : 1;
+			Tcl_SetObjResult (interp, zootcl_new_path_obj (rep->path, length));
+			return TCL_OK;
+		}
+
+		case ACTION_TAIL:
+		{
+			Tcl_SetObjResult (interp, Tcl_NewStringObj (rep->path + rep->tailOffset, rep->length - rep->tailOffset));
+			return TCL_OK;
+		}
+	}
+
+	return TCL_OK;
+}
+
+/*
+ * In-flight limit
+ *
+ * With -maxinflight, at most that many -async requests are out at once.
+ * The rest wait in order in a per-object queue and go out as the
+ * callbacks of earlier ones are run.  A request counts as in flight
+ * until its callback has run in the interpreter, so a backlog of
+ * answers waiting in the event queue holds new requests back too.
+ *
+ * The zootcl_async_ functions take the place of the zoo_a calls for
+ * the -async forms of the subcommands.
+ */
+
+/*
+ *--------------------------------------------------------------
+ *
+ * zootcl_async_send -- hand a request to zookeeper
+ *
+ * Results:
+ *      the status of the zoo_a call
+ *
+ *--------------------------------------------------------------
+ */
+static int
+zootcl_async_send (zootcl_objectClientData *zo, const zootcl_asyncRequest *req)
+{
+	zhandle_t *zh = zo->zh;
+
+	switch (req->kind) {
+		case REQ_EXISTS:
+			return zoo_awexists (zh, req->path, req->watcher, req->watcherCtx, req->completion.stat, req->context);
+
+		case REQ_GET:
+			return zoo_awget (zh, req->path, req->watcher, req->watcherCtx, req->completion.data, req->context);
+
+		case REQ_CHILDREN:
+			return zoo_awget_children (zh, req->path, req->watcher, req->watcherCtx, req->completion.strings, req->context);
+
+		case REQ_SET:
+			return zoo_aset (zh, req->path, req->value, req->valueLen, req->version, req->completion.stat, req->context);
+
+		case REQ_CREATE:
+			return zoo_acreate (zh, req->path, req->value, req->valueLen, &ZOO_OPEN_ACL_UNSAFE, req->flags, req->completion.string, req->context);
+
+		case REQ_DELETE:
+			return zoo_adelete (zh, req->path, req->version, req->completion.none, req->context);
+	}
+	return ZBADARGUMENTS;
+}
+
+static int
+zootcl_async_issue (zootcl_objectClientData *zo, const zootcl_asyncRequest *req)
+{
+	int status = zootcl_async_send (zo, req);
+
+	if (status == ZOK) {
+		zootcl_count_sent (zo, req->watcher != NULL, (req->value != NULL) ? req->valueLen : 0);
+	}
+	return status;
+}
+
+/*
+ *--------------------------------------------------------------
+ *
+ * zootcl_async_fail -- answer a queued request that couldn't be
+ *   sent by calling its completion with the error, so its callback
+ *   still runs
+ *
+ *--------------------------------------------------------------
+ */
+static void
+zootcl_async_fail (const zootcl_asyncRequest *req, int rc)
+{
+	switch (req->kind) {
+		case REQ_EXISTS:
+		case REQ_SET:
+			(*req->completion.stat) (rc, NULL, req->context);
+			break;
+
+		case REQ_GET:
+			(*req->completion.data) (rc, NULL, -1, NULL, req->context);
+			break;
+
+		case REQ_CHILDREN:
+			(*req->completion.strings) (rc, NULL, req->context);
+			break;
+
+		case REQ_CREATE:
+			(*req->completion.string) (rc, NULL, req->context);
+			break;
+
+		case REQ_DELETE:
+			(*req->completion.none) (rc, req->context);
+			break;
+	}
+}
+
+/*
+ *--------------------------------------------------------------
+ *
+ * zootcl_async_submit -- send a request now if the object is under
+ *   its in-flight limit, else queue it
+ *
+ * Results:
+ *      the status of the zoo_a call, or ZOK if the request was queued
+ *
+ *--------------------------------------------------------------
+ */
+static int
+zootcl_async_submit (zootcl_objectClientData *zo, const zootcl_asyncRequest *req)
+{
+	if (zo->maxInFlight <= 0 || (zo->inFlight < zo->maxInFlight && zo->pendingHead == NULL)) {
+		int status = zootcl_async_issue (zo, req);
+		if (status == ZOK) {
+			zo->inFlight++;
+		}
+		return status;
+	}
+
+	// hold on to copies of everything the caller's about to let go of
+	int pathLen = strlen (req->path) + 1;
+	int valueLen = (req->value != NULL && req->valueLen > 0) ? req->valueLen : 0;
+	zootcl_asyncRequest *queued = (zootcl_asyncRequest *)ckalloc (sizeof (zootcl_asyncRequest) + pathLen + valueLen);
+	char *copy = (char *)(queued + 1);
+
+	*queued = *req;
+	queued->next = NULL;
+	memcpy (copy, req->path, pathLen);
+	queued->path = copy;
+	if (req->value != NULL) {
+		memcpy (copy + pathLen, req->value, valueLen);
+		queued->value = copy + pathLen;
+	}
+
+	if (zo->pendingTail == NULL) {
+		zo->pendingHead = queued;
+	} else {
+		zo->pendingTail->next = queued;
+	}
+	zo->pendingTail = queued;
+	zo->pendingCount++;
+	return ZOK;
+}
+
+static zootcl_asyncRequest *
+zootcl_async_dequeue (zootcl_objectClientData *zo)
+{
+	zootcl_asyncRequest *req = zo->pendingHead;
+
+	if (req != NULL) {
+		zo->pendingHead = req->next;
+		if (zo->pendingHead == NULL) {
+			zo->pendingTail = NULL;
+		}
+		zo->pendingCount--;
+	}
+	return req;
+}
+
+/*
+ *--------------------------------------------------------------
+ *
+ * zootcl_async_drain -- send queued requests while there's room
+ *
+ *--------------------------------------------------------------
+ */
+static void
+zootcl_async_drain (zootcl_objectClientData *zo)
+{
+	while (zo->pendingHead != NULL && (zo->maxInFlight <= 0 || zo->inFlight < zo->maxInFlight)) {
+		zootcl_asyncRequest *req = zootcl_async_dequeue (zo);
+
+		// it counts either way, a failure is answered through the
+		// event queue like anything else
+		zo->inFlight++;
+		int status = zootcl_async_issue (zo, req);
+		if (status != ZOK) {
+			zootcl_async_fail (req, status);
+		}
+		ckfree (req);
+	}
+}
+
+/*
+ *--------------------------------------------------------------
+ *
+ * zootcl_async_answered -- called from the event handler when the
+ *   callback of an -async request is about to be run
+ *
+ *--------------------------------------------------------------
+ */
+void
+zootcl_async_answered (zootcl_objectClientData *zo)
+{
+	if (zo->inFlight > 0) {
+		zo->inFlight--;
+	}
+	zootcl_async_drain (zo);
+}
+
+/*
+ *--------------------------------------------------------------
+ *
+ * zootcl_async_cleanup -- fail the requests still queued when the
+ *   object is deleted, which frees their contexts.  the events that
+ *   makes are deleted along with the object's others.
+ *
+ *--------------------------------------------------------------
+ */
+void
+zootcl_async_cleanup (zootcl_objectClientData *zo)
+{
+	zootcl_asyncRequest *req;
+
+	while ((req = zootcl_async_dequeue (zo)) != NULL) {
+		zootcl_async_fail (req, ZCLOSING);
+		ckfree (req);
+	}
+}
+
+static int
+zootcl_async_awexists (zootcl_objectClientData *zo, int requestId, const char *path, watcher_fn watcher, void *watcherCtx, stat_completion_t completion, const void *context)
+{
+	zootcl_asyncRequest req;
+
+	memset (&req, 0, sizeof (req));
+	req.kind = REQ_EXISTS;
+	req.requestId = requestId;
+	req.path = path;
+	req.watcher = watcher;
+	req.watcherCtx = watcherCtx;
+	req.completion.stat = completion;
+	req.context = (void *)context;
+	return zootcl_async_submit (zo, &req);
+}
+
+static int
+zootcl_async_awget (zootcl_objectClientData *zo, int requestId, const char *path, watcher_fn watcher, void *watcherCtx, data_completion_t completion, const void *context)
+{
+	zootcl_asyncRequest req;
+
+	memset (&req, 0, sizeof (req));
+	req.kind = REQ_GET;
+	req.requestId = requestId;
+	req.path = path;
+	req.watcher = watcher;
+	req.watcherCtx = watcherCtx;
+	req.completion.data = completion;
+	req.context = (void *)context;
+	return zootcl_async_submit (zo, &req);
+}
+
+static int
+zootcl_async_awget_children (zootcl_objectClientData *zo, int requestId, const char *path, watcher_fn watcher, void *watcherCtx, strings_completion_t completion, const void *context)
+{
+	zootcl_asyncRequest req;
+
+	memset (&req, 0, sizeof (req));
+	req.kind = REQ_CHILDREN;
+	req.requestId = requestId;
+	req.path = path;
+	req.watcher = watcher;
+	req.watcherCtx = watcherCtx;
+	req.completion.strings = completion;
+	req.context = (void *)context;
+	return zootcl_async_submit (zo, &req);
+}
+
+static int
+zootcl_async_aset (zootcl_objectClientData *zo, int requestId, const char *path, const char *value, int valueLen, int version, stat_completion_t completion, const void *context)
+{
+	zootcl_asyncRequest req;
+
+	memset (&req, 0, sizeof (req));
+	req.kind = REQ_SET;
+	req.requestId = requestId;
+	req.path = path;
+	req.value = value;
+	req.valueLen = valueLen;
+	req.version = version;
+	req.completion.stat = completion;
+	req.context = (void *)context;
+	return zootcl_async_submit (zo, &req);
+}
+
+static int
+zootcl_async_acreate (zootcl_objectClientData *zo, int requestId, const char *path, const char *value, int valueLen, int flags, string_completion_t completion, const void *context)
+{
+	zootcl_asyncRequest req;
+
+	memset (&req, 0, sizeof (req));
+	req.kind = REQ_CREATE;
+	req.requestId = requestId;
+	req.path = path;
+	req.value = value;
+	req.valueLen = valueLen;
+	req.flags = flags;
+	req.completion.string = completion;
+	req.context = (void *)context;
+	return zootcl_async_submit (zo, &req);
+}
+
+static int
+zootcl_async_adelete (zootcl_objectClientData *zo, int requestId, const char *path, int version, void_completion_t completion, const void *context)
+{
+	zootcl_asyncRequest req;
+
+	memset (&req, 0, sizeof (req));
+	req.kind = REQ_DELETE;
+	req.requestId = requestId;
+	req.path = path;
+	req.version = version;
+	req.completion.none = completion;
+	req.context = (void *)context;
+	return zootcl_async_submit (zo, &req);
+}
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * zootcl_inflight_subcommand --
+ *
+ *      implement the "inflight" method of a zookeeper tcl command
+ *      object
+ *
+ *      $zk inflight ?-max n?
+ *
+ *      returns a list of key-value pairs: inflight, the -async
+ *      requests sent whose callbacks haven't run yet, queued, the ones
+ *      waiting to be sent, and max, the limit.  -max changes the limit
+ *      first, 0 meaning none.
+ *
+ * Results:
+ *      A standard Tcl result.
+ *
+ *----------------------------------------------------------------------
+ */
+int
+zootcl_inflight_subcommand(Tcl_Interp *interp, int objc, Tcl_Obj *CONST objv[], ZOOAPI zhandle_t *zh, zootcl_objectClientData *zo)
+{
+    assert (zo->zookeeper_object_magic == ZOOKEEPER_OBJECT_MAGIC);
+
+	if (objc != 2 && objc != 4) {
+		Tcl_WrongNumArgs (interp, 2, objv, "?-max n?");
+		return TCL_ERROR;
+	}
+
+	if (objc == 4) {
+		int maxInFlight;
+
+		if (strcmp (Tcl_GetString (objv[2]), "-max") != 0) {
+			Tcl_SetObjResult (interp, Tcl_ObjPrintf ("bad suboption \"%s\": must be -max", Tcl_GetString (objv[2])));
+			return TCL_ERROR;
+		}
+		if (Tcl_GetIntFromObj (interp, objv[3], &maxInFlight) == TCL_ERROR) {
+			return TCL_ERROR;
+		}
+		if (maxInFlight < 0) {
+			Tcl_SetObjResult (interp, Tcl_NewStringObj ("-max can't be negative", -1));
+			return TCL_ERROR;
+		}
+		zo->maxInFlight = maxInFlight;
+		zootcl_async_drain (zo);
+	}
+
+	Tcl_Obj *listObjv[6];
+
+	listObjv[0] = Tcl_NewStringObj ("inflight", -1);
+	listObjv[1] = Tcl_NewIntObj (zo->inFlight);
+	listObjv[2] = Tcl_NewStringObj ("queued", -1);
+	listObjv[3] = Tcl_NewIntObj (zo->pendingCount);
+	listObjv[4] = Tcl_NewStringObj ("max", -1);
+	listObjv[5] = Tcl_NewIntObj (zo->maxInFlight);
+	Tcl_SetObjResult (interp, Tcl_NewListObj (6, listObjv));
+	return TCL_OK;
+}
+
+/*
+ *--------------------------------------------------------------
+ *
+ * zootcl_async_result -- finish up an -async subcommand.  if the
+ *   request went out, or was queued, remember its id as pending and
+ *   make that the result.
+ *
+ * Results:
+ *      A standard Tcl result.
+ *
+ *--------------------------------------------------------------
+ */
+static int
+zootcl_async_result (Tcl_Interp *interp, zootcl_objectClientData *zo, enum zootcl_requestKind kind, int requestId, int status)
+{
+	int isNew;
+
+	if (status != ZOK) {
+		zootcl_count_request (zo, kind, status, 0);
+		return zootcl_set_tcl_return_code (interp, status);
+	}
+
+	Tcl_HashEntry *entry = Tcl_CreateHashEntry (&zo->requests, (char *)(intptr_t)requestId, &isNew);
+	Tcl_SetHashValue (entry, (ClientData)(intptr_t)ZOOTCL_REQUEST_PENDING);
+	Tcl_SetObjResult (interp, Tcl_NewIntObj (requestId));
+	return TCL_OK;
+}
+
+/*
+ *--------------------------------------------------------------
+ *
+ * zootcl_request_answered -- forget an -async request whose answer
+ *   has come in
+ *
+ * Results:
+ *      returns 0 if the request was cancelled and its callback
+ *      shouldn't be run, else 1
+ *
+ *--------------------------------------------------------------
+ */
+int
+zootcl_request_answered (zootcl_objectClientData *zo, int requestId)
+{
+	Tcl_HashEntry *entry = Tcl_FindHashEntry (&zo->requests, (char *)(intptr_t)requestId);
+
+	if (entry == NULL) {
+		return 1;
+	}
+
+	int state = (int)(intptr_t)Tcl_GetHashValue (entry);
+	Tcl_DeleteHashEntry (entry);
+	return state != ZOOTCL_REQUEST_CANCELLED;
+}
+
+/*
+ *--------------------------------------------------------------
+ *
+ * zootcl_request_pending -- see if any of a list of request ids
+ *   are still waiting on their answers.  cancelled and unknown ids
+ *   count as done.
+ *
+ *--------------------------------------------------------------
+ */
+static int
+zootcl_request_pending (zootcl_objectClientData *zo, int idCount, const int *ids)
+{
+	int i;
+
+	for (i = 0; i < idCount; i++) {
+		Tcl_HashEntry *entry = Tcl_FindHashEntry (&zo->requests, (char *)(intptr_t)ids[i]);
+
+		if (entry != NULL && (int)(intptr_t)Tcl_GetHashValue (entry) == ZOOTCL_REQUEST_PENDING) {
+			return 1;
+		}
+	}
+	return 0;
+}
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * zootcl_cancel_subcommand --
+ *
+ *      implement the "cancel" method of a zookeeper tcl command
+ *      object
+ *
+ *      the callback of the -async request with the given id won't
+ *      be run.  a request still held back by -maxinflight is never
+ *      sent; one already sent can't be taken back from the server,
+ *      only its answer is dropped.
+ *
+ * Results:
+ *      A standard Tcl result.  The result is 1 if the request was
+ *      cancelled, 0 if it had already been answered or cancelled.
+ *
+ *----------------------------------------------------------------------
+ */
+int
+zootcl_cancel_subcommand(Tcl_Interp *interp, int objc, Tcl_Obj *CONST objv[], ZOOAPI zhandle_t *zh, zootcl_objectClientData *zo)
+{
+	int requestId;
+
+    assert (zo->zookeeper_object_magic == ZOOKEEPER_OBJECT_MAGIC);
+
+	if (objc != 3) {
+		Tcl_WrongNumArgs (interp, 2, objv, "requestId");
+		return TCL_ERROR;
+	}
+
+	if (Tcl_GetIntFromObj (interp, objv[2], &requestId) == TCL_ERROR) {
+		return TCL_ERROR;
+	}
+
+	Tcl_HashEntry *entry = Tcl_FindHashEntry (&zo->requests, (char *)(intptr_t)requestId);
+	if (entry == NULL || (int)(intptr_t)Tcl_GetHashValue (entry) == ZOOTCL_REQUEST_CANCELLED) {
+		Tcl_SetObjResult (interp, Tcl_NewBooleanObj (0));
+		return TCL_OK;
+	}
+	Tcl_SetHashValue (entry, (ClientData)(intptr_t)ZOOTCL_REQUEST_CANCELLED);
+
+	zootcl_asyncRequest *prev = NULL;
+	zootcl_asyncRequest *req;
+
+	for (req = zo->pendingHead; req != NULL; prev = req, req = req->next) {
+		if (req->requestId == requestId) {
+			break;
+		}
+	}
+
+	if (req != NULL) {
+		if (prev == NULL) {
+			zo->pendingHead = req->next;
+		} else {
+			prev->next = req->next;
+		}
+		if (zo->pendingTail == req) {
+			zo->pendingTail = prev;
+		}
+		zo->pendingCount--;
+
+		// failing it frees its context; the answer that makes is
+		// dropped like any other cancelled one
+		zo->inFlight++;
+		zootcl_async_fail (req, ZCLOSING);
+		ckfree (req);
+	}
+
+	Tcl_SetObjResult (interp, Tcl_NewBooleanObj (1));
+	return TCL_OK;
+}
+
+// the events await takes off the queue, in order
+typedef struct zootcl_awaitHarvest
+{
+	zootcl_objectClientData *zo;
+	Tcl_Event *head;
+	Tcl_Event *tail;
+} zootcl_awaitHarvest;
+
+/*
+ *--------------------------------------------------------------
+ *
+ * zootcl_await_harvest -- Tcl_DeleteEvents proc that takes a copy
+ *   of each event queued for the object awaiting, so await can run
+ *   them without going through the event loop and running anything
+ *   else
+ *
+ *--------------------------------------------------------------
+ */
+static int
+zootcl_await_harvest (Tcl_Event *tevPtr, ClientData clientData)
+{
+	zootcl_awaitHarvest *harvest = (zootcl_awaitHarvest *)clientData;
+	zootcl_callbackEvent *evPtr = (zootcl_callbackEvent *)tevPtr;
+
+	// the proc is cleared on an event being serviced right now
+	if (tevPtr->proc != zootcl_EventProc || evPtr->zo != harvest->zo) {
+		return 0;
+	}
+
+	zootcl_callbackEvent *copy = (zootcl_callbackEvent *)ckalloc (sizeof (zootcl_callbackEvent));
+	*copy = *evPtr;
+	copy->event.nextPtr = NULL;
+
+	if (harvest->tail == NULL) {
+		harvest->head = (Tcl_Event *)copy;
+	} else {
+		harvest->tail->nextPtr = (Tcl_Event *)copy;
+	}
+	harvest->tail = (Tcl_Event *)copy;
+	return 1;
+}
+
+/*
+ *--------------------------------------------------------------
+ *
+ * zootcl_event_discard -- free an event that won't be handled
+ *
+ *--------------------------------------------------------------
+ */
+static void
+zootcl_event_discard (zootcl_callbackEvent *evPtr)
+{
+	switch (evPtr->callbackType) {
+		case WATCHER_CALLBACK:
+		case INTERNAL_INIT_CALLBACK:
+			if (evPtr->watcher.path != NULL) {
+				ckfree (evPtr->watcher.path);
+			}
+			break;
+
+		case DATA_CALLBACK:
+		case STRING_CALLBACK:
+		case VOID_CALLBACK:
+		case STAT_CALLBACK:
+			if (evPtr->data.dataObj != NULL) {
+				Tcl_IncrRefCount (evPtr->data.dataObj);
+				Tcl_DecrRefCount (evPtr->data.dataObj);
+			}
+			break;
+
+		default:
+			break;
+	}
+	ZOOTCL_COUNT (evPtr->zo, eventsDropped, 1);
+	ckfree (evPtr);
+}
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * zootcl_await_subcommand --
+ *
+ *      implement the "await" method of a zookeeper tcl command
+ *      object
+ *
+ *      block until the -async requests with the given ids have been
+ *      answered and their callbacks run.  the object's other events,
+ *      watches included, are handled as they come in so ordering is
+ *      kept, but nothing else in the event loop is.
+ *
+ * Results:
+ *      A standard Tcl result.  The result is 1 if all the requests
+ *      were answered, 0 if -timeout ran out first.
+ *
+ *----------------------------------------------------------------------
+ */
+int
+zootcl_await_subcommand(Tcl_Interp *interp, int objc, Tcl_Obj *CONST objv[], ZOOAPI zhandle_t *zh, zootcl_objectClientData *zo)
+{
+	Tcl_Obj **idObjv;
+	int idCount;
+	int timeout = -1;
+	Tcl_Time deadline;
+	Tcl_Time remaining;
+	int i;
+
+    assert (zo->zookeeper_object_magic == ZOOKEEPER_OBJECT_MAGIC);
+
+	if (objc != 3 && objc != 5) {
+		Tcl_WrongNumArgs (interp, 2, objv, "requestIds ?-timeout ms?");
+		return TCL_ERROR;
+	}
+
+	if (objc == 5) {
+		if (strcmp (Tcl_GetString (objv[3]), "-timeout") != 0) {
+			Tcl_SetObjResult (interp, Tcl_ObjPrintf ("bad suboption \"%s\": must be -timeout", Tcl_GetString (objv[3])));
+			return TCL_ERROR;
+		}
+		if (Tcl_GetIntFromObj (interp, objv[4], &timeout) == TCL_ERROR) {
+			return TCL_ERROR;
+		}
+		if (timeout < 0) {
+			Tcl_SetObjResult (interp, Tcl_NewStringObj ("-timeout can't be negative", -1));
+			return TCL_ERROR;
+		}
+		zootcl_deadline (&deadline, timeout);
+	}
+
+	if (Tcl_ListObjGetElements (interp, objv[2], &idCount, &idObjv) == TCL_ERROR) {
+		return TCL_ERROR;
+	}
+
+	int *ids = (int *)ckalloc (sizeof (int) * (idCount + 1));
+	for (i = 0; i < idCount; i++) {
+		if (Tcl_GetIntFromObj (interp, idObjv[i], &ids[i]) == TCL_ERROR) {
+			ckfree (ids);
+			return TCL_ERROR;
+		}
+	}
+
+	// a callback run from here could destroy the object
+	Tcl_Preserve (zo);
+
+	int result = TCL_OK;
+	int done = 0;
+
+	while (1) {
+		zootcl_awaitHarvest harvest;
+		Tcl_Event *tevPtr;
+		int seen;
+
+		Tcl_MutexLock (&zootcl_awaitMutex);
+		seen = zo->eventsQueued;
+		Tcl_MutexUnlock (&zootcl_awaitMutex);
+
+		harvest.zo = zo;
+		harvest.head = harvest.tail = NULL;
+		Tcl_DeleteEvents (zootcl_await_harvest, (ClientData)&harvest);
+
+		while ((tevPtr = harvest.head) != NULL) {
+			harvest.head = tevPtr->nextPtr;
+			if (zo->zookeeper_object_magic == ZOOKEEPER_OBJECT_MAGIC) {
+				zootcl_EventProc (tevPtr, TCL_ALL_EVENTS);
+				ckfree (tevPtr);
+			} else {
+				zootcl_event_discard ((zootcl_callbackEvent *)tevPtr);
+			}
+		}
+
+		if (zo->zookeeper_object_magic != ZOOKEEPER_OBJECT_MAGIC) {
+			Tcl_SetObjResult (interp, Tcl_NewStringObj ("zookeeper object deleted while awaiting", -1));
+			result = TCL_ERROR;
+			break;
+		}
+
+		if (!zootcl_request_pending (zo, idCount, ids)) {
+			done = 1;
+			break;
+		}
+
+		if (timeout >= 0 && !zootcl_time_remaining (&deadline, &remaining)) {
+			break;
+		}
+
+		Tcl_MutexLock (&zootcl_awaitMutex);
+		if (zo->eventsQueued == seen) {
+			zootcl_condition_wait (zh, &zo->eventQueued, &zootcl_awaitMutex, (timeout >= 0) ? &remaining : NULL);
+		}
+		Tcl_MutexUnlock (&zootcl_awaitMutex);
+	}
+
+	Tcl_Release (zo);
+	ckfree (ids);
+
+	if (result == TCL_OK) {
+		Tcl_SetObjResult (interp, Tcl_NewBooleanObj (done));
+	}
+	return result;
+}
+
+/*
+ *--------------------------------------------------------------
+ *
+ * zootcl_metrics_snapshot -- copy out an object's counters, or the
+ *   process-wide ones if zo is NULL
+ *
+ *--------------------------------------------------------------
+ */
+static void
+zootcl_metrics_snapshot (zootcl_objectClientData *zo, zootcl_metrics *metrics)
+{
+	Tcl_MutexLock (&zootcl_metricsMutex);
+	*metrics = (zo == NULL) ? zootcl_globalMetrics : zo->metrics;
+	Tcl_MutexUnlock (&zootcl_metricsMutex);
+}
+
+static const char *zootcl_requestKindNames[ZOOTCL_REQUEST_KINDS] = {"exists", "get", "children", "set", "create", "delete"};
+
+static const char *
+zootcl_slot_status (int slot)
+{
+	return zootcl_error_to_code_string ((slot == ZOOTCL_STATUS_SLOTS - 1) ? ZOOTCL_UNCHANGED : -slot);
+}
+
+// the plain counters, in the order they're reported
+static const struct {
+	const char *name;           // dict key, and metric name after zookeeper_
+	size_t offset;
+	const char *help;
+} zootcl_metricCounters[] = {
+	{"bytes_sent", offsetof (zootcl_metrics, bytesSent), "Bytes of znode data sent by set and create"},
+	{"bytes_received", offsetof (zootcl_metrics, bytesReceived), "Bytes of znode data received by get"},
+	{"events_queued", offsetof (zootcl_metrics, eventsQueued), "Events queued to the Tcl event loop"},
+	{"events_dispatched", offsetof (zootcl_metrics, eventsDispatched), "Events handled from the Tcl event loop"},
+	{"watches_registered", offsetof (zootcl_metrics, watchesRegistered), "Watches set with -watch"},
+	{"watches_fired", offsetof (zootcl_metrics, watchesFired), "Watch events delivered"},
+	{"reconnects", offsetof (zootcl_metrics, reconnects), "Connections made again after the first"},
+	{"session_expirations", offsetof (zootcl_metrics, sessionExpirations), "Sessions expired"},
+	{NULL, 0, NULL}
+};
+
+#define ZOOTCL_METRIC(metrics, i) (*(const Tcl_WideInt *)((const char *)(metrics) + zootcl_metricCounters[i].offset))
+
+/*
+ *--------------------------------------------------------------
+ *
+ * zootcl_metrics_dict -- the counters as a dict
+ *
+ *--------------------------------------------------------------
+ */
+static Tcl_Obj *
+zootcl_metrics_dict (const zootcl_metrics *metrics)
+{
+	Tcl_Obj *resultObj = Tcl_NewDictObj ();
+	Tcl_Obj *requestsObj = Tcl_NewDictObj ();
+	int kind, slot, i;
+
+	for (kind = 0; kind < ZOOTCL_REQUEST_KINDS; kind++) {
+		Tcl_Obj *statusesObj = Tcl_NewDictObj ();
+
+		for (slot = 0; slot < ZOOTCL_STATUS_SLOTS; slot++) {
+			if (metrics->requests[kind][slot] != 0) {
+				Tcl_DictObjPut (NULL, statusesObj, Tcl_NewStringObj (zootcl_slot_status (slot), -1), Tcl_NewWideIntObj (metrics->requests[kind][slot]));
+			}
+		}
+		Tcl_DictObjPut (NULL, requestsObj, Tcl_NewStringObj (zootcl_requestKindNames[kind], -1), statusesObj);
+	}
+	Tcl_DictObjPut (NULL, resultObj, Tcl_NewStringObj ("requests", -1), requestsObj);
+
+	for (i = 0; zootcl_metricCounters[i].name != NULL; i++) {
+		Tcl_DictObjPut (NULL, resultObj, Tcl_NewStringObj (zootcl_metricCounters[i].name, -1), Tcl_NewWideIntObj (ZOOTCL_METRIC (metrics, i)));
+	}
+
+	Tcl_DictObjPut (NULL, resultObj, Tcl_NewStringObj ("event_queue_depth", -1), Tcl_NewWideIntObj (metrics->eventsQueued - metrics->eventsDispatched - metrics->eventsDropped));
+	return resultObj;
+}
+
+/*
+ *--------------------------------------------------------------
+ *
+ * zootcl_metrics_openmetrics -- the counters in the OpenMetrics text
+ *   format.  label is put on every sample if it isn't empty.
+ *
+ *--------------------------------------------------------------
+ */
+static Tcl_Obj *
+zootcl_metrics_openmetrics (const zootcl_metrics *metrics, const char *label)
+{
+	Tcl_Obj *resultObj = Tcl_NewObj ();
+	const char *sep = (*label != '\0') ? "," : "";
+	int kind, slot, i;
+
+	Tcl_AppendToObj (resultObj, "# TYPE zookeeper_requests counter\n# HELP zookeeper_requests Requests answered, by operation and status\n", -1);
+	for (kind = 0; kind < ZOOTCL_REQUEST_KINDS; kind++) {
+		for (slot = 0; slot < ZOOTCL_STATUS_SLOTS; slot++) {
+			if (metrics->requests[kind][slot] != 0) {
+				Tcl_AppendPrintfToObj (resultObj, "zookeeper_requests_total{%s%sop=\"%s\",status=\"%s\"} %" TCL_LL_MODIFIER "d\n", label, sep, zootcl_requestKindNames[kind], zootcl_slot_status (slot), (Tcl_WideInt)metrics->requests[kind][slot]);
+			}
+		}
+	}
+
+	for (i = 0; zootcl_metricCounters[i].name != NULL; i++) {
+		const char *name = zootcl_metricCounters[i].name;
+
+		Tcl_AppendPrintfToObj (resultObj, "# TYPE zookeeper_%s counter\n# HELP zookeeper_%s %s\n", name, name, zootcl_metricCounters[i].help);
+		Tcl_AppendPrintfToObj (resultObj, "zookeeper_%s_total%s%s%s %" TCL_LL_MODIFIER "d\n", name, (*label != '\0') ? "{" : "", label, (*label != '\0') ? "}" : "", ZOOTCL_METRIC (metrics, i));
+	}
+
+	Tcl_AppendToObj (resultObj, "# TYPE zookeeper_event_queue_depth gauge\n# HELP zookeeper_event_queue_depth Events queued and not yet handled\n", -1);
+	Tcl_AppendPrintfToObj (resultObj, "zookeeper_event_queue_depth%s%s%s %" TCL_LL_MODIFIER "d\n", (*label != '\0') ? "{" : "", label, (*label != '\0') ? "}" : "", metrics->eventsQueued - metrics->eventsDispatched - metrics->eventsDropped);
+
+	Tcl_AppendToObj (resultObj, "# EOF\n", -1);
+	return resultObj;
+}
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * zootcl_metrics_subcommand --
+ *
+ *      implement "zookeeper::zookeeper metrics" and the "metrics"
+ *      method of a zookeeper tcl command object.  zo is NULL for the
+ *      former, which reports the counts for the whole process.
+ *
+ * Results:
+ *      A standard Tcl result.
+ *
+ *----------------------------------------------------------------------
+ */
+int
+zootcl_metrics_subcommand(Tcl_Interp *interp, int objc, Tcl_Obj *CONST objv[], zootcl_objectClientData *zo)
+{
+	static CONST char *formats[] = {
+		"dict",
+		"openmetrics",
+		NULL
+	};
+
+	enum formats {
+		FORMAT_DICT,
+		FORMAT_OPENMETRICS
+	};
+
+	int format = FORMAT_DICT;
+	zootcl_metrics metrics;
+
+	if (objc != 2 && objc != 4) {
+		Tcl_WrongNumArgs (interp, 2, objv, "?-format dict|openmetrics?");
+		return TCL_ERROR;
+	}
+
+	if (objc == 4) {
+		if (strcmp (Tcl_GetString (objv[2]), "-format") != 0) {
+			Tcl_SetObjResult (interp, Tcl_ObjPrintf ("bad suboption \"%s\": must be -format", Tcl_GetString (objv[2])));
+			return TCL_ERROR;
+		}
+		if (Tcl_GetIndexFromObj (interp, objv[3], formats, "format", TCL_EXACT, &format) != TCL_OK) {
+			return TCL_ERROR;
+		}
+	}
+
+	zootcl_metrics_snapshot (zo, &metrics);
+
+	if (format == FORMAT_DICT) {
+		Tcl_SetObjResult (interp, zootcl_metrics_dict (&metrics));
+		return TCL_OK;
+	}
+
+	// samples from an object are labelled with its name
+	Tcl_DString label;
+	Tcl_DStringInit (&label);
+	if (zo != NULL) {
+		Tcl_Obj *nameObj = Tcl_NewObj ();
+
+		Tcl_IncrRefCount (nameObj);
+		Tcl_GetCommandFullName (interp, zo->cmdToken, nameObj);
+		Tcl_DStringAppend (&label, "object=\"", -1);
+		Tcl_DStringAppend (&label, Tcl_GetString (nameObj), -1);
+		Tcl_DStringAppend (&label, "\"", -1);
+		Tcl_DecrRefCount (nameObj);
+	}
+	Tcl_SetObjResult (interp, zootcl_metrics_openmetrics (&metrics, Tcl_DStringValue (&label)));
+	Tcl_DStringFree (&label);
+	return TCL_OK;
+}
+
+static const char *zootcl_traceOpNames[] = {"exists", "get", "children", "set", "create", "delete", "watch", "session", "process"};
+
+/*
+ *--------------------------------------------------------------
+ *
+ * zootcl_trace_record_list -- append the key-value pairs of a trace
+ *   record to listObjv
+ *
+ * Results:
+ *      the number of elements appended
+ *
+ *--------------------------------------------------------------
+ */
+static int
+zootcl_trace_record_list (const zootcl_traceRecord *rec, Tcl_Obj **listObjv)
+{
+	int element = 0;
+
+	listObjv[element++] = Tcl_NewStringObj ("time", -1);
+	listObjv[element++] = Tcl_NewWideIntObj (rec->time);
+	listObjv[element++] = Tcl_NewStringObj ("op", -1);
+	listObjv[element++] = Tcl_NewStringObj (zootcl_traceOpNames[rec->op], -1);
+	listObjv[element++] = Tcl_NewStringObj ("async", -1);
+	listObjv[element++] = Tcl_NewBooleanObj (rec->async);
+	listObjv[element++] = Tcl_NewStringObj ("path_hash", -1);
+	listObjv[element++] = Tcl_NewWideIntObj ((Tcl_WideInt)rec->pathHash);
+
+	if (rec->op == TRACE_WATCH || rec->op == TRACE_SESSION) {
+		listObjv[element++] = Tcl_NewStringObj ("type", -1);
+		listObjv[element++] = Tcl_NewStringObj (zootcl_type_to_string (rec->rc), -1);
+		listObjv[element++] = Tcl_NewStringObj ("state", -1);
+		listObjv[element++] = Tcl_NewStringObj (zootcl_state_to_string (rec->state), -1);
+	} else {
+		listObjv[element++] = Tcl_NewStringObj ("status", -1);
+		listObjv[element++] = Tcl_NewStringObj (zootcl_error_to_code_string (rec->rc), -1);
+	}
+
+	listObjv[element++] = Tcl_NewStringObj ("complete_us", -1);
+	listObjv[element++] = Tcl_NewIntObj (rec->completeUs);
+	listObjv[element++] = Tcl_NewStringObj ("dispatch_us", -1);
+	listObjv[element++] = Tcl_NewIntObj (rec->dispatchUs);
+	return element;
+}
+
+// the most key-value elements a record makes, plus the callback prefix
+#define ZOOTCL_TRACE_ELEMENTS 20
+
+/*
+ *--------------------------------------------------------------
+ *
+ * zootcl_trace_stream -- idle callback handing the records written
+ *   since last time to the trace add callbacks
+ *
+ *--------------------------------------------------------------
+ */
+static void
+zootcl_trace_stream (ClientData clientData)
+{
+	zootcl_objectClientData *zo = (zootcl_objectClientData *)clientData;
+	zootcl_traceRing *ring = zo->trace;
+	Tcl_WideInt end = ring->next;
+
+	ring->streamPending = 0;
+
+	// records written by the callbacks wait for the next time round
+	Tcl_Preserve (zo);
+	while (zo->zookeeper_object_magic == ZOOKEEPER_OBJECT_MAGIC && zo->trace == ring && ring->callbacksObj != NULL && ring->streamed < end) {
+		// ones overwritten before we got to them are lost
+		if (ring->next - ring->streamed > ring->size) {
+			ring->streamed = ring->next - ring->size;
+		}
+
+		zootcl_traceRecord rec = ring->records[ring->streamed % ring->size];
+		Tcl_Obj *callbacksObj = ring->callbacksObj;
+		Tcl_Obj **callbackObjv;
+		int callbackObjc;
+		int i;
+
+		ring->streamed++;
+
+		Tcl_IncrRefCount (callbacksObj);
+		Tcl_ListObjGetElements (NULL, callbacksObj, &callbackObjc, &callbackObjv);
+		for (i = 0; i < callbackObjc && zo->zookeeper_object_magic == ZOOKEEPER_OBJECT_MAGIC; i++) {
+			Tcl_Obj *listObjv[ZOOTCL_TRACE_ELEMENTS];
+			int element = zootcl_callback_prefix (zo, listObjv);
+
+			element += zootcl_trace_record_list (&rec, listObjv + element);
+			zootcl_invoke_callback (zo, callbackObjv[i], Tcl_NewListObj (element, listObjv));
+		}
+		Tcl_DecrRefCount (callbacksObj);
+	}
+	Tcl_Release (zo);
+}
+
+/*
+ *--------------------------------------------------------------
+ *
+ * zootcl_trace_cleanup -- free an object's trace ring
+ *
+ *--------------------------------------------------------------
+ */
+void
+zootcl_trace_cleanup (zootcl_objectClientData *zo)
+{
+	zootcl_traceRing *ring = zo->trace;
+
+	zo->tracing = 0;
+	if (ring == NULL) {
+		return;
+	}
+
+	if (ring->streamPending) {
+		Tcl_CancelIdleCall (zootcl_trace_stream, (ClientData)zo);
+	}
+	if (ring->callbacksObj != NULL) {
+		Tcl_DecrRefCount (ring->callbacksObj);
+	}
+	ckfree (ring);
+	zo->trace = NULL;
+}
+
+#define ZOOTCL_TRACE_DEFAULT_SIZE 1024
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * zootcl_trace_subcommand --
+ *
+ *      implement the "trace" method of a zookeeper tcl command
+ *      object
+ *
+ *      trace on ?-size n?
+ *      trace off
+ *      trace dump ?-since time?
+ *      trace add callback
+ *      trace remove callback
+ *
+ * Results:
+ *      A standard Tcl result.
+ *
+ *----------------------------------------------------------------------
+ */
+int
+zootcl_trace_subcommand(Tcl_Interp *interp, int objc, Tcl_Obj *CONST objv[], ZOOAPI zhandle_t *zh, zootcl_objectClientData *zo)
+{
+	static CONST char *subCommands[] = {
+		"on",
+		"off",
+		"dump",
+		"add",
+		"remove",
+		NULL
+	};
+
+	enum subCommands {
+		SUBCMD_ON,
+		SUBCMD_OFF,
+		SUBCMD_DUMP,
+		SUBCMD_ADD,
+		SUBCMD_REMOVE
+	};
+
+	int subIndex;
+	zootcl_traceRing *ring = zo->trace;
+
+    assert (zo->zookeeper_object_magic == ZOOKEEPER_OBJECT_MAGIC);
+
+	if (objc < 3) {
+		Tcl_WrongNumArgs (interp, 2, objv, "on|off|dump|add|remove ?args?");
+		return TCL_ERROR;
+	}
+
+	if (Tcl_GetIndexFromObj (interp, objv[2], subCommands, "subcommand", TCL_EXACT, &subIndex) != TCL_OK) {
+		return TCL_ERROR;
+	}
+
+	switch ((enum subCommands) subIndex) {
+		case SUBCMD_ON:
+		{
+			int size = ZOOTCL_TRACE_DEFAULT_SIZE;
+
+			if (objc != 3 && objc != 5) {
+				Tcl_WrongNumArgs (interp, 3, objv, "?-size n?");
+				return TCL_ERROR;
+			}
+			if (objc == 5) {
+				if (strcmp (Tcl_GetString (objv[3]), "-size") != 0) {
+					Tcl_SetObjResult (interp, Tcl_ObjPrintf ("bad suboption \"%s\": must be -size", Tcl_GetString (objv[3])));
+					return TCL_ERROR;
+				}
+				if (Tcl_GetIntFromObj (interp, objv[4], &size) == TCL_ERROR) {
+					return TCL_ERROR;
+				}
+				if (size < 1) {
+					Tcl_SetObjResult (interp, Tcl_NewStringObj ("-size must be at least 1", -1));
+					return TCL_ERROR;
+				}
+			}
+
+			// a new size starts a new ring, keeping the callbacks
+			if (ring == NULL || (objc == 5 && size != ring->size)) {
+				zootcl_traceRing *newRing = (zootcl_traceRing *)ckalloc (sizeof (zootcl_traceRing) + (size - 1) * sizeof (zootcl_traceRecord));
+
+				newRing->size = size;
+				newRing->next = 0;
+				newRing->streamed = 0;
+				newRing->streamPending = 0;
+				newRing->callbacksObj = NULL;
+				if (ring != NULL) {
+					newRing->callbacksObj = ring->callbacksObj;
+					ring->callbacksObj = NULL;
+					zootcl_trace_cleanup (zo);
+				}
+				zo->trace = newRing;
+			}
+			zo->tracing = 1;
+			return TCL_OK;
+		}
+
+		case SUBCMD_OFF:
+			if (objc != 3) {
+				Tcl_WrongNumArgs (interp, 3, objv, "");
+				return TCL_ERROR;
+			}
+			// what's been recorded can still be dumped
+			zo->tracing = 0;
+			return TCL_OK;
+
+		case SUBCMD_DUMP:
+		{
+			Tcl_WideInt since = 0;
+			Tcl_WideInt n;
+
+			if (objc != 3 && objc != 5) {
+				Tcl_WrongNumArgs (interp, 3, objv, "?-since time?");
+				return TCL_ERROR;
+			}
+			if (objc == 5) {
+				if (strcmp (Tcl_GetString (objv[3]), "-since") != 0) {
+					Tcl_SetObjResult (interp, Tcl_ObjPrintf ("bad suboption \"%s\": must be -since", Tcl_GetString (objv[3])));
+					return TCL_ERROR;
+				}
+				if (Tcl_GetWideIntFromObj (interp, objv[4], &since) == TCL_ERROR) {
+					return TCL_ERROR;
+				}
+			}
+
+			Tcl_Obj *resultObj = Tcl_NewObj ();
+			if (ring != NULL) {
+				n = (ring->next > ring->size) ? ring->next - ring->size : 0;
+				for (; n < ring->next; n++) {
+					const zootcl_traceRecord *rec = &ring->records[n % ring->size];
+					Tcl_Obj *listObjv[ZOOTCL_TRACE_ELEMENTS];
+
+					if (rec->time <= since) {
+						continue;
+					}
+					Tcl_ListObjAppendElement (NULL, resultObj, Tcl_NewListObj (zootcl_trace_record_list (rec, listObjv), listObjv));
+				}
+			}
+			Tcl_SetObjResult (interp, resultObj);
+			return TCL_OK;
+		}
+
+		case SUBCMD_ADD:
+		case SUBCMD_REMOVE:
+		{
+			if (objc != 4) {
+				Tcl_WrongNumArgs (interp, 3, objv, "callback");
+				return TCL_ERROR;
+			}
+			if (ring == NULL) {
+				Tcl_SetObjResult (interp, Tcl_NewStringObj ("tracing has never been turned on", -1));
+				return TCL_ERROR;
+			}
+
+			Tcl_Obj *callbacksObj = Tcl_NewObj ();
+			Tcl_Obj **callbackObjv;
+			int callbackObjc = 0;
+			int i;
+
+			// the list is copied rather than changed in place since a
+			// stream in progress may be going through it
+			if (ring->callbacksObj != NULL) {
+				Tcl_ListObjGetElements (NULL, ring->callbacksObj, &callbackObjc, &callbackObjv);
+			}
+			for (i = 0; i < callbackObjc; i++) {
+				if (strcmp (Tcl_GetString (callbackObjv[i]), Tcl_GetString (objv[3])) != 0) {
+					Tcl_ListObjAppendElement (NULL, callbacksObj, callbackObjv[i]);
+				}
+			}
+			if (subIndex == SUBCMD_ADD) {
+				Tcl_ListObjAppendElement (NULL, callbacksObj, objv[3]);
+				// only what's recorded from now on is streamed
+				if (ring->callbacksObj == NULL) {
+					ring->streamed = ring->next;
+				}
+			}
+
+			if (ring->callbacksObj != NULL) {
+				Tcl_DecrRefCount (ring->callbacksObj);
+			}
+			Tcl_ListObjLength (NULL, callbacksObj, &callbackObjc);
+			if (callbackObjc == 0) {
+				Tcl_DecrRefCount (callbacksObj);
+				ring->callbacksObj = NULL;
+			} else {
+				Tcl_IncrRefCount (callbacksObj);
+				ring->callbacksObj = callbacksObj;
+			}
+			return TCL_OK;
+		}
+	}
+	return TCL_OK;
+}
+
+/*
+ * Hot keys
+ *
+ * With hotkeys on, each exists, get, children, set, create and delete
+ * and each watch event is counted by path and operation in a
+ * count-min sketch.  The estimate it gives never undercounts and only
+ * overcounts by a bit, with the memory fixed by its width and depth
+ * however many paths come through.  The K paths and operations with
+ * the highest counts are kept in a min-heap, so the least of them is
+ * the one to beat.  It's all done in the object's thread.
+ */
+#define ZOOTCL_HOTKEYS_DEFAULT_K 20
+#define ZOOTCL_HOTKEYS_DEFAULT_WIDTH 2048
+#define ZOOTCL_HOTKEYS_DEFAULT_DEPTH 4
+
+// 64MB of sketch, and a heap that size, is far past any sensible use
+#define ZOOTCL_HOTKEYS_MAX_COUNTERS (16 * 1024 * 1024)
+#define ZOOTCL_HOTKEYS_MAX_K 65536
+
+// murmur3's finalizer, to get a second hash out of the first
+static unsigned int
+zootcl_hash_mix (unsigned int h)
+{
+	h ^= h >> 16;
+	h *= 0x85ebca6bU;
+	h ^= h >> 13;
+	h *= 0xc2b2ae35U;
+	h ^= h >> 16;
+	return h;
+}
+
+static void
+zootcl_hotkeys_swap (zootcl_hotKeys *hk, int i, int j)
+{
+	zootcl_hotKey *hot = hk->heap[i];
+
+	hk->heap[i] = hk->heap[j];
+	hk->heap[j] = hot;
+	hk->heap[i]->heapIndex = i;
+	hk->heap[j]->heapIndex = j;
+}
+
+static void
+zootcl_hotkeys_sift_up (zootcl_hotKeys *hk, int i)
+{
+	while (i > 0) {
+		int parent = (i - 1) / 2;
+
+		if (hk->heap[parent]->count <= hk->heap[i]->count) {
+			return;
+		}
+		zootcl_hotkeys_swap (hk, i, parent);
+		i = parent;
+	}
+}
+
+static void
+zootcl_hotkeys_sift_down (zootcl_hotKeys *hk, int i)
+{
+	while (1) {
+		int least = i;
+		int left = 2 * i + 1;
+		int right = left + 1;
+
+		if (left < hk->heapSize && hk->heap[left]->count < hk->heap[least]->count) {
+			least = left;
+		}
+		if (right < hk->heapSize && hk->heap[right]->count < hk->heap[least]->count) {
+			least = right;
+		}
+		if (least == i) {
+			return;
+		}
+		zootcl_hotkeys_swap (hk, i, least);
+		i = least;
+	}
+}
+
+/*
+ *--------------------------------------------------------------
+ *
+ * zootcl_hotkeys_count -- count an operation on a path
+ *
+ *--------------------------------------------------------------
+ */
+void
+zootcl_hotkeys_count (zootcl_objectClientData *zo, int op, const char *path)
+{
+	zootcl_hotKeys *hk = zo->hotkeys;
+	int length = strlen (path);
+	unsigned int h1 = zootcl_path_hash (path, length) ^ ((unsigned int)(op + 1) * 0x9e3779b9U);
+	unsigned int h2 = zootcl_hash_mix (h1) | 1;
+	unsigned int estimate = UINT_MAX;
+	int row;
+
+	for (row = 0; row < hk->depth; row++) {
+		unsigned int *counter = &hk->sketch[row * hk->width + (h1 + row * h2) % hk->width];
+
+		if (*counter < UINT_MAX) {
+			(*counter)++;
+		}
+		if (*counter < estimate) {
+			estimate = *counter;
+		}
+	}
+
+	// most counts don't make the top K, so check before making the key
+	if (hk->heapSize == hk->k && estimate <= hk->heap[0]->count) {
+		return;
+	}
+
+	Tcl_DString key;
+	Tcl_HashEntry *entry;
+	zootcl_hotKey *hot;
+	int isNew;
+
+	Tcl_DStringInit (&key);
+	Tcl_DStringAppend (&key, zootcl_traceOpNames[op], -1);
+	Tcl_DStringAppend (&key, " ", 1);
+	Tcl_DStringAppend (&key, path, length);
+
+	entry = Tcl_CreateHashEntry (&hk->keys, Tcl_DStringValue (&key), &isNew);
+	Tcl_DStringFree (&key);
+
+	if (!isNew) {
+		hot = (zootcl_hotKey *)Tcl_GetHashValue (entry);
+		hot->count = estimate;
+		zootcl_hotkeys_sift_down (hk, hot->heapIndex);
+		return;
+	}
+
+	if (hk->heapSize < hk->k) {
+		hot = (zootcl_hotKey *)ckalloc (sizeof (zootcl_hotKey));
+		hot->heapIndex = hk->heapSize++;
+		hk->heap[hot->heapIndex] = hot;
+	} else {
+		// it takes the place of the least counted
+		hot = hk->heap[0];
+		Tcl_DeleteHashEntry (hot->entry);
+	}
+
+	hot->entry = entry;
+	hot->key = Tcl_GetHashKey (&hk->keys, entry);
+	hot->count = estimate;
+	Tcl_SetHashValue (entry, (ClientData)hot);
+
+	if (hot->heapIndex == 0 && hk->heapSize == hk->k) {
+		zootcl_hotkeys_sift_down (hk, 0);
+	} else {
+		zootcl_hotkeys_sift_up (hk, hot->heapIndex);
+	}
+}
+
+/*
+ *--------------------------------------------------------------
+ *
+ * zootcl_hotkeys_cleanup -- turn hotkeys off, freeing everything
+ *
+ *--------------------------------------------------------------
+ */
+void
+zootcl_hotkeys_cleanup (zootcl_objectClientData *zo)
+{
+	zootcl_hotKeys *hk = zo->hotkeys;
+	int i;
+
+	if (hk == NULL) {
+		return;
+	}
+
+	for (i = 0; i < hk->heapSize; i++) {
+		ckfree (hk->heap[i]);
+	}
+	Tcl_DeleteHashTable (&hk->keys);
+	ckfree (hk->heap);
+	ckfree (hk->sketch);
+	ckfree (hk);
+	zo->hotkeys = NULL;
+}
+
+static int
+zootcl_hotkeys_compare (const void *a, const void *b)
+{
+	Tcl_WideInt countA = (*(zootcl_hotKey * const *)a)->count;
+	Tcl_WideInt countB = (*(zootcl_hotKey * const *)b)->count;
+
+	return (countA < countB) ? 1 : (countA > countB) ? -1 : 0;
+}
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * zootcl_hotkeys_subcommand --
+ *
+ *      implement the "hotkeys" method of a zookeeper tcl command
+ *      object
+ *
+ *      hotkeys on ?-k n? ?-width n? ?-depth n?
+ *      hotkeys off
+ *      hotkeys reset
+ *      hotkeys ?-k n?
+ *
+ * Results:
+ *      A standard Tcl result.  The last form returns the most counted
+ *      paths and operations, most first, as a list of dicts.
+ *
+ *----------------------------------------------------------------------
+ */
+int
+zootcl_hotkeys_subcommand(Tcl_Interp *interp, int objc, Tcl_Obj *CONST objv[], ZOOAPI zhandle_t *zh, zootcl_objectClientData *zo)
+{
+	static CONST char *subOptions[] = {
+		"-k",
+		"-width",
+		"-depth",
+		NULL
+	};
+
+	enum subOptions {
+		SUBOPT_K,
+		SUBOPT_WIDTH,
+		SUBOPT_DEPTH
+	};
+
+	int k = ZOOTCL_HOTKEYS_DEFAULT_K;
+	int width = ZOOTCL_HOTKEYS_DEFAULT_WIDTH;
+	int depth = ZOOTCL_HOTKEYS_DEFAULT_DEPTH;
+	int first = 2;
+	int on = 0;
+	int i;
+
+    assert (zo->zookeeper_object_magic == ZOOKEEPER_OBJECT_MAGIC);
+
+	if (objc >= 3) {
+		const char *action = Tcl_GetString (objv[2]);
+
+		if (strcmp (action, "off") == 0 || strcmp (action, "reset") == 0) {
+			if (objc != 3) {
+				Tcl_WrongNumArgs (interp, 3, objv, "");
+				return TCL_ERROR;
+			}
+			if (*action == 'r' && zo->hotkeys != NULL) {
+				k = zo->hotkeys->k;
+				width = zo->hotkeys->width;
+				depth = zo->hotkeys->depth;
+				on = 1;
+			}
+			zootcl_hotkeys_cleanup (zo);
+			if (!on) {
+				return TCL_OK;
+			}
+		} else if (strcmp (action, "on") == 0) {
+			on = 1;
+			first = 3;
+		}
+	}
+
+	int reportK = (zo->hotkeys != NULL) ? zo->hotkeys->k : k;
+
+	for (i = first; i < objc; i++) {
+		int suboptIndex;
+		int value;
+
+		if (Tcl_GetIndexFromObj (interp, objv[i], subOptions, "suboption", TCL_EXACT, &suboptIndex) != TCL_OK) {
+			return TCL_ERROR;
+		}
+		if (!on && suboptIndex != SUBOPT_K) {
+			Tcl_SetObjResult (interp, Tcl_ObjPrintf ("%s only goes with hotkeys on", Tcl_GetString (objv[i])));
+			return TCL_ERROR;
+		}
+		if (i + 1 >= objc) {
+			Tcl_WrongNumArgs (interp, 2, objv, "?on? ?-k n? ?-width n? ?-depth n?");
+			return TCL_ERROR;
+		}
+		if (Tcl_GetIntFromObj (interp, objv[++i], &value) == TCL_ERROR) {
+			return TCL_ERROR;
+		}
+		if (value < 1) {
+			Tcl_SetObjResult (interp, Tcl_ObjPrintf ("%s must be at least 1", Tcl_GetString (objv[i - 1])));
+			return TCL_ERROR;
+		}
+
+		switch ((enum subOptions) suboptIndex) {
+			case SUBOPT_K:
+				k = reportK = value;
+				break;
+
+			case SUBOPT_WIDTH:
+				width = value;
+				break;
+
+			case SUBOPT_DEPTH:
+				depth = value;
+				break;
+		}
+	}
+
+	if (on) {
+		// checked before multiplying so the allocation can't wrap
+		if (width > ZOOTCL_HOTKEYS_MAX_COUNTERS / depth) {
+			Tcl_SetObjResult (interp, Tcl_ObjPrintf ("-width times -depth can be at most %d", ZOOTCL_HOTKEYS_MAX_COUNTERS));
+			return TCL_ERROR;
+		}
+		if (k > ZOOTCL_HOTKEYS_MAX_K) {
+			Tcl_SetObjResult (interp, Tcl_ObjPrintf ("-k can be at most %d", ZOOTCL_HOTKEYS_MAX_K));
+			return TCL_ERROR;
+		}
+
+		zootcl_hotkeys_cleanup (zo);
+
+		zootcl_hotKeys *hk = (zootcl_hotKeys *)ckalloc (sizeof (zootcl_hotKeys));
+		hk->width = width;
+		hk->depth = depth;
+		hk->k = k;
+		hk->sketch = (unsigned int *)ckalloc (sizeof (unsigned int) * width * depth);
+		memset (hk->sketch, 0, sizeof (unsigned int) * width * depth);
+		hk->heap = (zootcl_hotKey **)ckalloc (sizeof (zootcl_hotKey *) * k);
+		hk->heapSize = 0;
+		Tcl_InitHashTable (&hk->keys, TCL_STRING_KEYS);
+		zo->hotkeys = hk;
+		return TCL_OK;
+	}
+
+	zootcl_hotKeys *hk = zo->hotkeys;
+	Tcl_Obj *resultObj = Tcl_NewObj ();
+
+	if (hk == NULL) {
+		Tcl_SetObjResult (interp, resultObj);
+		return TCL_OK;
+	}
+
+	zootcl_hotKey **sorted = (zootcl_hotKey **)ckalloc (sizeof (zootcl_hotKey *) * (hk->heapSize + 1));
+	memcpy (sorted, hk->heap, sizeof (zootcl_hotKey *) * hk->heapSize);
+	qsort (sorted, hk->heapSize, sizeof (zootcl_hotKey *), zootcl_hotkeys_compare);
+
+	for (i = 0; i < hk->heapSize && i < reportK; i++) {
+		const char *space = strchr (sorted[i]->key, ' ');
+		Tcl_Obj *listObjv[6];
+
+		listObjv[0] = Tcl_NewStringObj ("path", -1);
+		listObjv[1] = Tcl_NewStringObj (space + 1, -1);
+		listObjv[2] = Tcl_NewStringObj ("op", -1);
+		listObjv[3] = Tcl_NewStringObj (sorted[i]->key, space - sorted[i]->key);
+		listObjv[4] = Tcl_NewStringObj ("count", -1);
+		listObjv[5] = Tcl_NewWideIntObj (sorted[i]->count);
+		Tcl_ListObjAppendElement (NULL, resultObj, Tcl_NewListObj (6, listObjv));
+	}
+	ckfree (sorted);
+
+	Tcl_SetObjResult (interp, resultObj);
+	return TCL_OK;
+}
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * zootcl_exists_subcommand --
+ *
+ *      implement the "exists" methods of a zookeeper tcl command
+ *      object
+ *
+ * Results:
+ *      A standard Tcl result.
+ *
+ *
+ *----------------------------------------------------------------------
+ */
+int
+zootcl_exists_subcommand(Tcl_Interp *interp, int objc, Tcl_Obj *CONST objv[], ZOOAPI zhandle_t *zh, zootcl_objectClientData *zo)
+{
+	static CONST char *subOptions[] = {
+		"-watch",
+		"-async",
+		"-stat",
+		"-statvar",
+		"-version",
+		"-watchfilter",
+		NULL
+	};
+
+	enum subOptions {
+		SUBOPT_WATCH,
+		SUBOPT_ASYNC,
+		SUBOPT_STAT,
+		SUBOPT_STATVAR,
+		SUBOPT_VERSION,
+		SUBOPT_WATCHFILTER
+	};
+
+	const char *path;
+	watcher_fn wfn = NULL;
+
+    assert (zo->zookeeper_object_magic == ZOOKEEPER_OBJECT_MAGIC);
+
+	if (objc < 3) {
+		Tcl_WrongNumArgs (interp, 2, objv, "path ?-watch code? ?-watchfilter filter? ?-stat statArray? ?-statvar statVar? ?-async callback? ?-version versionVar?");
+		return TCL_ERROR;
+	}
+
+	path = zootcl_path_string (interp, objv[2]);
+	if (path == NULL) {
+		return TCL_ERROR;
+	}
+
+	int i;
+	int suboptIndex = 0;
+	Tcl_Obj *watcherCallbackObj = NULL;
+	Tcl_Obj *asyncCallbackObj = NULL;
+	char *statArray = NULL;
+	Tcl_Obj *statVarObj = NULL;
+	Tcl_Obj *versionVarObj = NULL;
+	Tcl_Obj *watchFilterObj = NULL;
+
+	for (i = 3; i < objc; i++) {
+		if (Tcl_GetIndexFromObj (interp, objv[i], subOptions, "suboption",
+			TCL_EXACT, &suboptIndex) != TCL_OK) {
+			return TCL_ERROR;
+		}
+
+		switch ((enum subOptions) suboptIndex) {
+			case SUBOPT_WATCH:
+			{
+				if (i + 1 >= objc) {
+					Tcl_WrongNumArgs (interp, 2, objv, "path ... -watch code");
+					return TCL_ERROR;
+				}
+				watcherCallbackObj = objv[++i];
+				Tcl_IncrRefCount (watcherCallbackObj);
+				break;
+			}
+
+			case SUBOPT_ASYNC:
+			{
+				if (i + 1 >= objc) {
+					Tcl_WrongNumArgs (interp, 2, objv, "path ... -async code");
+					return TCL_ERROR;
+				}
+				asyncCallbackObj = objv[++i];
+				Tcl_IncrRefCount (asyncCallbackObj);
+				break;
+			}
+
+			case SUBOPT_STAT:
+			{
+				if (i + 1 >= objc) {
+					Tcl_WrongNumArgs (interp, 2, objv, "path ... -stat statArray");
+					return TCL_ERROR;
+				}
+				statArray = Tcl_GetString (objv[++i]);
+				break;
+			}
+
+			case SUBOPT_STATVAR:
+			{
+				if (i + 1 >= objc) {
+					Tcl_WrongNumArgs (interp, 2, objv, "path ... -statvar statVar");
+					return TCL_ERROR;
+				}
+				statVarObj = objv[++i];
+				break;
+			}
+
+			case SUBOPT_VERSION:
+			{
+				if (i + 1 >= objc) {
+					Tcl_WrongNumArgs (interp, 2, objv, "path ... -version versionVar");
+					return TCL_ERROR;
+				}
+				versionVarObj = objv[++i];
+				break;
+			}
+
+			case SUBOPT_WATCHFILTER:
+			{
+				if (i + 1 >= objc) {
+					Tcl_WrongNumArgs (interp, 2, objv, "path ... -watchfilter filter");
+					return TCL_ERROR;
+				}
+				watchFilterObj = objv[++i];
+				break;
+			}
+		}
+	}
+
+	if (asyncCallbackObj != NULL) {
+		if (statArray != NULL) {
+			Tcl_SetObjResult (interp, Tcl_NewStringObj ("-stat and -async options are mutually exclusive", -1));
+			return TCL_ERROR;
+		}
+
+		if (statVarObj != NULL) {
+			Tcl_SetObjResult (interp, Tcl_NewStringObj ("-statvar and -async options are mutually exclusive", -1));
+			return TCL_ERROR;
+		}
+
+		if (versionVarObj != NULL) {
+			Tcl_SetObjResult (interp, Tcl_NewStringObj ("-version and -async options are mutually exclusive", -1));
+			return TCL_ERROR;
+		}
+	}
+
+	if (watchFilterObj != NULL) {
+		if (watcherCallbackObj == NULL) {
+			Tcl_SetObjResult (interp, Tcl_NewStringObj ("-watchfilter requires -watch", -1));
+			return TCL_ERROR;
+		}
+
+		// the filter has to know whether the watch was left, which
+		// only the synchronous call tells us
+		if (asyncCallbackObj != NULL) {
+			Tcl_SetObjResult (interp, Tcl_NewStringObj ("-watchfilter and -async options are mutually exclusive", -1));
+			return TCL_ERROR;
+		}
+	}
+
+	if (watcherCallbackObj != NULL) {
+		wfn = zootcl_watcher;
+	}
+
+	void *watcherCtx = (void *)watcherCallbackObj;
+	zootcl_watchFilter *wf = NULL;
+
+	if (watchFilterObj != NULL) {
+		wf = zootcl_new_watch_filter (interp, watchFilterObj, zh, watcherCallbackObj, path, 0);
+		if (wf == NULL) {
+			return TCL_ERROR;
+		}
+		wfn = zootcl_filtered_watcher;
+		watcherCtx = (void *)wf;
+	}
+
+	if (zo->hotkeys != NULL) {
+		zootcl_hotkeys_count (zo, REQ_EXISTS, path);
+	}
+
+	int status;
+
+	if (asyncCallbackObj == NULL) {
+		struct Stat *stat = (struct Stat *)ckalloc (sizeof (struct Stat));
+		Tcl_WideInt traceStart = zootcl_trace_now (zo);
+		status = zoo_wexists(zh, path, wfn, watcherCtx, stat);	
+		zootcl_count_request (zo, REQ_EXISTS, status, 0);
+		zootcl_trace_sync (zo, REQ_EXISTS, path, traceStart, status);
+		zootcl_count_sent (zo, wfn != NULL && (status == ZOK || status == ZNONODE), 0);
+
+		// an exists leaves a watch whether or not the znode is there
+		if (wf != NULL) {
+			zootcl_watch_filter_registered (wf, status == ZOK || status == ZNONODE, 0, NULL, 0);
+		}
+
+		// if there's no node hand that according to our rule.
+		// unset the version var since we don't have one and we
+		// don't want to confuse the caller by letting through some
+		// old thing or require them to unset the var before calling
+		// us.  that ain't happenin'.
+		if (status == ZNONODE) {
+			if (versionVarObj != NULL) {
+				Tcl_UnsetVar (interp, Tcl_GetString (versionVarObj), 0);
+			}
+			Tcl_SetObjResult (interp, Tcl_NewBooleanObj (0));
+			ckfree (stat);
+			return TCL_OK;
+		}
+
+		// handle errors from the call like bad arguments and stuff
+		if (status != ZOK) {
+			ckfree (stat);
+			return zootcl_set_tcl_return_code (interp, status);
+		}
+
+		// it does exist
+		Tcl_SetObjResult (interp, Tcl_NewBooleanObj (1));
+
+		// if the caller wanted a stat array, we're good here,
+		// fill that.
+		if (statArray != NULL && zootcl_stat_to_array (interp, statArray, stat) == TCL_ERROR) {
+			ckfree (stat);
+			return TCL_ERROR;
+		}
+
+		// a single stat object is much cheaper than filling an
+		// array if only a field or two is wanted
+		if (statVarObj != NULL && Tcl_ObjSetVar2 (interp, statVarObj, NULL, zootcl_new_stat_obj (stat), TCL_LEAVE_ERR_MSG) == NULL) {
+			ckfree (stat);
+			return TCL_ERROR;
+		}
+
+		// we want version so commonly and not much else in the stat array
+		// so we have a -version option to make it easy
+		if (versionVarObj != NULL) {
+			if (Tcl_SetVar2Ex (interp, Tcl_GetString (versionVarObj), NULL, Tcl_NewIntObj (stat->version), TCL_LEAVE_ERR_MSG) == NULL) {
+				ckfree (stat);
+				return TCL_ERROR;
+			}
+		}
+		ckfree (stat);
+	} else {
+		// do the asynchronous version of znode existence check
+		zootcl_callbackContext *ztc = (zootcl_callbackContext *)ckalloc (sizeof (zootcl_callbackContext));
+		ztc->callbackObj = asyncCallbackObj;
+		ztc->zo = zo;
+		ztc->kind = REQ_EXISTS;
+		zootcl_trace_start (zo, ztc, path);
+		ztc->requestId = ++zo->nextRequestId;
+
+		status = zootcl_async_awexists (zo, ztc->requestId, path, wfn, (void *)watcherCallbackObj, zootcl_stat_completion_callback, ztc);
+		return zootcl_async_result (interp, zo, REQ_EXISTS, ztc->requestId, status);
+	}
+
+	return zootcl_set_tcl_return_code (interp, status);
+}
+
+/*
+ *--------------------------------------------------------------
+ *
+ * zootcl_unchanged_result -- answer a synchronous -ifnewer that
+ *   found nothing new.  that's not a failure, so the result is
+ *   empty (or 1, the znode exists, with -data) and unchangedVarObj,
+ *   if there is one, is set to 1.
+ *
+ *--------------------------------------------------------------
+ */
+static int
+zootcl_unchanged_result (Tcl_Interp *interp, Tcl_Obj *unchangedVarObj, int exists)
+{
+	if (unchangedVarObj != NULL && Tcl_ObjSetVar2 (interp, unchangedVarObj, NULL, Tcl_NewBooleanObj (1), TCL_LEAVE_ERR_MSG) == NULL) {
+		return TCL_ERROR;
+	}
+
+	if (exists) {
+		Tcl_SetObjResult (interp, Tcl_NewBooleanObj (1));
+	} else {
+		Tcl_ResetResult (interp);
+	}
+	return TCL_OK;
+}
+
+/*
+ *--------------------------------------------------------------
+ *
+ * zootcl_new_ifnewer_context -- make the context for an async
+ *   -ifnewer exists check
+ *
+ *--------------------------------------------------------------
+ */
+zootcl_ifNewerContext *
+zootcl_new_ifnewer_context (zootcl_objectClientData *zo, Tcl_Obj *callbackObj, int requestId, Tcl_WideInt zxid, int children, const char *path)
+{
+	zootcl_ifNewerContext *inc = (zootcl_ifNewerContext *)ckalloc (sizeof (zootcl_ifNewerContext));
+
+	inc->zo = zo;
+	inc->callbackObj = callbackObj;
+	inc->requestId = requestId;
+	inc->zxid = zxid;
+	inc->children = children;
+	inc->path = ckalloc (strlen (path) + 1);
+	strcpy (inc->path, path);
+	return inc;
+}
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * zootcl_get_subcommand --
+ *
+ *      implement the "get" methods of a zookeeper tcl command
+ *      object
+ *
+ * Results:
+ *      A standard Tcl result.
+ *
+ * NB: bears way too much in common with zootcl_exists_subcommand; needs factoring
+ *
+ *----------------------------------------------------------------------
+ */
+int
+zootcl_get_subcommand(Tcl_Interp *interp, int objc, Tcl_Obj *CONST objv[], ZOOAPI zhandle_t *zh, zootcl_objectClientData *zo)
+{
+	static CONST char *subOptions[] = {
+		"-watch",
+		"-async",
+		"-stat",
+		"-statvar",
+		"-data",
+		"-version",
+		"-ifnewer",
+		"-watchfilter",
+		"-unchangedvar",
+		NULL
+	};
+
+	enum subOptions {
+		SUBOPT_WATCH,
+		SUBOPT_ASYNC,
+		SUBOPT_STAT,
+		SUBOPT_STATVAR,
+		SUBOPT_DATA,
+		SUBOPT_VERSION,
+		SUBOPT_IFNEWER,
+		SUBOPT_WATCHFILTER,
+		SUBOPT_UNCHANGEDVAR
+	};
+
+	const char *path;
+	watcher_fn wfn = NULL;
+
+    assert (zo->zookeeper_object_magic == ZOOKEEPER_OBJECT_MAGIC);
+
+	if (objc < 3) {
+		Tcl_WrongNumArgs (interp, 2, objv, "path ?-watch code? ?-watchfilter filter? ?-stat statArray? ?-statvar statVar? ?-async callback? ?-data dataVar? ?-version versionVar? ?-ifnewer mzxid? ?-unchangedvar var?");
+		return TCL_ERROR;
+	}
+
+	path = zootcl_path_string (interp, objv[2]);
+	if (path == NULL) {
+		return TCL_ERROR;
+	}
+
+	int i;
+	int suboptIndex = 0;
+	Tcl_Obj *watcherCallbackObj = NULL;
+	Tcl_Obj *asyncCallbackObj = NULL;
+	char *statArray = NULL;
+	Tcl_Obj *statVarObj = NULL;
+	Tcl_Obj *dataVarObj = NULL;
+	Tcl_Obj *versionVarObj = NULL;
+	Tcl_WideInt ifNewer = 0;
+	int haveIfNewer = 0;
+	Tcl_Obj *watchFilterObj = NULL;
+	Tcl_Obj *unchangedVarObj = NULL;
+
+	for (i = 3; i < objc; i++) {
+		if (Tcl_GetIndexFromObj (interp, objv[i], subOptions, "suboption",
+			TCL_EXACT, &suboptIndex) != TCL_OK) {
+			return TCL_ERROR;
+		}
+
+		switch ((enum subOptions) suboptIndex) {
+			case SUBOPT_WATCH:
+			{
+				if (i + 1 >= objc) {
+					Tcl_WrongNumArgs (interp, 2, objv, "path ... -watch code");
+					return TCL_ERROR;
+				}
+				watcherCallbackObj = objv[++i];
+				Tcl_IncrRefCount (watcherCallbackObj);
+				break;
+			}
+
+			case SUBOPT_ASYNC:
+			{
+				if (i + 1 >= objc) {
+					Tcl_WrongNumArgs (interp, 2, objv, "path ... -async code");
+					return TCL_ERROR;
+				}
+				asyncCallbackObj = objv[++i];
+				Tcl_IncrRefCount (asyncCallbackObj);
+				break;
+			}
+
+			case SUBOPT_STAT:
+			{
+				if (i + 1 >= objc) {
+					Tcl_WrongNumArgs (interp, 2, objv, "path ... -stat statArray");
+					return TCL_ERROR;
+				}
+				statArray = Tcl_GetString (objv[++i]);
+				break;
+			}
+
+			case SUBOPT_STATVAR:
+			{
+				if (i + 1 >= objc) {
+					Tcl_WrongNumArgs (interp, 2, objv, "path ... -statvar statVar");
+					return TCL_ERROR;
+				}
+				statVarObj = objv[++i];
+				break;
+			}
+
+			case SUBOPT_DATA:
+			{
+				if (i + 1 >= objc) {
+					Tcl_WrongNumArgs (interp, 2, objv, "path ... -data dataVar");
+					return TCL_ERROR;
+				}
+				dataVarObj = objv[++i];
+				break;
+			}
+
+			case SUBOPT_VERSION:
+			{
+				if (i + 1 >= objc) {
+					Tcl_WrongNumArgs (interp, 2, objv, "path ... -version versionVar");
+					return TCL_ERROR;
+				}
+				versionVarObj = objv[++i];
+				break;
+			}
+
+			case SUBOPT_IFNEWER:
+			{
+				if (i + 1 >= objc) {
+					Tcl_WrongNumArgs (interp, 2, objv, "path ... -ifnewer mzxid");
+					return TCL_ERROR;
+				}
+				if (Tcl_GetWideIntFromObj (interp, objv[++i], &ifNewer) == TCL_ERROR) {
+					return TCL_ERROR;
+				}
+				haveIfNewer = 1;
+				break;
+			}
+
+			case SUBOPT_WATCHFILTER:
+			{
+				if (i + 1 >= objc) {
+					Tcl_WrongNumArgs (interp, 2, objv, "path ... -watchfilter filter");
+					return TCL_ERROR;
+				}
+				watchFilterObj = objv[++i];
+				break;
+			}
+
+			case SUBOPT_UNCHANGEDVAR:
+			{
+				if (i + 1 >= objc) {
+					Tcl_WrongNumArgs (interp, 2, objv, "path ... -unchangedvar var");
+					return TCL_ERROR;
+				}
+				unchangedVarObj = objv[++i];
+				break;
+			}
+		}
+	}
+
+	if (asyncCallbackObj != NULL) {
+		if (statArray != NULL) {
+			Tcl_SetObjResult (interp, Tcl_NewStringObj ("-stat and -async options are mutually exclusive", -1));
+			return TCL_ERROR;
+		}
+
+		if (statVarObj != NULL) {
+			Tcl_SetObjResult (interp, Tcl_NewStringObj ("-statvar and -async options are mutually exclusive", -1));
+			return TCL_ERROR;
+		}
+
+		if (dataVarObj != NULL) {
+			Tcl_SetObjResult (interp, Tcl_NewStringObj ("-data and -async options are mutually exclusive", -1));
+			return TCL_ERROR;
+		}
+
+		if (versionVarObj != NULL) {
+			Tcl_SetObjResult (interp, Tcl_NewStringObj ("-version and -async options are mutually exclusive", -1));
+			return TCL_ERROR;
+		}
+
+		if (unchangedVarObj != NULL) {
+			Tcl_SetObjResult (interp, Tcl_NewStringObj ("-unchangedvar and -async options are mutually exclusive", -1));
+			return TCL_ERROR;
+		}
+	}
+
+	// cleared up front, it's only set once we know nothing changed
+	if (unchangedVarObj != NULL && Tcl_ObjSetVar2 (interp, unchangedVarObj, NULL, Tcl_NewBooleanObj (0), TCL_LEAVE_ERR_MSG) == NULL) {
+		return TCL_ERROR;
+	}
+
+	if (watchFilterObj != NULL) {
+		if (watcherCallbackObj == NULL) {
+			Tcl_SetObjResult (interp, Tcl_NewStringObj ("-watchfilter requires -watch", -1));
+			return TCL_ERROR;
+		}
+
+		// the filter has to know whether the watch was left, which
+		// only the synchronous call tells us
+		if (asyncCallbackObj != NULL) {
+			Tcl_SetObjResult (interp, Tcl_NewStringObj ("-watchfilter and -async options are mutually exclusive", -1));
+			return TCL_ERROR;
+		}
+	}
+
+	if (watcherCallbackObj != NULL) {
+		wfn = zootcl_watcher;
+	}
+
+	void *watcherCtx = (void *)watcherCallbackObj;
+	zootcl_watchFilter *wf = NULL;
+
+	if (watchFilterObj != NULL) {
+		wf = zootcl_new_watch_filter (interp, watchFilterObj, zh, watcherCallbackObj, path, 1);
+		if (wf == NULL) {
+			return TCL_ERROR;
+		}
+		wfn = zootcl_filtered_watcher;
+		watcherCtx = (void *)wf;
+	}
+
+	int status;
+
+	if (zo->hotkeys != NULL) {
+		zootcl_hotkeys_count (zo, REQ_GET, path);
+	}
+
+	// if asyncCallbackObj is null, do the synchronous version
+	if (asyncCallbackObj == NULL) {
+		Tcl_WideInt traceStart = zootcl_trace_now (zo);
+
+		if (haveIfNewer) {
+			// look at the stat before pulling over the data.  any
+			// watch is left by the exists, which fires on the same
+			// changes a get's would.
+			struct Stat ifNewerStat;
+
+			status = zoo_wexists (zh, path, wfn, watcherCtx, &ifNewerStat);
+			zootcl_count_sent (zo, wfn != NULL && (status == ZOK || status == ZNONODE), 0);
+			if (status == ZOK) {
+				if (ifNewerStat.mzxid <= ifNewer) {
+					zootcl_count_request (zo, REQ_GET, ZOOTCL_UNCHANGED, 0);
+					zootcl_trace_sync (zo, REQ_GET, path, traceStart, ZOOTCL_UNCHANGED);
+					if (wf != NULL) {
+						zootcl_watch_filter_registered (wf, 1, 0, NULL, 0);
+					}
+					return zootcl_unchanged_result (interp, unchangedVarObj, dataVarObj != NULL);
+				}
+			} else if (status != ZNONODE) {
+				if (wf != NULL) {
+					zootcl_watch_filter_registered (wf, 0, 0, NULL, 0);
+				}
+				zootcl_count_request (zo, REQ_GET, status, 0);
+				zootcl_trace_sync (zo, REQ_GET, path, traceStart, status);
+				return zootcl_set_tcl_return_code (interp, status);
+			}
+
+			// the exists left the watch whether or not the znode
+			// is there, the get mustn't leave a second one
+			wfn = NULL;
+		}
+
+		// make the buffer 1MB + 1 byte since 1MB is the
+		// default maximum size for a znode's data
+		int bufferLen = 1048576 + 1;
+		char buffer[bufferLen];
+		struct Stat *stat = (struct Stat *)ckalloc (sizeof (struct Stat));
+
+		status = zoo_wget(zh, path, wfn, watcherCtx, buffer, &bufferLen, stat);	
+		zootcl_count_request (zo, REQ_GET, status, (status == ZOK) ? bufferLen : 0);
+		zootcl_trace_sync (zo, REQ_GET, path, traceStart, status);
+		zootcl_count_sent (zo, wfn != NULL && status == ZOK, 0);
+
+		if (wf != NULL) {
+			zootcl_watch_filter_registered (wf, haveIfNewer || status == ZOK, status == ZOK, buffer, bufferLen);
+		}
+
+		// if the node does not exist and -data was specified
+		// unset the var: do the same if a -version var was
+		// also specified and, finally, return 0
+		if (status == ZNONODE && dataVarObj != NULL) {
+			Tcl_UnsetVar(interp, Tcl_GetString(dataVarObj), 0);
+			if (versionVarObj != NULL) {
+				Tcl_UnsetVar (interp, Tcl_GetString (versionVarObj), 0);
+			}
+			Tcl_SetObjResult (interp, Tcl_NewBooleanObj (0));
+			ckfree (stat);
+			return TCL_OK;
+		}
+
+		if (status != ZOK) {
+			ckfree (stat);
+			return zootcl_set_tcl_return_code (interp, status);
+		}
+
+		if (dataVarObj == NULL) {
+			if (bufferLen != -1) {
+				Tcl_SetObjResult (interp, Tcl_NewStringObj(buffer, bufferLen));
+			}
+		} else if (bufferLen == -1) {
+			// if the node does exist, but the data in the znode is NULL
+			// unset the var name specified by -data
+			Tcl_UnsetVar(interp, Tcl_GetString(dataVarObj), 0);
+
+			// Need to set a boolean result to return to the caller
+			Tcl_SetObjResult (interp, Tcl_NewBooleanObj (1));
+		} else {
+			if (Tcl_SetVar2Ex (interp, Tcl_GetString (dataVarObj), NULL, Tcl_NewStringObj(buffer, bufferLen), TCL_LEAVE_ERR_MSG) == NULL) {
+				ckfree (stat);
+				return TCL_ERROR;
+			}
+			Tcl_SetObjResult (interp, Tcl_NewBooleanObj (1));
+		}
+
+		if (statArray && zootcl_stat_to_array (interp, statArray, stat) == TCL_ERROR) {
+			ckfree (stat);
+			return TCL_ERROR;
+		}
+
+		// a single stat object is much cheaper than filling an
+		// array if only a field or two is wanted
+		if (statVarObj != NULL && Tcl_ObjSetVar2 (interp, statVarObj, NULL, zootcl_new_stat_obj (stat), TCL_LEAVE_ERR_MSG) == NULL) {
+			ckfree (stat);
+			return TCL_ERROR;
+		}
+
+		if (versionVarObj != NULL) {
+			if (Tcl_SetVar2Ex (interp, Tcl_GetString (versionVarObj), NULL, Tcl_NewIntObj (stat->version), TCL_LEAVE_ERR_MSG) == NULL) {
+				ckfree (stat);
+				return TCL_ERROR;
+			}
+		}
+		ckfree (stat);
+	} else {
+		// do the asynchronous version
+		zootcl_callbackContext *ztc = (zootcl_callbackContext *)ckalloc (sizeof (zootcl_callbackContext));
+		ztc->callbackObj = asyncCallbackObj;
+		ztc->zo = zo;
+		ztc->kind = REQ_GET;
+		zootcl_trace_start (zo, ztc, path);
+		int requestId = ztc->requestId = ++zo->nextRequestId;
+
+		if (haveIfNewer) {
+			zootcl_ifNewerContext *inc = zootcl_new_ifnewer_context (zo, asyncCallbackObj, requestId, ifNewer, 0, path);
+			inc->submitTime = ztc->submitTime;
+			inc->pathHash = ztc->pathHash;
+			ckfree (ztc);
+			status = zootcl_async_awexists (zo, requestId, path, wfn, (void *)watcherCallbackObj, zootcl_ifnewer_completion_callback, inc);
+			if (status != ZOK) {
+				// the exists never went out, so its completion won't
+				// be around to free the context
+				Tcl_DecrRefCount (asyncCallbackObj);
+				ckfree (inc->path);
+				ckfree (inc);
+			}
+		} else {
+			status = zootcl_async_awget (zo, requestId, path, wfn, (void *)watcherCallbackObj, zootcl_data_completion_callback, ztc);
+		}
+		return zootcl_async_result (interp, zo, REQ_GET, requestId, status);
+	}
+
+	return zootcl_set_tcl_return_code (interp, status);
+}
+
+
+// the most children -since snapshots an object keeps before it starts
+// dropping the oldest
+#define ZOOTCL_CHILD_SNAPSHOTS_MAX 64
+
+/*
+ *--------------------------------------------------------------
+ *
+ * zootcl_child_snapshot_free -- free a children -since snapshot
+ *
+ *--------------------------------------------------------------
+ */
+void
+zootcl_child_snapshot_free (zootcl_childSnapshot *snapshot)
+{
+	Tcl_DeleteHashTable (&snapshot->names);
+	ckfree (snapshot->path);
+	ckfree (snapshot);
+}
+
+/*
+ *--------------------------------------------------------------
+ *
+ * zootcl_children_cleanup -- free the children -since snapshots
+ *   of an object that is being deleted
+ *
+ *--------------------------------------------------------------
+ */
+void
+zootcl_children_cleanup (zootcl_objectClientData *zo)
+{
+	Tcl_HashSearch search;
+	Tcl_HashEntry *hashEntry;
+
+	for (hashEntry = Tcl_FirstHashEntry (&zo->childSnapshots, &search); hashEntry != NULL; hashEntry = Tcl_NextHashEntry (&search)) {
+		zootcl_child_snapshot_free ((zootcl_childSnapshot *)Tcl_GetHashValue (hashEntry));
+	}
+	Tcl_DeleteHashTable (&zo->childSnapshots);
+}
+
+/*
+ *--------------------------------------------------------------
+ *
+ * zootcl_children_find_token -- look up the children -since
+ *   snapshot named by tokenObj, which must be for path
+ *
+ * Results:
+ *      the hash entry, or NULL with an error in the interpreter
+ *
+ *--------------------------------------------------------------
+ */
+static Tcl_HashEntry *
+zootcl_children_find_token (Tcl_Interp *interp, zootcl_objectClientData *zo, const char *path, Tcl_Obj *tokenObj)
+{
+	char *token = Tcl_GetString (tokenObj);
+	Tcl_HashEntry *hashEntry = Tcl_FindHashEntry (&zo->childSnapshots, token);
+
+	if (hashEntry == NULL) {
+		Tcl_SetObjResult (interp, Tcl_ObjPrintf ("unknown children token \"%s\"", token));
+		return NULL;
+	}
+
+	zootcl_childSnapshot *snapshot = (zootcl_childSnapshot *)Tcl_GetHashValue (hashEntry);
+	if (strcmp (snapshot->path, path) != 0) {
+		Tcl_SetObjResult (interp, Tcl_ObjPrintf ("children token \"%s\" is for \"%s\", not \"%s\"", token, snapshot->path, path));
+		return NULL;
+	}
+	return hashEntry;
+}
+
+/*
+ *--------------------------------------------------------------
+ *
+ * zootcl_children_evict -- drop the oldest children -since
+ *   snapshot once there are more than ZOOTCL_CHILD_SNAPSHOTS_MAX,
+ *   so tokens that are never used again don't pile up
+ *
+ *--------------------------------------------------------------
+ */
+static void
+zootcl_children_evict (zootcl_objectClientData *zo)
+{
+	Tcl_HashSearch search;
+	Tcl_HashEntry *hashEntry;
+	Tcl_HashEntry *oldest = NULL;
+	int oldestId = 0;
+
+	if (zo->childSnapshots.numEntries <= ZOOTCL_CHILD_SNAPSHOTS_MAX) {
+		return;
+	}
+
+	for (hashEntry = Tcl_FirstHashEntry (&zo->childSnapshots, &search); hashEntry != NULL; hashEntry = Tcl_NextHashEntry (&search)) {
+		zootcl_childSnapshot *snapshot = (zootcl_childSnapshot *)Tcl_GetHashValue (hashEntry);
+		if (oldest == NULL || snapshot->id < oldestId) {
+			oldest = hashEntry;
+			oldestId = snapshot->id;
+		}
+	}
+
+	zootcl_child_snapshot_free ((zootcl_childSnapshot *)Tcl_GetHashValue (oldest));
+	Tcl_DeleteHashEntry (oldest);
+}
+
+/*
+ *--------------------------------------------------------------
+ *
+ * zootcl_children_release -- free the children -since snapshot
+ *   named by tokenObj without diffing against it
+ *
+ * Results:
+ *      A standard Tcl result.
+ *
+ *--------------------------------------------------------------
+ */
+int
+zootcl_children_release (Tcl_Interp *interp, zootcl_objectClientData *zo, const char *path, Tcl_Obj *tokenObj)
+{
+	Tcl_HashEntry *hashEntry = zootcl_children_find_token (interp, zo, path, tokenObj);
+
+	if (hashEntry == NULL) {
+		return TCL_ERROR;
+	}
+	zootcl_child_snapshot_free ((zootcl_childSnapshot *)Tcl_GetHashValue (hashEntry));
+	Tcl_DeleteHashEntry (hashEntry);
+	return TCL_OK;
+}
+
+/*
+ *--------------------------------------------------------------
+ *
+ * zootcl_children_since -- diff the children of path against the
+ *   snapshot identified by sinceObj and set the interpreter result
+ *   to a list of the new token and the names added and removed
+ *
+ *   an empty token means there is no previous snapshot, so
+ *   everything is added.  a token is good for one use; the
+ *   snapshot it names is replaced by the one we make now.  only
+ *   the newest ZOOTCL_CHILD_SNAPSHOTS_MAX snapshots are kept.
+ *
+ * Results:
+ *      A standard Tcl result.
+ *
+ *--------------------------------------------------------------
+ */
+int
+zootcl_children_since (Tcl_Interp *interp, zootcl_objectClientData *zo, const char *path, Tcl_Obj *sinceObj, char **names, int count)
+{
+	zootcl_childSnapshot *old = NULL;
+	Tcl_HashEntry *hashEntry = NULL;
+	Tcl_HashSearch search;
+	char newToken[32];
+	int isNew;
+	int i;
+
+	if (*Tcl_GetString (sinceObj) != '\0') {
+		hashEntry = zootcl_children_find_token (interp, zo, path, sinceObj);
+		if (hashEntry == NULL) {
+			return TCL_ERROR;
+		}
+		old = (zootcl_childSnapshot *)Tcl_GetHashValue (hashEntry);
+		Tcl_DeleteHashEntry (hashEntry);
+	}
+
+	zootcl_childSnapshot *snapshot = (zootcl_childSnapshot *)ckalloc (sizeof (zootcl_childSnapshot));
+	snapshot->path = ckalloc (strlen (path) + 1);
+	strcpy (snapshot->path, path);
+	snapshot->id = zo->nextSnapshotId++;
+	Tcl_InitHashTable (&snapshot->names, TCL_STRING_KEYS);
+
+	Tcl_Obj *addedObj = Tcl_NewObj ();
+	Tcl_Obj *removedObj = Tcl_NewObj ();
+
+	for (i = 0; i < count; i++) {
+		Tcl_CreateHashEntry (&snapshot->names, names[i], &isNew);
+		if (old == NULL || Tcl_FindHashEntry (&old->names, names[i]) == NULL) {
+			Tcl_ListObjAppendElement (NULL, addedObj, Tcl_NewStringObj (names[i], -1));
+		}
+	}
+
+	if (old != NULL) {
+		for (hashEntry = Tcl_FirstHashEntry (&old->names, &search); hashEntry != NULL; hashEntry = Tcl_NextHashEntry (&search)) {
+			char *name = Tcl_GetHashKey (&old->names, hashEntry);
+			if (Tcl_FindHashEntry (&snapshot->names, name) == NULL) {
+				Tcl_ListObjAppendElement (NULL, removedObj, Tcl_NewStringObj (name, -1));
+			}
+		}
+		zootcl_child_snapshot_free (old);
+	}
+
+	snprintf (newToken, sizeof (newToken), "children%d", snapshot->id);
+	Tcl_SetHashValue (Tcl_CreateHashEntry (&zo->childSnapshots, newToken, &isNew), (ClientData)snapshot);
+	zootcl_children_evict (zo);
+
+	Tcl_Obj *listObjv[3];
+	listObjv[0] = Tcl_NewStringObj (newToken, -1);
+	listObjv[1] = addedObj;
+	listObjv[2] = removedObj;
+	Tcl_SetObjResult (interp, Tcl_NewListObj (3, listObjv));
+	return TCL_OK;
+}
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * zootcl_children_subcommand --
+ *
+ *      implement the "children" method of a zookeeper tcl command
+ *      object
+ *
+ * Results:
+ *      A standard Tcl result.
+ *
+ *
+ *----------------------------------------------------------------------
+ */
+int
+zootcl_children_subcommand(Tcl_Interp *interp, int objc, Tcl_Obj *CONST objv[], ZOOAPI zhandle_t *zh, zootcl_objectClientData *zo)
+{
+	Tcl_Obj *callbackObj = NULL;
 	Tcl_Obj *watcherCallbackObj = NULL;
-	Tcl_Obj *asyncCallbackObj = NULL;
-	char *statArray = NULL;
-	Tcl_Obj *versionVarObj = NULL;
 
-	for (i = 3; i < objc; i++) {
-		if (Tcl_GetIndexFromObj (interp, objv[i], subOptions, "suboption",
-			TCL_EXACT, &suboptIndex) != TCL_OK) {
-			return TCL_ERROR;
+	static CONST char *subOptions[] = {
+		"-watch",
+		"-async",
+		"-match",
+		"-regexp",
+		"-since",
+		"-ifnewer",
+		"-watchfilter",
+		"-release",
+		"-unchangedvar",
+		NULL
+	};
+
+	enum subOptions {
+		SUBOPT_WATCH,
+		SUBOPT_ASYNC,
+		SUBOPT_MATCH,
+		SUBOPT_REGEXP,
+		SUBOPT_SINCE,
+		SUBOPT_IFNEWER,
+		SUBOPT_WATCHFILTER,
+		SUBOPT_RELEASE,
+		SUBOPT_UNCHANGEDVAR
+	};
+
+	const char *path;
+	int i;
+	int suboptIndex = 0;
+	int status;
+	watcher_fn wfn = NULL;
+	char *pattern = NULL;
+	Tcl_RegExp regexp = NULL;
+	Tcl_Obj *sinceObj = NULL;
+	Tcl_Obj *releaseObj = NULL;
+	Tcl_WideInt ifNewer = 0;
+	int haveIfNewer = 0;
+	Tcl_Obj *watchFilterObj = NULL;
+	Tcl_Obj *unchangedVarObj = NULL;
+
+    assert (zo->zookeeper_object_magic == ZOOKEEPER_OBJECT_MAGIC);
+
+	if ((objc < 3) || (objc > 17)) {
+		Tcl_WrongNumArgs (interp, 2, objv, "path ?-async callback? ?-watch code? ?-watchfilter filter? ?-match pattern? ?-regexp exp? ?-since token? ?-ifnewer pzxid? ?-unchangedvar var? ?-release token?");
+		return TCL_ERROR;
+	}
+
+	path = zootcl_path_string (interp, objv[2]);
+	if (path == NULL) {
+		return TCL_ERROR;
+	}
+
+	for (i = 3; i < objc; i++) {
+		if (Tcl_GetIndexFromObj (interp, objv[i], subOptions, "suboption",
+			TCL_EXACT, &suboptIndex) != TCL_OK) {
+			goto error;
+		}
+
+		if (i + 1 >= objc) {
+			Tcl_WrongNumArgs (interp, 2, objv, "path ... option value");
+			goto error;
+		}
+
+		switch ((enum subOptions) suboptIndex) {
+			case SUBOPT_WATCH:
+			{
+				watcherCallbackObj = objv[++i];
+				Tcl_IncrRefCount (watcherCallbackObj);
+				break;
+			}
+
+			case SUBOPT_ASYNC:
+			{
+				callbackObj = objv[++i];
+				Tcl_IncrRefCount (callbackObj);
+				break;
+			}
+
+			case SUBOPT_MATCH:
+			{
+				pattern = Tcl_GetString (objv[++i]);
+				break;
+			}
+
+			case SUBOPT_REGEXP:
+			{
+				regexp = Tcl_GetRegExpFromObj (interp, objv[++i], TCL_REG_ADVANCED);
+				if (regexp == NULL) {
+					goto error;
+				}
+				break;
+			}
+
+			case SUBOPT_SINCE:
+			{
+				sinceObj = objv[++i];
+				break;
+			}
+
+			case SUBOPT_IFNEWER:
+			{
+				if (Tcl_GetWideIntFromObj (interp, objv[++i], &ifNewer) == TCL_ERROR) {
+					goto error;
+				}
+				haveIfNewer = 1;
+				break;
+			}
+
+			case SUBOPT_WATCHFILTER:
+			{
+				watchFilterObj = objv[++i];
+				break;
+			}
+
+			case SUBOPT_RELEASE:
+			{
+				releaseObj = objv[++i];
+				break;
+			}
+
+			case SUBOPT_UNCHANGEDVAR:
+			{
+				unchangedVarObj = objv[++i];
+				break;
+			}
+		}
+	}
+
+	// letting go of a -since token is all bookkeeping, nothing goes
+	// to zookeeper
+	if (releaseObj != NULL) {
+		if (objc != 5) {
+			Tcl_SetObjResult (interp, Tcl_NewStringObj ("-release can't be combined with other options", -1));
+			goto error;
+		}
+		return zootcl_children_release (interp, zo, path, releaseObj);
+	}
+
+	// filtering and diffing happen on the names as zookeeper hands
+	// them to us, which is in the completion thread for async calls
+	if (callbackObj != NULL && (pattern != NULL || regexp != NULL || sinceObj != NULL)) {
+		Tcl_SetObjResult (interp, Tcl_NewStringObj ("-match, -regexp and -since can't be used with -async", -1));
+		goto error;
+	}
+
+	if (callbackObj != NULL && unchangedVarObj != NULL) {
+		Tcl_SetObjResult (interp, Tcl_NewStringObj ("-unchangedvar and -async options are mutually exclusive", -1));
+		goto error;
+	}
+
+	// cleared up front, it's only set once we know nothing changed
+	if (unchangedVarObj != NULL && Tcl_ObjSetVar2 (interp, unchangedVarObj, NULL, Tcl_NewBooleanObj (0), TCL_LEAVE_ERR_MSG) == NULL) {
+		goto error;
+	}
+
+	// an exists can't leave a children watch
+	if (haveIfNewer && watcherCallbackObj != NULL) {
+		Tcl_SetObjResult (interp, Tcl_NewStringObj ("-ifnewer and -watch options are mutually exclusive", -1));
+		goto error;
+	}
+
+	if (watchFilterObj != NULL) {
+		if (watcherCallbackObj == NULL) {
+			Tcl_SetObjResult (interp, Tcl_NewStringObj ("-watchfilter requires -watch", -1));
+			goto error;
+		}
+
+		// the filter has to know whether the watch was left, which
+		// only the synchronous call tells us
+		if (callbackObj != NULL) {
+			Tcl_SetObjResult (interp, Tcl_NewStringObj ("-watchfilter and -async options are mutually exclusive", -1));
+			goto error;
+		}
+	}
+
+	if (watcherCallbackObj != NULL) {
+		wfn = zootcl_watcher;
+	}
+
+	void *watcherCtx = (void *)watcherCallbackObj;
+	zootcl_watchFilter *wf = NULL;
+
+	if (watchFilterObj != NULL) {
+		wf = zootcl_new_watch_filter (interp, watchFilterObj, zh, watcherCallbackObj, path, 0);
+		if (wf == NULL) {
+			goto error;
+		}
+		wfn = zootcl_filtered_watcher;
+		watcherCtx = (void *)wf;
+	}
+
+	if (zo->hotkeys != NULL) {
+		zootcl_hotkeys_count (zo, REQ_CHILDREN, path);
+	}
+
+	if (callbackObj == NULL) {
+		Tcl_WideInt traceStart = zootcl_trace_now (zo);
+
+		if (haveIfNewer) {
+			// look at the stat before pulling over the children
+			struct Stat ifNewerStat;
+
+			status = zoo_exists (zh, path, 0, &ifNewerStat);
+			if (status == ZOK && ifNewerStat.pzxid <= ifNewer) {
+				zootcl_count_request (zo, REQ_CHILDREN, ZOOTCL_UNCHANGED, 0);
+				zootcl_trace_sync (zo, REQ_CHILDREN, path, traceStart, ZOOTCL_UNCHANGED);
+				return zootcl_unchanged_result (interp, unchangedVarObj, 0);
+			} else if (status != ZOK && status != ZNONODE) {
+				zootcl_count_request (zo, REQ_CHILDREN, status, 0);
+				zootcl_trace_sync (zo, REQ_CHILDREN, path, traceStart, status);
+				return zootcl_set_tcl_return_code (interp, status);
+			}
+		}
+
+		struct String_vector *strings = (struct String_vector *)ckalloc (sizeof (struct String_vector));
+		status = zoo_wget_children(zh, path, wfn, watcherCtx, strings);	
+		zootcl_count_request (zo, REQ_CHILDREN, status, 0);
+		zootcl_trace_sync (zo, REQ_CHILDREN, path, traceStart, status);
+		zootcl_count_sent (zo, wfn != NULL && status == ZOK, 0);
+
+		if (wf != NULL) {
+			zootcl_watch_filter_registered (wf, status == ZOK, 0, NULL, 0);
+		}
+
+		if (status != ZOK && status != ZNONODE) {
+			ckfree (strings);
+			return zootcl_set_tcl_return_code (interp, status);
+		} else if (status == ZNONODE) {
+			// do not consider a non-existent path to be an error in this case
+			status = ZOK;
+			strings->count = 0;
+			strings->data = NULL;
+		}
+
+		// weed out the names that aren't wanted before making any
+		// Tcl objects, which for huge directories is most of the cost
+		char **names = (char **)ckalloc (sizeof (char *) * (strings->count + 1));
+		int count = 0;
+		for (i = 0; i < strings->count; i++) {
+			char *name = strings->data[i];
+
+			if (pattern != NULL && !Tcl_StringMatch (name, pattern)) {
+				continue;
+			}
+			if (regexp != NULL) {
+				int match = Tcl_RegExpExec (interp, regexp, name, name);
+				if (match < 0) {
+					ckfree (names);
+					deallocate_String_vector (strings);
+					ckfree (strings);
+					return TCL_ERROR;
+				}
+				if (!match) {
+					continue;
+				}
+			}
+			names[count++] = name;
+		}
+
+		if (sinceObj != NULL) {
+			if (zootcl_children_since (interp, zo, path, sinceObj, names, count) != TCL_OK) {
+				status = -1;
+			}
+		} else if (count > 0) {
+            Tcl_Obj **listObjv = (Tcl_Obj **)ckalloc (sizeof(Tcl_Obj *) * count);
+
+            for (i = 0; i < count; i++) {
+                listObjv[i] = Tcl_NewStringObj (names[i], -1);
+            }
+
+            Tcl_Obj *listObj = Tcl_NewListObj (count, listObjv);
+		    Tcl_SetObjResult (interp, listObj);
+            ckfree (listObjv);
+        } else {
+            Tcl_SetObjResult (interp, Tcl_NewListObj (0, NULL));    
+        }
+
+		ckfree (names);
+		deallocate_String_vector (strings);
+		ckfree (strings);
+
+		if (status != ZOK) {
+			return TCL_ERROR;
+		}
+	} else {
+		zootcl_callbackContext *ztc = (zootcl_callbackContext *)ckalloc (sizeof (zootcl_callbackContext));
+		ztc->callbackObj = callbackObj;
+		ztc->zo = zo;
+		ztc->kind = REQ_CHILDREN;
+		zootcl_trace_start (zo, ztc, path);
+		int requestId = ztc->requestId = ++zo->nextRequestId;
+		if (haveIfNewer) {
+			zootcl_ifNewerContext *inc = zootcl_new_ifnewer_context (zo, callbackObj, requestId, ifNewer, 1, path);
+			inc->submitTime = ztc->submitTime;
+			inc->pathHash = ztc->pathHash;
+			ckfree (ztc);
+			status = zootcl_async_awexists (zo, requestId, path, NULL, NULL, zootcl_ifnewer_completion_callback, inc);
+			if (status != ZOK) {
+				// the exists never went out, so its completion won't
+				// be around to free the context
+				Tcl_DecrRefCount (callbackObj);
+				ckfree (inc->path);
+				ckfree (inc);
+			}
+		} else {
+			status = zootcl_async_awget_children (zo, requestId, path, wfn, watcherCallbackObj, zootcl_strings_completion_callback, ztc);
+		}
+		return zootcl_async_result (interp, zo, REQ_CHILDREN, requestId, status);
+	}
+
+	return zootcl_set_tcl_return_code (interp, status);
+
+  error:
+	if (watcherCallbackObj != NULL) {
+		Tcl_DecrRefCount (watcherCallbackObj);
+	}
+	if (callbackObj != NULL) {
+		Tcl_DecrRefCount (callbackObj);
+	}
+	return TCL_ERROR;
+}
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * zootcl_set_subcommand --
+ *
+ *      implement the "set" method of a zookeeper tcl command
+ *      object
+ *
+ * Results:
+ *      A standard Tcl result.
+ *
+ *
+ *----------------------------------------------------------------------
+ */
+int
+zootcl_set_subcommand(Tcl_Interp *interp, int objc, Tcl_Obj *CONST objv[], ZOOAPI zhandle_t *zh, zootcl_objectClientData *zo)
+{
+	Tcl_Obj *callbackObj = NULL;
+
+	static CONST char *subOptions[] = {
+		"-async",
+		NULL
+	};
+
+	enum subOptions {
+		SUBOPT_ASYNC
+	};
+
+	const char *path;
+	char *buffer;
+	int bufferLen = 0;
+	int version = 0;
+
+	int i;
+	int suboptIndex = 0;
+
+    assert (zo->zookeeper_object_magic == ZOOKEEPER_OBJECT_MAGIC);
+
+	if ((objc < 5) || (objc > 7)) {
+		Tcl_WrongNumArgs (interp, 2, objv, "path data version ?-async callback?");
+		return TCL_ERROR;
+	}
+
+	path = zootcl_path_string (interp, objv[2]);
+	if (path == NULL) {
+		return TCL_ERROR;
+	}
+
+	buffer = Tcl_GetStringFromObj (objv[3], &bufferLen);
+
+	if (Tcl_GetIntFromObj (interp, objv[4], &version) == TCL_ERROR) {
+		return TCL_ERROR;
+	}
+
+	for (i = 5; i < objc; i++) {
+		if (Tcl_GetIndexFromObj (interp, objv[i], subOptions, "suboption",
+			TCL_EXACT, &suboptIndex) != TCL_OK) {
+			return TCL_ERROR;
+		}
+
+		switch ((enum subOptions) suboptIndex) {
+			case SUBOPT_ASYNC:
+			{
+				if (i + 1 >= objc) {
+					Tcl_WrongNumArgs (interp, 2, objv, "-async code");
+					return TCL_ERROR;
+				}
+				callbackObj = objv[++i];
+				Tcl_IncrRefCount (callbackObj);
+				break;
+			}
+		}
+	}
+
+	int status;
+
+	if (zo->hotkeys != NULL) {
+		zootcl_hotkeys_count (zo, REQ_SET, path);
+	}
+
+	if (callbackObj == NULL) {
+		// synchronous set
+		struct Stat *stat = (struct Stat *)ckalloc (sizeof (struct Stat));
+		Tcl_WideInt traceStart = zootcl_trace_now (zo);
+		status = zoo_set2(zh, path, buffer, bufferLen, version, stat);
+		zootcl_count_request (zo, REQ_SET, status, 0);
+		zootcl_trace_sync (zo, REQ_SET, path, traceStart, status);
+		zootcl_count_sent (zo, 0, (status == ZOK) ? bufferLen : 0);
+
+		ckfree (stat);
+	} else {
+		// asynchronous set
+		zootcl_callbackContext *ztc = (zootcl_callbackContext *)ckalloc (sizeof (zootcl_callbackContext));
+		ztc->zo = zo;
+		ztc->callbackObj = callbackObj;
+		ztc->kind = REQ_SET;
+		zootcl_trace_start (zo, ztc, path);
+		ztc->requestId = ++zo->nextRequestId;
+		status = zootcl_async_aset (zo, ztc->requestId, path, buffer, bufferLen, version, zootcl_stat_completion_callback, ztc);
+		return zootcl_async_result (interp, zo, REQ_SET, ztc->requestId, status);
+	}
+	return zootcl_set_tcl_return_code (interp, status);
+}
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * zootcl_create_subcommand --
+ *
+ *      implement the "create" method of a zookeeper tcl command
+ *      object
+ *
+ * Results:
+ *      A standard Tcl result.
+ *
+ *
+ *----------------------------------------------------------------------
+ */
+int
+zootcl_create_subcommand(Tcl_Interp *interp, int objc, Tcl_Obj *CONST objv[], ZOOAPI zhandle_t *zh, zootcl_objectClientData *zo)
+{
+	static CONST char *subOptions[] = {
+		"-async",
+		"-value",
+		"-ephemeral",
+		"-sequence",
+		NULL
+	};
+
+	enum subOptions {
+		SUBOPT_ASYNC,
+		SUBOPT_VALUE,
+		SUBOPT_EPHEMERAL,
+		SUBOPT_SEQUENCE
+	};
+
+	const char *path;
+	int valueLen = -1;
+	char *value = NULL;
+	int flags = 0;
+
+    assert (zo->zookeeper_object_magic == ZOOKEEPER_OBJECT_MAGIC);
+
+	if (objc < 3)  {
+		Tcl_WrongNumArgs (interp, 2, objv, "path ?-value value? ?-ephemeral? ?-sequence? ?-async callback?");
+		return TCL_ERROR;
+	}
+	int i;
+	int suboptIndex = 0;
+	Tcl_Obj *callbackObj = NULL;
+
+	for (i = 3; i < objc; i++) {
+		if (Tcl_GetIndexFromObj (interp, objv[i], subOptions, "suboption",
+			TCL_EXACT, &suboptIndex) != TCL_OK) {
+			return TCL_ERROR;
+		}
+
+		switch ((enum subOptions) suboptIndex) {
+			case SUBOPT_ASYNC:
+			{
+				if (i + 1 >= objc) {
+					Tcl_WrongNumArgs (interp, 2, objv, "-async callback");
+					return TCL_ERROR;
+				}
+				callbackObj = objv[++i];
+				Tcl_IncrRefCount (callbackObj);
+				break;
+			}
+			case SUBOPT_VALUE:
+			{
+				if (i + 1 >= objc) {
+					Tcl_WrongNumArgs (interp, 2, objv, "-value value");
+					return TCL_ERROR;
+				}
+				value = Tcl_GetStringFromObj (objv[++i], &valueLen);
+				break;
+			}
+
+			case SUBOPT_EPHEMERAL:
+			{
+				flags |= ZOO_EPHEMERAL;
+				break;
+			}
+
+			case SUBOPT_SEQUENCE:
+			{
+				flags |= ZOO_SEQUENCE;
+				break;
+			}
+		}
+	}
+
+	// a sequential node's name is finished off by the server, so a
+	// trailing slash there is meaningful and the path is passed as is
+	if (flags & ZOO_SEQUENCE) {
+		path = Tcl_GetString (objv[2]);
+	} else {
+		path = zootcl_path_string (interp, objv[2]);
+		if (path == NULL) {
+			if (callbackObj != NULL) {
+				Tcl_DecrRefCount (callbackObj);
+			}
+			return TCL_ERROR;
+		}
+	}
+
+	if (zo->hotkeys != NULL) {
+		zootcl_hotkeys_count (zo, REQ_CREATE, path);
+	}
+
+	int status;
+
+	if (callbackObj == NULL) {
+		// sync version
+		int pathBufferLen = 1024;
+		char pathBuffer[pathBufferLen];
+		Tcl_WideInt traceStart = zootcl_trace_now (zo);
+		status = zoo_create(zh, path, value, valueLen, &ZOO_OPEN_ACL_UNSAFE, flags, pathBuffer, pathBufferLen - 1);
+		zootcl_count_request (zo, REQ_CREATE, status, 0);
+		zootcl_trace_sync (zo, REQ_CREATE, path, traceStart, status);
+		zootcl_count_sent (zo, 0, (status == ZOK) ? valueLen : 0);
+
+		if (status != ZOK) {
+			return zootcl_set_tcl_return_code (interp, status);
+		}
+
+		if (status == ZOK) {
+			Tcl_SetObjResult (interp, Tcl_NewStringObj(pathBuffer, -1));
+		}
+	} else {
+		zootcl_callbackContext *ztc = (zootcl_callbackContext *)ckalloc (sizeof (zootcl_callbackContext));
+		ztc->callbackObj = callbackObj;
+		ztc->zo = zo;
+		ztc->kind = REQ_CREATE;
+		zootcl_trace_start (zo, ztc, path);
+		ztc->requestId = ++zo->nextRequestId;
+		status = zootcl_async_acreate (zo, ztc->requestId, path, value, valueLen, flags, zootcl_string_completion_callback, ztc);
+		return zootcl_async_result (interp, zo, REQ_CREATE, ztc->requestId, status);
+	}
+	return zootcl_set_tcl_return_code (interp, status);
+}
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * zootcl_delete_subcommand --
+ *
+ *      implement the "delete" method of a zookeeper tcl command
+ *      object
+ *
+ * Results:
+ *      A standard Tcl result.
+ *
+ *
+ *----------------------------------------------------------------------
+ */
+int
+zootcl_delete_subcommand(Tcl_Interp *interp, int objc, Tcl_Obj *CONST objv[], ZOOAPI zhandle_t *zh, zootcl_objectClientData *zo)
+{
+	Tcl_Obj *callbackObj = NULL;
+	int status;
+
+	static CONST char *subOptions[] = {
+		"-async",
+		NULL
+	};
+
+	enum subOptions {
+		SUBOPT_ASYNC
+	};
+
+	const char *path;
+	int version = 0;
+	int i;
+	int suboptIndex = 0;
+
+    assert (zo->zookeeper_object_magic == ZOOKEEPER_OBJECT_MAGIC);
+
+	if ((objc < 4) || (objc > 6)) {
+		Tcl_WrongNumArgs (interp, 2, objv, "path version ?-async callback?");
+		return TCL_ERROR;
+	}
+
+	path = zootcl_path_string (interp, objv[2]);
+	if (path == NULL) {
+		return TCL_ERROR;
+	}
+
+	if (Tcl_GetIntFromObj (interp, objv[3], &version) == TCL_ERROR) {
+		return TCL_ERROR;
+	}
+
+	for (i = 4; i < objc; i++) {
+		if (Tcl_GetIndexFromObj (interp, objv[i], subOptions, "suboption",
+			TCL_EXACT, &suboptIndex) != TCL_OK) {
+			return TCL_ERROR;
+		}
+
+		switch ((enum subOptions) suboptIndex) {
+			case SUBOPT_ASYNC:
+			{
+				if (i + 1 >= objc) {
+					Tcl_WrongNumArgs (interp, 2, objv, "-async code");
+					return TCL_ERROR;
+				}
+				callbackObj = objv[++i];
+				Tcl_IncrRefCount (callbackObj);
+				break;
+			}
+		}
+	}
+
+	if (zo->hotkeys != NULL) {
+		zootcl_hotkeys_count (zo, REQ_DELETE, path);
+	}
+
+	if (callbackObj == NULL) {
+		// synchronous delete
+		Tcl_WideInt traceStart = zootcl_trace_now (zo);
+		status = zoo_delete(zh, path, version);
+		zootcl_count_request (zo, REQ_DELETE, status, 0);
+		zootcl_trace_sync (zo, REQ_DELETE, path, traceStart, status);
+	} else {
+		zootcl_callbackContext *ztc = (zootcl_callbackContext *)ckalloc (sizeof (zootcl_callbackContext));
+		ztc->callbackObj = callbackObj;
+		ztc->zo = zo;
+		ztc->kind = REQ_DELETE;
+		zootcl_trace_start (zo, ztc, path);
+		ztc->requestId = ++zo->nextRequestId;
+		status = zootcl_async_adelete (zo, ztc->requestId, path, version, zootcl_void_completion_callback, ztc);
+		return zootcl_async_result (interp, zo, REQ_DELETE, ztc->requestId, status);
+	}
+
+	return zootcl_set_tcl_return_code (interp, status);
+}
+
+/*
+ *--------------------------------------------------------------
+ *
+ * zootcl_join_path -- append dir/name to a DString, taking care
+ *   not to double the slash when dir is the root
+ *
+ *--------------------------------------------------------------
+ */
+char *
+zootcl_join_path (Tcl_DString *dsPtr, const char *dir, const char *name)
+{
+	Tcl_DStringAppend (dsPtr, dir, -1);
+	if (Tcl_DStringLength (dsPtr) == 0 || dir[Tcl_DStringLength (dsPtr) - 1] != '/') {
+		Tcl_DStringAppend (dsPtr, "/", 1);
+	}
+	return Tcl_DStringAppend (dsPtr, name, -1);
+}
+
+/*
+ *--------------------------------------------------------------
+ *
+ * zootcl_sequence_compare -- qsort comparison for sequence entries
+ *
+ *--------------------------------------------------------------
+ */
+static int
+zootcl_sequence_compare (const void *a, const void *b)
+{
+	const zootcl_sequenceEntry *ea = (const zootcl_sequenceEntry *)a;
+	const zootcl_sequenceEntry *eb = (const zootcl_sequenceEntry *)b;
+
+	if (ea->seq != eb->seq) {
+		return (ea->seq < eb->seq) ? -1 : 1;
+	}
+	return strcmp (ea->name, eb->name);
+}
+
+/*
+ *--------------------------------------------------------------
+ *
+ * zootcl_sequence_sort -- given the children of a recipe directory,
+ *   pick out the ones starting with prefix and ending in the ten
+ *   digit suffix zookeeper appends to sequential znodes, and sort
+ *   them by sequence number
+ *
+ * Results:
+ *      returns the number of entries and stores a ckalloc'ed array of
+ *      them in *entriesPtr.  the names point into strings so they are
+ *      only good as long as it is.
+ *
+ *--------------------------------------------------------------
+ */
+int
+zootcl_sequence_sort (const struct String_vector *strings, const char *prefix, zootcl_sequenceEntry **entriesPtr)
+{
+	int prefixLen = strlen (prefix);
+	int count = 0;
+	int i;
+	zootcl_sequenceEntry *entries = (zootcl_sequenceEntry *)ckalloc (sizeof (zootcl_sequenceEntry) * (strings->count + 1));
+
+	for (i = 0; i < strings->count; i++) {
+		char *name = strings->data[i];
+		int nameLen = strlen (name);
+		char *end;
+
+		if (nameLen < prefixLen + 10 || strncmp (name, prefix, prefixLen) != 0) {
+			continue;
+		}
+
+		entries[count].seq = strtoll (name + nameLen - 10, &end, 10);
+		if (*end != '\0') {
+			continue;
+		}
+		entries[count++].name = name;
+	}
+
+	qsort (entries, count, sizeof (zootcl_sequenceEntry), zootcl_sequence_compare);
+	*entriesPtr = entries;
+	return count;
+}
+
+/*
+ *--------------------------------------------------------------
+ *
+ * zootcl_time_remaining -- given a deadline, store how long is left
+ *   until it in *remainingPtr
+ *
+ * Results:
+ *      returns 1 if there is time left, else 0
+ *
+ *--------------------------------------------------------------
+ */
+int
+zootcl_time_remaining (const Tcl_Time *deadline, Tcl_Time *remainingPtr)
+{
+	Tcl_Time now;
+
+	Tcl_GetTime (&now);
+	remainingPtr->sec = deadline->sec - now.sec;
+	remainingPtr->usec = deadline->usec - now.usec;
+	if (remainingPtr->usec < 0) {
+		remainingPtr->usec += 1000000;
+		remainingPtr->sec--;
+	}
+	return (remainingPtr->sec > 0 || (remainingPtr->sec == 0 && remainingPtr->usec > 0));
+}
+
+/*
+ *--------------------------------------------------------------
+ *
+ * zootcl_deadline -- set *deadline to be ms milliseconds from now
+ *
+ *--------------------------------------------------------------
+ */
+void
+zootcl_deadline (Tcl_Time *deadline, int ms)
+{
+	Tcl_GetTime (deadline);
+	deadline->sec += ms / 1000;
+	deadline->usec += (ms % 1000) * 1000;
+	if (deadline->usec >= 1000000) {
+		deadline->usec -= 1000000;
+		deadline->sec++;
+	}
+}
+
+/*
+ *--------------------------------------------------------------
+ *
+ * zootcl_recipe_create_node -- create an ephemeral sequential znode
+ *   named dirPath/prefix<session id>-<sequence>, creating dirPath too
+ *   if it doesn't exist
+ *
+ *   because the name contains our session id, a create that was lost
+ *   to a connection loss can be found again.  *uncertainPtr is set
+ *   when that happens and the next call looks before creating.
+ *
+ * Results:
+ *      a zookeeper status; on ZOK *nodePathPtr is set to a ckalloc'ed
+ *      copy of the znode's path
+ *
+ *--------------------------------------------------------------
+ */
+int
+zootcl_recipe_create_node (zhandle_t *zh, const char *dirPath, const char *prefix, const char *value, int valueLen, char **nodePathPtr, int *uncertainPtr)
+{
+	char sessionPrefix[64];
+	char pathBuffer[1024];
+	Tcl_DString ds;
+	int status;
+	int i;
+
+	snprintf (sessionPrefix, sizeof (sessionPrefix), "%s%016llx-", prefix, (unsigned long long)zoo_client_id (zh)->client_id);
+
+	// if we lost the connection during a previous attempt the znode
+	// may be there already, look for it before making another
+	if (*uncertainPtr) {
+		struct String_vector children;
+		int prefixLen = strlen (sessionPrefix);
+
+		status = zoo_get_children (zh, dirPath, 0, &children);
+		if (status != ZOK && status != ZNONODE) {
+			return status;
+		}
+
+		*uncertainPtr = 0;
+		if (status == ZOK) {
+			*nodePathPtr = NULL;
+			for (i = 0; i < children.count; i++) {
+				if (strncmp (children.data[i], sessionPrefix, prefixLen) == 0) {
+					Tcl_DStringInit (&ds);
+					zootcl_join_path (&ds, dirPath, children.data[i]);
+					*nodePathPtr = ckalloc (Tcl_DStringLength (&ds) + 1);
+					strcpy (*nodePathPtr, Tcl_DStringValue (&ds));
+					Tcl_DStringFree (&ds);
+					break;
+				}
+			}
+			deallocate_String_vector (&children);
+			if (*nodePathPtr != NULL) {
+				return ZOK;
+			}
+		}
+	}
+
+	Tcl_DStringInit (&ds);
+	zootcl_join_path (&ds, dirPath, sessionPrefix);
+
+	status = zoo_create (zh, Tcl_DStringValue (&ds), value, valueLen, &ZOO_OPEN_ACL_UNSAFE, ZOO_EPHEMERAL | ZOO_SEQUENCE, pathBuffer, sizeof (pathBuffer) - 1);
+
+	if (status == ZNONODE) {
+		// the recipe's directory doesn't exist yet
+		status = zoo_create (zh, dirPath, NULL, -1, &ZOO_OPEN_ACL_UNSAFE, 0, NULL, 0);
+		if (status == ZOK || status == ZNODEEXISTS) {
+			status = zoo_create (zh, Tcl_DStringValue (&ds), value, valueLen, &ZOO_OPEN_ACL_UNSAFE, ZOO_EPHEMERAL | ZOO_SEQUENCE, pathBuffer, sizeof (pathBuffer) - 1);
+		}
+	}
+	Tcl_DStringFree (&ds);
+
+	if (status == ZCONNECTIONLOSS || status == ZOPERATIONTIMEOUT) {
+		*uncertainPtr = 1;
+	}
+
+	if (status == ZOK) {
+		*nodePathPtr = ckalloc (strlen (pathBuffer) + 1);
+		strcpy (*nodePathPtr, pathBuffer);
+	}
+	return status;
+}
+
+/*
+ *--------------------------------------------------------------
+ *
+ * zootcl_recipe_delete_node -- delete our session's znode in a
+ *   recipe directory, for when we couldn't find out whether the
+ *   create went through
+ *
+ *--------------------------------------------------------------
+ */
+void
+zootcl_recipe_delete_node (zhandle_t *zh, const char *dirPath, const char *prefix)
+{
+	char sessionPrefix[64];
+	struct String_vector children;
+	Tcl_DString ds;
+	int i;
+
+	snprintf (sessionPrefix, sizeof (sessionPrefix), "%s%016llx-", prefix, (unsigned long long)zoo_client_id (zh)->client_id);
+
+	if (zoo_get_children (zh, dirPath, 0, &children) != ZOK) {
+		return;
+	}
+
+	for (i = 0; i < children.count; i++) {
+		if (strncmp (children.data[i], sessionPrefix, strlen (sessionPrefix)) == 0) {
+			Tcl_DStringInit (&ds);
+			zootcl_join_path (&ds, dirPath, children.data[i]);
+			zoo_delete (zh, Tcl_DStringValue (&ds), -1);
+			Tcl_DStringFree (&ds);
+		}
+	}
+	deallocate_String_vector (&children);
+}
+
+/*
+ * Lock recipe
+ *
+ * Each waiter creates an ephemeral sequential znode under the lock
+ * directory and watches only the znode immediately ahead of it, so
+ * releasing the lock wakes exactly one waiter rather than all of them.
+ *
+ * The znode name carries our session id so if the create is lost to a
+ * connection loss we can find out whether it made it to the server.
+ *
+ * Sync acquisitions block on a condition variable signaled from the
+ * zookeeper completion thread.  Async ones are driven from the event
+ * loop by RECIPE_CALLBACK events and are kept in the object's locks
+ * table until zookeeper no longer holds a watch pointing at them.
+ * Only the waiting is asynchronous: each step still lists the lock
+ * directory and sets its watch with synchronous calls, so handling a
+ * wakeup holds up the event loop for a couple of round trips, the
+ * same as the other recipes.
+ */
+TCL_DECLARE_MUTEX(zootcl_lockMutex)
+
+#define ZOOTCL_LOCK_PREFIX "lock-"
+
+void
+zootcl_lock_free (zootcl_lockWaiter *lw)
+{
+	if (lw->callbackObj != NULL) {
+		Tcl_DecrRefCount (lw->callbackObj);
+	}
+	Tcl_ConditionFinalize (&lw->cond);
+	if (lw->nodePath != NULL) {
+		ckfree (lw->nodePath);
+	}
+	ckfree (lw->dirPath);
+	ckfree (lw);
+}
+
+/*
+ *--------------------------------------------------------------
+ *
+ * zootcl_lock_forget -- remove an async lock waiter from its
+ *   object's table and free it
+ *
+ *--------------------------------------------------------------
+ */
+void
+zootcl_lock_forget (zootcl_lockWaiter *lw)
+{
+	Tcl_HashEntry *hashEntry = Tcl_FindHashEntry (&lw->zo->locks, lw->nodePath);
+
+	if (hashEntry != NULL) {
+		Tcl_DeleteHashEntry (hashEntry);
+	}
+	if (lw->timer != NULL) {
+		Tcl_DeleteTimerHandler (lw->timer);
+	}
+	zootcl_lock_free (lw);
+}
+
+/*
+ *--------------------------------------------------------------
+ *
+ * zootcl_lock_pending -- find out whether zookeeper still holds
+ *   a watch pointing at the waiter
+ *
+ * Results:
+ *      returns the number of watches still pending
+ *
+ *--------------------------------------------------------------
+ */
+static int
+zootcl_lock_pending (zootcl_lockWaiter *lw)
+{
+	int pending;
+
+	Tcl_MutexLock (&zootcl_lockMutex);
+	pending = lw->watchPending;
+	Tcl_MutexUnlock (&zootcl_lockMutex);
+	return pending;
+}
+
+void zootcl_lock_event (ClientData clientData, int type, int state);
+
+/*
+ *--------------------------------------------------------------
+ *
+ * zootcl_lock_watcher -- watcher on the znode ahead of us
+ *
+ * runs in the zookeeper completion thread.  wakes up a sync waiter
+ * or queues an event for an async one.
+ *
+ *--------------------------------------------------------------
+ */
+void
+zootcl_lock_watcher (zhandle_t *zh, int type, int state, const char *path, void *context)
+{
+	zootcl_lockWaiter *lw = (zootcl_lockWaiter *)context;
+	int freeIt = 0;
+
+	// other than expiration, session events leave the watch in place
+	// and it is reestablished when the client reconnects
+	if (type == ZOO_SESSION_EVENT && state != ZOO_EXPIRED_SESSION_STATE) {
+		return;
+	}
+
+	// an async waiter does its bookkeeping when the event is handled
+	// so it can't be freed while the event is still in the queue
+	if (lw->async) {
+		zootcl_queue_recipe_event (lw->zo, zootcl_lock_event, (ClientData)lw, type, state);
+		return;
+	}
+
+	Tcl_MutexLock (&zootcl_lockMutex);
+	lw->watchPending--;
+	lw->fired = 1;
+	if (type == ZOO_SESSION_EVENT) {
+		lw->expired = 1;
+	}
+
+	if (lw->done) {
+		// the sync waiter gave up already, we're the last one
+		// holding it
+		freeIt = (lw->watchPending == 0);
+	} else {
+		Tcl_ConditionNotify (&lw->cond);
+	}
+	Tcl_MutexUnlock (&zootcl_lockMutex);
+
+	if (freeIt) {
+		zootcl_lock_free (lw);
+	}
+}
+
+/*
+ *--------------------------------------------------------------
+ *
+ * zootcl_lock_create_node -- create our place in line
+ *
+ *--------------------------------------------------------------
+ */
+int
+zootcl_lock_create_node (zootcl_lockWaiter *lw)
+{
+	return zootcl_recipe_create_node (lw->zo->zh, lw->dirPath, ZOOTCL_LOCK_PREFIX, NULL, -1, &lw->nodePath, &lw->createUncertain);
+}
+
+/*
+ *--------------------------------------------------------------
+ *
+ * zootcl_lock_check -- see if we hold the lock and if not put a
+ *   watch on the znode immediately ahead of us
+ *
+ * Results:
+ *      a zookeeper status.  on ZOK, *acquiredPtr says whether we
+ *      got the lock; if we didn't, a watch has been set.
+ *
+ *--------------------------------------------------------------
+ */
+int
+zootcl_lock_check (zootcl_lockWaiter *lw, int *acquiredPtr)
+{
+	zhandle_t *zh = lw->zo->zh;
+	struct String_vector children;
+	zootcl_sequenceEntry *entries;
+	Tcl_DString ds;
+	int count;
+	int status;
+	int i;
+
+	*acquiredPtr = 0;
+
+	for (;;) {
+		if (lw->nodePath == NULL) {
+			status = zootcl_lock_create_node (lw);
+			if (status != ZOK) {
+				return status;
+			}
+		}
+
+		status = zoo_get_children (zh, lw->dirPath, 0, &children);
+		if (status != ZOK) {
+			return status;
+		}
+
+		const char *myName = strrchr (lw->nodePath, '/') + 1;
+		count = zootcl_sequence_sort (&children, ZOOTCL_LOCK_PREFIX, &entries);
+
+		for (i = 0; i < count; i++) {
+			if (strcmp (entries[i].name, myName) == 0) {
+				break;
+			}
+		}
+
+		if (i == count) {
+			// our znode is gone, someone deleted it or the session
+			// expired
+			ckfree (entries);
+			deallocate_String_vector (&children);
+			return ZNONODE;
+		}
+
+		if (i == 0) {
+			ckfree (entries);
+			deallocate_String_vector (&children);
+			*acquiredPtr = 1;
+			return ZOK;
+		}
+
+		Tcl_DStringInit (&ds);
+		zootcl_join_path (&ds, lw->dirPath, entries[i - 1].name);
+		ckfree (entries);
+		deallocate_String_vector (&children);
+
+		Tcl_MutexLock (&zootcl_lockMutex);
+		lw->watchPending++;
+		lw->fired = 0;
+		Tcl_MutexUnlock (&zootcl_lockMutex);
+
+		// a data watch rather than an exists watch so no watch is left
+		// behind if the predecessor is already gone
+		char buffer[1];
+		int bufferLen = sizeof (buffer);
+		status = zoo_wget (zh, Tcl_DStringValue (&ds), zootcl_lock_watcher, (void *)lw, buffer, &bufferLen, NULL);
+		Tcl_DStringFree (&ds);
+
+		if (status == ZOK) {
+			return ZOK;
+		}
+
+		Tcl_MutexLock (&zootcl_lockMutex);
+		lw->watchPending--;
+		Tcl_MutexUnlock (&zootcl_lockMutex);
+
+		if (status != ZNONODE) {
+			return status;
+		}
+		// the znode ahead of us went away while we looked, go again
+	}
+}
+
+/*
+ *--------------------------------------------------------------
+ *
+ * zootcl_lock_finish -- an async acquisition is over one way or
+ *   another, tell the caller
+ *
+ *--------------------------------------------------------------
+ */
+void
+zootcl_lock_finish (zootcl_lockWaiter *lw, int status)
+{
+	zootcl_objectClientData *zo = lw->zo;
+	Tcl_Obj *listObjv[6];
+	int element = 0;
+
+	lw->done = 1;
+	if (lw->timer != NULL) {
+		Tcl_DeleteTimerHandler (lw->timer);
+		lw->timer = NULL;
+	}
+
+	// if we didn't get it, get out of line
+	if (status != ZOK && lw->nodePath != NULL) {
+		zoo_delete (zo->zh, lw->nodePath, -1);
+	}
+
+	element += zootcl_callback_prefix (zo, listObjv);
+	listObjv[element++] = Tcl_NewStringObj ("status", -1);
+	listObjv[element++] = Tcl_NewStringObj (zootcl_error_to_code_string (status), -1);
+	listObjv[element++] = Tcl_NewStringObj ("path", -1);
+	listObjv[element++] = Tcl_NewStringObj (lw->nodePath, -1);
+
+	Tcl_Obj *callbackObj = lw->callbackObj;
+	Tcl_IncrRefCount (callbackObj);
+
+	// the callback may release the lock or destroy the object, so be
+	// done with lw before invoking it
+	if (zootcl_lock_pending (lw) == 0) {
+		zootcl_lock_forget (lw);
+	}
+
+	zootcl_invoke_callback (zo, callbackObj, Tcl_NewListObj (element, listObjv));
+	Tcl_DecrRefCount (callbackObj);
+}
+
+void zootcl_lock_step (zootcl_lockWaiter *lw);
+void zootcl_lock_timer (ClientData clientData);
+
+/*
+ *--------------------------------------------------------------
+ *
+ * zootcl_lock_arm_timeout -- make sure an async waiter that is
+ *   waiting in line has its -timeout timer running
+ *
+ * Results:
+ *      returns 0 if the deadline has already passed
+ *
+ *--------------------------------------------------------------
+ */
+int
+zootcl_lock_arm_timeout (zootcl_lockWaiter *lw)
+{
+	Tcl_Time remaining;
+
+	if (!lw->hasDeadline || lw->timer != NULL) {
+		return 1;
+	}
+
+	if (!zootcl_time_remaining (&lw->deadline, &remaining)) {
+		return 0;
+	}
+	lw->timer = Tcl_CreateTimerHandler (remaining.sec * 1000 + remaining.usec / 1000, zootcl_lock_timer, (ClientData)lw);
+	return 1;
+}
+
+/*
+ *--------------------------------------------------------------
+ *
+ * zootcl_lock_timer -- async timer proc, for either the -timeout
+ *   or for retrying after a connection loss
+ *
+ *--------------------------------------------------------------
+ */
+void
+zootcl_lock_timer (ClientData clientData)
+{
+	zootcl_lockWaiter *lw = (zootcl_lockWaiter *)clientData;
+
+	lw->timer = NULL;
+	zootcl_session_ready (lw->zo);
+	if (lw->retrying) {
+		lw->retrying = 0;
+		zootcl_lock_step (lw);
+		return;
+	}
+	zootcl_lock_finish (lw, ZOPERATIONTIMEOUT);
+}
+
+/*
+ *--------------------------------------------------------------
+ *
+ * zootcl_lock_step -- advance an async acquisition
+ *
+ *--------------------------------------------------------------
+ */
+void
+zootcl_lock_step (zootcl_lockWaiter *lw)
+{
+	int acquired;
+	int status;
+
+	if (lw->expired) {
+		zootcl_lock_finish (lw, ZSESSIONEXPIRED);
+		return;
+	}
+
+	if (lw->retrying) {
+		// a connection loss retry is already scheduled
+		return;
+	}
+
+	status = zootcl_lock_check (lw, &acquired);
+	if (status == ZOK) {
+		if (acquired) {
+			zootcl_lock_finish (lw, ZOK);
+		} else if (!zootcl_lock_arm_timeout (lw)) {
+			zootcl_lock_finish (lw, ZOPERATIONTIMEOUT);
+		}
+		return;
+	}
+
+	if (status == ZCONNECTIONLOSS || status == ZOPERATIONTIMEOUT) {
+		// the client is reconnecting, try again shortly.  this
+		// replaces the -timeout timer so keep to the deadline.
+		Tcl_Time remaining;
+		int ms = ZOOTCL_RECIPE_RETRY_MS;
+
+		if (lw->hasDeadline) {
+			if (!zootcl_time_remaining (&lw->deadline, &remaining)) {
+				zootcl_lock_finish (lw, ZOPERATIONTIMEOUT);
+				return;
+			}
+			if (remaining.sec * 1000 + remaining.usec / 1000 < ms) {
+				ms = remaining.sec * 1000 + remaining.usec / 1000;
+			}
+		}
+		if (lw->timer != NULL) {
+			Tcl_DeleteTimerHandler (lw->timer);
+		}
+		lw->retrying = 1;
+		lw->timer = Tcl_CreateTimerHandler (ms, zootcl_lock_timer, (ClientData)lw);
+		return;
+	}
+
+	zootcl_lock_finish (lw, status);
+}
+
+/*
+ *--------------------------------------------------------------
+ *
+ * zootcl_lock_event -- RECIPE_CALLBACK handler for an async waiter,
+ *   the znode ahead of it changed or the session expired
+ *
+ *--------------------------------------------------------------
+ */
+void
+zootcl_lock_event (ClientData clientData, int type, int state)
+{
+	zootcl_lockWaiter *lw = (zootcl_lockWaiter *)clientData;
+
+	Tcl_MutexLock (&zootcl_lockMutex);
+	lw->watchPending--;
+	lw->fired = 1;
+	if (type == ZOO_SESSION_EVENT) {
+		lw->expired = 1;
+	}
+	Tcl_MutexUnlock (&zootcl_lockMutex);
+
+	if (lw->done) {
+		// released or given up while zookeeper still had a watch on
+		// it; now it's safe to let go
+		if (zootcl_lock_pending (lw) == 0) {
+			zootcl_lock_forget (lw);
+		}
+		return;
+	}
+
+	zootcl_lock_step (lw);
+}
+
+/*
+ *--------------------------------------------------------------
+ *
+ * zootcl_lock_cleanup -- free all async lock waiters of an object
+ *   that is being deleted.  zookeeper has been closed by now so no
+ *   more watches can fire.
+ *
+ *--------------------------------------------------------------
+ */
+void
+zootcl_lock_cleanup (zootcl_objectClientData *zo)
+{
+	Tcl_HashSearch search;
+	Tcl_HashEntry *hashEntry;
+
+	for (hashEntry = Tcl_FirstHashEntry (&zo->locks, &search); hashEntry != NULL; hashEntry = Tcl_NextHashEntry (&search)) {
+		zootcl_lockWaiter *lw = (zootcl_lockWaiter *)Tcl_GetHashValue (hashEntry);
+		if (lw->timer != NULL) {
+			Tcl_DeleteTimerHandler (lw->timer);
+		}
+		zootcl_lock_free (lw);
+	}
+	Tcl_DeleteHashTable (&zo->locks);
+}
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * zootcl_lock_subcommand --
+ *
+ *      implement the "lock" method of a zookeeper tcl command
+ *      object
+ *
+ *      lock acquire path ?-timeout ms? ?-async callback?
+ *      lock release lockNode
+ *
+ * Results:
+ *      A standard Tcl result.
+ *
+ *
+ *----------------------------------------------------------------------
+ */
+int
+zootcl_lock_subcommand(Tcl_Interp *interp, int objc, Tcl_Obj *CONST objv[], ZOOAPI zhandle_t *zh, zootcl_objectClientData *zo)
+{
+	static CONST char *actions[] = {
+		"acquire",
+		"release",
+		NULL
+	};
+
+	enum actions {
+		ACTION_ACQUIRE,
+		ACTION_RELEASE
+	};
+
+	static CONST char *subOptions[] = {
+		"-timeout",
+		"-async",
+		NULL
+	};
+
+	enum subOptions {
+		SUBOPT_TIMEOUT,
+		SUBOPT_ASYNC
+	};
+
+	int actionIndex;
+	int suboptIndex = 0;
+	int timeout = -1;
+	Tcl_Obj *callbackObj = NULL;
+	int status;
+	int i;
+
+    assert (zo->zookeeper_object_magic == ZOOKEEPER_OBJECT_MAGIC);
+
+	if (objc < 4) {
+		Tcl_WrongNumArgs (interp, 2, objv, "acquire|release path ?-timeout ms? ?-async callback?");
+		return TCL_ERROR;
+	}
+
+	if (Tcl_GetIndexFromObj (interp, objv[2], actions, "action", TCL_EXACT, &actionIndex) != TCL_OK) {
+		return TCL_ERROR;
+	}
+
+	if ((enum actions) actionIndex == ACTION_RELEASE) {
+		if (objc != 4) {
+			Tcl_WrongNumArgs (interp, 3, objv, "lockNode");
+			return TCL_ERROR;
+		}
+
+		char *nodePath = Tcl_GetString (objv[3]);
+		Tcl_HashEntry *hashEntry = Tcl_FindHashEntry (&zo->locks, nodePath);
+
+		// an async acquisition that's still waiting, or waiting to
+		// be freed; cancel it without a callback
+		if (hashEntry != NULL) {
+			zootcl_lockWaiter *lw = (zootcl_lockWaiter *)Tcl_GetHashValue (hashEntry);
+			lw->done = 1;
+			if (lw->timer != NULL) {
+				Tcl_DeleteTimerHandler (lw->timer);
+				lw->timer = NULL;
+			}
+			if (zootcl_lock_pending (lw) == 0) {
+				zootcl_lock_forget (lw);
+			}
+		}
+
+		status = zoo_delete (zh, nodePath, -1);
+		return zootcl_set_tcl_return_code (interp, status);
+	}
+
+	for (i = 4; i < objc; i++) {
+		if (Tcl_GetIndexFromObj (interp, objv[i], subOptions, "suboption",
+			TCL_EXACT, &suboptIndex) != TCL_OK) {
+			return TCL_ERROR;
+		}
+
+		switch ((enum subOptions) suboptIndex) {
+			case SUBOPT_TIMEOUT:
+			{
+				if (i + 1 >= objc) {
+					Tcl_WrongNumArgs (interp, 3, objv, "path ... -timeout ms");
+					return TCL_ERROR;
+				}
+				if (Tcl_GetIntFromObj (interp, objv[++i], &timeout) == TCL_ERROR) {
+					return TCL_ERROR;
+				}
+				break;
+			}
+
+			case SUBOPT_ASYNC:
+			{
+				if (i + 1 >= objc) {
+					Tcl_WrongNumArgs (interp, 3, objv, "path ... -async callback");
+					return TCL_ERROR;
+				}
+				callbackObj = objv[++i];
+				break;
+			}
+		}
+	}
+
+	zootcl_lockWaiter *lw = (zootcl_lockWaiter *)ckalloc (sizeof (zootcl_lockWaiter));
+	memset (lw, 0, sizeof (zootcl_lockWaiter));
+	lw->zo = zo;
+	lw->dirPath = ckalloc (strlen (Tcl_GetString (objv[3])) + 1);
+	strcpy (lw->dirPath, Tcl_GetString (objv[3]));
+	if (timeout >= 0) {
+		lw->hasDeadline = 1;
+		zootcl_deadline (&lw->deadline, timeout);
+	}
+
+	if (callbackObj != NULL) {
+		int acquired;
+		int isNew;
+
+		lw->async = 1;
+		lw->callbackObj = callbackObj;
+		Tcl_IncrRefCount (callbackObj);
+
+		// getting in line happens right away; it's the waiting
+		// that's asynchronous
+		status = zootcl_lock_create_node (lw);
+		if (status != ZOK) {
+			zootcl_lock_free (lw);
+			return zootcl_set_tcl_return_code (interp, status);
+		}
+
+		Tcl_SetHashValue (Tcl_CreateHashEntry (&zo->locks, lw->nodePath, &isNew), (ClientData)lw);
+		Tcl_SetObjResult (interp, Tcl_NewStringObj (lw->nodePath, -1));
+
+		status = zootcl_lock_check (lw, &acquired);
+		if (status == ZOK && !acquired) {
+			zootcl_lock_arm_timeout (lw);
+			return TCL_OK;
+		}
+
+		// got it already, or need to retry; either way the callback
+		// comes from the event loop rather than from in here
+		if (status == ZOK || status == ZCONNECTIONLOSS || status == ZOPERATIONTIMEOUT) {
+			lw->retrying = 1;
+			lw->timer = Tcl_CreateTimerHandler (status == ZOK ? 0 : ZOOTCL_RECIPE_RETRY_MS, zootcl_lock_timer, (ClientData)lw);
+			return TCL_OK;
+		}
+
+		// anything else failed before we got in line for good, so
+		// it's an error like a failed create rather than a callback.
+		// no watch was left behind if the check failed.
+		zoo_delete (zh, lw->nodePath, -1);
+		lw->done = 1;
+		if (zootcl_lock_pending (lw) == 0) {
+			zootcl_lock_forget (lw);
+		}
+		return zootcl_set_tcl_return_code (interp, status);
+	}
+
+	// synchronous acquire, block until we get the lock, time out
+	// or fail
+	for (;;) {
+		int acquired;
+		Tcl_Time remaining;
+
+		status = zootcl_lock_check (lw, &acquired);
+		if (status == ZOK) {
+			if (acquired) {
+				break;
+			}
+
+			// wait for the znode ahead of us to go away
+			Tcl_MutexLock (&zootcl_lockMutex);
+			while (!lw->fired) {
+				if (!lw->hasDeadline) {
+					zootcl_condition_wait (zh, &lw->cond, &zootcl_lockMutex, NULL);
+				} else if (zootcl_time_remaining (&lw->deadline, &remaining)) {
+					zootcl_condition_wait (zh, &lw->cond, &zootcl_lockMutex, &remaining);
+				} else {
+					break;
+				}
+			}
+			int fired = lw->fired;
+			int expired = lw->expired;
+			Tcl_MutexUnlock (&zootcl_lockMutex);
+
+			if (expired) {
+				status = ZSESSIONEXPIRED;
+				break;
+			}
+			if (!fired) {
+				status = ZOPERATIONTIMEOUT;
+				break;
+			}
+			continue;
+		}
+
+		if (status == ZCONNECTIONLOSS || status == ZOPERATIONTIMEOUT) {
+			// the client library is reconnecting, try again unless
+			// we're out of time
+			if (lw->hasDeadline && !zootcl_time_remaining (&lw->deadline, &remaining)) {
+				break;
+			}
+			Tcl_Sleep (ZOOTCL_RECIPE_RETRY_MS);
+			continue;
+		}
+		break;
+	}
+
+	if (status == ZOK) {
+		Tcl_SetObjResult (interp, Tcl_NewStringObj (lw->nodePath, -1));
+	} else if (lw->nodePath != NULL) {
+		zoo_delete (zh, lw->nodePath, -1);
+	}
+
+	// if zookeeper still has a watch on it the watcher frees it
+	Tcl_MutexLock (&zootcl_lockMutex);
+	lw->done = 1;
+	int freeIt = (lw->watchPending == 0);
+	Tcl_MutexUnlock (&zootcl_lockMutex);
+	if (freeIt) {
+		zootcl_lock_free (lw);
+	}
+
+	return zootcl_set_tcl_return_code (interp, status);
+}
+
+/*
+ * Leader election recipe
+ *
+ * Each candidate creates an ephemeral sequential znode and the lowest
+ * sequence number leads.  Candidates ahead of us can only go away,
+ * never be added, so we cache their names when we join and watch only
+ * the one immediately ahead.  When it goes away we move on to the next
+ * one in the cache without relisting the directory, so the candidate
+ * right behind a dead leader takes over without any round trips.
+ *
+ * Watching the next candidate is a synchronous call made from the
+ * event loop, one round trip each time a candidate ahead goes away.
+ *
+ * The leader watches its own znode to hear about connection trouble.
+ * On a disconnect it is told it is suspended and should stop acting as
+ * leader, since its session may expire on the server and another
+ * candidate take over before it finds out.  That keeps two leaders from
+ * overlapping.
+ */
+
+#define ZOOTCL_ELECTION_PREFIX "n_"
+
+void
+zootcl_election_free (zootcl_electionCandidate *ec)
+{
+	int i;
+
+	for (i = 0; i < ec->aheadCount; i++) {
+		ckfree (ec->ahead[i]);
+	}
+	if (ec->ahead != NULL) {
+		ckfree (ec->ahead);
+	}
+	if (ec->timer != NULL) {
+		Tcl_DeleteTimerHandler (ec->timer);
+	}
+	Tcl_DecrRefCount (ec->callbackObj);
+	ckfree (ec->nodePath);
+	ckfree (ec->dirPath);
+	ckfree (ec);
+}
+
+/*
+ *--------------------------------------------------------------
+ *
+ * zootcl_election_forget -- remove a candidate from its object's
+ *   table and free it
+ *
+ *--------------------------------------------------------------
+ */
+void
+zootcl_election_forget (zootcl_electionCandidate *ec)
+{
+	Tcl_HashEntry *hashEntry = Tcl_FindHashEntry (&ec->zo->elections, ec->nodePath);
+
+	if (hashEntry != NULL) {
+		Tcl_DeleteHashEntry (hashEntry);
+	}
+	zootcl_election_free (ec);
+}
+
+/*
+ *--------------------------------------------------------------
+ *
+ * zootcl_election_notify -- tell the candidate's callback about
+ *   a role change.
+ *
+ *   the callback may leave the election or destroy the object so
+ *   callers must not touch ec after this.
+ *
+ *--------------------------------------------------------------
+ */
+void
+zootcl_election_notify (zootcl_electionCandidate *ec, enum zootcl_electionRole role)
+{
+	static CONST char *roleStrings[] = {"candidate", "follower", "leader", "suspended", "lost"};
+	zootcl_objectClientData *zo = ec->zo;
+	Tcl_Obj *listObjv[6];
+	int element = 0;
+
+	ec->role = role;
+
+	element += zootcl_callback_prefix (zo, listObjv);
+	listObjv[element++] = Tcl_NewStringObj ("path", -1);
+	listObjv[element++] = Tcl_NewStringObj (ec->nodePath, -1);
+	listObjv[element++] = Tcl_NewStringObj ("role", -1);
+	listObjv[element++] = Tcl_NewStringObj (roleStrings[role], -1);
+
+	Tcl_Obj *callbackObj = ec->callbackObj;
+	Tcl_IncrRefCount (callbackObj);
+
+	if (role == ELECTION_LOST) {
+		ec->done = 1;
+		if (ec->watchPending == 0) {
+			zootcl_election_forget (ec);
+		}
+	}
+
+	zootcl_invoke_callback (zo, callbackObj, Tcl_NewListObj (element, listObjv));
+	Tcl_DecrRefCount (callbackObj);
+}
+
+void zootcl_election_event (ClientData clientData, int type, int state);
+void zootcl_election_timer (ClientData clientData);
+
+/*
+ *--------------------------------------------------------------
+ *
+ * zootcl_election_watcher -- watcher on the candidate ahead of us,
+ *   or on our own znode if we lead
+ *
+ * runs in the zookeeper completion thread, so just hand the event
+ * to the interpreter's thread.
+ *
+ *--------------------------------------------------------------
+ */
+void
+zootcl_election_watcher (zhandle_t *zh, int type, int state, const char *path, void *context)
+{
+	zootcl_electionCandidate *ec = (zootcl_electionCandidate *)context;
+
+	zootcl_queue_recipe_event (ec->zo, zootcl_election_event, (ClientData)ec, type, state);
+}
+
+/*
+ *--------------------------------------------------------------
+ *
+ * zootcl_election_advance -- watch the nearest candidate ahead of
+ *   us that still exists, or take the lead if there isn't one
+ *
+ *--------------------------------------------------------------
+ */
+void
+zootcl_election_advance (zootcl_electionCandidate *ec)
+{
+	zhandle_t *zh = ec->zo->zh;
+	Tcl_DString ds;
+	int status;
+
+	while (ec->aheadCount > 0) {
+		char buffer[1];
+		int bufferLen = sizeof (buffer);
+
+		Tcl_DStringInit (&ds);
+		zootcl_join_path (&ds, ec->dirPath, ec->ahead[ec->aheadCount - 1]);
+		ec->watchPending++;
+		status = zoo_wget (zh, Tcl_DStringValue (&ds), zootcl_election_watcher, (void *)ec, buffer, &bufferLen, NULL);
+		Tcl_DStringFree (&ds);
+
+		if (status == ZOK) {
+			if (ec->role != ELECTION_FOLLOWER) {
+				zootcl_election_notify (ec, ELECTION_FOLLOWER);
+			}
+			return;
+		}
+
+		ec->watchPending--;
+		if (status != ZNONODE) {
+			goto retry;
+		}
+
+		// gone already, on to the next one
+		ckfree (ec->ahead[--ec->aheadCount]);
+	}
+
+	// nobody ahead of us.  watch our own znode so we hear about the
+	// session and about anyone deleting it.
+	ec->watchPending++;
+	status = zoo_wexists (zh, ec->nodePath, zootcl_election_watcher, (void *)ec, NULL);
+
+	if (status == ZOK) {
+		if (ec->role != ELECTION_LEADER) {
+			zootcl_election_notify (ec, ELECTION_LEADER);
+		}
+		return;
+	}
+
+	if (status == ZNONODE) {
+		// our znode is gone (the exists watch stays behind waiting
+		// for it to be created)
+		zootcl_election_notify (ec, ELECTION_LOST);
+		return;
+	}
+	ec->watchPending--;
+
+  retry:
+	if (status == ZSESSIONEXPIRED) {
+		zootcl_election_notify (ec, ELECTION_LOST);
+		return;
+	}
+	ec->timer = Tcl_CreateTimerHandler (ZOOTCL_RECIPE_RETRY_MS, zootcl_election_timer, (ClientData)ec);
+}
+
+/*
+ *--------------------------------------------------------------
+ *
+ * zootcl_election_timer -- take the first look after joining, or
+ *   look again after a connection loss
+ *
+ *--------------------------------------------------------------
+ */
+void
+zootcl_election_timer (ClientData clientData)
+{
+	zootcl_electionCandidate *ec = (zootcl_electionCandidate *)clientData;
+
+	ec->timer = NULL;
+	zootcl_session_ready (ec->zo);
+	zootcl_election_advance (ec);
+}
+
+/*
+ *--------------------------------------------------------------
+ *
+ * zootcl_election_event -- RECIPE_CALLBACK handler for a candidate
+ *
+ *--------------------------------------------------------------
+ */
+void
+zootcl_election_event (ClientData clientData, int type, int state)
+{
+	zootcl_electionCandidate *ec = (zootcl_electionCandidate *)clientData;
+
+	if (type == ZOO_SESSION_EVENT) {
+		if (state == ZOO_EXPIRED_SESSION_STATE) {
+			// zookeeper drops all watches when the session expires
+			ec->watchPending = 0;
+			if (ec->done) {
+				zootcl_election_forget (ec);
+			} else {
+				zootcl_election_notify (ec, ELECTION_LOST);
+			}
+			return;
+		}
+
+		if (ec->done) {
+			return;
+		}
+
+		// while disconnected we can't know that we still lead
+		if (state == ZOO_CONNECTED_STATE) {
+			if (ec->role == ELECTION_SUSPENDED) {
+				zootcl_election_notify (ec, ELECTION_LEADER);
+			}
+		} else if (ec->role == ELECTION_LEADER) {
+			zootcl_election_notify (ec, ELECTION_SUSPENDED);
+		}
+		return;
+	}
+
+	ec->watchPending--;
+	if (ec->done) {
+		if (ec->watchPending == 0) {
+			zootcl_election_forget (ec);
+		}
+		return;
+	}
+
+	if (ec->role == ELECTION_LEADER || ec->role == ELECTION_SUSPENDED) {
+		// the watch was on our own znode
+		if (type == ZOO_DELETED_EVENT) {
+			zootcl_election_notify (ec, ELECTION_LOST);
+			return;
+		}
+	} else if (type == ZOO_DELETED_EVENT && ec->aheadCount > 0) {
+		// the candidate ahead of us is gone, no need to ask
+		ckfree (ec->ahead[--ec->aheadCount]);
+	}
+
+	if (ec->timer == NULL) {
+		zootcl_election_advance (ec);
+	}
+}
+
+/*
+ *--------------------------------------------------------------
+ *
+ * zootcl_election_cleanup -- free all election candidates of an
+ *   object that is being deleted
+ *
+ *--------------------------------------------------------------
+ */
+void
+zootcl_election_cleanup (zootcl_objectClientData *zo)
+{
+	Tcl_HashSearch search;
+	Tcl_HashEntry *hashEntry;
+
+	for (hashEntry = Tcl_FirstHashEntry (&zo->elections, &search); hashEntry != NULL; hashEntry = Tcl_NextHashEntry (&search)) {
+		zootcl_election_free ((zootcl_electionCandidate *)Tcl_GetHashValue (hashEntry));
+	}
+	Tcl_DeleteHashTable (&zo->elections);
+}
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * zootcl_election_subcommand --
+ *
+ *      implement the "election" method of a zookeeper tcl command
+ *      object
+ *
+ *      election join path ?-data id? callback
+ *      election leave candidateNode
+ *      election leader path
+ *
+ * Results:
+ *      A standard Tcl result.
+ *
+ *
+ *----------------------------------------------------------------------
+ */
+int
+zootcl_election_subcommand(Tcl_Interp *interp, int objc, Tcl_Obj *CONST objv[], ZOOAPI zhandle_t *zh, zootcl_objectClientData *zo)
+{
+	static CONST char *actions[] = {
+		"join",
+		"leave",
+		"leader",
+		NULL
+	};
+
+	enum actions {
+		ACTION_JOIN,
+		ACTION_LEAVE,
+		ACTION_LEADER
+	};
+
+	int actionIndex;
+	struct String_vector children;
+	zootcl_sequenceEntry *entries;
+	int count;
+	int status;
+	int i;
+
+    assert (zo->zookeeper_object_magic == ZOOKEEPER_OBJECT_MAGIC);
+
+	if (objc < 4) {
+		Tcl_WrongNumArgs (interp, 2, objv, "join|leave|leader path ?-data id? ?callback?");
+		return TCL_ERROR;
+	}
+
+	if (Tcl_GetIndexFromObj (interp, objv[2], actions, "action", TCL_EXACT, &actionIndex) != TCL_OK) {
+		return TCL_ERROR;
+	}
+
+	char *path = Tcl_GetString (objv[3]);
+
+	switch ((enum actions) actionIndex) {
+		case ACTION_LEAVE:
+		{
+			if (objc != 4) {
+				Tcl_WrongNumArgs (interp, 3, objv, "candidateNode");
+				return TCL_ERROR;
+			}
+
+			Tcl_HashEntry *hashEntry = Tcl_FindHashEntry (&zo->elections, path);
+			if (hashEntry != NULL) {
+				zootcl_electionCandidate *ec = (zootcl_electionCandidate *)Tcl_GetHashValue (hashEntry);
+				ec->done = 1;
+				if (ec->timer != NULL) {
+					Tcl_DeleteTimerHandler (ec->timer);
+					ec->timer = NULL;
+				}
+				if (ec->watchPending == 0) {
+					zootcl_election_forget (ec);
+				}
+			}
+
+			status = zoo_delete (zh, path, -1);
+			return zootcl_set_tcl_return_code (interp, status);
+		}
+
+		case ACTION_LEADER:
+		{
+			if (objc != 4) {
+				Tcl_WrongNumArgs (interp, 3, objv, "path");
+				return TCL_ERROR;
+			}
+
+			// the data of the lowest numbered candidate, or nothing
+			// if there are no candidates
+			for (;;) {
+				status = zoo_get_children (zh, path, 0, &children);
+				if (status == ZNONODE) {
+					return TCL_OK;
+				}
+				if (status != ZOK) {
+					return zootcl_set_tcl_return_code (interp, status);
+				}
+
+				count = zootcl_sequence_sort (&children, ZOOTCL_ELECTION_PREFIX, &entries);
+				if (count == 0) {
+					ckfree (entries);
+					deallocate_String_vector (&children);
+					return TCL_OK;
+				}
+
+				Tcl_DString ds;
+				int bufferLen = 1048576 + 1;
+				char *buffer = ckalloc (bufferLen);
+
+				Tcl_DStringInit (&ds);
+				zootcl_join_path (&ds, path, entries[0].name);
+				ckfree (entries);
+				deallocate_String_vector (&children);
+
+				status = zoo_get (zh, Tcl_DStringValue (&ds), 0, buffer, &bufferLen, NULL);
+				Tcl_DStringFree (&ds);
+
+				if (status == ZOK && bufferLen >= 0) {
+					Tcl_SetObjResult (interp, Tcl_NewStringObj (buffer, bufferLen));
+				}
+				ckfree (buffer);
+
+				// the leader went away while we looked, look again
+				if (status != ZNONODE) {
+					return zootcl_set_tcl_return_code (interp, status);
+				}
+			}
+		}
+
+		case ACTION_JOIN:
+		{
+			char *value = NULL;
+			int valueLen = -1;
+			int uncertain = 0;
+			char *nodePath = NULL;
+
+			if (objc == 7) {
+				if (strcmp (Tcl_GetString (objv[4]), "-data") != 0) {
+					Tcl_SetObjResult (interp, Tcl_ObjPrintf ("bad suboption \"%s\": must be -data", Tcl_GetString (objv[4])));
+					return TCL_ERROR;
+				}
+				value = Tcl_GetStringFromObj (objv[5], &valueLen);
+			} else if (objc != 5) {
+				Tcl_WrongNumArgs (interp, 3, objv, "path ?-data id? callback");
+				return TCL_ERROR;
+			}
+
+			status = zootcl_recipe_create_node (zh, path, ZOOTCL_ELECTION_PREFIX, value, valueLen, &nodePath, &uncertain);
+			if (status != ZOK && uncertain) {
+				// one more go in case the create made it there
+				status = zootcl_recipe_create_node (zh, path, ZOOTCL_ELECTION_PREFIX, value, valueLen, &nodePath, &uncertain);
+			}
+			if (status != ZOK) {
+				return zootcl_set_tcl_return_code (interp, status);
+			}
+
+			status = zoo_get_children (zh, path, 0, &children);
+			if (status != ZOK) {
+				zoo_delete (zh, nodePath, -1);
+				ckfree (nodePath);
+				return zootcl_set_tcl_return_code (interp, status);
+			}
+
+			zootcl_electionCandidate *ec = (zootcl_electionCandidate *)ckalloc (sizeof (zootcl_electionCandidate));
+			memset (ec, 0, sizeof (zootcl_electionCandidate));
+			ec->zo = zo;
+			ec->dirPath = ckalloc (strlen (path) + 1);
+			strcpy (ec->dirPath, path);
+			ec->nodePath = nodePath;
+			ec->callbackObj = objv[objc - 1];
+			Tcl_IncrRefCount (ec->callbackObj);
+			ec->role = ELECTION_CANDIDATE;
+
+			// remember who is ahead of us, in order
+			const char *myName = strrchr (nodePath, '/') + 1;
+			count = zootcl_sequence_sort (&children, ZOOTCL_ELECTION_PREFIX, &entries);
+			ec->ahead = (char **)ckalloc (sizeof (char *) * (count + 1));
+			for (i = 0; i < count && strcmp (entries[i].name, myName) != 0; i++) {
+				ec->ahead[i] = ckalloc (strlen (entries[i].name) + 1);
+				strcpy (ec->ahead[i], entries[i].name);
+			}
+			ec->aheadCount = i;
+			ckfree (entries);
+			deallocate_String_vector (&children);
+
+			int isNew;
+			Tcl_SetHashValue (Tcl_CreateHashEntry (&zo->elections, nodePath, &isNew), (ClientData)ec);
+
+			// the callback comes from the event loop rather than from in here
+			ec->timer = Tcl_CreateTimerHandler (0, zootcl_election_timer, (ClientData)ec);
+
+			Tcl_SetObjResult (interp, Tcl_NewStringObj (nodePath, -1));
+			return TCL_OK;
+		}
+	}
+
+	return TCL_OK;
+}
+
+/*
+ * Pipelined reads
+ *
+ * Issue a batch of async gets back to back and wait once for all of
+ * them, so N reads cost about one round trip instead of N.
+ */
+TCL_DECLARE_MUTEX(zootcl_batchMutex)
+
+static void
+zootcl_batch_get_completion (int rc, const char *value, int valueLen, const struct Stat *stat, const void *context)
+{
+	zootcl_getResult *result = (zootcl_getResult *)context;
+	zootcl_getBatch *batch = result->batch;
+
+	result->rc = rc;
+	if (value != NULL && valueLen >= 0) {
+		result->data = ckalloc (valueLen + 1);
+		memcpy (result->data, value, valueLen);
+		result->dataLen = valueLen;
+	}
+	if (stat != NULL) {
+		result->stat = *stat;
+	}
+
+	Tcl_MutexLock (&zootcl_batchMutex);
+	if (--batch->outstanding == 0) {
+		Tcl_ConditionNotify (&batch->cond);
+	}
+	Tcl_MutexUnlock (&zootcl_batchMutex);
+}
+
+/*
+ *--------------------------------------------------------------
+ *
+ * zootcl_pipelined_wget -- get the data and stat of count znodes,
+ *   blocking until all of them have answered.  if watcher isn't NULL
+ *   also leave a data watch on each, with watcherCtxs[i] as the
+ *   context of the one on paths[i].
+ *
+ *   a watch is only left on the znodes whose result is ZOK
+ *
+ * Results:
+ *      fills in results, which the caller frees with
+ *      zootcl_pipelined_get_free
+ *
+ *--------------------------------------------------------------
+ */
+void
+zootcl_pipelined_wget (zhandle_t *zh, int count, char **paths, watcher_fn watcher, void **watcherCtxs, zootcl_getResult *results)
+{
+	zootcl_getBatch batch;
+	int i;
+
+	memset (&batch, 0, sizeof (batch));
+
+	for (i = 0; i < count; i++) {
+		memset (&results[i], 0, sizeof (zootcl_getResult));
+		results[i].batch = &batch;
+		results[i].dataLen = -1;
+
+		Tcl_MutexLock (&zootcl_batchMutex);
+		batch.outstanding++;
+		Tcl_MutexUnlock (&zootcl_batchMutex);
+
+		int status;
+		if (watcher == NULL) {
+			status = zoo_aget (zh, paths[i], 0, zootcl_batch_get_completion, &results[i]);
+		} else {
+			status = zoo_awget (zh, paths[i], watcher, watcherCtxs[i], zootcl_batch_get_completion, &results[i]);
+		}
+		if (status != ZOK) {
+			results[i].rc = status;
+			Tcl_MutexLock (&zootcl_batchMutex);
+			batch.outstanding--;
+			Tcl_MutexUnlock (&zootcl_batchMutex);
+		}
+	}
+
+	Tcl_MutexLock (&zootcl_batchMutex);
+	while (batch.outstanding > 0) {
+		zootcl_condition_wait (zh, &batch.cond, &zootcl_batchMutex, NULL);
+	}
+	Tcl_MutexUnlock (&zootcl_batchMutex);
+	Tcl_ConditionFinalize (&batch.cond);
+}
+
+/*
+ *--------------------------------------------------------------
+ *
+ * zootcl_pipelined_get -- zootcl_pipelined_wget without the watches
+ *
+ *--------------------------------------------------------------
+ */
+void
+zootcl_pipelined_get (zhandle_t *zh, int count, char **paths, zootcl_getResult *results)
+{
+	zootcl_pipelined_wget (zh, count, paths, NULL, NULL, results);
+}
+
+void
+zootcl_pipelined_get_free (int count, zootcl_getResult *results)
+{
+	int i;
+
+	for (i = 0; i < count; i++) {
+		if (results[i].data != NULL) {
+			ckfree (results[i].data);
+			results[i].data = NULL;
+		}
+	}
+}
+
+static void
+zootcl_batch_children_completion (int rc, const struct String_vector *strings, const void *context)
+{
+	zootcl_childrenResult *result = (zootcl_childrenResult *)context;
+	zootcl_getBatch *batch = result->batch;
+	int i;
+
+	result->rc = rc;
+	if (rc == ZOK && strings != NULL) {
+		// the library frees its copy when we return
+		result->strings.count = strings->count;
+		result->strings.data = (char **)calloc (strings->count, sizeof (char *));
+		for (i = 0; i < strings->count; i++) {
+			result->strings.data[i] = strdup (strings->data[i]);
+		}
+	}
+
+	Tcl_MutexLock (&zootcl_batchMutex);
+	if (--batch->outstanding == 0) {
+		Tcl_ConditionNotify (&batch->cond);
+	}
+	Tcl_MutexUnlock (&zootcl_batchMutex);
+}
+
+/*
+ *--------------------------------------------------------------
+ *
+ * zootcl_pipelined_wget_children -- list the children of count
+ *   znodes, blocking until all of them have answered.  if watcher
+ *   isn't NULL also leave a children watch on each, with
+ *   watcherCtxs[i] as the context of the one on paths[i].
+ *
+ *   a watch is only left on the znodes whose result is ZOK
+ *
+ * Results:
+ *      fills in results, which the caller frees with
+ *      zootcl_pipelined_get_children_free
+ *
+ *--------------------------------------------------------------
+ */
+void
+zootcl_pipelined_wget_children (zhandle_t *zh, int count, char **paths, watcher_fn watcher, void **watcherCtxs, zootcl_childrenResult *results)
+{
+	zootcl_getBatch batch;
+	int i;
+
+	memset (&batch, 0, sizeof (batch));
+
+	for (i = 0; i < count; i++) {
+		memset (&results[i], 0, sizeof (zootcl_childrenResult));
+		results[i].batch = &batch;
+
+		Tcl_MutexLock (&zootcl_batchMutex);
+		batch.outstanding++;
+		Tcl_MutexUnlock (&zootcl_batchMutex);
+
+		int status;
+		if (watcher == NULL) {
+			status = zoo_aget_children (zh, paths[i], 0, zootcl_batch_children_completion, &results[i]);
+		} else {
+			status = zoo_awget_children (zh, paths[i], watcher, watcherCtxs[i], zootcl_batch_children_completion, &results[i]);
+		}
+		if (status != ZOK) {
+			results[i].rc = status;
+			Tcl_MutexLock (&zootcl_batchMutex);
+			batch.outstanding--;
+			Tcl_MutexUnlock (&zootcl_batchMutex);
+		}
+	}
+
+	Tcl_MutexLock (&zootcl_batchMutex);
+	while (batch.outstanding > 0) {
+		zootcl_condition_wait (zh, &batch.cond, &zootcl_batchMutex, NULL);
+	}
+	Tcl_MutexUnlock (&zootcl_batchMutex);
+	Tcl_ConditionFinalize (&batch.cond);
+}
+
+/*
+ *--------------------------------------------------------------
+ *
+ * zootcl_pipelined_get_children -- zootcl_pipelined_wget_children
+ *   without the watches
+ *
+ *--------------------------------------------------------------
+ */
+void
+zootcl_pipelined_get_children (zhandle_t *zh, int count, char **paths, zootcl_childrenResult *results)
+{
+	zootcl_pipelined_wget_children (zh, count, paths, NULL, NULL, results);
+}
+
+void
+zootcl_pipelined_get_children_free (int count, zootcl_childrenResult *results)
+{
+	int i;
+
+	for (i = 0; i < count; i++) {
+		if (results[i].strings.data != NULL) {
+			deallocate_String_vector (&results[i].strings);
+			results[i].strings.data = NULL;
+		}
+	}
+}
+
+/*
+ * Queue recipe
+ *
+ * Items are persistent sequential znodes under the queue directory.
+ * Consumers keep the sorted list of items in memory and only relist
+ * the directory when their children watch fires or the list runs out.
+ * A take reads up to -max items in one pipelined batch and claims them
+ * with a single multi of version-checked deletes; items some other
+ * consumer got to first are dropped and the rest claimed again.
+ */
+TCL_DECLARE_MUTEX(zootcl_queueMutex)
+
+#define ZOOTCL_QUEUE_PREFIX "qn-"
+
+static void
+zootcl_queue_free_names (zootcl_queueCache *qc)
+{
+	int i;
+
+	for (i = 0; i < qc->count; i++) {
+		ckfree (qc->names[i]);
+	}
+	if (qc->names != NULL) {
+		ckfree (qc->names);
+	}
+	qc->names = NULL;
+	qc->count = 0;
+	qc->head = 0;
+}
+
+/*
+ *--------------------------------------------------------------
+ *
+ * zootcl_queue_watcher -- children watch on a queue directory
+ *
+ * runs in the zookeeper completion thread.  marks the cache stale
+ * and wakes any consumer waiting for items.
+ *
+ *--------------------------------------------------------------
+ */
+void
+zootcl_queue_watcher (zhandle_t *zh, int type, int state, const char *path, void *context)
+{
+	zootcl_queueCache *qc = (zootcl_queueCache *)context;
+
+	if (type == ZOO_SESSION_EVENT && state != ZOO_EXPIRED_SESSION_STATE) {
+		return;
+	}
+
+	Tcl_MutexLock (&zootcl_queueMutex);
+	qc->watchPending = 0;
+	qc->stale = 1;
+	Tcl_ConditionNotify (&qc->cond);
+	Tcl_MutexUnlock (&zootcl_queueMutex);
+}
+
+/*
+ *--------------------------------------------------------------
+ *
+ * zootcl_queue_refresh -- relist the queue directory, setting the
+ *   children watch if we don't have one
+ *
+ *--------------------------------------------------------------
+ */
+int
+zootcl_queue_refresh (zhandle_t *zh, zootcl_queueCache *qc)
+{
+	struct String_vector children;
+	zootcl_sequenceEntry *entries;
+	int setWatch;
+	int status;
+	int i;
+
+	Tcl_MutexLock (&zootcl_queueMutex);
+	qc->stale = 0;
+	setWatch = !qc->watchPending;
+	qc->watchPending = 1;
+	Tcl_MutexUnlock (&zootcl_queueMutex);
+
+	if (setWatch) {
+		status = zoo_wget_children (zh, qc->path, zootcl_queue_watcher, (void *)qc, &children);
+	} else {
+		status = zoo_get_children (zh, qc->path, 0, &children);
+	}
+
+	if (status != ZOK) {
+		Tcl_MutexLock (&zootcl_queueMutex);
+		if (setWatch) {
+			qc->watchPending = 0;
+		}
+		qc->stale = 1;
+		Tcl_MutexUnlock (&zootcl_queueMutex);
+		if (status != ZNONODE) {
+			return status;
+		}
+
+		// no queue yet means no items.  watch for it to be created
+		// so a waiting consumer doesn't have to poll.
+		zootcl_queue_free_names (qc);
+		Tcl_MutexLock (&zootcl_queueMutex);
+		setWatch = !qc->watchPending;
+		qc->watchPending = 1;
+		Tcl_MutexUnlock (&zootcl_queueMutex);
+		if (!setWatch) {
+			return ZOK;
+		}
+
+		status = zoo_wexists (zh, qc->path, zootcl_queue_watcher, (void *)qc, NULL);
+		Tcl_MutexLock (&zootcl_queueMutex);
+		if (status == ZNONODE) {
+			qc->stale = 0;
+		} else {
+			// it showed up in the meantime, or something went wrong.
+			// either way the next look needs a children watch; a
+			// stray exists watch firing later only costs a relist.
+			qc->watchPending = 0;
+		}
+		Tcl_MutexUnlock (&zootcl_queueMutex);
+		return (status == ZNONODE || status == ZOK) ? ZOK : status;
+	}
+
+	zootcl_queue_free_names (qc);
+	qc->count = zootcl_sequence_sort (&children, ZOOTCL_QUEUE_PREFIX, &entries);
+	qc->names = (char **)ckalloc (sizeof (char *) * (qc->count + 1));
+	for (i = 0; i < qc->count; i++) {
+		qc->names[i] = ckalloc (strlen (entries[i].name) + 1);
+		strcpy (qc->names[i], entries[i].name);
+	}
+	ckfree (entries);
+	deallocate_String_vector (&children);
+	return ZOK;
+}
+
+/*
+ *--------------------------------------------------------------
+ *
+ * zootcl_queue_claim -- read and delete up to max items from the
+ *   head of the cached list
+ *
+ * Results:
+ *      a zookeeper status.  the data of the items we got are
+ *      appended to listObj.
+ *
+ *--------------------------------------------------------------
+ */
+int
+zootcl_queue_claim (zhandle_t *zh, zootcl_queueCache *qc, int max, Tcl_Obj *listObj)
+{
+	int window = qc->count - qc->head;
+	int status = ZOK;
+	int i;
+
+	if (window > max) {
+		window = max;
+	}
+	if (window == 0) {
+		return ZOK;
+	}
+
+	char **paths = (char **)ckalloc (sizeof (char *) * window);
+	zootcl_getResult *results = (zootcl_getResult *)ckalloc (sizeof (zootcl_getResult) * window);
+	zoo_op_t *ops = (zoo_op_t *)ckalloc (sizeof (zoo_op_t) * window);
+	zoo_op_result_t *opResults = (zoo_op_result_t *)ckalloc (sizeof (zoo_op_result_t) * window);
+	int *claim = (int *)ckalloc (sizeof (int) * window);
+	int nClaim = 0;
+
+	for (i = 0; i < window; i++) {
+		Tcl_DString ds;
+
+		Tcl_DStringInit (&ds);
+		zootcl_join_path (&ds, qc->path, qc->names[qc->head + i]);
+		paths[i] = ckalloc (Tcl_DStringLength (&ds) + 1);
+		strcpy (paths[i], Tcl_DStringValue (&ds));
+		Tcl_DStringFree (&ds);
+	}
+
+	// one round trip to read them all
+	zootcl_pipelined_get (zh, window, paths, results);
+
+	for (i = 0; i < window; i++) {
+		if (results[i].rc == ZOK) {
+			claim[nClaim++] = i;
+		} else if (results[i].rc != ZNONODE) {
+			// someone else taking it is fine, anything else isn't
+			status = results[i].rc;
+		}
+	}
+
+	// and one more to delete the ones still there, as long as nobody
+	// else has gotten to them
+	while (status == ZOK && nClaim > 0) {
+		int failed = -1;
+
+		for (i = 0; i < nClaim; i++) {
+			zoo_delete_op_init (&ops[i], paths[claim[i]], results[claim[i]].stat.version);
+		}
+
+		status = zoo_multi (zh, nClaim, ops, opResults);
+		if (status == ZOK) {
+			for (i = 0; i < nClaim; i++) {
+				zootcl_getResult *result = &results[claim[i]];
+				Tcl_ListObjAppendElement (NULL, listObj, Tcl_NewStringObj (result->data ? result->data : "", result->data ? result->dataLen : 0));
+			}
+			break;
+		}
+
+		for (i = 0; i < nClaim; i++) {
+			if (opResults[i].err == ZNONODE || opResults[i].err == ZBADVERSION) {
+				failed = i;
+				break;
+			}
+		}
+		if (failed < 0) {
+			break;
+		}
+
+		// lost that one to another consumer, claim the rest
+		memmove (&claim[failed], &claim[failed + 1], sizeof (int) * (nClaim - failed - 1));
+		nClaim--;
+		status = ZOK;
+	}
+
+	// everything in the window is either ours now or someone else's
+	if (status == ZOK) {
+		qc->head += window;
+	}
+
+	for (i = 0; i < window; i++) {
+		ckfree (paths[i]);
+	}
+	zootcl_pipelined_get_free (window, results);
+	ckfree (paths);
+	ckfree (results);
+	ckfree (ops);
+	ckfree (opResults);
+	ckfree (claim);
+	return status;
+}
+
+/*
+ *--------------------------------------------------------------
+ *
+ * zootcl_queue_cleanup -- free the queue caches of an object that
+ *   is being deleted
+ *
+ *--------------------------------------------------------------
+ */
+void
+zootcl_queue_cleanup (zootcl_objectClientData *zo)
+{
+	Tcl_HashSearch search;
+	Tcl_HashEntry *hashEntry;
+
+	for (hashEntry = Tcl_FirstHashEntry (&zo->queues, &search); hashEntry != NULL; hashEntry = Tcl_NextHashEntry (&search)) {
+		zootcl_queueCache *qc = (zootcl_queueCache *)Tcl_GetHashValue (hashEntry);
+		zootcl_queue_free_names (qc);
+		Tcl_ConditionFinalize (&qc->cond);
+		ckfree (qc->path);
+		ckfree (qc);
+	}
+	Tcl_DeleteHashTable (&zo->queues);
+}
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * zootcl_queue_subcommand --
+ *
+ *      implement the "queue" method of a zookeeper tcl command
+ *      object
+ *
+ *      queue put path data
+ *      queue take path ?-max n? ?-timeout ms?
+ *
+ * Results:
+ *      A standard Tcl result.
+ *
+ *
+ *----------------------------------------------------------------------
+ */
+int
+zootcl_queue_subcommand(Tcl_Interp *interp, int objc, Tcl_Obj *CONST objv[], ZOOAPI zhandle_t *zh, zootcl_objectClientData *zo)
+{
+	static CONST char *actions[] = {
+		"put",
+		"take",
+		NULL
+	};
+
+	enum actions {
+		ACTION_PUT,
+		ACTION_TAKE
+	};
+
+	static CONST char *subOptions[] = {
+		"-max",
+		"-timeout",
+		NULL
+	};
+
+	enum subOptions {
+		SUBOPT_MAX,
+		SUBOPT_TIMEOUT
+	};
+
+	int actionIndex;
+	int suboptIndex = 0;
+	int max = 1;
+	int timeout = 0;
+	int status;
+	int i;
+
+    assert (zo->zookeeper_object_magic == ZOOKEEPER_OBJECT_MAGIC);
+
+	if (objc < 4) {
+		Tcl_WrongNumArgs (interp, 2, objv, "put|take path ?arg ...?");
+		return TCL_ERROR;
+	}
+
+	if (Tcl_GetIndexFromObj (interp, objv[2], actions, "action", TCL_EXACT, &actionIndex) != TCL_OK) {
+		return TCL_ERROR;
+	}
+
+	char *path = Tcl_GetString (objv[3]);
+
+	if ((enum actions) actionIndex == ACTION_PUT) {
+		char pathBuffer[1024];
+		int valueLen;
+		Tcl_DString ds;
+
+		if (objc != 5) {
+			Tcl_WrongNumArgs (interp, 3, objv, "path data");
+			return TCL_ERROR;
+		}
+
+		char *value = Tcl_GetStringFromObj (objv[4], &valueLen);
+
+		Tcl_DStringInit (&ds);
+		zootcl_join_path (&ds, path, ZOOTCL_QUEUE_PREFIX);
+		status = zoo_create (zh, Tcl_DStringValue (&ds), value, valueLen, &ZOO_OPEN_ACL_UNSAFE, ZOO_SEQUENCE, pathBuffer, sizeof (pathBuffer) - 1);
+		if (status == ZNONODE) {
+			// the queue directory doesn't exist yet
+			status = zoo_create (zh, path, NULL, -1, &ZOO_OPEN_ACL_UNSAFE, 0, NULL, 0);
+			if (status == ZOK || status == ZNODEEXISTS) {
+				status = zoo_create (zh, Tcl_DStringValue (&ds), value, valueLen, &ZOO_OPEN_ACL_UNSAFE, ZOO_SEQUENCE, pathBuffer, sizeof (pathBuffer) - 1);
+			}
+		}
+		Tcl_DStringFree (&ds);
+
+		if (status == ZOK) {
+			Tcl_SetObjResult (interp, Tcl_NewStringObj (pathBuffer, -1));
+		}
+		return zootcl_set_tcl_return_code (interp, status);
+	}
+
+	for (i = 4; i < objc; i++) {
+		if (Tcl_GetIndexFromObj (interp, objv[i], subOptions, "suboption",
+			TCL_EXACT, &suboptIndex) != TCL_OK) {
+			return TCL_ERROR;
+		}
+
+		if (i + 1 >= objc) {
+			Tcl_WrongNumArgs (interp, 3, objv, "path ?-max n? ?-timeout ms?");
+			return TCL_ERROR;
+		}
+
+		switch ((enum subOptions) suboptIndex) {
+			case SUBOPT_MAX:
+			{
+				if (Tcl_GetIntFromObj (interp, objv[++i], &max) == TCL_ERROR) {
+					return TCL_ERROR;
+				}
+				if (max < 1) {
+					Tcl_SetObjResult (interp, Tcl_NewStringObj ("-max must be at least 1", -1));
+					return TCL_ERROR;
+				}
+				break;
+			}
+
+			case SUBOPT_TIMEOUT:
+			{
+				if (Tcl_GetIntFromObj (interp, objv[++i], &timeout) == TCL_ERROR) {
+					return TCL_ERROR;
+				}
+				break;
+			}
+		}
+	}
+
+	int isNew;
+	Tcl_HashEntry *hashEntry = Tcl_CreateHashEntry (&zo->queues, path, &isNew);
+	zootcl_queueCache *qc;
+
+	if (isNew) {
+		qc = (zootcl_queueCache *)ckalloc (sizeof (zootcl_queueCache));
+		memset (qc, 0, sizeof (zootcl_queueCache));
+		qc->path = ckalloc (strlen (path) + 1);
+		strcpy (qc->path, path);
+		qc->stale = 1;
+		Tcl_SetHashValue (hashEntry, (ClientData)qc);
+	} else {
+		qc = (zootcl_queueCache *)Tcl_GetHashValue (hashEntry);
+	}
+
+	Tcl_Time deadline;
+	Tcl_Time remaining;
+	Tcl_Obj *listObj = Tcl_NewObj ();
+
+	if (timeout > 0) {
+		zootcl_deadline (&deadline, timeout);
+	}
+
+	for (;;) {
+		int stale;
+
+		Tcl_MutexLock (&zootcl_queueMutex);
+		stale = qc->stale;
+		Tcl_MutexUnlock (&zootcl_queueMutex);
+
+		// we only need to list the directory if it changed and
+		// we've run out of items we know about
+		if (qc->head >= qc->count && stale) {
+			status = zootcl_queue_refresh (zh, qc);
+			if (status != ZOK) {
+				break;
+			}
+		}
+
+		status = zootcl_queue_claim (zh, qc, max, listObj);
+		if (status != ZOK) {
+			break;
+		}
+
+		int gotten;
+		Tcl_ListObjLength (NULL, listObj, &gotten);
+		if (gotten > 0) {
+			break;
+		}
+
+		if (qc->head < qc->count) {
+			// all of those were taken by others, try the rest
+			continue;
+		}
+
+		// the queue is empty.  if we're willing to wait, sleep until
+		// the children watch says something was added.
+		if (timeout <= 0) {
+			break;
+		}
+
+		Tcl_MutexLock (&zootcl_queueMutex);
+		while (!qc->stale && zootcl_time_remaining (&deadline, &remaining)) {
+			zootcl_condition_wait (zh, &qc->cond, &zootcl_queueMutex, &remaining);
+		}
+		stale = qc->stale;
+		Tcl_MutexUnlock (&zootcl_queueMutex);
+
+		if (!stale) {
+			break;
+		}
+	}
+
+	if (status != ZOK) {
+		Tcl_DecrRefCount (listObj);
+		return zootcl_set_tcl_return_code (interp, status);
+	}
+
+	Tcl_SetObjResult (interp, listObj);
+	return TCL_OK;
+}
+
+/*
+ * Double barrier recipe
+ *
+ * Participants enter by creating an ephemeral sequential znode under
+ * the barrier directory, and the one whose arrival fills the barrier
+ * creates a "ready" znode.  Everyone else waits on a single exists
+ * watch on "ready", so each participant is woken once rather than on
+ * every arrival.  Leaving follows the usual recipe: the lowest
+ * participant waits for the highest to go, everyone else deletes
+ * their znode and waits for the lowest to go.
+ */
+TCL_DECLARE_MUTEX(zootcl_barrierMutex)
+
+#define ZOOTCL_BARRIER_PREFIX "b-"
+#define ZOOTCL_BARRIER_READY "ready"
+
+/*
+ *--------------------------------------------------------------
+ *
+ * zootcl_barrier_watcher -- exists watch for a blocked barrier call
+ *
+ * runs in the zookeeper completion thread
+ *
+ *--------------------------------------------------------------
+ */
+void
+zootcl_barrier_watcher (zhandle_t *zh, int type, int state, const char *path, void *context)
+{
+	zootcl_barrierWaiter *bw = (zootcl_barrierWaiter *)context;
+	int freeIt;
+
+	if (type == ZOO_SESSION_EVENT && state != ZOO_EXPIRED_SESSION_STATE) {
+		return;
+	}
+
+	Tcl_MutexLock (&zootcl_barrierMutex);
+	bw->fired = 1;
+	if (type == ZOO_SESSION_EVENT) {
+		bw->expired = 1;
+	}
+	freeIt = bw->abandoned;
+	if (!freeIt) {
+		Tcl_ConditionNotify (&bw->cond);
+	}
+	Tcl_MutexUnlock (&zootcl_barrierMutex);
+
+	if (freeIt) {
+		Tcl_ConditionFinalize (&bw->cond);
+		ckfree (bw);
+	}
+}
+
+/*
+ *--------------------------------------------------------------
+ *
+ * zootcl_barrier_wait -- set a watch on path and, if existence is
+ *   what we're waiting to change, block until the watch fires or
+ *   the deadline passes
+ *
+ * Results:
+ *      a zookeeper status.  ZOK means the watch fired, or path
+ *      already is the way we want it.
+ *
+ *--------------------------------------------------------------
+ */
+int
+zootcl_barrier_wait (zhandle_t *zh, const char *path, int wantExists, Tcl_Time *deadline)
+{
+	zootcl_barrierWaiter *bw = (zootcl_barrierWaiter *)ckalloc (sizeof (zootcl_barrierWaiter));
+	Tcl_Time remaining;
+	int status;
+
+	memset (bw, 0, sizeof (zootcl_barrierWaiter));
+
+	if (wantExists) {
+		status = zoo_wexists (zh, path, zootcl_barrier_watcher, (void *)bw, NULL);
+	} else {
+		// a data watch rather than an exists watch, so no watch is
+		// left waiting for a sequential znode that's already gone to
+		// be created again
+		char buffer[1];
+		int bufferLen = sizeof (buffer);
+
+		status = zoo_wget (zh, path, zootcl_barrier_watcher, (void *)bw, buffer, &bufferLen, NULL);
+		if (status == ZNONODE) {
+			ckfree (bw);
+			return ZOK;
+		}
+	}
+	if (status != ZOK && status != ZNONODE) {
+		// no watch was set
+		ckfree (bw);
+		return status;
+	}
+
+	Tcl_MutexLock (&zootcl_barrierMutex);
+	if ((status == ZOK) != wantExists) {
+		while (!bw->fired) {
+			if (deadline == NULL) {
+				zootcl_condition_wait (zh, &bw->cond, &zootcl_barrierMutex, NULL);
+			} else if (zootcl_time_remaining (deadline, &remaining)) {
+				zootcl_condition_wait (zh, &bw->cond, &zootcl_barrierMutex, &remaining);
+			} else {
+				break;
+			}
+		}
+		status = bw->expired ? ZSESSIONEXPIRED : (bw->fired ? ZOK : ZOPERATIONTIMEOUT);
+	} else {
+		status = ZOK;
+	}
+
+	// if the watch is still out there it owns the waiter now
+	int freeIt = bw->fired;
+	bw->abandoned = 1;
+	Tcl_MutexUnlock (&zootcl_barrierMutex);
+
+	if (freeIt) {
+		Tcl_ConditionFinalize (&bw->cond);
+		ckfree (bw);
+	}
+	return status;
+}
+
+/*
+ *--------------------------------------------------------------
+ *
+ * zootcl_barrier_enter -- wait for count participants to arrive
+ *
+ * Results:
+ *      a zookeeper status; on ZOK *nodePathPtr is our ckalloc'ed
+ *      participant znode
+ *
+ *--------------------------------------------------------------
+ */
+int
+zootcl_barrier_enter (zhandle_t *zh, const char *dirPath, int count, Tcl_Time *deadline, char **nodePathPtr)
+{
+	struct String_vector children;
+	zootcl_sequenceEntry *entries;
+	Tcl_DString readyPath;
+	int uncertain = 0;
+	int status;
+
+	status = zootcl_recipe_create_node (zh, dirPath, ZOOTCL_BARRIER_PREFIX, NULL, -1, nodePathPtr, &uncertain);
+	if (status != ZOK && uncertain) {
+		// one more go in case the create made it there
+		status = zootcl_recipe_create_node (zh, dirPath, ZOOTCL_BARRIER_PREFIX, NULL, -1, nodePathPtr, &uncertain);
+	}
+	if (status != ZOK) {
+		if (uncertain) {
+			// a participant we don't know about would be counted
+			// if the caller tries again, make sure there isn't one
+			zootcl_recipe_delete_node (zh, dirPath, ZOOTCL_BARRIER_PREFIX);
+		}
+		return status;
+	}
+
+	Tcl_DStringInit (&readyPath);
+	zootcl_join_path (&readyPath, dirPath, ZOOTCL_BARRIER_READY);
+
+	// count the participants; if we're the one that fills the
+	// barrier, say so.  otherwise wait for whoever does.
+	status = zoo_get_children (zh, dirPath, 0, &children);
+	if (status == ZOK) {
+		int arrived = zootcl_sequence_sort (&children, ZOOTCL_BARRIER_PREFIX, &entries);
+		ckfree (entries);
+		deallocate_String_vector (&children);
+
+		if (arrived >= count) {
+			status = zoo_create (zh, Tcl_DStringValue (&readyPath), NULL, -1, &ZOO_OPEN_ACL_UNSAFE, 0, NULL, 0);
+			if (status == ZNODEEXISTS) {
+				status = ZOK;
+			}
+		} else {
+			status = zootcl_barrier_wait (zh, Tcl_DStringValue (&readyPath), 1, deadline);
+		}
+	}
+	Tcl_DStringFree (&readyPath);
+
+	if (status != ZOK) {
+		zoo_delete (zh, *nodePathPtr, -1);
+		ckfree (*nodePathPtr);
+		*nodePathPtr = NULL;
+	}
+	return status;
+}
+
+/*
+ *--------------------------------------------------------------
+ *
+ * zootcl_barrier_leave -- remove our participant znode and wait for
+ *   everyone else to do the same
+ *
+ *--------------------------------------------------------------
+ */
+int
+zootcl_barrier_leave (zhandle_t *zh, const char *nodePath, Tcl_Time *deadline)
+{
+	const char *name = strrchr (nodePath, '/');
+	Tcl_DString dirPath;
+	int status;
+
+	if (name == NULL) {
+		return ZBADARGUMENTS;
+	}
+
+	Tcl_DStringInit (&dirPath);
+	Tcl_DStringAppend (&dirPath, nodePath, (name == nodePath) ? 1 : name - nodePath);
+	name++;
+
+	for (;;) {
+		struct String_vector children;
+		zootcl_sequenceEntry *entries;
+		Tcl_DString watchPath;
+		int count;
+		int mine = -1;
+		int i;
+
+		status = zoo_get_children (zh, Tcl_DStringValue (&dirPath), 0, &children);
+		if (status != ZOK) {
+			break;
+		}
+
+		count = zootcl_sequence_sort (&children, ZOOTCL_BARRIER_PREFIX, &entries);
+		for (i = 0; i < count; i++) {
+			if (strcmp (entries[i].name, name) == 0) {
+				mine = i;
+			}
+		}
+
+		if (count == 0 || (count == 1 && mine == 0)) {
+			// we're the last one out, tidy up for the next round
+			ckfree (entries);
+			deallocate_String_vector (&children);
+			if (mine == 0) {
+				zoo_delete (zh, nodePath, -1);
+				Tcl_DStringInit (&watchPath);
+				zootcl_join_path (&watchPath, Tcl_DStringValue (&dirPath), ZOOTCL_BARRIER_READY);
+				zoo_delete (zh, Tcl_DStringValue (&watchPath), -1);
+				Tcl_DStringFree (&watchPath);
+			}
+			status = ZOK;
+			break;
+		}
+
+		// the lowest waits for the highest to leave, everyone else
+		// leaves and waits for the lowest
+		Tcl_DStringInit (&watchPath);
+		if (mine == 0) {
+			zootcl_join_path (&watchPath, Tcl_DStringValue (&dirPath), entries[count - 1].name);
+		} else {
+			if (mine > 0) {
+				status = zoo_delete (zh, nodePath, -1);
+				if (status == ZNONODE) {
+					status = ZOK;
+				}
+			}
+			zootcl_join_path (&watchPath, Tcl_DStringValue (&dirPath), entries[0].name);
+		}
+		ckfree (entries);
+		deallocate_String_vector (&children);
+
+		if (status == ZOK) {
+			status = zootcl_barrier_wait (zh, Tcl_DStringValue (&watchPath), 0, deadline);
+		}
+		Tcl_DStringFree (&watchPath);
+
+		if (status != ZOK) {
+			break;
+		}
+	}
+
+	Tcl_DStringFree (&dirPath);
+	return status;
+}
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * zootcl_barrier_subcommand --
+ *
+ *      implement the "barrier" method of a zookeeper tcl command
+ *      object
+ *
+ *      barrier enter path count ?-timeout ms?
+ *      barrier leave node ?-timeout ms?
+ *
+ * Results:
+ *      A standard Tcl result.
+ *
+ *
+ *----------------------------------------------------------------------
+ */
+int
+zootcl_barrier_subcommand(Tcl_Interp *interp, int objc, Tcl_Obj *CONST objv[], ZOOAPI zhandle_t *zh, zootcl_objectClientData *zo)
+{
+	static CONST char *actions[] = {
+		"enter",
+		"leave",
+		NULL
+	};
+
+	enum actions {
+		ACTION_ENTER,
+		ACTION_LEAVE
+	};
+
+	static CONST char *subOptions[] = {
+		"-timeout",
+		NULL
+	};
+
+	enum subOptions {
+		SUBOPT_TIMEOUT
+	};
+
+	int actionIndex;
+	int suboptIndex = 0;
+	int timeout = -1;
+	int count = 0;
+	int firstOpt;
+	int status;
+	int i;
+
+    assert (zo->zookeeper_object_magic == ZOOKEEPER_OBJECT_MAGIC);
+
+	if (objc < 4) {
+		Tcl_WrongNumArgs (interp, 2, objv, "enter path count ?-timeout ms?|leave node ?-timeout ms?");
+		return TCL_ERROR;
+	}
+
+	if (Tcl_GetIndexFromObj (interp, objv[2], actions, "action", TCL_EXACT, &actionIndex) != TCL_OK) {
+		return TCL_ERROR;
+	}
+
+	if ((enum actions) actionIndex == ACTION_ENTER) {
+		if (objc < 5) {
+			Tcl_WrongNumArgs (interp, 3, objv, "path count ?-timeout ms?");
+			return TCL_ERROR;
+		}
+		if (Tcl_GetIntFromObj (interp, objv[4], &count) == TCL_ERROR) {
+			return TCL_ERROR;
+		}
+		firstOpt = 5;
+	} else {
+		firstOpt = 4;
+	}
+
+	for (i = firstOpt; i < objc; i++) {
+		if (Tcl_GetIndexFromObj (interp, objv[i], subOptions, "suboption",
+			TCL_EXACT, &suboptIndex) != TCL_OK) {
+			return TCL_ERROR;
+		}
+
+		switch ((enum subOptions) suboptIndex) {
+			case SUBOPT_TIMEOUT:
+			{
+				if (i + 1 >= objc) {
+					Tcl_WrongNumArgs (interp, 3, objv, "path ... -timeout ms");
+					return TCL_ERROR;
+				}
+				if (Tcl_GetIntFromObj (interp, objv[++i], &timeout) == TCL_ERROR) {
+					return TCL_ERROR;
+				}
+				break;
+			}
+		}
+	}
+
+	Tcl_Time deadline;
+	if (timeout >= 0) {
+		zootcl_deadline (&deadline, timeout);
+	}
+
+	if ((enum actions) actionIndex == ACTION_ENTER) {
+		char *nodePath = NULL;
+
+		status = zootcl_barrier_enter (zh, Tcl_GetString (objv[3]), count, (timeout >= 0) ? &deadline : NULL, &nodePath);
+		if (status == ZOK) {
+			Tcl_SetObjResult (interp, Tcl_NewStringObj (nodePath, -1));
+			ckfree (nodePath);
+		}
+	} else {
+		status = zootcl_barrier_leave (zh, Tcl_GetString (objv[3]), (timeout >= 0) ? &deadline : NULL);
+	}
+
+	return zootcl_set_tcl_return_code (interp, status);
+}
+
+/*
+ *--------------------------------------------------------------
+ *
+ * zootcl_update_loop -- read-modify-write a znode, retrying when
+ *   someone else changes it between our get and our set
+ *
+ *   the set is conditioned on the version we read.  on ZBADVERSION
+ *   (or ZNODEEXISTS, if we were creating it) we sleep a random time
+ *   up to the current backoff, double the backoff and try again, up
+ *   to maxRetries times.  if create is set, a missing znode is
+ *   created with what proc makes of no data.
+ *
+ * Results:
+ *      a standard Tcl result.  on TCL_OK *statPtr holds the stat
+ *      after our update and, if newDataPtr isn't NULL, *newDataPtr
+ *      the data we stored, with a refcount we own.
+ *
+ *--------------------------------------------------------------
+ */
+int
+zootcl_update_loop (Tcl_Interp *interp, zhandle_t *zh, const char *path, int maxRetries, int backoff, int create, zootcl_UpdateProc *proc, ClientData clientData, struct Stat *statPtr, Tcl_Obj **newDataPtr)
+{
+	char *buffer = NULL;
+	int bufferLen = 0;
+	int attempt;
+	int status = ZOK;
+	Tcl_Time now;
+
+	Tcl_GetTime (&now);
+	unsigned int seed = (unsigned int)now.usec ^ (unsigned int)(size_t)path;
+
+	for (attempt = 0; attempt <= maxRetries; attempt++) {
+		int dataLen;
+		Tcl_Obj *newDataObj;
+		int exists = 1;
+
+		if (attempt > 0) {
+			// jittered exponential backoff so contending writers
+			// spread out instead of colliding again in lockstep
+			Tcl_Sleep (backoff > 0 ? rand_r (&seed) % (backoff + 1) : 0);
+			backoff *= 2;
+			if (backoff > ZOOTCL_UPDATE_BACKOFF_MAX_MS) {
+				backoff = ZOOTCL_UPDATE_BACKOFF_MAX_MS;
+			}
+		}
+
+		if (buffer == NULL) {
+			// 1MB + 1 byte, same as get, since 1MB is the most a
+			// znode can hold
+			bufferLen = 1048576 + 1;
+			buffer = ckalloc (bufferLen);
+		}
+		dataLen = bufferLen;
+		status = zoo_get (zh, path, 0, buffer, &dataLen, statPtr);
+
+		if (status == ZNONODE && create) {
+			exists = 0;
+		} else if (status != ZOK) {
+			break;
+		}
+
+		// a znode with no data gets the empty string
+		if (exists && dataLen < 0) {
+			dataLen = 0;
+		}
+
+		if ((*proc) (interp, clientData, exists ? buffer : NULL, exists ? dataLen : -1, &newDataObj) != TCL_OK) {
+			if (buffer != NULL) {
+				ckfree (buffer);
+			}
+			return TCL_ERROR;
+		}
+
+		Tcl_IncrRefCount (newDataObj);
+		int newDataLen;
+		char *newData = Tcl_GetStringFromObj (newDataObj, &newDataLen);
+
+		if (exists) {
+			status = zoo_set2 (zh, path, newData, newDataLen, statPtr->version, statPtr);
+		} else {
+			status = zoo_create (zh, path, newData, newDataLen, &ZOO_OPEN_ACL_UNSAFE, 0, NULL, 0);
+			if (status == ZOK) {
+				status = zoo_exists (zh, path, 0, statPtr);
+			}
+		}
+
+		if (status == ZOK && newDataPtr != NULL) {
+			*newDataPtr = newDataObj;
+		} else {
+			Tcl_DecrRefCount (newDataObj);
+		}
+
+		if (status != ZBADVERSION && status != ZNODEEXISTS) {
+			break;
+		}
+	}
+
+	if (buffer != NULL) {
+		ckfree (buffer);
+	}
+	return zootcl_set_tcl_return_code (interp, status);
+}
+
+/*
+ *--------------------------------------------------------------
+ *
+ * zootcl_update_apply -- update proc that runs a lambda on the
+ *   znode's data
+ *
+ *--------------------------------------------------------------
+ */
+static int
+zootcl_update_apply (Tcl_Interp *interp, ClientData clientData, const char *data, int dataLen, Tcl_Obj **newDataPtr)
+{
+	Tcl_Obj *evalObjv[3];
+	int tclReturnCode;
+	int i;
+
+	evalObjv[0] = Tcl_NewStringObj ("::apply", -1);
+	evalObjv[1] = (Tcl_Obj *)clientData;
+	evalObjv[2] = Tcl_NewStringObj (data, dataLen);
+
+	for (i = 0; i < 3; i++) {
+		Tcl_IncrRefCount (evalObjv[i]);
+	}
+
+	tclReturnCode = Tcl_EvalObjv (interp, 3, evalObjv, TCL_EVAL_GLOBAL);
+
+	for (i = 0; i < 3; i++) {
+		Tcl_DecrRefCount (evalObjv[i]);
+	}
+
+	if (tclReturnCode != TCL_OK) {
+		return TCL_ERROR;
+	}
+
+	*newDataPtr = Tcl_GetObjResult (interp);
+	return TCL_OK;
+}
+
+/*
+ *--------------------------------------------------------------
+ *
+ * zootcl_update_incr -- update proc that adds to a counter
+ *
+ *   a missing or empty znode counts as zero
+ *
+ *--------------------------------------------------------------
+ */
+static int
+zootcl_update_incr (Tcl_Interp *interp, ClientData clientData, const char *data, int dataLen, Tcl_Obj **newDataPtr)
+{
+	Tcl_WideInt delta = *(Tcl_WideInt *)clientData;
+	Tcl_WideInt value = 0;
+
+	if (data != NULL && dataLen > 0) {
+		Tcl_Obj *valueObj = Tcl_NewStringObj (data, dataLen);
+		Tcl_IncrRefCount (valueObj);
+		int tclReturnCode = Tcl_GetWideIntFromObj (interp, valueObj, &value);
+		Tcl_DecrRefCount (valueObj);
+		if (tclReturnCode != TCL_OK) {
+			return TCL_ERROR;
+		}
+	}
+
+	*newDataPtr = Tcl_NewWideIntObj (value + delta);
+	return TCL_OK;
+}
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * zootcl_update_subcommand --
+ *
+ *      implement the "update" method of a zookeeper tcl command
+ *      object
+ *
+ *      update path ?-maxretries n? ?-backoff ms? lambda
+ *
+ * Results:
+ *      A standard Tcl result.
+ *
+ *
+ *----------------------------------------------------------------------
+ */
+int
+zootcl_update_subcommand(Tcl_Interp *interp, int objc, Tcl_Obj *CONST objv[], ZOOAPI zhandle_t *zh, zootcl_objectClientData *zo)
+{
+	static CONST char *subOptions[] = {
+		"-maxretries",
+		"-backoff",
+		NULL
+	};
+
+	enum subOptions {
+		SUBOPT_MAXRETRIES,
+		SUBOPT_BACKOFF
+	};
+
+	int maxRetries = ZOOTCL_UPDATE_MAX_RETRIES;
+	int backoff = ZOOTCL_UPDATE_BACKOFF_MS;
+	int suboptIndex = 0;
+	struct Stat stat;
+	int i;
+
+    assert (zo->zookeeper_object_magic == ZOOKEEPER_OBJECT_MAGIC);
+
+	if (objc < 4 || (objc % 2) != 0) {
+		Tcl_WrongNumArgs (interp, 2, objv, "path ?-maxretries n? ?-backoff ms? lambda");
+		return TCL_ERROR;
+	}
+
+	for (i = 3; i < objc - 1; i++) {
+		if (Tcl_GetIndexFromObj (interp, objv[i], subOptions, "suboption",
+			TCL_EXACT, &suboptIndex) != TCL_OK) {
+			return TCL_ERROR;
+		}
+
+		switch ((enum subOptions) suboptIndex) {
+			case SUBOPT_MAXRETRIES:
+			{
+				if (Tcl_GetIntFromObj (interp, objv[++i], &maxRetries) == TCL_ERROR) {
+					return TCL_ERROR;
+				}
+				if (maxRetries < 0) {
+					Tcl_SetObjResult (interp, Tcl_NewStringObj ("-maxretries can't be negative", -1));
+					return TCL_ERROR;
+				}
+				break;
+			}
+
+			case SUBOPT_BACKOFF:
+			{
+				if (Tcl_GetIntFromObj (interp, objv[++i], &backoff) == TCL_ERROR) {
+					return TCL_ERROR;
+				}
+				if (backoff < 0) {
+					Tcl_SetObjResult (interp, Tcl_NewStringObj ("-backoff can't be negative", -1));
+					return TCL_ERROR;
+				}
+				// the loop caps it after the first retry anyway
+				if (backoff > ZOOTCL_UPDATE_BACKOFF_MAX_MS) {
+					backoff = ZOOTCL_UPDATE_BACKOFF_MAX_MS;
+				}
+				break;
+			}
+		}
+	}
+
+	Tcl_Obj *lambdaObj = objv[objc - 1];
+	Tcl_IncrRefCount (lambdaObj);
+	int tclReturnCode = zootcl_update_loop (interp, zh, Tcl_GetString (objv[2]), maxRetries, backoff, 0, zootcl_update_apply, (ClientData)lambdaObj, &stat, NULL);
+	Tcl_DecrRefCount (lambdaObj);
+
+	if (tclReturnCode == TCL_OK) {
+		Tcl_SetObjResult (interp, zootcl_new_stat_obj (&stat));
+	}
+	return tclReturnCode;
+}
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * zootcl_counter_subcommand --
+ *
+ *      implement the "counter" method of a zookeeper tcl command
+ *      object
+ *
+ *      counter incr path ?delta?
+ *
+ * Results:
+ *      A standard Tcl result.
+ *
+ *
+ *----------------------------------------------------------------------
+ */
+int
+zootcl_counter_subcommand(Tcl_Interp *interp, int objc, Tcl_Obj *CONST objv[], ZOOAPI zhandle_t *zh, zootcl_objectClientData *zo)
+{
+	static CONST char *actions[] = {
+		"incr",
+		NULL
+	};
+
+	int actionIndex;
+	Tcl_WideInt delta = 1;
+	Tcl_Obj *newDataObj;
+	struct Stat stat;
+
+    assert (zo->zookeeper_object_magic == ZOOKEEPER_OBJECT_MAGIC);
+
+	if (objc < 4 || objc > 5) {
+		Tcl_WrongNumArgs (interp, 2, objv, "incr path ?delta?");
+		return TCL_ERROR;
+	}
+
+	if (Tcl_GetIndexFromObj (interp, objv[2], actions, "action", TCL_EXACT, &actionIndex) != TCL_OK) {
+		return TCL_ERROR;
+	}
+
+	if (objc == 5 && Tcl_GetWideIntFromObj (interp, objv[4], &delta) == TCL_ERROR) {
+		return TCL_ERROR;
+	}
+
+	if (zootcl_update_loop (interp, zh, Tcl_GetString (objv[3]), ZOOTCL_UPDATE_MAX_RETRIES, ZOOTCL_UPDATE_BACKOFF_MS, 1, zootcl_update_incr, (ClientData)&delta, &stat, &newDataObj) != TCL_OK) {
+		return TCL_ERROR;
+	}
+
+	Tcl_SetObjResult (interp, newDataObj);
+	Tcl_DecrRefCount (newDataObj);
+	return TCL_OK;
+}
+
+/*
+ * Registry recipe
+ *
+ * Keeps a copy of a directory's children and their data, for service
+ * discovery and the like.  A single children watch tells us when the
+ * membership changes and only the children we haven't seen are read,
+ * in one pipelined batch, so the cost of a change is proportional to
+ * the change rather than to the size of the directory.  Each child
+ * also has a data watch so changes to it are picked up without
+ * rereading the others.  The callback is told the deltas.
+ *
+ * Watches queue RECIPE_CALLBACK events and all the bookkeeping happens
+ * in the interpreter's thread.  A registry closed while zookeeper still
+ * holds some of its watches stays in the table, empty, until they are
+ * all accounted for.
+ */
+void zootcl_registry_event (ClientData clientData, int type, int state);
+void zootcl_registry_refresh (zootcl_registry *reg);
+
+static void
+zootcl_registry_free_entry (zootcl_registryEntry *entry)
+{
+	if (entry->data != NULL) {
+		ckfree (entry->data);
+	}
+	ckfree (entry);
+}
+
+static void
+zootcl_registry_clear (zootcl_registry *reg)
+{
+	Tcl_HashSearch search;
+	Tcl_HashEntry *hashEntry;
+
+	for (hashEntry = Tcl_FirstHashEntry (&reg->children, &search); hashEntry != NULL; hashEntry = Tcl_NextHashEntry (&search)) {
+		zootcl_registry_free_entry ((zootcl_registryEntry *)Tcl_GetHashValue (hashEntry));
+	}
+	Tcl_DeleteHashTable (&reg->children);
+	Tcl_InitHashTable (&reg->children, TCL_STRING_KEYS);
+}
+
+void
+zootcl_registry_free (zootcl_registry *reg)
+{
+	zootcl_registry_clear (reg);
+	Tcl_DeleteHashTable (&reg->children);
+	if (reg->timer != NULL) {
+		Tcl_DeleteTimerHandler (reg->timer);
+	}
+	if (reg->callbackObj != NULL) {
+		Tcl_DecrRefCount (reg->callbackObj);
+	}
+	ckfree (reg->path);
+	ckfree (reg);
+}
+
+/*
+ *--------------------------------------------------------------
+ *
+ * zootcl_registry_forget -- remove a registry from its object's
+ *   table and free it
+ *
+ *--------------------------------------------------------------
+ */
+void
+zootcl_registry_forget (zootcl_registry *reg)
+{
+	Tcl_HashEntry *hashEntry = Tcl_FindHashEntry (&reg->zo->registries, reg->path);
+
+	if (hashEntry != NULL) {
+		Tcl_DeleteHashEntry (hashEntry);
+	}
+	zootcl_registry_free (reg);
+}
+
+/*
+ *--------------------------------------------------------------
+ *
+ * zootcl_registry_watcher -- children watch on the directory or data
+ *   watch on a child
+ *
+ * runs in the zookeeper completion thread.  short of expiration,
+ * session events leave the watch in place so they're of no interest.
+ *
+ *--------------------------------------------------------------
+ */
+void
+zootcl_registry_watcher (zhandle_t *zh, int type, int state, const char *path, void *context)
+{
+	zootcl_registryWatch *rw = (zootcl_registryWatch *)context;
+
+	if (type == ZOO_SESSION_EVENT && state != ZOO_EXPIRED_SESSION_STATE) {
+		return;
+	}
+	zootcl_queue_recipe_event (rw->reg->zo, zootcl_registry_event, (ClientData)rw, type, state);
+}
+
+static zootcl_registryWatch *
+zootcl_registry_new_watch (zootcl_registry *reg, const char *name)
+{
+	zootcl_registryWatch *rw = (zootcl_registryWatch *)ckalloc (sizeof (zootcl_registryWatch));
+
+	rw->reg = reg;
+	rw->name = NULL;
+	if (name != NULL) {
+		rw->name = ckalloc (strlen (name) + 1);
+		strcpy (rw->name, name);
+	}
+	reg->watchPending++;
+	return rw;
+}
+
+static void
+zootcl_registry_free_watch (zootcl_registryWatch *rw)
+{
+	rw->reg->watchPending--;
+	if (rw->name != NULL) {
+		ckfree (rw->name);
+	}
+	ckfree (rw);
+}
+
+/*
+ *--------------------------------------------------------------
+ *
+ * zootcl_registry_notify -- invoke the registry's callback
+ *
+ *--------------------------------------------------------------
+ */
+static void
+zootcl_registry_notify (zootcl_registry *reg, int status, Tcl_Obj *addedObj, Tcl_Obj *removedObj, Tcl_Obj *changedObj)
+{
+	Tcl_Obj *listObjv[12];
+	int element = zootcl_callback_prefix (reg->zo, listObjv);
+
+	listObjv[element++] = Tcl_NewStringObj ("status", -1);
+	listObjv[element++] = Tcl_NewStringObj (zootcl_error_to_code_string (status), -1);
+
+	listObjv[element++] = Tcl_NewStringObj ("path", -1);
+	listObjv[element++] = Tcl_NewStringObj (reg->path, -1);
+
+	if (status == ZOK) {
+		listObjv[element++] = Tcl_NewStringObj ("added", -1);
+		listObjv[element++] = addedObj;
+
+		listObjv[element++] = Tcl_NewStringObj ("removed", -1);
+		listObjv[element++] = removedObj;
+
+		listObjv[element++] = Tcl_NewStringObj ("changed", -1);
+		listObjv[element++] = changedObj;
+	}
+
+	zootcl_invoke_callback (reg->zo, reg->callbackObj, Tcl_NewListObj (element, listObjv));
+}
+
+static Tcl_Obj *
+zootcl_registry_data_obj (zootcl_registryEntry *entry)
+{
+	if (entry->data == NULL) {
+		return Tcl_NewObj ();
+	}
+	return Tcl_NewStringObj (entry->data, entry->dataLen);
+}
+
+/*
+ *--------------------------------------------------------------
+ *
+ * zootcl_registry_retry -- try a refresh again in a bit
+ *
+ *--------------------------------------------------------------
+ */
+static void
+zootcl_registry_timer (ClientData clientData)
+{
+	zootcl_registry *reg = (zootcl_registry *)clientData;
+
+	reg->timer = NULL;
+	zootcl_session_ready (reg->zo);
+	zootcl_registry_refresh (reg);
+}
+
+static void
+zootcl_registry_retry (zootcl_registry *reg)
+{
+	if (reg->timer == NULL) {
+		reg->timer = Tcl_CreateTimerHandler (ZOOTCL_RECIPE_RETRY_MS, zootcl_registry_timer, (ClientData)reg);
+	}
+}
+
+/*
+ *--------------------------------------------------------------
+ *
+ * zootcl_registry_refresh -- list the directory, read the children
+ *   we don't know about yet and forget the ones that are gone
+ *
+ *--------------------------------------------------------------
+ */
+void
+zootcl_registry_refresh (zootcl_registry *reg)
+{
+	zhandle_t *zh = reg->zo->zh;
+	struct String_vector children;
+	Tcl_HashSearch search;
+	Tcl_HashEntry *hashEntry;
+	Tcl_HashTable seen;
+	int status;
+	int i;
+
+	if (reg->closed || reg->expired) {
+		return;
+	}
+
+	if (!reg->childWatch) {
+		zootcl_registryWatch *rw = zootcl_registry_new_watch (reg, NULL);
+		status = zoo_wget_children (zh, reg->path, zootcl_registry_watcher, (void *)rw, &children);
+		if (status == ZOK) {
+			reg->childWatch = 1;
+		} else {
+			zootcl_registry_free_watch (rw);
+		}
+	} else {
+		status = zoo_get_children (zh, reg->path, 0, &children);
+	}
+
+	if (status == ZNONODE) {
+		// no directory, no children.  watch for it to show up.
+		zootcl_registryWatch *rw = zootcl_registry_new_watch (reg, NULL);
+		status = zoo_wexists (zh, reg->path, zootcl_registry_watcher, (void *)rw, NULL);
+		if (status == ZNONODE) {
+			reg->childWatch = 1;
+			children.count = 0;
+			children.data = NULL;
+			status = ZOK;
+		} else {
+			// it showed up in the meantime or something went wrong,
+			// look again in a bit.  an exists watch on a znode that
+			// is there stays pending, so it's still accounted for.
+			if (status != ZOK) {
+				zootcl_registry_free_watch (rw);
+			}
+			zootcl_registry_retry (reg);
+			return;
+		}
+	}
+
+	if (status != ZOK) {
+		if (status == ZCONNECTIONLOSS || status == ZOPERATIONTIMEOUT) {
+			zootcl_registry_retry (reg);
+		} else {
+			zootcl_registry_notify (reg, status, NULL, NULL, NULL);
+		}
+		return;
+	}
+
+	// work out what was added and what was removed
+	Tcl_InitHashTable (&seen, TCL_STRING_KEYS);
+	char **addedPaths = (char **)ckalloc (sizeof (char *) * (children.count + 1));
+	char **addedNames = (char **)ckalloc (sizeof (char *) * (children.count + 1));
+	int addedCount = 0;
+
+	for (i = 0; i < children.count; i++) {
+		int isNew;
+
+		Tcl_CreateHashEntry (&seen, children.data[i], &isNew);
+		if (Tcl_FindHashEntry (&reg->children, children.data[i]) == NULL) {
+			Tcl_DString ds;
+
+			Tcl_DStringInit (&ds);
+			zootcl_join_path (&ds, reg->path, children.data[i]);
+			addedPaths[addedCount] = ckalloc (Tcl_DStringLength (&ds) + 1);
+			strcpy (addedPaths[addedCount], Tcl_DStringValue (&ds));
+			Tcl_DStringFree (&ds);
+			addedNames[addedCount++] = children.data[i];
+		}
+	}
+
+	Tcl_Obj *removedObj = Tcl_NewObj ();
+	for (hashEntry = Tcl_FirstHashEntry (&reg->children, &search); hashEntry != NULL; hashEntry = Tcl_NextHashEntry (&search)) {
+		char *name = Tcl_GetHashKey (&reg->children, hashEntry);
+		if (Tcl_FindHashEntry (&seen, name) == NULL) {
+			Tcl_ListObjAppendElement (NULL, removedObj, Tcl_NewStringObj (name, -1));
+			zootcl_registry_free_entry ((zootcl_registryEntry *)Tcl_GetHashValue (hashEntry));
+			Tcl_DeleteHashEntry (hashEntry);
+		}
+	}
+	Tcl_DeleteHashTable (&seen);
+
+	// read only the new ones, all at once, leaving a data watch on each
+	Tcl_Obj *addedObj = Tcl_NewObj ();
+	if (addedCount > 0) {
+		zootcl_getResult *results = (zootcl_getResult *)ckalloc (sizeof (zootcl_getResult) * addedCount);
+		void **watchCtxs = (void **)ckalloc (sizeof (void *) * addedCount);
+
+		for (i = 0; i < addedCount; i++) {
+			watchCtxs[i] = (void *)zootcl_registry_new_watch (reg, addedNames[i]);
+		}
+
+		zootcl_pipelined_wget (zh, addedCount, addedPaths, zootcl_registry_watcher, watchCtxs, results);
+
+		for (i = 0; i < addedCount; i++) {
+			if (results[i].rc != ZOK) {
+				// gone already, or we'll find out on the next look
+				zootcl_registry_free_watch ((zootcl_registryWatch *)watchCtxs[i]);
+				if (results[i].rc != ZNONODE) {
+					zootcl_registry_retry (reg);
+				}
+				continue;
+			}
+
+			int isNew;
+			zootcl_registryEntry *entry = (zootcl_registryEntry *)ckalloc (sizeof (zootcl_registryEntry));
+			entry->data = results[i].data;
+			entry->dataLen = results[i].dataLen;
+			entry->stat = results[i].stat;
+			results[i].data = NULL;
+			Tcl_SetHashValue (Tcl_CreateHashEntry (&reg->children, addedNames[i], &isNew), (ClientData)entry);
+
+			Tcl_ListObjAppendElement (NULL, addedObj, Tcl_NewStringObj (addedNames[i], -1));
+			Tcl_ListObjAppendElement (NULL, addedObj, zootcl_registry_data_obj (entry));
+		}
+
+		zootcl_pipelined_get_free (addedCount, results);
+		for (i = 0; i < addedCount; i++) {
+			ckfree (addedPaths[i]);
+		}
+		ckfree (results);
+		ckfree (watchCtxs);
+	}
+	ckfree (addedPaths);
+	ckfree (addedNames);
+	deallocate_String_vector (&children);
+
+	int addedLen, removedLen;
+	Tcl_ListObjLength (NULL, addedObj, &addedLen);
+	Tcl_ListObjLength (NULL, removedObj, &removedLen);
+	if (addedLen == 0 && removedLen == 0) {
+		Tcl_DecrRefCount (addedObj);
+		Tcl_DecrRefCount (removedObj);
+		return;
+	}
+
+	zootcl_registry_notify (reg, ZOK, addedObj, removedObj, Tcl_NewObj ());
+}
+
+/*
+ *--------------------------------------------------------------
+ *
+ * zootcl_registry_child_changed -- reread a child whose data watch
+ *   fired and report the change
+ *
+ *--------------------------------------------------------------
+ */
+static void
+zootcl_registry_child_changed (zootcl_registry *reg, const char *name)
+{
+	Tcl_HashEntry *hashEntry = Tcl_FindHashEntry (&reg->children, name);
+	zootcl_getResult result;
+	Tcl_DString ds;
+	char *path;
+
+	if (hashEntry == NULL) {
+		// it was removed since
+		return;
+	}
+
+	Tcl_DStringInit (&ds);
+	path = zootcl_join_path (&ds, reg->path, name);
+
+	zootcl_registryWatch *rw = zootcl_registry_new_watch (reg, name);
+	void *watchCtx = (void *)rw;
+	zootcl_pipelined_wget (reg->zo->zh, 1, &path, zootcl_registry_watcher, &watchCtx, &result);
+	Tcl_DStringFree (&ds);
+
+	if (result.rc != ZOK) {
+		zootcl_registry_free_watch (rw);
+		if (result.rc == ZNONODE) {
+			// the children watch will tell us it's gone
+			return;
+		}
+		zootcl_registry_retry (reg);
+		return;
+	}
+
+	zootcl_registryEntry *entry = (zootcl_registryEntry *)Tcl_GetHashValue (hashEntry);
+	if (entry->stat.mzxid == result.stat.mzxid) {
+		zootcl_pipelined_get_free (1, &result);
+		return;
+	}
+
+	if (entry->data != NULL) {
+		ckfree (entry->data);
+	}
+	entry->data = result.data;
+	entry->dataLen = result.dataLen;
+	entry->stat = result.stat;
+
+	Tcl_Obj *changedObj = Tcl_NewObj ();
+	Tcl_ListObjAppendElement (NULL, changedObj, Tcl_NewStringObj (name, -1));
+	Tcl_ListObjAppendElement (NULL, changedObj, zootcl_registry_data_obj (entry));
+	zootcl_registry_notify (reg, ZOK, Tcl_NewObj (), Tcl_NewObj (), changedObj);
+}
+
+/*
+ *--------------------------------------------------------------
+ *
+ * zootcl_registry_event -- handle a registry watch in the
+ *   interpreter's thread
+ *
+ *--------------------------------------------------------------
+ */
+void
+zootcl_registry_event (ClientData clientData, int type, int state)
+{
+	zootcl_registryWatch *rw = (zootcl_registryWatch *)clientData;
+	zootcl_registry *reg = rw->reg;
+	char *name = rw->name;
+	int notifyExpired = 0;
+
+	rw->name = NULL;
+	if (name == NULL) {
+		reg->childWatch = 0;
+	}
+	zootcl_registry_free_watch (rw);
+
+	if (type == ZOO_SESSION_EVENT) {
+		// every watch we have hears about it, only say so once
+		notifyExpired = !reg->expired && !reg->closed;
+		reg->expired = 1;
+	}
+
+	if (reg->closed) {
+		if (reg->watchPending == 0) {
+			zootcl_registry_forget (reg);
+		}
+	} else if (notifyExpired) {
+		zootcl_registry_notify (reg, ZSESSIONEXPIRED, NULL, NULL, NULL);
+	} else if (!reg->expired) {
+		if (name == NULL) {
+			zootcl_registry_refresh (reg);
+		} else if (type == ZOO_CHANGED_EVENT) {
+			zootcl_registry_child_changed (reg, name);
+		}
+	}
+
+	if (name != NULL) {
+		ckfree (name);
+	}
+}
+
+/*
+ *--------------------------------------------------------------
+ *
+ * zootcl_registry_cleanup -- free the registries of an object that
+ *   is being deleted
+ *
+ *--------------------------------------------------------------
+ */
+void
+zootcl_registry_cleanup (zootcl_objectClientData *zo)
+{
+	Tcl_HashSearch search;
+	Tcl_HashEntry *hashEntry;
+
+	for (hashEntry = Tcl_FirstHashEntry (&zo->registries, &search); hashEntry != NULL; hashEntry = Tcl_NextHashEntry (&search)) {
+		zootcl_registry_free ((zootcl_registry *)Tcl_GetHashValue (hashEntry));
+	}
+	Tcl_DeleteHashTable (&zo->registries);
+}
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * zootcl_registry_subcommand --
+ *
+ *      implement the "registry" method of a zookeeper tcl command
+ *      object
+ *
+ *      registry open path callback
+ *      registry get path
+ *      registry close path
+ *
+ * Results:
+ *      A standard Tcl result.
+ *
+ *
+ *----------------------------------------------------------------------
+ */
+int
+zootcl_registry_subcommand(Tcl_Interp *interp, int objc, Tcl_Obj *CONST objv[], ZOOAPI zhandle_t *zh, zootcl_objectClientData *zo)
+{
+	static CONST char *actions[] = {
+		"open",
+		"get",
+		"close",
+		NULL
+	};
+
+	enum actions {
+		ACTION_OPEN,
+		ACTION_GET,
+		ACTION_CLOSE
+	};
+
+	int actionIndex;
+
+    assert (zo->zookeeper_object_magic == ZOOKEEPER_OBJECT_MAGIC);
+
+	if (objc < 4) {
+		Tcl_WrongNumArgs (interp, 2, objv, "open|get|close path ?callback?");
+		return TCL_ERROR;
+	}
+
+	if (Tcl_GetIndexFromObj (interp, objv[2], actions, "action", TCL_EXACT, &actionIndex) != TCL_OK) {
+		return TCL_ERROR;
+	}
+
+	char *path = Tcl_GetString (objv[3]);
+	Tcl_HashEntry *hashEntry = Tcl_FindHashEntry (&zo->registries, path);
+	zootcl_registry *reg = (hashEntry == NULL) ? NULL : (zootcl_registry *)Tcl_GetHashValue (hashEntry);
+
+	if (reg != NULL && reg->closed && (enum actions) actionIndex != ACTION_OPEN) {
+		reg = NULL;
+	}
+
+	switch ((enum actions) actionIndex) {
+		case ACTION_OPEN:
+		{
+			if (objc != 5) {
+				Tcl_WrongNumArgs (interp, 3, objv, "path callback");
+				return TCL_ERROR;
+			}
+
+			if (reg != NULL && !reg->closed) {
+				Tcl_SetObjResult (interp, Tcl_ObjPrintf ("registry already open on \"%s\"", path));
+				return TCL_ERROR;
+			}
+
+			if (reg == NULL) {
+				int isNew;
+
+				reg = (zootcl_registry *)ckalloc (sizeof (zootcl_registry));
+				memset (reg, 0, sizeof (zootcl_registry));
+				reg->zo = zo;
+				reg->path = ckalloc (strlen (path) + 1);
+				strcpy (reg->path, path);
+				Tcl_InitHashTable (&reg->children, TCL_STRING_KEYS);
+				Tcl_SetHashValue (Tcl_CreateHashEntry (&zo->registries, path, &isNew), (ClientData)reg);
+			} else {
+				// reopened before the watches of the last time were
+				// all accounted for, carry on with them
+				Tcl_DecrRefCount (reg->callbackObj);
+				reg->closed = 0;
+			}
+
+			reg->callbackObj = objv[4];
+			Tcl_IncrRefCount (reg->callbackObj);
+
+			// the first look happens from the event loop so the initial
+			// added callback comes the same way as all the others
+			if (reg->timer != NULL) {
+				Tcl_DeleteTimerHandler (reg->timer);
+			}
+			reg->timer = Tcl_CreateTimerHandler (0, zootcl_registry_timer, (ClientData)reg);
+			return TCL_OK;
+		}
+
+		case ACTION_GET:
+		{
+			Tcl_HashSearch search;
+			Tcl_Obj *listObj;
+
+			if (objc != 4) {
+				Tcl_WrongNumArgs (interp, 3, objv, "path");
+				return TCL_ERROR;
+			}
+			if (reg == NULL) {
+				Tcl_SetObjResult (interp, Tcl_ObjPrintf ("no registry open on \"%s\"", path));
+				return TCL_ERROR;
+			}
+
+			listObj = Tcl_NewObj ();
+			for (hashEntry = Tcl_FirstHashEntry (&reg->children, &search); hashEntry != NULL; hashEntry = Tcl_NextHashEntry (&search)) {
+				Tcl_ListObjAppendElement (NULL, listObj, Tcl_NewStringObj (Tcl_GetHashKey (&reg->children, hashEntry), -1));
+				Tcl_ListObjAppendElement (NULL, listObj, zootcl_registry_data_obj ((zootcl_registryEntry *)Tcl_GetHashValue (hashEntry)));
+			}
+			Tcl_SetObjResult (interp, listObj);
+			return TCL_OK;
+		}
+
+		case ACTION_CLOSE:
+		{
+			if (objc != 4) {
+				Tcl_WrongNumArgs (interp, 3, objv, "path");
+				return TCL_ERROR;
+			}
+			if (reg == NULL) {
+				Tcl_SetObjResult (interp, Tcl_ObjPrintf ("no registry open on \"%s\"", path));
+				return TCL_ERROR;
+			}
+
+			if (reg->timer != NULL) {
+				Tcl_DeleteTimerHandler (reg->timer);
+				reg->timer = NULL;
+			}
+
+			if (reg->watchPending == 0) {
+				zootcl_registry_forget (reg);
+			} else {
+				// zookeeper still has watches pointing at it
+				reg->closed = 1;
+				zootcl_registry_clear (reg);
+			}
+			return TCL_OK;
+		}
+	}
+
+	return TCL_OK;
+}
+
+/*
+ * Snapshots
+ *
+ * A snapshot is a subtree written to a file one record per znode,
+ * parents before children: the path below the top of the subtree, the
+ * data and the stat, length-prefixed and big-endian.  The first eight
+ * bytes are "ZKSNAP", the format version and a flags byte saying
+ * whether the rest is deflated.  The last record is an end marker with
+ * the count of the ones before it, so a truncated file is caught.
+ *
+ * Saving walks the tree breadth first, a window of znodes at a time,
+ * pipelining the gets of the window and then the children listings of
+ * those that have children.  Loading sends multis of up to -batch
+ * creates and keeps -window of them in flight.  zookeeper handles a
+ * session's requests in order, so a parent created by one multi is
+ * there for the multis after it.
+ */
+#define ZOOTCL_SNAPSHOT_MAGIC "ZKSNAP"
+#define ZOOTCL_SNAPSHOT_VERSION 1
+#define ZOOTCL_SNAPSHOT_DEFLATED 1
+#define ZOOTCL_SNAPSHOT_END 0xffffffffU
+#define ZOOTCL_SNAPSHOT_STAT_SIZE 68
+
+#define ZOOTCL_SNAPSHOT_DEFAULT_WINDOW 256
+#define ZOOTCL_SNAPSHOT_DEFAULT_BATCH 200
+#define ZOOTCL_SNAPSHOT_DEFAULT_MULTIS 8
+
+// bounds on what a record can claim, so a corrupt file can't have us
+// allocate gigabytes
+#define ZOOTCL_SNAPSHOT_MAX_PATH 65536
+#define ZOOTCL_SNAPSHOT_MAX_DATA (64 * 1024 * 1024)
+
+// keep a multi well under zookeeper's default 1MB jute.maxbuffer
+#define ZOOTCL_SNAPSHOT_MULTI_BYTES (512 * 1024)
+
+static void
+zootcl_snapshot_put (Tcl_DString *dsPtr, Tcl_WideUInt value, int bytes)
+{
+	unsigned char buf[8];
+	int i;
+
+	for (i = bytes - 1; i >= 0; i--) {
+		buf[i] = (unsigned char)(value & 0xff);
+		value >>= 8;
+	}
+	Tcl_DStringAppend (dsPtr, (char *)buf, bytes);
+}
+
+static Tcl_WideUInt
+zootcl_snapshot_get (const unsigned char *buf, int bytes)
+{
+	Tcl_WideUInt value = 0;
+	int i;
+
+	for (i = 0; i < bytes; i++) {
+		value = (value << 8) | buf[i];
+	}
+	return value;
+}
+
+static void
+zootcl_snapshot_put_stat (Tcl_DString *dsPtr, const struct Stat *stat)
+{
+	zootcl_snapshot_put (dsPtr, stat->czxid, 8);
+	zootcl_snapshot_put (dsPtr, stat->mzxid, 8);
+	zootcl_snapshot_put (dsPtr, stat->ctime, 8);
+	zootcl_snapshot_put (dsPtr, stat->mtime, 8);
+	zootcl_snapshot_put (dsPtr, (unsigned int)stat->version, 4);
+	zootcl_snapshot_put (dsPtr, (unsigned int)stat->cversion, 4);
+	zootcl_snapshot_put (dsPtr, (unsigned int)stat->aversion, 4);
+	zootcl_snapshot_put (dsPtr, stat->ephemeralOwner, 8);
+	zootcl_snapshot_put (dsPtr, (unsigned int)stat->dataLength, 4);
+	zootcl_snapshot_put (dsPtr, (unsigned int)stat->numChildren, 4);
+	zootcl_snapshot_put (dsPtr, stat->pzxid, 8);
+}
+
+// read exactly length bytes, false at end of file or on error
+static int
+zootcl_snapshot_read (Tcl_Channel channel, char *buf, int length)
+{
+	return length == 0 || Tcl_Read (channel, buf, length) == length;
+}
+
+static int
+zootcl_snapshot_name_compare (const void *a, const void *b)
+{
+	return strcmp (*(char * const *)a, *(char * const *)b);
+}
+
+// stack zlib's deflate or inflate transform on a registered channel
+static int
+zootcl_snapshot_push (Tcl_Interp *interp, Tcl_Channel channel, const char *mode)
+{
+	Tcl_Obj *evalObjv[4];
+	int tclReturnCode;
+	int i;
+
+	evalObjv[0] = Tcl_NewStringObj ("::zlib", -1);
+	evalObjv[1] = Tcl_NewStringObj ("push", -1);
+	evalObjv[2] = Tcl_NewStringObj (mode, -1);
+	evalObjv[3] = Tcl_NewStringObj (Tcl_GetChannelName (channel), -1);
+
+	for (i = 0; i < 4; i++) {
+		Tcl_IncrRefCount (evalObjv[i]);
+	}
+
+	tclReturnCode = Tcl_EvalObjv (interp, 4, evalObjv, TCL_EVAL_GLOBAL);
+
+	for (i = 0; i < 4; i++) {
+		Tcl_DecrRefCount (evalObjv[i]);
+	}
+	return tclReturnCode;
+}
+
+// close a channel we registered without losing the error in interp
+static void
+zootcl_snapshot_close (Tcl_Interp *interp, Tcl_Channel channel)
+{
+	Tcl_InterpState state = Tcl_SaveInterpState (interp, TCL_ERROR);
+
+	Tcl_UnregisterChannel (interp, channel);
+	Tcl_RestoreInterpState (interp, state);
+}
+
+static int
+zootcl_snapshot_error (Tcl_Interp *interp, const char *path, int status)
+{
+	Tcl_SetObjResult (interp, Tcl_ObjPrintf ("%s: %s", path, zerror (status)));
+	Tcl_SetErrorCode (interp, "ZOOKEEPER", zootcl_error_to_code_string (status), zerror (status), (char *) NULL);
+	return TCL_ERROR;
+}
+
+/*
+ *--------------------------------------------------------------
+ *
+ * zootcl_snapshot_save -- write the subtree at root to a snapshot
+ *   file, reading window znodes per round trip
+ *
+ *   ephemeral znodes are left out, they belong to their sessions
+ *
+ * Results:
+ *      A standard Tcl result, the number of znodes written on success.
+ *      A partly written file is deleted.
+ *
+ *--------------------------------------------------------------
+ */
+static int
+zootcl_snapshot_save (Tcl_Interp *interp, zhandle_t *zh, const char *root, Tcl_Obj *fileObj, int window, int compress)
+{
+	Tcl_Channel channel = Tcl_FSOpenFileChannel (interp, fileObj, "w", 0666);
+	if (channel == NULL) {
+		return TCL_ERROR;
+	}
+	Tcl_RegisterChannel (interp, channel);
+	Tcl_SetChannelOption (NULL, channel, "-translation", "binary");
+
+	char header[8];
+	memcpy (header, ZOOTCL_SNAPSHOT_MAGIC, 6);
+	header[6] = ZOOTCL_SNAPSHOT_VERSION;
+	header[7] = compress ? ZOOTCL_SNAPSHOT_DEFLATED : 0;
+
+	int headerFailed = 0;
+
+	if (Tcl_Write (channel, header, 8) != 8) {
+		Tcl_SetObjResult (interp, Tcl_ObjPrintf ("error writing \"%s\": %s", Tcl_GetString (fileObj), Tcl_PosixError (interp)));
+		headerFailed = 1;
+	} else if (compress && zootcl_snapshot_push (interp, channel, "deflate") != TCL_OK) {
+		headerFailed = 1;
+	}
+
+	if (headerFailed) {
+		zootcl_snapshot_close (interp, channel);
+		Tcl_FSDeleteFile (fileObj);
+		return TCL_ERROR;
+	}
+
+	// paths waiting to be read, in breadth first order
+	int queueSize = 1024;
+	int head = 0;
+	int tail = 0;
+	char **queue = (char **)ckalloc (sizeof (char *) * queueSize);
+
+	queue[tail] = ckalloc (strlen (root) + 1);
+	strcpy (queue[tail++], root);
+
+	char **paths = (char **)ckalloc (sizeof (char *) * window);
+	char **listPaths = (char **)ckalloc (sizeof (char *) * window);
+	zootcl_getResult *results = (zootcl_getResult *)ckalloc (sizeof (zootcl_getResult) * window);
+	zootcl_childrenResult *childResults = (zootcl_childrenResult *)ckalloc (sizeof (zootcl_childrenResult) * window);
+
+	// what's below root, with nothing standing for root itself
+	size_t rootLen = (strcmp (root, "/") == 0) ? 0 : strlen (root);
+	Tcl_WideInt written = 0;
+	Tcl_DString failedPath;
+	int status = ZOK;
+	int writeFailed = 0;
+	int firstRound = 1;
+	int i;
+
+	Tcl_DStringInit (&failedPath);
+
+	while (head < tail && status == ZOK && !writeFailed) {
+		int count = tail - head;
+		int listCount = 0;
+		int j;
+
+		if (count > window) {
+			count = window;
+		}
+		memcpy (paths, &queue[head], sizeof (char *) * count);
+
+		zootcl_pipelined_get (zh, count, paths, results);
+		for (i = 0; i < count; i++) {
+			if (results[i].rc == ZOK && results[i].stat.numChildren > 0) {
+				listPaths[listCount++] = paths[i];
+			}
+		}
+		zootcl_pipelined_get_children (zh, listCount, listPaths, childResults);
+
+		for (i = 0, j = 0; i < count; i++) {
+			zootcl_getResult *result = &results[i];
+			zootcl_childrenResult *children = NULL;
+			int isRoot = (firstRound && i == 0);
+
+			if (result->rc == ZOK && result->stat.numChildren > 0) {
+				children = &childResults[j++];
+			}
+
+			// something deleted since its parent was listed is simply
+			// not in the snapshot
+			if (result->rc == ZNONODE && !isRoot) {
+				continue;
+			}
+			if (result->rc != ZOK) {
+				status = result->rc;
+			} else if (children != NULL && children->rc != ZOK && children->rc != ZNONODE) {
+				status = children->rc;
+			}
+			if (status != ZOK) {
+				Tcl_DStringAppend (&failedPath, paths[i], -1);
+				break;
+			}
+
+			if (result->stat.ephemeralOwner != 0) {
+				continue;
+			}
+
+			const char *relative = isRoot ? "" : paths[i] + rootLen;
+			Tcl_DString record;
+
+			Tcl_DStringInit (&record);
+			zootcl_snapshot_put (&record, strlen (relative), 4);
+			Tcl_DStringAppend (&record, relative, -1);
+			zootcl_snapshot_put (&record, (unsigned int)result->dataLen, 4);
+			if (result->dataLen > 0) {
+				Tcl_DStringAppend (&record, result->data, result->dataLen);
+			}
+			zootcl_snapshot_put_stat (&record, &result->stat);
+
+			if (Tcl_Write (channel, Tcl_DStringValue (&record), Tcl_DStringLength (&record)) < 0) {
+				writeFailed = 1;
+			}
+			Tcl_DStringFree (&record);
+			if (writeFailed) {
+				break;
+			}
+			written++;
+
+			if (children == NULL || children->rc != ZOK) {
+				continue;
+			}
+
+			// sorted so the same tree always makes the same file
+			qsort (children->strings.data, children->strings.count, sizeof (char *), zootcl_snapshot_name_compare);
+
+			int k;
+			for (k = 0; k < children->strings.count; k++) {
+				Tcl_DString ds;
+
+				if (tail == queueSize) {
+					// slide out what's been read before growing
+					memmove (queue, &queue[head], sizeof (char *) * (tail - head));
+					tail -= head;
+					head = 0;
+					if (tail > queueSize / 2) {
+						queueSize *= 2;
+						queue = (char **)ckrealloc ((char *)queue, sizeof (char *) * queueSize);
+					}
+				}
+
+				Tcl_DStringInit (&ds);
+				zootcl_join_path (&ds, paths[i], children->strings.data[k]);
+				queue[tail] = ckalloc (Tcl_DStringLength (&ds) + 1);
+				strcpy (queue[tail++], Tcl_DStringValue (&ds));
+				Tcl_DStringFree (&ds);
+			}
+		}
+
+		// the queue may have been slid down, but paths hasn't moved
+		for (i = 0; i < count; i++) {
+			ckfree (paths[i]);
+		}
+		head += count;
+		firstRound = 0;
+		zootcl_pipelined_get_free (count, results);
+		zootcl_pipelined_get_children_free (listCount, childResults);
+	}
+
+	for (i = head; i < tail; i++) {
+		ckfree (queue[i]);
+	}
+	ckfree (queue);
+	ckfree (paths);
+	ckfree (listPaths);
+	ckfree (results);
+	ckfree (childResults);
+
+	if (status == ZOK && !writeFailed) {
+		Tcl_DString end;
+
+		Tcl_DStringInit (&end);
+		zootcl_snapshot_put (&end, ZOOTCL_SNAPSHOT_END, 4);
+		zootcl_snapshot_put (&end, written, 8);
+		writeFailed = (Tcl_Write (channel, Tcl_DStringValue (&end), Tcl_DStringLength (&end)) < 0);
+		Tcl_DStringFree (&end);
+	}
+
+	if (writeFailed) {
+		Tcl_SetObjResult (interp, Tcl_ObjPrintf ("error writing \"%s\": %s", Tcl_GetString (fileObj), Tcl_PosixError (interp)));
+	} else if (status != ZOK) {
+		zootcl_snapshot_error (interp, Tcl_DStringValue (&failedPath), status);
+	}
+	Tcl_DStringFree (&failedPath);
+
+	if (writeFailed || status != ZOK) {
+		zootcl_snapshot_close (interp, channel);
+		Tcl_FSDeleteFile (fileObj);
+		return TCL_ERROR;
+	}
+
+	// closing flushes, which can fail too
+	if (Tcl_UnregisterChannel (interp, channel) != TCL_OK) {
+		Tcl_FSDeleteFile (fileObj);
+		return TCL_ERROR;
+	}
+
+	Tcl_SetObjResult (interp, Tcl_NewWideIntObj (written));
+	return TCL_OK;
+}
+
+static void
+zootcl_snapshot_multi_completion (int rc, const void *context)
+{
+	zootcl_snapshotMulti *sm = (zootcl_snapshotMulti *)context;
+
+	Tcl_MutexLock (&zootcl_batchMutex);
+	sm->rc = rc;
+	sm->inFlight = 0;
+	Tcl_ConditionNotify (&sm->window->cond);
+	Tcl_MutexUnlock (&zootcl_batchMutex);
+}
+
+/*
+ *--------------------------------------------------------------
+ *
+ * zootcl_snapshot_reap -- wait for a multi of a load to come back,
+ *   free what its ops pointed into and make it ready to fill again
+ *
+ * Results:
+ *      the status of the multi.  if it failed and failedPath is still
+ *      empty, the path of the op that failed is put there.
+ *
+ *--------------------------------------------------------------
+ */
+static int
+zootcl_snapshot_reap (zhandle_t *zh, zootcl_snapshotMulti *sm, Tcl_DString *failedPath)
+{
+	int status;
+	int i;
+
+	Tcl_MutexLock (&zootcl_batchMutex);
+	while (sm->inFlight) {
+		zootcl_condition_wait (zh, &sm->window->cond, &zootcl_batchMutex, NULL);
+	}
+	Tcl_MutexUnlock (&zootcl_batchMutex);
+
+	status = sm->rc;
+	if (status != ZOK && sm->count > 0 && Tcl_DStringLength (failedPath) == 0) {
+		// name the op that failed, not the ones rolled back with it
+		const char *path = sm->blocks[0];
+
+		for (i = 0; i < sm->count; i++) {
+			if (sm->results[i].err != ZOK && sm->results[i].err != ZRUNTIMEINCONSISTENCY) {
+				path = sm->blocks[i];
+				break;
+			}
+		}
+		Tcl_DStringAppend (failedPath, path, -1);
+	}
+
+	for (i = 0; i < sm->count; i++) {
+		ckfree (sm->blocks[i]);
+	}
+	sm->count = 0;
+	sm->rc = ZOK;
+	return status;
+}
+
+/*
+ *--------------------------------------------------------------
+ *
+ * zootcl_snapshot_load -- create the znodes of a snapshot file under
+ *   target, batch creates to a multi with up to multis of them in
+ *   flight
+ *
+ *   if target already exists its data is set from the snapshot,
+ *   everything below it must not exist yet
+ *
+ * Results:
+ *      A standard Tcl result, the number of znodes restored on
+ *      success.  A failed multi leaves the ones before it in place.
+ *
+ *--------------------------------------------------------------
+ */
+static int
+zootcl_snapshot_load (Tcl_Interp *interp, zhandle_t *zh, Tcl_Obj *fileObj, const char *target, int batch, int multis)
+{
+	Tcl_Channel channel = Tcl_FSOpenFileChannel (interp, fileObj, "r", 0);
+	if (channel == NULL) {
+		return TCL_ERROR;
+	}
+	Tcl_RegisterChannel (interp, channel);
+	Tcl_SetChannelOption (NULL, channel, "-translation", "binary");
+
+	char header[8];
+
+	if (!zootcl_snapshot_read (channel, header, 8) || memcmp (header, ZOOTCL_SNAPSHOT_MAGIC, 6) != 0 || header[6] != ZOOTCL_SNAPSHOT_VERSION) {
+		Tcl_SetObjResult (interp, Tcl_ObjPrintf ("\"%s\" isn't a zookeeper snapshot", Tcl_GetString (fileObj)));
+		zootcl_snapshot_close (interp, channel);
+		return TCL_ERROR;
+	}
+	if ((header[7] & ZOOTCL_SNAPSHOT_DEFLATED) && zootcl_snapshot_push (interp, channel, "inflate") != TCL_OK) {
+		zootcl_snapshot_close (interp, channel);
+		return TCL_ERROR;
+	}
+
+	struct Stat stat;
+	int status = zoo_exists (zh, target, 0, &stat);
+	int targetExists = (status == ZOK);
+
+	if (status != ZOK && status != ZNONODE) {
+		zootcl_snapshot_close (interp, channel);
+		return zootcl_snapshot_error (interp, target, status);
+	}
+	status = ZOK;
+
+	zootcl_getBatch window;
+	zootcl_snapshotMulti *sms = (zootcl_snapshotMulti *)ckalloc (sizeof (zootcl_snapshotMulti) * multis);
+	int i;
+
+	memset (&window, 0, sizeof (window));
+	for (i = 0; i < multis; i++) {
+		sms[i].count = 0;
+		sms[i].ops = (zoo_op_t *)ckalloc (sizeof (zoo_op_t) * batch);
+		sms[i].results = (zoo_op_result_t *)ckalloc (sizeof (zoo_op_result_t) * batch);
+		sms[i].blocks = (char **)ckalloc (sizeof (char *) * batch);
+		sms[i].inFlight = 0;
+		sms[i].rc = ZOK;
+		sms[i].window = &window;
+	}
+
+	size_t targetLen = (strcmp (target, "/") == 0) ? 0 : strlen (target);
+	Tcl_WideInt records = 0;
+	Tcl_DString failedPath;
+	int corrupt = 0;
+	int done = 0;
+	int next = 0;
+
+	Tcl_DStringInit (&failedPath);
+
+	while (!done && !corrupt && status == ZOK) {
+		zootcl_snapshotMulti *sm = &sms[next];
+		int bytes = 0;
+
+		next = (next + 1) % multis;
+
+		// the oldest multi has to be back before it can be reused
+		status = zootcl_snapshot_reap (zh, sm, &failedPath);
+		if (status != ZOK) {
+			break;
+		}
+
+		while (sm->count < batch && bytes < ZOOTCL_SNAPSHOT_MULTI_BYTES) {
+			unsigned char numBuf[8];
+			char statBuf[ZOOTCL_SNAPSHOT_STAT_SIZE];
+
+			if (!zootcl_snapshot_read (channel, (char *)numBuf, 4)) {
+				corrupt = 1;
+				break;
+			}
+
+			unsigned int pathLen = (unsigned int)zootcl_snapshot_get (numBuf, 4);
+			if (pathLen == ZOOTCL_SNAPSHOT_END) {
+				if (!zootcl_snapshot_read (channel, (char *)numBuf, 8) || (Tcl_WideInt)zootcl_snapshot_get (numBuf, 8) != records) {
+					corrupt = 1;
+				}
+				done = 1;
+				break;
+			}
+			if (pathLen > ZOOTCL_SNAPSHOT_MAX_PATH || (pathLen == 0) != (records == 0)) {
+				corrupt = 1;
+				break;
+			}
+
+			// the full path and the data go in one block, path first
+			Tcl_DString ds;
+			Tcl_DStringInit (&ds);
+			if (pathLen == 0 || targetLen > 0) {
+				Tcl_DStringAppend (&ds, target, -1);
+			}
+			int prefixLen = Tcl_DStringLength (&ds);
+			Tcl_DStringSetLength (&ds, prefixLen + pathLen);
+
+			int dataLen = 0;
+			if (!zootcl_snapshot_read (channel, Tcl_DStringValue (&ds) + prefixLen, pathLen) || (pathLen > 0 && Tcl_DStringValue (&ds)[prefixLen] != '/') || !zootcl_snapshot_read (channel, (char *)numBuf, 4)) {
+				corrupt = 1;
+			} else {
+				dataLen = (int)(unsigned int)zootcl_snapshot_get (numBuf, 4);
+				corrupt = (dataLen < -1 || dataLen > ZOOTCL_SNAPSHOT_MAX_DATA);
+			}
+			if (corrupt) {
+				Tcl_DStringFree (&ds);
+				break;
+			}
+
+			int fullLen = Tcl_DStringLength (&ds);
+			char *block = ckalloc (fullLen + 1 + (dataLen > 0 ? dataLen : 0));
+			memcpy (block, Tcl_DStringValue (&ds), fullLen);
+			block[fullLen] = '\0';
+			Tcl_DStringFree (&ds);
+
+			if (!zootcl_snapshot_read (channel, block + fullLen + 1, dataLen > 0 ? dataLen : 0) || !zootcl_snapshot_read (channel, statBuf, ZOOTCL_SNAPSHOT_STAT_SIZE)) {
+				ckfree (block);
+				corrupt = 1;
+				break;
+			}
+
+			const char *data = (dataLen < 0) ? NULL : block + fullLen + 1;
+			zoo_op_t *op = &sm->ops[sm->count];
+
+			if (records == 0 && targetExists) {
+				zoo_set_op_init (op, block, data, dataLen, -1, NULL);
+			} else {
+				zoo_create_op_init (op, block, data, dataLen, &ZOO_OPEN_ACL_UNSAFE, 0, NULL, 0);
+			}
+			sm->blocks[sm->count++] = block;
+			bytes += fullLen + (dataLen > 0 ? dataLen : 0);
+			records++;
+		}
+
+		if (corrupt || sm->count == 0) {
+			continue;
+		}
+
+		memset (sm->results, 0, sizeof (zoo_op_result_t) * sm->count);
+		Tcl_MutexLock (&zootcl_batchMutex);
+		sm->inFlight = 1;
+		Tcl_MutexUnlock (&zootcl_batchMutex);
+
+		int rc = zoo_amulti (zh, sm->count, sm->ops, sm->results, zootcl_snapshot_multi_completion, sm);
+		if (rc != ZOK) {
+			Tcl_MutexLock (&zootcl_batchMutex);
+			sm->inFlight = 0;
+			sm->rc = rc;
+			Tcl_MutexUnlock (&zootcl_batchMutex);
+		}
+	}
+
+	// everything still out has to come back before its memory goes,
+	// oldest first so the first failure is the one reported
+	for (i = 0; i < multis; i++) {
+		int rc = zootcl_snapshot_reap (zh, &sms[(next + i) % multis], &failedPath);
+
+		if (status == ZOK) {
+			status = rc;
+		}
+		ckfree (sms[(next + i) % multis].ops);
+		ckfree (sms[(next + i) % multis].results);
+		ckfree (sms[(next + i) % multis].blocks);
+	}
+	ckfree (sms);
+	Tcl_ConditionFinalize (&window.cond);
+	zootcl_snapshot_close (interp, channel);
+
+	if (status != ZOK) {
+		zootcl_snapshot_error (interp, Tcl_DStringValue (&failedPath), status);
+	} else if (corrupt) {
+		Tcl_SetObjResult (interp, Tcl_ObjPrintf ("snapshot \"%s\" is truncated or corrupt", Tcl_GetString (fileObj)));
+	}
+	Tcl_DStringFree (&failedPath);
+
+	if (status != ZOK || corrupt) {
+		return TCL_ERROR;
+	}
+
+	Tcl_SetObjResult (interp, Tcl_NewWideIntObj (records));
+	return TCL_OK;
+}
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * zootcl_snapshot_subcommand --
+ *
+ *      implement the "snapshot" method of a zookeeper tcl command
+ *      object
+ *
+ *      snapshot save path file ?-compress? ?-window n?
+ *      snapshot load file path ?-batch n? ?-window n?
+ *
+ * Results:
+ *      A standard Tcl result, the number of znodes saved or loaded.
+ *
+ *
+ *----------------------------------------------------------------------
+ */
+int
+zootcl_snapshot_subcommand(Tcl_Interp *interp, int objc, Tcl_Obj *CONST objv[], ZOOAPI zhandle_t *zh, zootcl_objectClientData *zo)
+{
+	static CONST char *actions[] = {
+		"save",
+		"load",
+		NULL
+	};
+
+	enum actions {
+		ACTION_SAVE,
+		ACTION_LOAD
+	};
+
+	static CONST char *subOptions[] = {
+		"-compress",
+		"-window",
+		"-batch",
+		NULL
+	};
+
+	enum subOptions {
+		SUBOPT_COMPRESS,
+		SUBOPT_WINDOW,
+		SUBOPT_BATCH
+	};
+
+	int actionIndex;
+	int compress = 0;
+	int window = -1;
+	int batch = ZOOTCL_SNAPSHOT_DEFAULT_BATCH;
+	int i;
+
+    assert (zo->zookeeper_object_magic == ZOOKEEPER_OBJECT_MAGIC);
+
+	if (objc < 5) {
+		Tcl_WrongNumArgs (interp, 2, objv, "save path file ?-compress? ?-window n?|load file path ?-batch n? ?-window n?");
+		return TCL_ERROR;
+	}
+
+	if (Tcl_GetIndexFromObj (interp, objv[2], actions, "action", TCL_EXACT, &actionIndex) != TCL_OK) {
+		return TCL_ERROR;
+	}
+
+	for (i = 5; i < objc; i++) {
+		int suboptIndex;
+
+		if (Tcl_GetIndexFromObj (interp, objv[i], subOptions, "suboption", TCL_EXACT, &suboptIndex) != TCL_OK) {
+			return TCL_ERROR;
+		}
+
+		if ((suboptIndex == SUBOPT_COMPRESS && actionIndex != ACTION_SAVE) || (suboptIndex == SUBOPT_BATCH && actionIndex != ACTION_LOAD)) {
+			Tcl_SetObjResult (interp, Tcl_ObjPrintf ("%s doesn't go with snapshot %s", Tcl_GetString (objv[i]), Tcl_GetString (objv[2])));
+			return TCL_ERROR;
+		}
+
+		if (suboptIndex == SUBOPT_COMPRESS) {
+			compress = 1;
+			continue;
+		}
+
+		if (i + 1 >= objc) {
+			Tcl_SetObjResult (interp, Tcl_ObjPrintf ("%s requires a value", Tcl_GetString (objv[i])));
+			return TCL_ERROR;
+		}
+
+		int value;
+		if (Tcl_GetIntFromObj (interp, objv[++i], &value) == TCL_ERROR) {
+			return TCL_ERROR;
+		}
+		if (value < 1) {
+			Tcl_SetObjResult (interp, Tcl_ObjPrintf ("%s must be at least 1", Tcl_GetString (objv[i - 1])));
+			return TCL_ERROR;
+		}
+
+		if (suboptIndex == SUBOPT_WINDOW) {
+			window = value;
+		} else {
+			batch = value;
+		}
+	}
+
+	switch ((enum actions) actionIndex) {
+		case ACTION_SAVE:
+		{
+			const char *path = zootcl_path_string (interp, objv[3]);
+			if (path == NULL) {
+				return TCL_ERROR;
+			}
+			return zootcl_snapshot_save (interp, zh, path, objv[4], (window < 0) ? ZOOTCL_SNAPSHOT_DEFAULT_WINDOW : window, compress);
+		}
+
+		case ACTION_LOAD:
+		{
+			const char *path = zootcl_path_string (interp, objv[4]);
+			if (path == NULL) {
+				return TCL_ERROR;
+			}
+			return zootcl_snapshot_load (interp, zh, objv[3], path, batch, (window < 0) ? ZOOTCL_SNAPSHOT_DEFAULT_MULTIS : window);
+		}
+	}
+
+	return TCL_OK;
+}
+
+/*
+ * Mirrors
+ *
+ * A mirror keeps a subtree current with a data and a children watch
+ * on each znode and writes it to a file that any process on the host
+ * can map and read without a session of its own.  When something
+ * changes only the znodes whose watches fired are read again, all of
+ * them at once, and after -delay ms of gathering changes a new file is
+ * written beside the old one and renamed over it, so a reader sees the
+ * old tree or the new one and never part of either.
+ *
+ * The file is read-optimized, all big-endian:
+ *
+ *   header    "ZKMIRROR", u32 version, u32 count, u64 zxid, u64 generation
+ *   entries   count of them, breadth first from the top, each a u32
+ *             path offset, u32 path length, u32 data offset, i32 data
+ *             length (-1 for none), u32 first child, u32 child count,
+ *             i32 version, i32 cversion, u64 mzxid
+ *   index     u32 entry numbers in order of path, to binary search
+ *   paths     NUL-terminated
+ *   data
+ *
+ * The children of an entry are the child count entries starting at its
+ * first child, in order of name.  zxid is the highest mzxid or pzxid
+ * in the tree, the newest change the file has in it.
+ */
+#define ZOOTCL_MIRROR_MAGIC "ZKMIRROR"
+#define ZOOTCL_MIRROR_VERSION 1
+#define ZOOTCL_MIRROR_HEADER_SIZE 32
+#define ZOOTCL_MIRROR_ENTRY_SIZE 40
+
+void zootcl_mirror_event (ClientData clientData, int type, int state);
+static void zootcl_mirror_read (zootcl_mirror *mirror, int count, char **paths);
+
+static void
+zootcl_mirror_free_node (zootcl_mirrorNode *node)
+{
+	int i;
+
+	if (node->data != NULL) {
+		ckfree (node->data);
+	}
+	for (i = 0; i < node->childCount; i++) {
+		ckfree (node->children[i]);
+	}
+	if (node->children != NULL) {
+		ckfree (node->children);
+	}
+	ckfree (node);
+}
+
+static void
+zootcl_mirror_clear (zootcl_mirror *mirror)
+{
+	Tcl_HashSearch search;
+	Tcl_HashEntry *hashEntry;
+
+	for (hashEntry = Tcl_FirstHashEntry (&mirror->nodes, &search); hashEntry != NULL; hashEntry = Tcl_NextHashEntry (&search)) {
+		zootcl_mirror_free_node ((zootcl_mirrorNode *)Tcl_GetHashValue (hashEntry));
+	}
+	Tcl_DeleteHashTable (&mirror->nodes);
+	Tcl_InitHashTable (&mirror->nodes, TCL_STRING_KEYS);
+}
+
+void
+zootcl_mirror_free (zootcl_mirror *mirror)
+{
+	zootcl_mirror_clear (mirror);
+	Tcl_DeleteHashTable (&mirror->nodes);
+	if (mirror->timer != NULL) {
+		Tcl_DeleteTimerHandler (mirror->timer);
+	}
+	if (mirror->writeTimer != NULL) {
+		Tcl_DeleteTimerHandler (mirror->writeTimer);
+	}
+	if (mirror->errorObj != NULL) {
+		Tcl_DecrRefCount (mirror->errorObj);
+	}
+	Tcl_DecrRefCount (mirror->fileObj);
+	ckfree (mirror->path);
+	ckfree (mirror);
+}
+
+/*
+ *--------------------------------------------------------------
+ *
+ * zootcl_mirror_forget -- remove a mirror from its object's table
+ *   and free it
+ *
+ *--------------------------------------------------------------
+ */
+void
+zootcl_mirror_forget (zootcl_mirror *mirror)
+{
+	Tcl_HashEntry *hashEntry = Tcl_FindHashEntry (&mirror->zo->mirrors, mirror->path);
+
+	if (hashEntry != NULL && Tcl_GetHashValue (hashEntry) == (ClientData)mirror) {
+		Tcl_DeleteHashEntry (hashEntry);
+	}
+	zootcl_mirror_free (mirror);
+}
+
+/*
+ *--------------------------------------------------------------
+ *
+ * zootcl_mirror_watcher -- data, children or exists watch of a mirror
+ *
+ * runs in the zookeeper completion thread.  short of expiration,
+ * session events leave the watch in place so they're of no interest.
+ *
+ *--------------------------------------------------------------
+ */
+void
+zootcl_mirror_watcher (zhandle_t *zh, int type, int state, const char *path, void *context)
+{
+	zootcl_mirrorWatch *mw = (zootcl_mirrorWatch *)context;
+
+	if (type == ZOO_SESSION_EVENT && state != ZOO_EXPIRED_SESSION_STATE) {
+		return;
+	}
+	zootcl_queue_recipe_event (mw->mirror->zo, zootcl_mirror_event, (ClientData)mw, type, state);
+}
+
+static zootcl_mirrorWatch *
+zootcl_mirror_new_watch (zootcl_mirror *mirror, const char *path, int kind)
+{
+	zootcl_mirrorWatch *mw = (zootcl_mirrorWatch *)ckalloc (sizeof (zootcl_mirrorWatch));
+
+	mw->mirror = mirror;
+	mw->path = ckalloc (strlen (path) + 1);
+	strcpy (mw->path, path);
+	mw->kind = kind;
+	mirror->watchPending++;
+	return mw;
+}
+
+static void
+zootcl_mirror_free_watch (zootcl_mirrorWatch *mw)
+{
+	mw->mirror->watchPending--;
+	if (mw->path != NULL) {
+		ckfree (mw->path);
+	}
+	ckfree (mw);
+}
+
+static char *
+zootcl_mirror_strdup (const char *string)
+{
+	char *copy = ckalloc (strlen (string) + 1);
+
+	strcpy (copy, string);
+	return copy;
+}
+
+/*
+ *--------------------------------------------------------------
+ *
+ * zootcl_mirror_remove -- drop a znode and everything under it from
+ *   a mirror.  zookeeper tells the watches they hold that it's gone.
+ *
+ *--------------------------------------------------------------
+ */
+static void
+zootcl_mirror_remove (zootcl_mirror *mirror, const char *path)
+{
+	Tcl_HashEntry *hashEntry = Tcl_FindHashEntry (&mirror->nodes, path);
+	zootcl_mirrorNode *node;
+	int i;
+
+	if (hashEntry == NULL) {
+		return;
+	}
+	node = (zootcl_mirrorNode *)Tcl_GetHashValue (hashEntry);
+	Tcl_DeleteHashEntry (hashEntry);
+
+	for (i = 0; i < node->childCount; i++) {
+		Tcl_DString ds;
+
+		Tcl_DStringInit (&ds);
+		zootcl_mirror_remove (mirror, zootcl_join_path (&ds, path, node->children[i]));
+		Tcl_DStringFree (&ds);
+	}
+	zootcl_mirror_free_node (node);
+}
+
+static zootcl_mirrorNode *
+zootcl_mirror_node (zootcl_mirror *mirror, const char *path)
+{
+	Tcl_HashEntry *hashEntry = Tcl_FindHashEntry (&mirror->nodes, path);
+
+	return (hashEntry == NULL) ? NULL : (zootcl_mirrorNode *)Tcl_GetHashValue (hashEntry);
+}
+
+static zootcl_mirrorNode *
+zootcl_mirror_new_node (zootcl_mirror *mirror, const char *path)
+{
+	zootcl_mirrorNode *node = (zootcl_mirrorNode *)ckalloc (sizeof (zootcl_mirrorNode));
+	int isNew;
+
+	memset (node, 0, sizeof (zootcl_mirrorNode));
+	node->dataLen = -1;
+	Tcl_SetHashValue (Tcl_CreateHashEntry (&mirror->nodes, path, &isNew), (ClientData)node);
+	return node;
+}
+
+static void
+zootcl_mirror_timer (ClientData clientData)
+{
+	zootcl_mirror *mirror = (zootcl_mirror *)clientData;
+	Tcl_HashSearch search;
+	Tcl_HashEntry *hashEntry;
+
+	mirror->timer = NULL;
+	zootcl_session_ready (mirror->zo);
+
+	// look again at everything zookeeper isn't watching for us
+	int count = 0;
+	char **paths = (char **)ckalloc (sizeof (char *) * (mirror->nodes.numEntries + 1));
+
+	if (zootcl_mirror_node (mirror, mirror->path) == NULL && !mirror->rootWatch) {
+		paths[count++] = zootcl_mirror_strdup (mirror->path);
+	}
+	for (hashEntry = Tcl_FirstHashEntry (&mirror->nodes, &search); hashEntry != NULL; hashEntry = Tcl_NextHashEntry (&search)) {
+		zootcl_mirrorNode *node = (zootcl_mirrorNode *)Tcl_GetHashValue (hashEntry);
+
+		if (!node->dataWatch || !node->childWatch) {
+			paths[count++] = zootcl_mirror_strdup (Tcl_GetHashKey (&mirror->nodes, hashEntry));
+		}
+	}
+	zootcl_mirror_read (mirror, count, paths);
+}
+
+static void
+zootcl_mirror_retry (zootcl_mirror *mirror)
+{
+	if (mirror->timer == NULL) {
+		mirror->timer = Tcl_CreateTimerHandler (ZOOTCL_RECIPE_RETRY_MS, zootcl_mirror_timer, (ClientData)mirror);
+	}
+}
+
+static void zootcl_mirror_write_timer (ClientData clientData);
+
+static void
+zootcl_mirror_changed (zootcl_mirror *mirror)
+{
+	if (mirror->writeTimer == NULL) {
+		mirror->writeTimer = Tcl_CreateTimerHandler (mirror->delay, zootcl_mirror_write_timer, (ClientData)mirror);
+	}
+}
+
+static int
+zootcl_mirror_name_compare (const void *a, const void *b)
+{
+	return strcmp (*(char * const *)a, *(char * const *)b);
+}
+
+/*
+ *--------------------------------------------------------------
+ *
+ * zootcl_mirror_set_children -- take a fresh children listing of a
+ *   node, dropping what's gone and adding what's new to the paths to
+ *   read next
+ *
+ *--------------------------------------------------------------
+ */
+static void
+zootcl_mirror_set_children (zootcl_mirror *mirror, const char *path, zootcl_mirrorNode *node, struct String_vector *strings, char ***nextPtr, int *nextCountPtr, int *nextSizePtr)
+{
+	Tcl_HashTable seen;
+	int isNew;
+	int i;
+
+	Tcl_InitHashTable (&seen, TCL_STRING_KEYS);
+	for (i = 0; i < strings->count; i++) {
+		Tcl_CreateHashEntry (&seen, strings->data[i], &isNew);
+	}
+
+	for (i = 0; i < node->childCount; i++) {
+		if (Tcl_FindHashEntry (&seen, node->children[i]) == NULL) {
+			Tcl_DString ds;
+
+			Tcl_DStringInit (&ds);
+			zootcl_mirror_remove (mirror, zootcl_join_path (&ds, path, node->children[i]));
+			Tcl_DStringFree (&ds);
 		}
+		ckfree (node->children[i]);
+	}
+	Tcl_DeleteHashTable (&seen);
+	if (node->children != NULL) {
+		ckfree (node->children);
+	}
 
-		switch ((enum subOptions) suboptIndex) {
-			case SUBOPT_WATCH:
-			{
-				if (i + 1 >= objc) {
-					Tcl_WrongNumArgs (interp, 2, objv, "path ... -watch code");
-					return TCL_ERROR;
-				}
-				watcherCallbackObj = objv[++i];
-				Tcl_IncrRefCount (watcherCallbackObj);
-				break;
+	node->childCount = strings->count;
+	node->children = (char **)ckalloc (sizeof (char *) * (strings->count + 1));
+	for (i = 0; i < strings->count; i++) {
+		Tcl_DString ds;
+
+		node->children[i] = zootcl_mirror_strdup (strings->data[i]);
+
+		Tcl_DStringInit (&ds);
+		zootcl_join_path (&ds, path, strings->data[i]);
+		if (zootcl_mirror_node (mirror, Tcl_DStringValue (&ds)) == NULL) {
+			if (*nextCountPtr == *nextSizePtr) {
+				*nextSizePtr *= 2;
+				*nextPtr = (char **)ckrealloc ((char *)*nextPtr, sizeof (char *) * *nextSizePtr);
 			}
+			(*nextPtr)[(*nextCountPtr)++] = zootcl_mirror_strdup (Tcl_DStringValue (&ds));
+		}
+		Tcl_DStringFree (&ds);
+	}
+	qsort (node->children, node->childCount, sizeof (char *), zootcl_mirror_name_compare);
+}
 
-			case SUBOPT_ASYNC:
-			{
-				if (i + 1 >= objc) {
-					Tcl_WrongNumArgs (interp, 2, objv, "path ... -async code");
-					return TCL_ERROR;
+/*
+ *--------------------------------------------------------------
+ *
+ * zootcl_mirror_read -- read the data and children of count znodes
+ *   at once, leaving the watches that aren't already there, then the
+ *   children that are new to us the same way, a level at a time.
+ *   frees paths and the strings in it.
+ *
+ *--------------------------------------------------------------
+ */
+static void
+zootcl_mirror_read (zootcl_mirror *mirror, int count, char **paths)
+{
+	zhandle_t *zh = mirror->zo->zh;
+	int changed = 0;
+	int i;
+
+	while (count > 0 && !mirror->closed && !mirror->expired) {
+		char **dataPaths = (char **)ckalloc (sizeof (char *) * count);
+		char **childPaths = (char **)ckalloc (sizeof (char *) * count);
+		void **dataCtxs = (void **)ckalloc (sizeof (void *) * count);
+		void **childCtxs = (void **)ckalloc (sizeof (void *) * count);
+		zootcl_getResult *dataResults = (zootcl_getResult *)ckalloc (sizeof (zootcl_getResult) * count);
+		zootcl_childrenResult *childResults = (zootcl_childrenResult *)ckalloc (sizeof (zootcl_childrenResult) * count);
+		int dataCount = 0;
+		int childCount = 0;
+
+		int nextSize = 16;
+		int nextCount = 0;
+		char **next = (char **)ckalloc (sizeof (char *) * nextSize);
+
+		for (i = 0; i < count; i++) {
+			zootcl_mirrorNode *node = zootcl_mirror_node (mirror, paths[i]);
+
+			if (node == NULL || !node->dataWatch) {
+				dataCtxs[dataCount] = (void *)zootcl_mirror_new_watch (mirror, paths[i], ZOOTCL_MIRROR_DATA);
+				dataPaths[dataCount++] = paths[i];
+			}
+			if (node == NULL || !node->childWatch) {
+				childCtxs[childCount] = (void *)zootcl_mirror_new_watch (mirror, paths[i], ZOOTCL_MIRROR_CHILDREN);
+				childPaths[childCount++] = paths[i];
+			}
+		}
+
+		// two round trips for the lot
+		zootcl_pipelined_wget (zh, dataCount, dataPaths, zootcl_mirror_watcher, dataCtxs, dataResults);
+		zootcl_pipelined_wget_children (zh, childCount, childPaths, zootcl_mirror_watcher, childCtxs, childResults);
+
+		for (i = 0; i < dataCount; i++) {
+			zootcl_getResult *result = &dataResults[i];
+			zootcl_mirrorNode *node = zootcl_mirror_node (mirror, dataPaths[i]);
+
+			if (result->rc != ZOK) {
+				zootcl_mirror_free_watch ((zootcl_mirrorWatch *)dataCtxs[i]);
+				if (result->rc == ZNONODE) {
+					if (node != NULL) {
+						zootcl_mirror_remove (mirror, dataPaths[i]);
+						changed = 1;
+					}
+				} else {
+					// we'll look again, as it is it's not watched
+					if (node != NULL) {
+						node->dataWatch = 0;
+					}
+					zootcl_mirror_retry (mirror);
 				}
-				asyncCallbackObj = objv[++i];
-				Tcl_IncrRefCount (asyncCallbackObj);
-				break;
+				continue;
 			}
 
-			case SUBOPT_STAT:
-			{
-				if (i + 1 >= objc) {
-					Tcl_WrongNumArgs (interp, 2, objv, "path ... -stat statArray");
-					return TCL_ERROR;
+			if (node == NULL) {
+				node = zootcl_mirror_new_node (mirror, dataPaths[i]);
+			}
+			if (node->data != NULL) {
+				ckfree (node->data);
+			}
+			node->data = result->data;
+			node->dataLen = result->dataLen;
+			node->stat = result->stat;
+			node->dataWatch = 1;
+			result->data = NULL;
+			changed = 1;
+		}
+
+		for (i = 0; i < childCount; i++) {
+			zootcl_childrenResult *result = &childResults[i];
+			zootcl_mirrorNode *node = zootcl_mirror_node (mirror, childPaths[i]);
+
+			if (result->rc != ZOK) {
+				zootcl_mirror_free_watch ((zootcl_mirrorWatch *)childCtxs[i]);
+				if (result->rc != ZNONODE) {
+					zootcl_mirror_retry (mirror);
 				}
-				statArray = Tcl_GetString (objv[++i]);
-				break;
+				continue;
 			}
 
-			case SUBOPT_VERSION:
-			{
-				if (i + 1 >= objc) {
-					Tcl_WrongNumArgs (interp, 2, objv, "path ... -version versionVar");
-					return TCL_ERROR;
+			if (node == NULL) {
+				// made between the two reads, get its data next time
+				node = zootcl_mirror_new_node (mirror, childPaths[i]);
+				zootcl_mirror_retry (mirror);
+			}
+			node->childWatch = 1;
+			zootcl_mirror_set_children (mirror, childPaths[i], node, &result->strings, &next, &nextCount, &nextSize);
+			changed = 1;
+		}
+
+		// no top, watch for it to show up
+		if (zootcl_mirror_node (mirror, mirror->path) == NULL && !mirror->rootWatch) {
+			zootcl_mirrorWatch *mw = zootcl_mirror_new_watch (mirror, mirror->path, ZOOTCL_MIRROR_EXISTS);
+			int status = zoo_wexists (zh, mirror->path, zootcl_mirror_watcher, (void *)mw, NULL);
+
+			if (status == ZNONODE) {
+				mirror->rootWatch = 1;
+			} else {
+				// it's there after all or something went wrong, look
+				// again in a bit.  an exists watch on a znode that's
+				// there stays pending, so it's still accounted for.
+				if (status != ZOK) {
+					zootcl_mirror_free_watch (mw);
 				}
-				versionVarObj = objv[++i];
-				break;
+				zootcl_mirror_retry (mirror);
 			}
 		}
+
+		zootcl_pipelined_get_free (dataCount, dataResults);
+		zootcl_pipelined_get_children_free (childCount, childResults);
+		ckfree (dataPaths);
+		ckfree (childPaths);
+		ckfree (dataCtxs);
+		ckfree (childCtxs);
+		ckfree (dataResults);
+		ckfree (childResults);
+
+		for (i = 0; i < count; i++) {
+			ckfree (paths[i]);
+		}
+		ckfree (paths);
+
+		paths = next;
+		count = nextCount;
 	}
 
-	if (asyncCallbackObj != NULL) {
-		if (statArray != NULL) {
-			Tcl_SetObjResult (interp, Tcl_NewStringObj ("-stat and -async options are mutually exclusive", -1));
-			return TCL_ERROR;
+	for (i = 0; i < count; i++) {
+		ckfree (paths[i]);
+	}
+	ckfree (paths);
+
+	if (changed) {
+		zootcl_mirror_changed (mirror);
+	}
+}
+
+static void
+zootcl_mirror_error (zootcl_mirror *mirror, Tcl_Obj *errorObj)
+{
+	if (mirror->errorObj != NULL) {
+		Tcl_DecrRefCount (mirror->errorObj);
+	}
+	mirror->errorObj = errorObj;
+	if (errorObj != NULL) {
+		Tcl_IncrRefCount (errorObj);
+	}
+}
+
+typedef struct zootcl_mirrorSortEntry
+{
+	const char *path;
+	unsigned int index;
+} zootcl_mirrorSortEntry;
+
+static int
+zootcl_mirror_sort_compare (const void *a, const void *b)
+{
+	return strcmp (((const zootcl_mirrorSortEntry *)a)->path, ((const zootcl_mirrorSortEntry *)b)->path);
+}
+
+/*
+ *--------------------------------------------------------------
+ *
+ * zootcl_mirror_write -- write the mirror's file and swap it in
+ *
+ * Results:
+ *      A standard Tcl result.  On error the reason is in
+ *      mirror->errorObj and the old file is left alone.
+ *
+ *--------------------------------------------------------------
+ */
+static int
+zootcl_mirror_write (zootcl_mirror *mirror)
+{
+	int orderSize = mirror->nodes.numEntries + 1;
+	const char **orderPaths = (const char **)ckalloc (sizeof (char *) * orderSize);
+	zootcl_mirrorNode **order = (zootcl_mirrorNode **)ckalloc (sizeof (zootcl_mirrorNode *) * orderSize);
+	unsigned int *firstChild = (unsigned int *)ckalloc (sizeof (unsigned int) * orderSize);
+	unsigned int *childCount = (unsigned int *)ckalloc (sizeof (unsigned int) * orderSize);
+	Tcl_HashEntry *hashEntry = Tcl_FindHashEntry (&mirror->nodes, mirror->path);
+	Tcl_WideInt zxid = 0;
+	int count = 0;
+	int i, j;
+
+	// breadth first, so the children of each are together
+	if (hashEntry != NULL) {
+		orderPaths[count] = Tcl_GetHashKey (&mirror->nodes, hashEntry);
+		order[count++] = (zootcl_mirrorNode *)Tcl_GetHashValue (hashEntry);
+	}
+	for (i = 0; i < count; i++) {
+		zootcl_mirrorNode *node = order[i];
+
+		firstChild[i] = count;
+		for (j = 0; j < node->childCount; j++) {
+			Tcl_DString ds;
+
+			Tcl_DStringInit (&ds);
+			hashEntry = Tcl_FindHashEntry (&mirror->nodes, zootcl_join_path (&ds, orderPaths[i], node->children[j]));
+			Tcl_DStringFree (&ds);
+
+			// not read yet
+			if (hashEntry == NULL) {
+				continue;
+			}
+			orderPaths[count] = Tcl_GetHashKey (&mirror->nodes, hashEntry);
+			order[count++] = (zootcl_mirrorNode *)Tcl_GetHashValue (hashEntry);
 		}
+		childCount[i] = count - firstChild[i];
 
-		if (versionVarObj != NULL) {
-			Tcl_SetObjResult (interp, Tcl_NewStringObj ("-version and -async options are mutually exclusive", -1));
-			return TCL_ERROR;
+		if (node->stat.mzxid > zxid) {
+			zxid = node->stat.mzxid;
+		}
+		if (node->stat.pzxid > zxid) {
+			zxid = node->stat.pzxid;
 		}
 	}
 
-	if (watcherCallbackObj != NULL) {
-		wfn = zootcl_watcher;
+	zootcl_mirrorSortEntry *sorted = (zootcl_mirrorSortEntry *)ckalloc (sizeof (zootcl_mirrorSortEntry) * orderSize);
+	for (i = 0; i < count; i++) {
+		sorted[i].path = orderPaths[i];
+		sorted[i].index = i;
 	}
+	qsort (sorted, count, sizeof (zootcl_mirrorSortEntry), zootcl_mirror_sort_compare);
 
-	int status;
+	Tcl_DString file;
+	Tcl_WideUInt pathOffset = ZOOTCL_MIRROR_HEADER_SIZE + (Tcl_WideUInt)count * (ZOOTCL_MIRROR_ENTRY_SIZE + 4);
+	Tcl_WideUInt dataOffset = pathOffset;
 
-	if (asyncCallbackObj == NULL) {
-		struct Stat *stat = (struct Stat *)ckalloc (sizeof (struct Stat));
-		status = zoo_wexists(zh, path, wfn, (void *)watcherCallbackObj, stat);	
+	for (i = 0; i < count; i++) {
+		dataOffset += strlen (orderPaths[i]) + 1;
+	}
 
-		// if there's no node hand that according to our rule.
-		// unset the version var since we don't have one and we
-		// don't want to confuse the caller by letting through some
-		// old thing or require them to unset the var before calling
-		// us.  that ain't happenin'.
-		if (status == ZNONODE) {
-			if (versionVarObj != NULL) {
-				Tcl_UnsetVar (interp, Tcl_GetString (versionVarObj), 0);
-			}
-			Tcl_SetObjResult (interp, Tcl_NewBooleanObj (0));
-			ckfree (stat);
-			return TCL_OK;
+	Tcl_DStringInit (&file);
+	Tcl_DStringAppend (&file, ZOOTCL_MIRROR_MAGIC, 8);
+	zootcl_snapshot_put (&file, ZOOTCL_MIRROR_VERSION, 4);
+	zootcl_snapshot_put (&file, count, 4);
+	zootcl_snapshot_put (&file, zxid, 8);
+	zootcl_snapshot_put (&file, mirror->generation + 1, 8);
+
+	for (i = 0; i < count; i++) {
+		zootcl_mirrorNode *node = order[i];
+		int pathLen = strlen (orderPaths[i]);
+
+		zootcl_snapshot_put (&file, pathOffset, 4);
+		zootcl_snapshot_put (&file, pathLen, 4);
+		zootcl_snapshot_put (&file, dataOffset, 4);
+		zootcl_snapshot_put (&file, (unsigned int)node->dataLen, 4);
+		zootcl_snapshot_put (&file, firstChild[i], 4);
+		zootcl_snapshot_put (&file, childCount[i], 4);
+		zootcl_snapshot_put (&file, (unsigned int)node->stat.version, 4);
+		zootcl_snapshot_put (&file, (unsigned int)node->stat.cversion, 4);
+		zootcl_snapshot_put (&file, node->stat.mzxid, 8);
+
+		pathOffset += pathLen + 1;
+		if (node->dataLen > 0) {
+			dataOffset += node->dataLen;
 		}
+	}
 
-		// handle errors from the call like bad arguments and stuff
-		if (status != ZOK) {
-			ckfree (stat);
-			return zootcl_set_tcl_return_code (interp, status);
+	for (i = 0; i < count; i++) {
+		zootcl_snapshot_put (&file, sorted[i].index, 4);
+	}
+	for (i = 0; i < count; i++) {
+		Tcl_DStringAppend (&file, orderPaths[i], strlen (orderPaths[i]) + 1);
+	}
+	for (i = 0; i < count; i++) {
+		if (order[i]->dataLen > 0) {
+			Tcl_DStringAppend (&file, order[i]->data, order[i]->dataLen);
 		}
+	}
 
-		// it does exist
-		Tcl_SetObjResult (interp, Tcl_NewBooleanObj (1));
+	ckfree (orderPaths);
+	ckfree (order);
+	ckfree (firstChild);
+	ckfree (childCount);
+	ckfree (sorted);
 
-		// if the caller wanted a stat array, we're good here,
-		// fill that.
-		if (statArray != NULL && zootcl_stat_to_array (interp, statArray, stat) == TCL_ERROR) {
-			ckfree (stat);
-			return TCL_ERROR;
+	// offsets are 32 bits
+	if (dataOffset > UINT_MAX) {
+		Tcl_DStringFree (&file);
+		zootcl_mirror_error (mirror, Tcl_NewStringObj ("mirror is too big for its file format", -1));
+		return TCL_ERROR;
+	}
+
+	// write it beside the old one and rename it over that
+	Tcl_Obj *newObj = Tcl_DuplicateObj (mirror->fileObj);
+	Tcl_AppendToObj (newObj, ".new", -1);
+	Tcl_IncrRefCount (newObj);
+
+	Tcl_Channel channel = Tcl_FSOpenFileChannel (NULL, newObj, "w", 0644);
+	int failed = (channel == NULL);
+
+	if (!failed) {
+		Tcl_SetChannelOption (NULL, channel, "-translation", "binary");
+		failed = (Tcl_Write (channel, Tcl_DStringValue (&file), Tcl_DStringLength (&file)) < 0);
+		if (Tcl_Close (NULL, channel) != TCL_OK) {
+			failed = 1;
 		}
+	}
+	if (!failed) {
+		failed = (Tcl_FSRenameFile (newObj, mirror->fileObj) != 0);
+	}
+	Tcl_DStringFree (&file);
 
-		// we want version so commonly and not much else in the stat array
-		// so we have a -version option to make it easy
-		if (versionVarObj != NULL) {
-			if (Tcl_SetVar2Ex (interp, Tcl_GetString (versionVarObj), NULL, Tcl_NewIntObj (stat->version), TCL_LEAVE_ERR_MSG) == NULL) {
-				ckfree (stat);
-				return TCL_ERROR;
-			}
+	if (failed) {
+		zootcl_mirror_error (mirror, Tcl_ObjPrintf ("error writing \"%s\": %s", Tcl_GetString (newObj), Tcl_ErrnoMsg (Tcl_GetErrno ())));
+		Tcl_FSDeleteFile (newObj);
+		Tcl_DecrRefCount (newObj);
+		return TCL_ERROR;
+	}
+	Tcl_DecrRefCount (newObj);
+
+	mirror->generation++;
+	zootcl_mirror_error (mirror, NULL);
+	return TCL_OK;
+}
+
+static void
+zootcl_mirror_write_timer (ClientData clientData)
+{
+	zootcl_mirror *mirror = (zootcl_mirror *)clientData;
+
+	mirror->writeTimer = NULL;
+	if (zootcl_mirror_write (mirror) != TCL_OK) {
+		// maybe the disk fills up, try again in a bit
+		mirror->writeTimer = Tcl_CreateTimerHandler (ZOOTCL_RECIPE_RETRY_MS, zootcl_mirror_write_timer, (ClientData)mirror);
+	}
+}
+
+/*
+ *--------------------------------------------------------------
+ *
+ * zootcl_mirror_event -- handle a mirror watch in the interpreter's
+ *   thread by reading the znode again
+ *
+ *--------------------------------------------------------------
+ */
+void
+zootcl_mirror_event (ClientData clientData, int type, int state)
+{
+	zootcl_mirrorWatch *mw = (zootcl_mirrorWatch *)clientData;
+	zootcl_mirror *mirror = mw->mirror;
+	char *path = mw->path;
+	int kind = mw->kind;
+
+	mw->path = NULL;
+	zootcl_mirror_free_watch (mw);
+
+	if (type == ZOO_SESSION_EVENT && !mirror->expired) {
+		// every watch we have hears about it, the file stays as it was
+		mirror->expired = 1;
+		zootcl_mirror_error (mirror, Tcl_NewStringObj ("session expired", -1));
+	}
+
+	if (mirror->closed) {
+		if (mirror->watchPending == 0) {
+			zootcl_mirror_forget (mirror);
+		}
+	} else if (!mirror->expired) {
+		zootcl_mirrorNode *node = zootcl_mirror_node (mirror, path);
+
+		if (kind == ZOOTCL_MIRROR_EXISTS) {
+			mirror->rootWatch = 0;
+		} else if (node != NULL && kind == ZOOTCL_MIRROR_DATA) {
+			node->dataWatch = 0;
+		} else if (node != NULL) {
+			node->childWatch = 0;
 		}
-		ckfree (stat);
-	} else {
-		// do the asynchronous version of znode existence check
-		zootcl_callbackContext *ztc = (zootcl_callbackContext *)ckalloc (sizeof (zootcl_callbackContext));
-		ztc->callbackObj = asyncCallbackObj;
-		ztc->zo = zo;
 
-		status = zoo_awexists (zh, path, wfn, (void *)watcherCallbackObj, zootcl_stat_completion_callback, ztc);
+		// something no longer in the mirror has nothing to look at
+		if (node != NULL || kind == ZOOTCL_MIRROR_EXISTS) {
+			char **paths = (char **)ckalloc (sizeof (char *));
+
+			paths[0] = path;
+			path = NULL;
+			zootcl_mirror_read (mirror, 1, paths);
+		}
 	}
 
-	return zootcl_set_tcl_return_code (interp, status);
+	if (path != NULL) {
+		ckfree (path);
+	}
+}
+
+/*
+ *--------------------------------------------------------------
+ *
+ * zootcl_mirror_cleanup -- free the mirrors of an object that is
+ *   being deleted.  their files stay.
+ *
+ *--------------------------------------------------------------
+ */
+void
+zootcl_mirror_cleanup (zootcl_objectClientData *zo)
+{
+	Tcl_HashSearch search;
+	Tcl_HashEntry *hashEntry;
+
+	for (hashEntry = Tcl_FirstHashEntry (&zo->mirrors, &search); hashEntry != NULL; hashEntry = Tcl_NextHashEntry (&search)) {
+		zootcl_mirror_free ((zootcl_mirror *)Tcl_GetHashValue (hashEntry));
+	}
+	Tcl_DeleteHashTable (&zo->mirrors);
+}
+
+static void
+zootcl_mirror_close (zootcl_mirror *mirror)
+{
+	if (mirror->timer != NULL) {
+		Tcl_DeleteTimerHandler (mirror->timer);
+		mirror->timer = NULL;
+	}
+	if (mirror->writeTimer != NULL) {
+		Tcl_DeleteTimerHandler (mirror->writeTimer);
+		mirror->writeTimer = NULL;
+	}
+
+	if (mirror->watchPending == 0) {
+		zootcl_mirror_forget (mirror);
+	} else {
+		// zookeeper still has watches pointing at it
+		mirror->closed = 1;
+		zootcl_mirror_clear (mirror);
+	}
 }
 
 /*
  *----------------------------------------------------------------------
  *
- * zootcl_get_subcommand --
+ * zootcl_mirror_subcommand --
  *
- *      implement the "get" methods of a zookeeper tcl command
+ *      implement the "mirror" method of a zookeeper tcl command
  *      object
  *
+ *      mirror open path file ?-delay ms?
+ *      mirror info path
+ *      mirror close path
+ *
  * Results:
  *      A standard Tcl result.
  *
- * NB: bears way too much in common with zootcl_exists_subcommand; needs factoring
  *
  *----------------------------------------------------------------------
  */
 int
-zootcl_get_subcommand(Tcl_Interp *interp, int objc, Tcl_Obj *CONST objv[], ZOOAPI zhandle_t *zh, zootcl_objectClientData *zo)
+zootcl_mirror_subcommand(Tcl_Interp *interp, int objc, Tcl_Obj *CONST objv[], ZOOAPI zhandle_t *zh, zootcl_objectClientData *zo)
 {
-	static CONST char *subOptions[] = {
-		"-watch",
-		"-async",
-		"-stat",
-		"-data",
-		"-version",
+	static CONST char *actions[] = {
+		"open",
+		"info",
+		"close",
 		NULL
 	};
 
-	enum subOptions {
-		SUBOPT_WATCH,
-		SUBOPT_ASYNC,
-		SUBOPT_STAT,
-		SUBOPT_DATA,
-		SUBOPT_VERSION
+	enum actions {
+		ACTION_OPEN,
+		ACTION_INFO,
+		ACTION_CLOSE
 	};
 
-	const char *path;
-	watcher_fn wfn = NULL;
-
+	int actionIndex;
+
     assert (zo->zookeeper_object_magic == ZOOKEEPER_OBJECT_MAGIC);
 
-	if (objc < 3) {
-		Tcl_WrongNumArgs (interp, 2, objv, "path ?-watch code? ?-stat statArray? ?-async callback? ?-data dataVar? ?-version versionVar?");
+	if (objc < 4) {
+		Tcl_WrongNumArgs (interp, 2, objv, "open|info|close path ?file? ?-delay ms?");
 		return TCL_ERROR;
 	}
 
-	path = Tcl_GetString (objv[2]);
+	if (Tcl_GetIndexFromObj (interp, objv[2], actions, "action", TCL_EXACT, &actionIndex) != TCL_OK) {
+		return TCL_ERROR;
+	}
 
-	int i;
-	int suboptIndex = 0;
-	Tcl_Obj *watcherCallbackObj = NULL;
-	Tcl_Obj *asyncCallbackObj = NULL;
-	char *statArray = NULL;
-	Tcl_Obj *dataVarObj = NULL;
-	Tcl_Obj *versionVarObj = NULL;
+	const char *path = zootcl_path_string (interp, objv[3]);
+	if (path == NULL) {
+		return TCL_ERROR;
+	}
 
-	for (i = 3; i < objc; i++) {
-		if (Tcl_GetIndexFromObj (interp, objv[i], subOptions, "suboption",
-			TCL_EXACT, &suboptIndex) != TCL_OK) {
-			return TCL_ERROR;
-		}
+	Tcl_HashEntry *hashEntry = Tcl_FindHashEntry (&zo->mirrors, path);
+	zootcl_mirror *mirror = (hashEntry == NULL) ? NULL : (zootcl_mirror *)Tcl_GetHashValue (hashEntry);
 
-		switch ((enum subOptions) suboptIndex) {
-			case SUBOPT_WATCH:
-			{
-				if (i + 1 >= objc) {
-					Tcl_WrongNumArgs (interp, 2, objv, "path ... -watch code");
-					return TCL_ERROR;
-				}
-				watcherCallbackObj = objv[++i];
-				Tcl_IncrRefCount (watcherCallbackObj);
-				break;
-			}
+	if (mirror != NULL && mirror->closed && (enum actions) actionIndex != ACTION_OPEN) {
+		mirror = NULL;
+	}
 
-			case SUBOPT_ASYNC:
-			{
-				if (i + 1 >= objc) {
-					Tcl_WrongNumArgs (interp, 2, objv, "path ... -async code");
-					return TCL_ERROR;
-				}
-				asyncCallbackObj = objv[++i];
-				Tcl_IncrRefCount (asyncCallbackObj);
-				break;
-			}
+	switch ((enum actions) actionIndex) {
+		case ACTION_OPEN:
+		{
+			int delay = 0;
 
-			case SUBOPT_STAT:
-			{
-				if (i + 1 >= objc) {
-					Tcl_WrongNumArgs (interp, 2, objv, "path ... -stat statArray");
+			if (objc != 5 && objc != 7) {
+				Tcl_WrongNumArgs (interp, 3, objv, "path file ?-delay ms?");
+				return TCL_ERROR;
+			}
+			if (objc == 7) {
+				if (strcmp (Tcl_GetString (objv[5]), "-delay") != 0) {
+					Tcl_SetObjResult (interp, Tcl_ObjPrintf ("bad suboption \"%s\": must be -delay", Tcl_GetString (objv[5])));
 					return TCL_ERROR;
 				}
-				statArray = Tcl_GetString (objv[++i]);
-				break;
-			}
-
-			case SUBOPT_DATA:
-			{
-				if (i + 1 >= objc) {
-					Tcl_WrongNumArgs (interp, 2, objv, "path ... -data dataVar");
+				if (Tcl_GetIntFromObj (interp, objv[6], &delay) == TCL_ERROR) {
 					return TCL_ERROR;
 				}
-				dataVarObj = objv[++i];
-				break;
-			}
-
-			case SUBOPT_VERSION:
-			{
-				if (i + 1 >= objc) {
-					Tcl_WrongNumArgs (interp, 2, objv, "path ... -version versionVar");
+				if (delay < 0) {
+					Tcl_SetObjResult (interp, Tcl_NewStringObj ("-delay can't be negative", -1));
 					return TCL_ERROR;
 				}
-				versionVarObj = objv[++i];
-				break;
 			}
-		}
-	}
-
-	if (asyncCallbackObj != NULL) {
-		if (statArray != NULL) {
-			Tcl_SetObjResult (interp, Tcl_NewStringObj ("-stat and -async options are mutually exclusive", -1));
-			return TCL_ERROR;
-		}
-
-		if (dataVarObj != NULL) {
-			Tcl_SetObjResult (interp, Tcl_NewStringObj ("-data and -async options are mutually exclusive", -1));
-			return TCL_ERROR;
-		}
 
-		if (versionVarObj != NULL) {
-			Tcl_SetObjResult (interp, Tcl_NewStringObj ("-version and -async options are mutually exclusive", -1));
-			return TCL_ERROR;
-		}
-	}
+			if (mirror != NULL && !mirror->closed) {
+				Tcl_SetObjResult (interp, Tcl_ObjPrintf ("mirror already open on \"%s\"", path));
+				return TCL_ERROR;
+			}
 
-	if (watcherCallbackObj != NULL) {
-		wfn = zootcl_watcher;
-	}
+			if (mirror == NULL) {
+				int isNew;
 
-	int status;
+				mirror = (zootcl_mirror *)ckalloc (sizeof (zootcl_mirror));
+				memset (mirror, 0, sizeof (zootcl_mirror));
+				mirror->zo = zo;
+				mirror->path = zootcl_mirror_strdup (path);
+				Tcl_InitHashTable (&mirror->nodes, TCL_STRING_KEYS);
+				Tcl_SetHashValue (Tcl_CreateHashEntry (&zo->mirrors, path, &isNew), (ClientData)mirror);
+			} else {
+				// reopened before the watches of the last time were
+				// all accounted for, carry on with them
+				Tcl_DecrRefCount (mirror->fileObj);
+				mirror->closed = 0;
+			}
 
-	// if asyncCallbackObj is null, do the synchronous version
-	if (asyncCallbackObj == NULL) {
-		// make the buffer 1MB + 1 byte since 1MB is the
-		// default maximum size for a znode's data
-		int bufferLen = 1048576 + 1;
-		char buffer[bufferLen];
-		struct Stat *stat = (struct Stat *)ckalloc (sizeof (struct Stat));
+			mirror->fileObj = objv[4];
+			Tcl_IncrRefCount (mirror->fileObj);
+			mirror->delay = delay;
 
-		status = zoo_wget(zh, path, wfn, (void *)watcherCallbackObj, buffer, &bufferLen, stat);	
+			// the first look is done here so the file is there when
+			// we return
+			char **paths = (char **)ckalloc (sizeof (char *));
+			paths[0] = zootcl_mirror_strdup (path);
+			zootcl_mirror_read (mirror, 1, paths);
 
-		// if the node does not exist and -data was specified
-		// unset the var: do the same if a -version var was
-		// also specified and, finally, return 0
-		if (status == ZNONODE && dataVarObj != NULL) {
-			Tcl_UnsetVar(interp, Tcl_GetString(dataVarObj), 0);
-			if (versionVarObj != NULL) {
-				Tcl_UnsetVar (interp, Tcl_GetString (versionVarObj), 0);
+			if (mirror->writeTimer != NULL) {
+				Tcl_DeleteTimerHandler (mirror->writeTimer);
+				mirror->writeTimer = NULL;
+			}
+			if (zootcl_mirror_write (mirror) != TCL_OK) {
+				Tcl_SetObjResult (interp, mirror->errorObj);
+				zootcl_mirror_close (mirror);
+				return TCL_ERROR;
 			}
-			Tcl_SetObjResult (interp, Tcl_NewBooleanObj (0));
-			ckfree (stat);
 			return TCL_OK;
 		}
 
-		if (status != ZOK) {
-			ckfree (stat);
-			return zootcl_set_tcl_return_code (interp, status);
-		}
+		case ACTION_INFO:
+		{
+			Tcl_Obj *listObjv[10];
 
-		if (dataVarObj == NULL) {
-			if (bufferLen != -1) {
-				Tcl_SetObjResult (interp, Tcl_NewStringObj(buffer, bufferLen));
+			if (objc != 4) {
+				Tcl_WrongNumArgs (interp, 3, objv, "path");
+				return TCL_ERROR;
 			}
-		} else if (bufferLen == -1) {
-			// if the node does exist, but the data in the znode is NULL
-			// unset the var name specified by -data
-			Tcl_UnsetVar(interp, Tcl_GetString(dataVarObj), 0);
-
-			// Need to set a boolean result to return to the caller
-			Tcl_SetObjResult (interp, Tcl_NewBooleanObj (1));
-		} else {
-			if (Tcl_SetVar2Ex (interp, Tcl_GetString (dataVarObj), NULL, Tcl_NewStringObj(buffer, bufferLen), TCL_LEAVE_ERR_MSG) == NULL) {
-				ckfree (stat);
+			if (mirror == NULL) {
+				Tcl_SetObjResult (interp, Tcl_ObjPrintf ("no mirror open on \"%s\"", path));
 				return TCL_ERROR;
 			}
-			Tcl_SetObjResult (interp, Tcl_NewBooleanObj (1));
-		}
 
-		if (statArray && zootcl_stat_to_array (interp, statArray, stat) == TCL_ERROR) {
-			ckfree (stat);
-			return TCL_ERROR;
+			listObjv[0] = Tcl_NewStringObj ("file", -1);
+			listObjv[1] = mirror->fileObj;
+			listObjv[2] = Tcl_NewStringObj ("znodes", -1);
+			listObjv[3] = Tcl_NewIntObj (mirror->nodes.numEntries);
+			listObjv[4] = Tcl_NewStringObj ("generation", -1);
+			listObjv[5] = Tcl_NewWideIntObj (mirror->generation);
+			listObjv[6] = Tcl_NewStringObj ("pending", -1);
+			listObjv[7] = Tcl_NewBooleanObj (mirror->writeTimer != NULL);
+			listObjv[8] = Tcl_NewStringObj ("error", -1);
+			listObjv[9] = (mirror->errorObj == NULL) ? Tcl_NewObj () : mirror->errorObj;
+			Tcl_SetObjResult (interp, Tcl_NewListObj (10, listObjv));
+			return TCL_OK;
 		}
 
-		if (versionVarObj != NULL) {
-			if (Tcl_SetVar2Ex (interp, Tcl_GetString (versionVarObj), NULL, Tcl_NewIntObj (stat->version), TCL_LEAVE_ERR_MSG) == NULL) {
-				ckfree (stat);
+		case ACTION_CLOSE:
+		{
+			if (objc != 4) {
+				Tcl_WrongNumArgs (interp, 3, objv, "path");
+				return TCL_ERROR;
+			}
+			if (mirror == NULL) {
+				Tcl_SetObjResult (interp, Tcl_ObjPrintf ("no mirror open on \"%s\"", path));
 				return TCL_ERROR;
 			}
-		}
-		ckfree (stat);
-	} else {
-		// do the asynchronous version
-		zootcl_callbackContext *ztc = (zootcl_callbackContext *)ckalloc (sizeof (zootcl_callbackContext));
-		ztc->callbackObj = asyncCallbackObj;
-		ztc->zo = zo;
 
-		status = zoo_awget (zh, path, wfn, (void *)watcherCallbackObj, zootcl_data_completion_callback, ztc);
+			zootcl_mirror_close (mirror);
+			return TCL_OK;
+		}
 	}
 
-	return zootcl_set_tcl_return_code (interp, status);
+	return TCL_OK;
 }
 
-
 /*
- *----------------------------------------------------------------------
+ * Mirror readers
  *
- * zootcl_children_subcommand --
+ * zookeeper::mirror open maps a mirror file read-only.  Every lookup
+ * first checks whether the writer has renamed a new file into place
+ * and maps that one if so; that's a stat, no locks and no session.
+ */
+TCL_DECLARE_MUTEX(zootcl_mirrorMutex)
+
+static int zootcl_mirrorReaderCount = 0;
+
+static void
+zootcl_mirror_unmap (zootcl_mirrorReader *reader)
+{
+	if (reader->map != NULL) {
+		munmap ((void *)reader->map, reader->mapSize);
+		reader->map = NULL;
+		reader->mapSize = 0;
+	}
+}
+
+/*
+ *--------------------------------------------------------------
  *
- *      implement the "children" method of a zookeeper tcl command
- *      object
+ * zootcl_mirror_map -- make sure the reader has the current file
+ *   mapped, mapping it again if it's been replaced
  *
  * Results:
- *      A standard Tcl result.
+ *      A standard Tcl result.  On error what was mapped stays.
  *
- *
- *----------------------------------------------------------------------
+ *--------------------------------------------------------------
  */
-int
-zootcl_children_subcommand(Tcl_Interp *interp, int objc, Tcl_Obj *CONST objv[], ZOOAPI zhandle_t *zh, zootcl_objectClientData *zo)
+static int
+zootcl_mirror_map (Tcl_Interp *interp, zootcl_mirrorReader *reader)
 {
-	Tcl_Obj *callbackObj = NULL;
-	Tcl_Obj *watcherCallbackObj = NULL;
-
-	static CONST char *subOptions[] = {
-		"-watch",
-		"-async",
-		NULL
-	};
-
-	enum subOptions {
-		SUBOPT_WATCH,
-		SUBOPT_ASYNC
-	};
+	const char *native = (const char *)Tcl_FSGetNativePath (reader->fileObj);
+	struct stat st;
 
-	char *path;
-	int i;
-	int suboptIndex = 0;
-	int status;
-	watcher_fn wfn = NULL;
-
-    assert (zo->zookeeper_object_magic == ZOOKEEPER_OBJECT_MAGIC);
+	if (native == NULL || stat (native, &st) != 0) {
+		Tcl_SetObjResult (interp, Tcl_ObjPrintf ("couldn't open \"%s\": %s", Tcl_GetString (reader->fileObj), Tcl_PosixError (interp)));
+		return TCL_ERROR;
+	}
+	if (reader->map != NULL && (Tcl_WideUInt)st.st_dev == reader->device && (Tcl_WideUInt)st.st_ino == reader->inode) {
+		return TCL_OK;
+	}
 
-	if ((objc < 3) || (objc > 7)) {
-		Tcl_WrongNumArgs (interp, 2, objv, "path ?-async callback? ?-watch code?");
+	int fd = open (native, O_RDONLY);
+	if (fd < 0 || fstat (fd, &st) != 0) {
+		Tcl_SetObjResult (interp, Tcl_ObjPrintf ("couldn't open \"%s\": %s", Tcl_GetString (reader->fileObj), Tcl_PosixError (interp)));
+		if (fd >= 0) {
+			close (fd);
+		}
 		return TCL_ERROR;
 	}
 
-	path = Tcl_GetString (objv[2]);
+	const unsigned char *map = NULL;
+	size_t mapSize = (size_t)st.st_size;
 
-	for (i = 3; i < objc; i++) {
-		if (Tcl_GetIndexFromObj (interp, objv[i], subOptions, "suboption",
-			TCL_EXACT, &suboptIndex) != TCL_OK) {
+	if (mapSize >= ZOOTCL_MIRROR_HEADER_SIZE) {
+		map = (const unsigned char *)mmap (NULL, mapSize, PROT_READ, MAP_SHARED, fd, 0);
+		if (map == (const unsigned char *)MAP_FAILED) {
+			Tcl_SetObjResult (interp, Tcl_ObjPrintf ("couldn't map \"%s\": %s", Tcl_GetString (reader->fileObj), Tcl_PosixError (interp)));
+			close (fd);
 			return TCL_ERROR;
 		}
+	}
+	close (fd);
 
-		switch ((enum subOptions) suboptIndex) {
-			case SUBOPT_WATCH:
-			{
-				if (i + 1 >= objc) {
-					Tcl_WrongNumArgs (interp, 2, objv, "path ... -watch code");
-					return TCL_ERROR;
-				}
-				watcherCallbackObj = objv[++i];
-				Tcl_IncrRefCount (watcherCallbackObj);
-				break;
-			}
-
-			case SUBOPT_ASYNC:
-			{
-				if (i + 1 >= objc) {
-					Tcl_WrongNumArgs (interp, 2, objv, "-async code");
-					return TCL_ERROR;
-				}
-				callbackObj = objv[++i];
-				Tcl_IncrRefCount (callbackObj);
-				break;
-			}
+	if (map == NULL || memcmp (map, ZOOTCL_MIRROR_MAGIC, 8) != 0 || zootcl_snapshot_get (map + 8, 4) != ZOOTCL_MIRROR_VERSION
+	  || ZOOTCL_MIRROR_HEADER_SIZE + zootcl_snapshot_get (map + 12, 4) * (ZOOTCL_MIRROR_ENTRY_SIZE + 4) > mapSize) {
+		if (map != NULL) {
+			munmap ((void *)map, mapSize);
 		}
+		Tcl_SetObjResult (interp, Tcl_ObjPrintf ("\"%s\" isn't a zookeeper mirror", Tcl_GetString (reader->fileObj)));
+		return TCL_ERROR;
 	}
 
-	if (watcherCallbackObj != NULL) {
-		wfn = zootcl_watcher;
-	}
+	zootcl_mirror_unmap (reader);
+	reader->map = map;
+	reader->mapSize = mapSize;
+	reader->device = (Tcl_WideUInt)st.st_dev;
+	reader->inode = (Tcl_WideUInt)st.st_ino;
+	return TCL_OK;
+}
 
+static unsigned int
+zootcl_mirror_count (zootcl_mirrorReader *reader)
+{
+	return (unsigned int)zootcl_snapshot_get (reader->map + 12, 4);
+}
 
-	if (callbackObj == NULL) {
-		struct String_vector *strings = (struct String_vector *)ckalloc (sizeof (struct String_vector));
-		status = zoo_wget_children(zh, path, wfn, (void *)watcherCallbackObj, strings);	
+static const unsigned char *
+zootcl_mirror_entry (zootcl_mirrorReader *reader, unsigned int index)
+{
+	return reader->map + ZOOTCL_MIRROR_HEADER_SIZE + (size_t)index * ZOOTCL_MIRROR_ENTRY_SIZE;
+}
 
-		if (status != ZOK && status != ZNONODE) {
-			ckfree (strings);
-			return zootcl_set_tcl_return_code (interp, status);
-		} else if (status == ZNONODE) {
-			// do not consider a non-existent path to be an error in this case
-			status = ZOK;
-			strings->count = 0;
-		}
-		
-        if (strings->count > 0) {
-            Tcl_Obj **listObjv = (Tcl_Obj **)ckalloc (sizeof(Tcl_Obj *) * strings->count);
+// the path of an entry, NULL if it points outside the file
+static const char *
+zootcl_mirror_entry_path (zootcl_mirrorReader *reader, const unsigned char *entry, size_t *lengthPtr)
+{
+	Tcl_WideUInt offset = zootcl_snapshot_get (entry, 4);
+	Tcl_WideUInt length = zootcl_snapshot_get (entry + 4, 4);
 
-            for (i = 0; i < strings->count; i++) {
-                listObjv[i] = Tcl_NewStringObj (strings->data[i], -1);
-            }
+	if (offset + length >= reader->mapSize) {
+		return NULL;
+	}
+	*lengthPtr = (size_t)length;
+	return (const char *)reader->map + offset;
+}
 
-            Tcl_Obj *listObj = Tcl_NewListObj (strings->count, listObjv);
-		    Tcl_SetObjResult (interp, listObj);
-        } else {
-            Tcl_SetObjResult (interp, Tcl_NewListObj (0, NULL));    
-        }
+/*
+ *--------------------------------------------------------------
+ *
+ * zootcl_mirror_find -- binary search the index for a path
+ *
+ * Results:
+ *      the entry number, or -1 if the path isn't in the mirror
+ *
+ *--------------------------------------------------------------
+ */
+static int
+zootcl_mirror_find (zootcl_mirrorReader *reader, const char *path)
+{
+	unsigned int count = zootcl_mirror_count (reader);
+	const unsigned char *index = zootcl_mirror_entry (reader, count);
+	size_t length = strlen (path);
+	unsigned int lo = 0;
+	unsigned int hi = count;
+
+	while (lo < hi) {
+		unsigned int mid = lo + (hi - lo) / 2;
+		unsigned int entryIndex = (unsigned int)zootcl_snapshot_get (index + 4 * mid, 4);
+		const char *entryPath;
+		size_t entryLength;
+		int cmp;
+
+		if (entryIndex >= count || (entryPath = zootcl_mirror_entry_path (reader, zootcl_mirror_entry (reader, entryIndex), &entryLength)) == NULL) {
+			return -1;
+		}
 
-		ckfree (strings);
-	} else {
-		zootcl_callbackContext *ztc = (zootcl_callbackContext *)ckalloc (sizeof (zootcl_callbackContext));
-		ztc->callbackObj = callbackObj;
-		ztc->zo = zo;
-		status = zoo_awget_children (zh, path, wfn, watcherCallbackObj, zootcl_strings_completion_callback, ztc);
+		cmp = memcmp (path, entryPath, (length < entryLength) ? length : entryLength);
+		if (cmp == 0) {
+			cmp = (length < entryLength) ? -1 : (length > entryLength);
+		}
+		if (cmp == 0) {
+			return (int)entryIndex;
+		}
+		if (cmp < 0) {
+			hi = mid;
+		} else {
+			lo = mid + 1;
+		}
 	}
+	return -1;
+}
 
-	return zootcl_set_tcl_return_code (interp, status);
+static int
+zootcl_mirror_corrupt (Tcl_Interp *interp, zootcl_mirrorReader *reader)
+{
+	Tcl_SetObjResult (interp, Tcl_ObjPrintf ("mirror \"%s\" is corrupt", Tcl_GetString (reader->fileObj)));
+	return TCL_ERROR;
 }
 
 /*
  *----------------------------------------------------------------------
  *
- * zootcl_set_subcommand --
+ * zootcl_mirrorReaderObjCmd --
  *
- *      implement the "set" method of a zookeeper tcl command
- *      object
+ *      implement a mirror reader command
+ *
+ *      $m get path
+ *      $m exists path
+ *      $m children path
+ *      $m stat path
+ *      $m zxid
+ *      $m generation
+ *      $m close
  *
  * Results:
  *      A standard Tcl result.
  *
- *
  *----------------------------------------------------------------------
  */
 int
-zootcl_set_subcommand(Tcl_Interp *interp, int objc, Tcl_Obj *CONST objv[], ZOOAPI zhandle_t *zh, zootcl_objectClientData *zo)
+zootcl_mirrorReaderObjCmd(ClientData clientData, Tcl_Interp *interp, int objc, Tcl_Obj *CONST objv[])
 {
-	Tcl_Obj *callbackObj = NULL;
-
-	static CONST char *subOptions[] = {
-		"-async",
+	zootcl_mirrorReader *reader = (zootcl_mirrorReader *)clientData;
+
+	static CONST char *options[] = {
+		"get",
+		"exists",
+		"children",
+		"stat",
+		"zxid",
+		"generation",
+		"close",
 		NULL
 	};
 
-	enum subOptions {
-		SUBOPT_ASYNC
+	enum options {
+		OPT_GET,
+		OPT_EXISTS,
+		OPT_CHILDREN,
+		OPT_STAT,
+		OPT_ZXID,
+		OPT_GENERATION,
+		OPT_CLOSE
 	};
 
-	char *path;
-	char *buffer;
-	int bufferLen = 0;
-	int version = 0;
-
-	int i;
-	int suboptIndex = 0;
+	int optIndex;
+	int index = -1;
+	const unsigned char *entry = NULL;
 
-    assert (zo->zookeeper_object_magic == ZOOKEEPER_OBJECT_MAGIC);
+	if (objc < 2) {
+		Tcl_WrongNumArgs (interp, 1, objv, "subcommand ?args?");
+		return TCL_ERROR;
+	}
 
-	if ((objc < 5) || (objc > 7)) {
-		Tcl_WrongNumArgs (interp, 2, objv, "path data version ?-async callback?");
+	if (Tcl_GetIndexFromObj (interp, objv[1], options, "subcommand", TCL_EXACT, &optIndex) != TCL_OK) {
 		return TCL_ERROR;
 	}
 
-	path = Tcl_GetString (objv[2]);
-	buffer = Tcl_GetStringFromObj (objv[3], &bufferLen);
+	if ((enum options) optIndex == OPT_CLOSE) {
+		if (objc != 2) {
+			Tcl_WrongNumArgs (interp, 2, objv, "");
+			return TCL_ERROR;
+		}
+		Tcl_DeleteCommandFromToken (interp, reader->cmdToken);
+		return TCL_OK;
+	}
 
-	if (Tcl_GetIntFromObj (interp, objv[4], &version) == TCL_ERROR) {
+	if (zootcl_mirror_map (interp, reader) != TCL_OK) {
 		return TCL_ERROR;
 	}
 
-	for (i = 5; i < objc; i++) {
-		if (Tcl_GetIndexFromObj (interp, objv[i], subOptions, "suboption",
-			TCL_EXACT, &suboptIndex) != TCL_OK) {
+	if (optIndex <= OPT_STAT) {
+		if (objc != 3) {
+			Tcl_WrongNumArgs (interp, 2, objv, "path");
 			return TCL_ERROR;
 		}
 
-		switch ((enum subOptions) suboptIndex) {
-			case SUBOPT_ASYNC:
-			{
-				if (i + 1 >= objc) {
-					Tcl_WrongNumArgs (interp, 2, objv, "-async code");
-					return TCL_ERROR;
+		const char *path = zootcl_path_string (interp, objv[2]);
+		if (path == NULL) {
+			return TCL_ERROR;
+		}
+
+		index = zootcl_mirror_find (reader, path);
+		if (index < 0 && (enum options) optIndex != OPT_EXISTS) {
+			return zootcl_set_tcl_return_code (interp, ZNONODE);
+		}
+		if (index >= 0) {
+			entry = zootcl_mirror_entry (reader, index);
+		}
+	} else if (objc != 2) {
+		Tcl_WrongNumArgs (interp, 2, objv, "");
+		return TCL_ERROR;
+	}
+
+	switch ((enum options) optIndex) {
+		case OPT_GET:
+		{
+			Tcl_WideUInt offset = zootcl_snapshot_get (entry + 8, 4);
+			int dataLen = (int)(unsigned int)zootcl_snapshot_get (entry + 12, 4);
+
+			if (dataLen < 0) {
+				Tcl_SetObjResult (interp, Tcl_NewObj ());
+				return TCL_OK;
+			}
+			if (offset + dataLen > reader->mapSize) {
+				return zootcl_mirror_corrupt (interp, reader);
+			}
+			Tcl_SetObjResult (interp, Tcl_NewStringObj ((const char *)reader->map + offset, dataLen));
+			return TCL_OK;
+		}
+
+		case OPT_EXISTS:
+			Tcl_SetObjResult (interp, Tcl_NewBooleanObj (index >= 0));
+			return TCL_OK;
+
+		case OPT_CHILDREN:
+		{
+			unsigned int first = (unsigned int)zootcl_snapshot_get (entry + 16, 4);
+			unsigned int count = (unsigned int)zootcl_snapshot_get (entry + 20, 4);
+			Tcl_Obj *listObj = Tcl_NewObj ();
+			unsigned int i;
+
+			if ((Tcl_WideUInt)first + count > zootcl_mirror_count (reader)) {
+				Tcl_DecrRefCount (listObj);
+				return zootcl_mirror_corrupt (interp, reader);
+			}
+
+			for (i = first; i < first + count; i++) {
+				size_t length;
+				const char *childPath = zootcl_mirror_entry_path (reader, zootcl_mirror_entry (reader, i), &length);
+				const char *tail;
+
+				if (childPath == NULL || memchr (childPath, '\0', length + 1) == NULL || (tail = strrchr (childPath, '/')) == NULL) {
+					Tcl_DecrRefCount (listObj);
+					return zootcl_mirror_corrupt (interp, reader);
 				}
-				callbackObj = objv[++i];
-				Tcl_IncrRefCount (callbackObj);
-				break;
+				Tcl_ListObjAppendElement (NULL, listObj, Tcl_NewStringObj (tail + 1, -1));
 			}
+			Tcl_SetObjResult (interp, listObj);
+			return TCL_OK;
 		}
-	}
 
-	int status;
+		case OPT_STAT:
+		{
+			Tcl_Obj *listObjv[10];
+			int dataLen = (int)(unsigned int)zootcl_snapshot_get (entry + 12, 4);
+
+			listObjv[0] = Tcl_NewStringObj ("version", -1);
+			listObjv[1] = Tcl_NewIntObj ((int)(unsigned int)zootcl_snapshot_get (entry + 24, 4));
+			listObjv[2] = Tcl_NewStringObj ("cversion", -1);
+			listObjv[3] = Tcl_NewIntObj ((int)(unsigned int)zootcl_snapshot_get (entry + 28, 4));
+			listObjv[4] = Tcl_NewStringObj ("mzxid", -1);
+			listObjv[5] = Tcl_NewWideIntObj ((Tcl_WideInt)zootcl_snapshot_get (entry + 32, 8));
+			listObjv[6] = Tcl_NewStringObj ("dataLength", -1);
+			listObjv[7] = Tcl_NewIntObj (dataLen < 0 ? 0 : dataLen);
+			listObjv[8] = Tcl_NewStringObj ("numChildren", -1);
+			listObjv[9] = Tcl_NewIntObj ((int)zootcl_snapshot_get (entry + 20, 4));
+			Tcl_SetObjResult (interp, Tcl_NewListObj (10, listObjv));
+			return TCL_OK;
+		}
 
-	if (callbackObj == NULL) {
-		// synchronous set
-		struct Stat *stat = (struct Stat *)ckalloc (sizeof (struct Stat));
-		status = zoo_set2(zh, path, buffer, bufferLen, version, stat);
+		case OPT_ZXID:
+			Tcl_SetObjResult (interp, Tcl_NewWideIntObj ((Tcl_WideInt)zootcl_snapshot_get (reader->map + 16, 8)));
+			return TCL_OK;
 
-		ckfree (stat);
-	} else {
-		// asynchronous set
-		zootcl_callbackContext *ztc = (zootcl_callbackContext *)ckalloc (sizeof (zootcl_callbackContext));
-		ztc->zo = zo;
-		ztc->callbackObj = callbackObj;
-		status = zoo_aset (zh, path, buffer, bufferLen, version, zootcl_stat_completion_callback, ztc);
+		case OPT_GENERATION:
+			Tcl_SetObjResult (interp, Tcl_NewWideIntObj ((Tcl_WideInt)zootcl_snapshot_get (reader->map + 24, 8)));
+			return TCL_OK;
+
+		case OPT_CLOSE:
+			break;
 	}
-	return zootcl_set_tcl_return_code (interp, status);
+
+	return TCL_OK;
+}
+
+static void
+zootcl_mirrorReaderDelete (ClientData clientData)
+{
+	zootcl_mirrorReader *reader = (zootcl_mirrorReader *)clientData;
+
+	zootcl_mirror_unmap (reader);
+	Tcl_DecrRefCount (reader->fileObj);
+	ckfree (reader);
 }
 
 /*
  *----------------------------------------------------------------------
  *
- * zootcl_create_subcommand --
+ * zootcl_mirrorObjCmd --
  *
- *      implement the "create" method of a zookeeper tcl command
- *      object
+ *      implement the zookeeper::mirror command
  *
- * Results:
- *      A standard Tcl result.
+ *      zookeeper::mirror open file
  *
+ * Results:
+ *      A standard Tcl result, the name of a new command to read the
+ *      mirror with.
  *
  *----------------------------------------------------------------------
  */
 int
-zootcl_create_subcommand(Tcl_Interp *interp, int objc, Tcl_Obj *CONST objv[], ZOOAPI zhandle_t *zh, zootcl_objectClientData *zo)
+zootcl_mirrorObjCmd(ClientData clientData, Tcl_Interp *interp, int objc, Tcl_Obj *CONST objv[])
 {
-	static CONST char *subOptions[] = {
-		"-async",
-		"-value",
-		"-ephemeral",
-		"-sequence",
+	static CONST char *actions[] = {
+		"open",
 		NULL
 	};
 
-	enum subOptions {
-		SUBOPT_ASYNC,
-		SUBOPT_VALUE,
-		SUBOPT_EPHEMERAL,
-		SUBOPT_SEQUENCE
-	};
-
-	char *path;
-	int valueLen = -1;
-	char *value = NULL;
-	int flags = 0;
-
-    assert (zo->zookeeper_object_magic == ZOOKEEPER_OBJECT_MAGIC);
+	int actionIndex;
+	char cmdName[64];
 
-	if (objc < 3)  {
-		Tcl_WrongNumArgs (interp, 2, objv, "path ?-value value? ?-ephemeral? ?-sequence? ?-async callback?");
+	if (objc != 3) {
+		Tcl_WrongNumArgs (interp, 1, objv, "open file");
 		return TCL_ERROR;
 	}
-	path = Tcl_GetString (objv[2]);
-	int i;
-	int suboptIndex = 0;
-	Tcl_Obj *callbackObj = NULL;
-
-	for (i = 3; i < objc; i++) {
-		if (Tcl_GetIndexFromObj (interp, objv[i], subOptions, "suboption",
-			TCL_EXACT, &suboptIndex) != TCL_OK) {
-			return TCL_ERROR;
-		}
-
-		switch ((enum subOptions) suboptIndex) {
-			case SUBOPT_ASYNC:
-			{
-				if (i + 1 >= objc) {
-					Tcl_WrongNumArgs (interp, 2, objv, "-async callback");
-					return TCL_ERROR;
-				}
-				callbackObj = objv[++i];
-				Tcl_IncrRefCount (callbackObj);
-				break;
-			}
-			case SUBOPT_VALUE:
-			{
-				if (i + 1 >= objc) {
-					Tcl_WrongNumArgs (interp, 2, objv, "-value value");
-					return TCL_ERROR;
-				}
-				value = Tcl_GetStringFromObj (objv[++i], &valueLen);
-				break;
-			}
-
-			case SUBOPT_EPHEMERAL:
-			{
-				flags |= ZOO_EPHEMERAL;
-				break;
-			}
 
-			case SUBOPT_SEQUENCE:
-			{
-				flags |= ZOO_SEQUENCE;
-				break;
-			}
-		}
+	if (Tcl_GetIndexFromObj (interp, objv[1], actions, "action", TCL_EXACT, &actionIndex) != TCL_OK) {
+		return TCL_ERROR;
 	}
 
-	int status;
+	zootcl_mirrorReader *reader = (zootcl_mirrorReader *)ckalloc (sizeof (zootcl_mirrorReader));
+	memset (reader, 0, sizeof (zootcl_mirrorReader));
+	reader->fileObj = objv[2];
+	Tcl_IncrRefCount (reader->fileObj);
 
-	if (callbackObj == NULL) {
-		// sync version
-		int pathBufferLen = 1024;
-		char pathBuffer[pathBufferLen];
-		status = zoo_create(zh, path, value, valueLen, &ZOO_OPEN_ACL_UNSAFE, flags, pathBuffer, pathBufferLen - 1);
+	if (zootcl_mirror_map (interp, reader) != TCL_OK) {
+		zootcl_mirrorReaderDelete ((ClientData)reader);
+		return TCL_ERROR;
+	}
 
-		if (status != ZOK) {
-			return zootcl_set_tcl_return_code (interp, status);
-		}
+	Tcl_MutexLock (&zootcl_mirrorMutex);
+	snprintf (cmdName, sizeof (cmdName), "::zookeeper::mirror%d", zootcl_mirrorReaderCount++);
+	Tcl_MutexUnlock (&zootcl_mirrorMutex);
 
-		if (status == ZOK) {
-			Tcl_SetObjResult (interp, Tcl_NewStringObj(pathBuffer, -1));
-		}
-	} else {
-		zootcl_callbackContext *ztc = (zootcl_callbackContext *)ckalloc (sizeof (zootcl_callbackContext));
-		ztc->callbackObj = callbackObj;
-		ztc->zo = zo;
-		status = zoo_acreate (zh, path, value, valueLen, &ZOO_OPEN_ACL_UNSAFE, flags, zootcl_string_completion_callback, ztc);
-	}
-	return zootcl_set_tcl_return_code (interp, status);
+	reader->cmdToken = Tcl_CreateObjCommand (interp, cmdName, zootcl_mirrorReaderObjCmd, (ClientData)reader, zootcl_mirrorReaderDelete);
+	Tcl_SetObjResult (interp, Tcl_NewStringObj (cmdName, -1));
+	return TCL_OK;
 }
 
 /*
  *----------------------------------------------------------------------
  *
- * zootcl_delete_subcommand --
+ * zootcl_servers_subcommand --
  *
- *      implement the "delete" method of a zookeeper tcl command
+ *      implement the "servers" method of a zookeeper tcl command
  *      object
  *
+ *      with no argument return the host list we're using.  with one,
+ *      hand the new host list to zoo_set_servers, which uses
+ *      probabilistic rebalancing to decide whether this client should
+ *      move to one of the new servers to keep load even.
+ *
  * Results:
  *      A standard Tcl result.
  *
@@ -1876,69 +11959,33 @@ zootcl_create_subcommand(Tcl_Interp *interp, int objc, Tcl_Obj *CONST objv[], ZO
  *----------------------------------------------------------------------
  */
 int
-zootcl_delete_subcommand(Tcl_Interp *interp, int objc, Tcl_Obj *CONST objv[], ZOOAPI zhandle_t *zh, zootcl_objectClientData *zo)
+zootcl_servers_subcommand(Tcl_Interp *interp, int objc, Tcl_Obj *CONST objv[], ZOOAPI zhandle_t *zh, zootcl_objectClientData *zo)
 {
-	Tcl_Obj *callbackObj = NULL;
-	int status;
-
-	static CONST char *subOptions[] = {
-		"-async",
-		NULL
-	};
-
-	enum subOptions {
-		SUBOPT_ASYNC
-	};
-
-	char *path;
-	int version = 0;
-	int i;
-	int suboptIndex = 0;
-
     assert (zo->zookeeper_object_magic == ZOOKEEPER_OBJECT_MAGIC);
 
-	if ((objc < 4) || (objc > 6)) {
-		Tcl_WrongNumArgs (interp, 2, objv, "path version ?-async callback?");
-		return TCL_ERROR;
-	}
-
-	path = Tcl_GetString (objv[2]);
-
-	if (Tcl_GetIntFromObj (interp, objv[3], &version) == TCL_ERROR) {
+	if ((objc < 2) || (objc > 3)) {
+		Tcl_WrongNumArgs (interp, 2, objv, "?hostList?");
 		return TCL_ERROR;
 	}
 
-	for (i = 4; i < objc; i++) {
-		if (Tcl_GetIndexFromObj (interp, objv[i], subOptions, "suboption",
-			TCL_EXACT, &suboptIndex) != TCL_OK) {
-			return TCL_ERROR;
-		}
-
-		switch ((enum subOptions) suboptIndex) {
-			case SUBOPT_ASYNC:
-			{
-				if (i + 1 >= objc) {
-					Tcl_WrongNumArgs (interp, 2, objv, "-async code");
-					return TCL_ERROR;
-				}
-				callbackObj = objv[++i];
-				Tcl_IncrRefCount (callbackObj);
-				break;
-			}
+	if (objc == 3) {
+#ifdef ZOOTCL_ZOO_35
+		int status = zoo_set_servers (zh, Tcl_GetString (objv[2]));
+		if (status != ZOK) {
+			return zootcl_set_tcl_return_code (interp, status);
 		}
-	}
 
-	if (callbackObj == NULL) {
-		// synchronous delete
-		status = zoo_delete(zh, path, version);
-	} else {
-		zootcl_callbackContext *ztc = (zootcl_callbackContext *)ckalloc (sizeof (zootcl_callbackContext));
-		ztc->callbackObj = callbackObj;
-		ztc->zo = zo;
-		status = zoo_adelete (zh, path, version, zootcl_void_completion_callback, ztc);
+		Tcl_DecrRefCount (zo->hostsObj);
+		zo->hostsObj = objv[2];
+		Tcl_IncrRefCount (zo->hostsObj);
+#else
+		Tcl_SetObjResult (interp, Tcl_NewStringObj ("changing servers requires zookeeper C library 3.5 or later", -1));
+		return TCL_ERROR;
+#endif
 	}
 
-	return zootcl_set_tcl_return_code (interp, status);
+	Tcl_SetObjResult (interp, zo->hostsObj);
+	return TCL_OK;
 }
 
 /*
@@ -2004,6 +12051,23 @@ zootcl_zookeeperObjectObjCmd(ClientData clientData, Tcl_Interp *interp, int objc
 		"server",
         "recv_timeout",
         "is_unrecoverable",
+		"session_id",
+		"servers",
+		"lock",
+		"election",
+		"queue",
+		"barrier",
+		"update",
+		"counter",
+		"registry",
+		"inflight",
+		"cancel",
+		"await",
+		"metrics",
+		"trace",
+		"hotkeys",
+		"snapshot",
+		"mirror",
 		"close",
 		"destroy",
         NULL
@@ -2020,6 +12084,23 @@ zootcl_zookeeperObjectObjCmd(ClientData clientData, Tcl_Interp *interp, int objc
 		OPT_SERVER,
 		OPT_RECV_TIMEOUT,
 		OPT_IS_UNRECOVERABLE,
+		OPT_SESSION_ID,
+		OPT_SERVERS,
+		OPT_LOCK,
+		OPT_ELECTION,
+		OPT_QUEUE,
+		OPT_BARRIER,
+		OPT_UPDATE,
+		OPT_COUNTER,
+		OPT_REGISTRY,
+		OPT_INFLIGHT,
+		OPT_CANCEL,
+		OPT_AWAIT,
+		OPT_METRICS,
+		OPT_TRACE,
+		OPT_HOTKEYS,
+		OPT_SNAPSHOT,
+		OPT_MIRROR,
 		OPT_CLOSE,
 		OPT_DESTROY
     };
@@ -2036,6 +12117,9 @@ zootcl_zookeeperObjectObjCmd(ClientData clientData, Tcl_Interp *interp, int objc
         return TCL_ERROR;
     }
 
+	// most subcommands hand the client a request
+	zootcl_session_ready (zo);
+
 	// hand off each subcommand to its proper handler
     switch ((enum options) optIndex) {
 		case OPT_EXISTS:
@@ -2106,6 +12190,66 @@ zootcl_zookeeperObjectObjCmd(ClientData clientData, Tcl_Interp *interp, int objc
 			break;
 		}
 
+		case OPT_SESSION_ID:
+		{
+			if (objc != 2) {
+				Tcl_WrongNumArgs (interp, 2, objv, "");
+				return TCL_ERROR;
+			}
+
+			// only meaningful once connected; before that the id is zero
+			Tcl_SetObjResult (interp, zootcl_client_id_to_obj (zoo_client_id (zh)));
+			break;
+		}
+
+		case OPT_SERVERS:
+			return zootcl_servers_subcommand(interp, objc, objv, zh, zo);
+
+		case OPT_LOCK:
+			return zootcl_lock_subcommand(interp, objc, objv, zh, zo);
+
+		case OPT_ELECTION:
+			return zootcl_election_subcommand(interp, objc, objv, zh, zo);
+
+		case OPT_QUEUE:
+			return zootcl_queue_subcommand(interp, objc, objv, zh, zo);
+
+		case OPT_BARRIER:
+			return zootcl_barrier_subcommand(interp, objc, objv, zh, zo);
+
+		case OPT_UPDATE:
+			return zootcl_update_subcommand(interp, objc, objv, zh, zo);
+
+		case OPT_COUNTER:
+			return zootcl_counter_subcommand(interp, objc, objv, zh, zo);
+
+		case OPT_REGISTRY:
+			return zootcl_registry_subcommand(interp, objc, objv, zh, zo);
+
+		case OPT_INFLIGHT:
+			return zootcl_inflight_subcommand(interp, objc, objv, zh, zo);
+
+		case OPT_CANCEL:
+			return zootcl_cancel_subcommand(interp, objc, objv, zh, zo);
+
+		case OPT_AWAIT:
+			return zootcl_await_subcommand(interp, objc, objv, zh, zo);
+
+		case OPT_METRICS:
+			return zootcl_metrics_subcommand(interp, objc, objv, zo);
+
+		case OPT_TRACE:
+			return zootcl_trace_subcommand(interp, objc, objv, zh, zo);
+
+		case OPT_HOTKEYS:
+			return zootcl_hotkeys_subcommand(interp, objc, objv, zh, zo);
+
+		case OPT_SNAPSHOT:
+			return zootcl_snapshot_subcommand(interp, objc, objv, zh, zo);
+
+		case OPT_MIRROR:
+			return zootcl_mirror_subcommand(interp, objc, objv, zh, zo);
+
 		case OPT_CLOSE:
 		case OPT_DESTROY:
 			return zootcl_destroy_subcommand(interp, objc, objv, zh, zo);
@@ -2135,20 +12279,30 @@ zootcl_init_subcommand(Tcl_Interp *interp, int objc, Tcl_Obj *CONST objv[])
 {
 	zootcl_objectClientData *zo = NULL;
 	int timeout;
+	int flags = 0;
 	Tcl_Obj *callbackObj = NULL;
+	clientid_t clientId;
+	clientid_t *clientIdPtr = NULL;
+	int maxInFlight = 0;
 
 	static CONST char *subOptions[] = {
 		"-async",
+		"-readonly",
+		"-session",
+		"-maxinflight",
 		NULL
 	};
 
 	enum subOptions {
-		SUBOPT_ASYNC
+		SUBOPT_ASYNC,
+		SUBOPT_READONLY,
+		SUBOPT_SESSION,
+		SUBOPT_MAXINFLIGHT
 	};
 
 
-	if ((objc < 5) || (objc > 7)) {
-		Tcl_WrongNumArgs (interp, 2, objv, "cmdName hosts timeout ?-async callback?");
+	if ((objc < 5) || (objc > 12)) {
+		Tcl_WrongNumArgs (interp, 2, objv, "cmdName hosts timeout ?-async callback? ?-readonly? ?-session {id passwd}? ?-maxinflight n?");
 		return TCL_ERROR;
 	}
 
@@ -2179,22 +12333,90 @@ zootcl_init_subcommand(Tcl_Interp *interp, int objc, Tcl_Obj *CONST objv[])
 				Tcl_IncrRefCount (callbackObj);
 				break;
 			}
+
+			case SUBOPT_READONLY:
+			{
+#ifdef ZOOTCL_ZOO_35
+				// allow the session to attach to (and stay on) a
+				// server that has lost quorum; reads keep working,
+				// writes fail with ZNOTREADONLY
+				flags |= ZOO_READONLY;
+				break;
+#else
+				Tcl_SetObjResult (interp, Tcl_NewStringObj ("-readonly is not supported by this version of the zookeeper C library", -1));
+				return TCL_ERROR;
+#endif
+			}
+
+			case SUBOPT_SESSION:
+			{
+				if (i + 1 >= objc) {
+					Tcl_WrongNumArgs (interp, 2, objv, "-session {id passwd}");
+					return TCL_ERROR;
+				}
+				// reattach to a session exported with "$zk session_id",
+				// keeping its ephemerals if it hasn't expired yet
+				if (zootcl_obj_to_client_id (interp, objv[++i], &clientId) == TCL_ERROR) {
+					return TCL_ERROR;
+				}
+				clientIdPtr = &clientId;
+				break;
+			}
+
+			case SUBOPT_MAXINFLIGHT:
+			{
+				if (i + 1 >= objc) {
+					Tcl_WrongNumArgs (interp, 2, objv, "-maxinflight n");
+					return TCL_ERROR;
+				}
+				if (Tcl_GetIntFromObj (interp, objv[++i], &maxInFlight) == TCL_ERROR) {
+					return TCL_ERROR;
+				}
+				if (maxInFlight < 0) {
+					Tcl_SetObjResult (interp, Tcl_NewStringObj ("-maxinflight can't be negative", -1));
+					return TCL_ERROR;
+				}
+				break;
+			}
 		}
 	}
 	//
 	// allocate one of our zookeeper client data objects for Tcl and configure it
+	// the init callback can run on the IO thread before zookeeper_init
+	// even returns, so everything it looks at is set up first
 	zo = (zootcl_objectClientData *)ckalloc (sizeof (zootcl_objectClientData));
+	memset (zo, 0, sizeof (zootcl_objectClientData));
 	zo->zookeeper_object_magic = ZOOKEEPER_OBJECT_MAGIC;
 	zo->interp = interp;
 	zo->threadId = Tcl_GetCurrentThread ();
-	zo->channel = NULL;
-	zo->currentFD = -1;
 	zo->initCallbackObj = callbackObj;
-
-	zhandle_t *zh = zookeeper_init (hosts, callbackObj?zootcl_init_callback:NULL, timeout, NULL, zo, 0);
+	zo->hostsObj = objv[3];
+	Tcl_IncrRefCount (zo->hostsObj);
+	Tcl_InitHashTable (&zo->locks, TCL_STRING_KEYS);
+	Tcl_InitHashTable (&zo->elections, TCL_STRING_KEYS);
+	Tcl_InitHashTable (&zo->queues, TCL_STRING_KEYS);
+	Tcl_InitHashTable (&zo->registries, TCL_STRING_KEYS);
+	Tcl_InitHashTable (&zo->mirrors, TCL_STRING_KEYS);
+	Tcl_InitHashTable (&zo->childSnapshots, TCL_STRING_KEYS);
+	Tcl_InitHashTable (&zo->requests, TCL_ONE_WORD_KEYS);
+	zo->maxInFlight = maxInFlight;
+
+	zhandle_t *zh = zookeeper_init (hosts, zootcl_init_callback, timeout, clientIdPtr, zo, flags);
 
 	if (zh == NULL) {
 		Tcl_SetObjResult (interp, Tcl_NewStringObj (Tcl_PosixError (interp), -1));
+		Tcl_DeleteHashTable (&zo->locks);
+		Tcl_DeleteHashTable (&zo->elections);
+		Tcl_DeleteHashTable (&zo->queues);
+		Tcl_DeleteHashTable (&zo->registries);
+		Tcl_DeleteHashTable (&zo->mirrors);
+		Tcl_DeleteHashTable (&zo->childSnapshots);
+		Tcl_DeleteHashTable (&zo->requests);
+		Tcl_DecrRefCount (zo->hostsObj);
+		if (callbackObj != NULL) {
+			Tcl_DecrRefCount (callbackObj);
+		}
+		ckfree ((char *)zo);
 		return TCL_ERROR;
 	}
 
@@ -2223,7 +12445,433 @@ zootcl_init_subcommand(Tcl_Interp *interp, int objc, Tcl_Obj *CONST objv[])
 		ckfree(cmdName);
 	}
 
-	Tcl_CreateEventSource (zootcl_EventSetupProc, zootcl_EventCheckProc, (ClientData) zo);
+	zootcl_session_register (zo);
+	return TCL_OK;
+}
+
+/*
+ * Log stream
+ *
+ * The client library writes its log with fprintf to one stream for the
+ * whole process, stderr unless told otherwise, and does it on whatever
+ * thread is logging, its IO thread included.  log_stream points it at
+ * the write end of a non-blocking pipe instead, so logging never waits:
+ * when the pipe is full, lines are dropped.  The thread that set it up
+ * drains the pipe from its event loop, rate limits the lines, and writes
+ * them to a Tcl channel or keeps the last so many in memory.
+ *
+ * Since the library could be part way through writing to it at any
+ * moment, the pipe is made once and never closed.
+ */
+enum zootcl_logMode {LOG_STDERR, LOG_CHANNEL, LOG_RING};
+
+typedef struct zootcl_logStream {
+	enum zootcl_logMode mode;
+	Tcl_ThreadId threadId;  // the thread draining the pipe
+	int readFd;
+	FILE *writeFp;          // what the library writes to
+	Tcl_Channel channel;    // LOG_CHANNEL
+	Tcl_Obj **ring;         // LOG_RING, the last ringSize lines
+	int ringSize;
+	Tcl_WideInt ringNext;
+	int rate;               // lines per second let through, 0 for no limit
+	Tcl_WideInt second;     // the second being counted
+	int linesThisSecond;
+	int dropped;            // lines over the rate, not yet reported
+	Tcl_DString partial;    // a line read part way
+} zootcl_logStream;
+
+TCL_DECLARE_MUTEX(zootcl_logMutex)
+
+static zootcl_logStream *zootcl_log = NULL;
+
+#define ZOOTCL_LOG_DEFAULT_SIZE 1000
+
+/*
+ *--------------------------------------------------------------
+ *
+ * zootcl_log_emit -- send a log line where it's going
+ *
+ *--------------------------------------------------------------
+ */
+static void
+zootcl_log_emit (zootcl_logStream *ls, const char *line, int length)
+{
+	if (ls->mode == LOG_CHANNEL) {
+		Tcl_WriteChars (ls->channel, line, length);
+		Tcl_WriteChars (ls->channel, "\n", 1);
+	} else if (ls->mode == LOG_RING) {
+		Tcl_Obj **slot = &ls->ring[ls->ringNext++ % ls->ringSize];
+
+		if (*slot != NULL) {
+			Tcl_DecrRefCount (*slot);
+		}
+		*slot = Tcl_NewStringObj (line, length);
+		Tcl_IncrRefCount (*slot);
+	} else {
+		fprintf (stderr, "%.*s\n", length, line);
+	}
+}
+
+/*
+ *--------------------------------------------------------------
+ *
+ * zootcl_log_line -- handle a line read from the pipe, keeping to
+ *   the rate limit
+ *
+ *--------------------------------------------------------------
+ */
+static void
+zootcl_log_line (zootcl_logStream *ls, const char *line, int length)
+{
+	if (ls->rate > 0) {
+		Tcl_Time now;
+
+		Tcl_GetTime (&now);
+		if (now.sec != ls->second) {
+			ls->second = now.sec;
+			ls->linesThisSecond = 0;
+		}
+		if (ls->linesThisSecond >= ls->rate) {
+			ls->dropped++;
+			return;
+		}
+		ls->linesThisSecond++;
+	}
+
+	if (ls->dropped > 0) {
+		char note[80];
+		int noteLength = snprintf (note, sizeof (note), "zookeeper: %d log lines dropped over the rate limit", ls->dropped);
+
+		ls->dropped = 0;
+		zootcl_log_emit (ls, note, noteLength);
+	}
+	zootcl_log_emit (ls, line, length);
+}
+
+/*
+ *--------------------------------------------------------------
+ *
+ * zootcl_log_drain -- file handler reading what the library has
+ *   logged out of the pipe
+ *
+ *--------------------------------------------------------------
+ */
+static void
+zootcl_log_drain (ClientData clientData, int mask)
+{
+	zootcl_logStream *ls = (zootcl_logStream *)clientData;
+	char buffer[4096];
+	int n;
+
+	while ((n = read (ls->readFd, buffer, sizeof (buffer))) > 0) {
+		int start = 0;
+		int i;
+
+		for (i = 0; i < n; i++) {
+			if (buffer[i] != '\n') {
+				continue;
+			}
+			if (Tcl_DStringLength (&ls->partial) > 0) {
+				Tcl_DStringAppend (&ls->partial, buffer + start, i - start);
+				zootcl_log_line (ls, Tcl_DStringValue (&ls->partial), Tcl_DStringLength (&ls->partial));
+				Tcl_DStringSetLength (&ls->partial, 0);
+			} else {
+				zootcl_log_line (ls, buffer + start, i - start);
+			}
+			start = i + 1;
+		}
+		Tcl_DStringAppend (&ls->partial, buffer + start, n - start);
+	}
+}
+
+/*
+ *--------------------------------------------------------------
+ *
+ * zootcl_log_release -- stop writing to the channel or ring
+ *
+ *--------------------------------------------------------------
+ */
+static void
+zootcl_log_release (zootcl_logStream *ls)
+{
+	int i;
+
+	if (ls->channel != NULL) {
+		Tcl_Flush (ls->channel);
+		Tcl_UnregisterChannel (NULL, ls->channel);
+		ls->channel = NULL;
+	}
+	if (ls->ring != NULL) {
+		for (i = 0; i < ls->ringSize; i++) {
+			if (ls->ring[i] != NULL) {
+				Tcl_DecrRefCount (ls->ring[i]);
+			}
+		}
+		ckfree (ls->ring);
+		ls->ring = NULL;
+	}
+	ls->mode = LOG_STDERR;
+}
+
+/*
+ *--------------------------------------------------------------
+ *
+ * zootcl_log_thread_exit -- the draining thread is going away, put
+ *   the library back to logging to stderr
+ *
+ *--------------------------------------------------------------
+ */
+static void
+zootcl_log_thread_exit (ClientData clientData)
+{
+	zootcl_logStream *ls = (zootcl_logStream *)clientData;
+
+	Tcl_MutexLock (&zootcl_logMutex);
+	zoo_set_log_stream (NULL);
+	Tcl_DeleteFileHandler (ls->readFd);
+	zootcl_log_release (ls);
+	ls->threadId = NULL;
+	Tcl_MutexUnlock (&zootcl_logMutex);
+}
+
+/*
+ *--------------------------------------------------------------
+ *
+ * zootcl_log_pipe -- make the pipe the first time through
+ *
+ * Results:
+ *      the log stream, or NULL with an error in interp
+ *
+ *--------------------------------------------------------------
+ */
+static zootcl_logStream *
+zootcl_log_pipe (Tcl_Interp *interp)
+{
+	int fds[2];
+
+	if (zootcl_log != NULL) {
+		return zootcl_log;
+	}
+
+	if (pipe (fds) < 0) {
+		Tcl_SetObjResult (interp, Tcl_ObjPrintf ("couldn't make log pipe: %s", Tcl_PosixError (interp)));
+		return NULL;
+	}
+	fcntl (fds[0], F_SETFL, O_NONBLOCK);
+	fcntl (fds[1], F_SETFL, O_NONBLOCK);
+	fcntl (fds[0], F_SETFD, FD_CLOEXEC);
+	fcntl (fds[1], F_SETFD, FD_CLOEXEC);
+
+	zootcl_logStream *ls = (zootcl_logStream *)ckalloc (sizeof (zootcl_logStream));
+	memset (ls, 0, sizeof (zootcl_logStream));
+	ls->mode = LOG_STDERR;
+	ls->readFd = fds[0];
+	ls->writeFp = fdopen (fds[1], "w");
+	// a line at a time, so a full pipe costs whole lines
+	setvbuf (ls->writeFp, NULL, _IOLBF, 0);
+	Tcl_DStringInit (&ls->partial);
+
+	zootcl_log = ls;
+	return ls;
+}
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * zootcl_log_stream_subcommand --
+ *
+ *      implement "zookeeper::zookeeper log_stream"
+ *
+ *      log_stream channel channelId ?-rate n?
+ *      log_stream ring ?-size n? ?-rate n?
+ *      log_stream stderr
+ *      log_stream dump
+ *
+ * Results:
+ *      A standard Tcl result.
+ *
+ *----------------------------------------------------------------------
+ */
+int
+zootcl_log_stream_subcommand(Tcl_Interp *interp, int objc, Tcl_Obj *CONST objv[])
+{
+	static CONST char *modes[] = {
+		"channel",
+		"ring",
+		"stderr",
+		"dump",
+		NULL
+	};
+
+	enum modes {
+		MODE_CHANNEL,
+		MODE_RING,
+		MODE_STDERR,
+		MODE_DUMP
+	};
+
+	static CONST char *subOptions[] = {
+		"-size",
+		"-rate",
+		NULL
+	};
+
+	enum subOptions {
+		SUBOPT_SIZE,
+		SUBOPT_RATE
+	};
+
+	int modeIndex;
+	int suboptIndex;
+	int size = ZOOTCL_LOG_DEFAULT_SIZE;
+	int rate = 0;
+	Tcl_Channel channel = NULL;
+	int i;
+
+	if (objc < 3) {
+		Tcl_WrongNumArgs (interp, 2, objv, "channel|ring|stderr|dump ?args?");
+		return TCL_ERROR;
+	}
+
+	if (Tcl_GetIndexFromObj (interp, objv[2], modes, "mode", TCL_EXACT, &modeIndex) != TCL_OK) {
+		return TCL_ERROR;
+	}
+
+	i = 3;
+	if (modeIndex == MODE_CHANNEL) {
+		int channelMode;
+
+		if (objc < 4) {
+			Tcl_WrongNumArgs (interp, 3, objv, "channelId ?-rate n?");
+			return TCL_ERROR;
+		}
+		channel = Tcl_GetChannel (interp, Tcl_GetString (objv[3]), &channelMode);
+		if (channel == NULL) {
+			return TCL_ERROR;
+		}
+		if (!(channelMode & TCL_WRITABLE)) {
+			Tcl_SetObjResult (interp, Tcl_ObjPrintf ("channel \"%s\" wasn't opened for writing", Tcl_GetString (objv[3])));
+			return TCL_ERROR;
+		}
+		i = 4;
+	}
+
+	if ((modeIndex == MODE_STDERR || modeIndex == MODE_DUMP) && objc != 3) {
+		Tcl_WrongNumArgs (interp, 3, objv, "");
+		return TCL_ERROR;
+	}
+
+	for (; i < objc; i++) {
+		if (Tcl_GetIndexFromObj (interp, objv[i], subOptions, "suboption", TCL_EXACT, &suboptIndex) != TCL_OK) {
+			return TCL_ERROR;
+		}
+		if (i + 1 >= objc) {
+			Tcl_WrongNumArgs (interp, 3, objv, "... option value");
+			return TCL_ERROR;
+		}
+
+		switch ((enum subOptions) suboptIndex) {
+			case SUBOPT_SIZE:
+				if (modeIndex != MODE_RING) {
+					Tcl_SetObjResult (interp, Tcl_NewStringObj ("-size only goes with ring", -1));
+					return TCL_ERROR;
+				}
+				if (Tcl_GetIntFromObj (interp, objv[++i], &size) == TCL_ERROR) {
+					return TCL_ERROR;
+				}
+				if (size < 1) {
+					Tcl_SetObjResult (interp, Tcl_NewStringObj ("-size must be at least 1", -1));
+					return TCL_ERROR;
+				}
+				break;
+
+			case SUBOPT_RATE:
+				if (Tcl_GetIntFromObj (interp, objv[++i], &rate) == TCL_ERROR) {
+					return TCL_ERROR;
+				}
+				if (rate < 0) {
+					Tcl_SetObjResult (interp, Tcl_NewStringObj ("-rate can't be negative", -1));
+					return TCL_ERROR;
+				}
+				break;
+		}
+	}
+
+	Tcl_MutexLock (&zootcl_logMutex);
+
+	zootcl_logStream *ls = zootcl_log;
+	if (ls != NULL && ls->threadId != NULL && ls->threadId != Tcl_GetCurrentThread ()) {
+		Tcl_MutexUnlock (&zootcl_logMutex);
+		Tcl_SetObjResult (interp, Tcl_NewStringObj ("the log stream belongs to another thread", -1));
+		return TCL_ERROR;
+	}
+
+	if (modeIndex == MODE_DUMP) {
+		Tcl_Obj *resultObj = Tcl_NewObj ();
+
+		if (ls != NULL && ls->mode == LOG_RING) {
+			Tcl_WideInt n = (ls->ringNext > ls->ringSize) ? ls->ringNext - ls->ringSize : 0;
+
+			// pick up what's been logged since the event loop last looked
+			zootcl_log_drain ((ClientData)ls, TCL_READABLE);
+			for (; n < ls->ringNext; n++) {
+				Tcl_ListObjAppendElement (NULL, resultObj, ls->ring[n % ls->ringSize]);
+			}
+		}
+		Tcl_MutexUnlock (&zootcl_logMutex);
+		Tcl_SetObjResult (interp, resultObj);
+		return TCL_OK;
+	}
+
+	if (modeIndex == MODE_STDERR) {
+		if (ls != NULL && ls->threadId != NULL) {
+			zoo_set_log_stream (NULL);
+			zootcl_log_drain ((ClientData)ls, TCL_READABLE);
+			Tcl_DeleteFileHandler (ls->readFd);
+			Tcl_DeleteThreadExitHandler (zootcl_log_thread_exit, (ClientData)ls);
+			zootcl_log_release (ls);
+			ls->threadId = NULL;
+		}
+		Tcl_MutexUnlock (&zootcl_logMutex);
+		return TCL_OK;
+	}
+
+	ls = zootcl_log_pipe (interp);
+	if (ls == NULL) {
+		Tcl_MutexUnlock (&zootcl_logMutex);
+		return TCL_ERROR;
+	}
+
+	// whatever's in the pipe was meant for the old destination
+	if (ls->threadId != NULL) {
+		zootcl_log_drain ((ClientData)ls, TCL_READABLE);
+	}
+	zootcl_log_release (ls);
+
+	if (modeIndex == MODE_CHANNEL) {
+		ls->mode = LOG_CHANNEL;
+		ls->channel = channel;
+		Tcl_RegisterChannel (NULL, channel);
+	} else {
+		ls->mode = LOG_RING;
+		ls->ringSize = size;
+		ls->ringNext = 0;
+		ls->ring = (Tcl_Obj **)ckalloc (sizeof (Tcl_Obj *) * size);
+		memset (ls->ring, 0, sizeof (Tcl_Obj *) * size);
+	}
+	ls->rate = rate;
+	ls->linesThisSecond = 0;
+	ls->dropped = 0;
+
+	if (ls->threadId == NULL) {
+		ls->threadId = Tcl_GetCurrentThread ();
+		Tcl_CreateFileHandler (ls->readFd, TCL_READABLE, zootcl_log_drain, (ClientData)ls);
+		Tcl_CreateThreadExitHandler (zootcl_log_thread_exit, (ClientData)ls);
+		zoo_set_log_stream (ls->writeFp);
+	}
+
+	Tcl_MutexUnlock (&zootcl_logMutex);
 	return TCL_OK;
 }
 
@@ -2255,13 +12903,17 @@ zootcl_zookeeperObjCmd(ClientData clientData, Tcl_Interp *interp, int objc, Tcl_
         "init",
         "version",
         "debug_level",
+        "metrics",
+        "log_stream",
         NULL
     };
 
     enum options {
         OPT_INIT,
 		OPT_VERSION,
-		OPT_DEBUG_LEVEL
+		OPT_DEBUG_LEVEL,
+		OPT_METRICS,
+		OPT_LOG_STREAM
     };
 
     // basic command line processing
@@ -2298,6 +12950,12 @@ zootcl_zookeeperObjCmd(ClientData clientData, Tcl_Interp *interp, int objc, Tcl_
 		case OPT_INIT:
 			return zootcl_init_subcommand(interp, objc, objv);
 
+		case OPT_METRICS:
+			return zootcl_metrics_subcommand(interp, objc, objv, NULL);
+
+		case OPT_LOG_STREAM:
+			return zootcl_log_stream_subcommand(interp, objc, objv);
+
 		case OPT_DEBUG_LEVEL:
 		{
 			int zooLogLevel = 0;
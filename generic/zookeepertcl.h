@@ -17,9 +17,147 @@
 
 #define ZOOKEEPER_OBJECT_MAGIC 7220331
 
+// the 3.5 C client added dynamic server lists, read-only mode and such
+#if defined(ZOO_MAJOR_VERSION) && ((ZOO_MAJOR_VERSION > 3) || (ZOO_MAJOR_VERSION == 3 && ZOO_MINOR_VERSION >= 5))
+#define ZOOTCL_ZOO_35 1
+#endif
+
 extern int
 zootcl_zookeeperObjCmd(ClientData clientData, Tcl_Interp *interp, int objc, Tcl_Obj *CONST objvp[]);
 
+extern int
+zootcl_statObjCmd(ClientData clientData, Tcl_Interp *interp, int objc, Tcl_Obj *CONST objvp[]);
+
+extern Tcl_ObjType zootcl_statObjType;
+
+extern int
+zootcl_pathObjCmd(ClientData clientData, Tcl_Interp *interp, int objc, Tcl_Obj *CONST objvp[]);
+
+extern Tcl_ObjType zootcl_pathObjType;
+
+extern int
+zootcl_mirrorObjCmd(ClientData clientData, Tcl_Interp *interp, int objc, Tcl_Obj *CONST objvp[]);
+
+// the internal rep of a znode path object.  equal paths in a thread
+// share one of these.
+typedef struct zootcl_pathRep
+{
+	int refCount;
+	int length;
+	int tailOffset;         // where the last component starts
+	unsigned int hash;
+	Tcl_HashEntry *internEntry;
+	char path[1];           // validated and normalized, goes on past the struct
+} zootcl_pathRep;
+
+extern zootcl_pathRep *
+zootcl_get_path_rep (Tcl_Interp *interp, Tcl_Obj *objPtr);
+
+extern const char *
+zootcl_path_string (Tcl_Interp *interp, Tcl_Obj *objPtr);
+
+extern unsigned int
+zootcl_path_hash (const char *path, int length);
+
+// the requests that can be made -async, and are counted and traced
+enum zootcl_requestKind {REQ_EXISTS, REQ_GET, REQ_CHILDREN, REQ_SET, REQ_CREATE, REQ_DELETE};
+#define ZOOTCL_REQUEST_KINDS 6
+
+// requests are counted by status.  the zookeeper status codes run from
+// 0 down to a bit past -120; the last slot is for our ZUNCHANGED.
+#define ZOOTCL_STATUS_SLOTS 130
+
+// the counters behind the metrics commands, kept per object and for
+// the process as a whole
+typedef struct zootcl_metrics
+{
+	Tcl_WideInt requests[ZOOTCL_REQUEST_KINDS][ZOOTCL_STATUS_SLOTS];
+	Tcl_WideInt bytesSent;          // data of sets and creates
+	Tcl_WideInt bytesReceived;      // data of gets
+	Tcl_WideInt eventsQueued;
+	Tcl_WideInt eventsDispatched;
+	Tcl_WideInt eventsDropped;      // deleted along with their object
+	Tcl_WideInt watchesRegistered;
+	Tcl_WideInt watchesFired;
+	Tcl_WideInt reconnects;
+	Tcl_WideInt sessionExpirations;
+} zootcl_metrics;
+
+// what a trace record is of, past the request kinds
+enum zootcl_traceOp {TRACE_WATCH = ZOOTCL_REQUEST_KINDS, TRACE_SESSION, TRACE_PROCESS};
+
+// one request or event in an object's trace.  times are microseconds.
+typedef struct zootcl_traceRecord
+{
+	Tcl_WideInt time;       // when the request was made or the event came in
+	int op;                 // an enum zootcl_requestKind or zootcl_traceOp
+	int async;
+	unsigned int pathHash;
+	int rc;                 // status, or the type of a watch or session event
+	int state;              // of a watch or session event
+	int completeUs;         // from time until zookeeper answered
+	int dispatchUs;         // from then until the callback ran
+} zootcl_traceRecord;
+
+// a path and operation in the top-K of an object's hotkeys
+typedef struct zootcl_hotKey
+{
+	const char *key;        // the op, a space and the path; the keys table owns it
+	Tcl_HashEntry *entry;
+	Tcl_WideInt count;      // the sketch's estimate
+	int heapIndex;
+} zootcl_hotKey;
+
+// hotkeys counts operations by path in a count-min sketch, so memory
+// stays the same however many paths there are, and keeps the top K in
+// a min-heap
+typedef struct zootcl_hotKeys
+{
+	int width;              // counters in a row of the sketch
+	int depth;              // rows, each with its own hash
+	int k;
+	unsigned int *sketch;   // depth rows of width counters
+	zootcl_hotKey **heap;   // least counted first
+	int heapSize;
+	Tcl_HashTable keys;     // the heap's members by key
+} zootcl_hotKeys;
+
+// the ring of trace records.  it is only written and read in the
+// object's thread, so it needs no lock.
+typedef struct zootcl_traceRing
+{
+	int size;
+	Tcl_WideInt next;       // records written so far
+	Tcl_WideInt streamed;   // records handed to the stream callbacks
+	Tcl_Obj *callbacksObj;  // list of trace add callbacks
+	int streamPending;      // an idle callback to stream is scheduled
+	zootcl_traceRecord records[1]; // goes on past the struct
+} zootcl_traceRing;
+
+// an -async request held back by -maxinflight until an earlier one
+// has been answered
+typedef struct zootcl_asyncRequest
+{
+	struct zootcl_asyncRequest *next;
+	enum zootcl_requestKind kind;
+	int requestId;          // what the -async call returned
+	const char *path;
+	const char *value;      // set and create
+	int valueLen;
+	int version;            // set and delete
+	int flags;              // create
+	watcher_fn watcher;
+	void *watcherCtx;
+	union {
+		stat_completion_t stat;
+		data_completion_t data;
+		strings_completion_t strings;
+		string_completion_t string;
+		void_completion_t none;
+	} completion;
+	void *context;
+} zootcl_asyncRequest;
+
 // this is the data structure we have to throw around between
 // zookeeper and zookeepertcl to be able to find one from the other
 typedef struct zootcl_objectClientData
@@ -31,17 +169,304 @@ typedef struct zootcl_objectClientData
 	Tcl_Command cmdToken;
 	Tcl_Channel channel;
 	int currentFD;
+	int ready; // on its thread's ready list
+	struct zootcl_objectClientData *readyNext;
+	Tcl_TimerToken interestTimer; // when the client next wants a look
 	Tcl_Obj *initCallbackObj; // handle callbacks from zookeeper_init callback function
+	Tcl_Obj *hostsObj; // comma separated host:port list we're connecting to
+	Tcl_HashTable locks; // async lock waiters keyed by lock znode path
+	Tcl_HashTable elections; // election candidates keyed by candidate znode path
+	Tcl_HashTable queues; // queue child caches keyed by queue znode path
+	Tcl_HashTable registries; // registry caches keyed by directory znode path
+	Tcl_HashTable mirrors; // file mirrors keyed by subtree znode path
+	Tcl_HashTable childSnapshots; // children -since snapshots keyed by token
+	int nextSnapshotId;
+	int maxInFlight; // cap on unanswered -async requests, 0 for none
+	int inFlight; // -async requests sent whose callbacks haven't run
+	int pendingCount;
+	zootcl_asyncRequest *pendingHead; // held back by maxInFlight
+	zootcl_asyncRequest *pendingTail;
+	Tcl_HashTable requests; // unanswered -async requests keyed by request id
+	int nextRequestId;
+	Tcl_Condition eventQueued; // await sleeps on this
+	int eventsQueued;       // bumped each time an event is queued for us
+	int everConnected;      // so a connect after that is a reconnect
+	zootcl_metrics metrics;
+	int tracing;            // looked at from the completion thread
+	zootcl_traceRing *trace;
+	zootcl_hotKeys *hotkeys; // NULL unless turned on
 } zootcl_objectClientData;
 
-enum zootcl_CallbackType {NULL_CALLBACK, INTERNAL_INIT_CALLBACK, WATCHER_CALLBACK, DATA_CALLBACK, STRING_CALLBACK, VOID_CALLBACK, STAT_CALLBACK};
+// the states of an -async request in the object's requests table
+#define ZOOTCL_REQUEST_PENDING   1
+#define ZOOTCL_REQUEST_CANCELLED 2
+
+extern void
+zootcl_session_ready (zootcl_objectClientData *zo);
+
+enum zootcl_CallbackType {NULL_CALLBACK, INTERNAL_INIT_CALLBACK, WATCHER_CALLBACK, DATA_CALLBACK, STRING_CALLBACK, VOID_CALLBACK, STAT_CALLBACK, RECIPE_CALLBACK};
+
+// recipes (locks and such) implemented in C receive their watch events
+// in the interpreter's thread through one of these
+typedef void (zootcl_RecipeProc) (ClientData clientData, int type, int state);
+
+// how long recipes wait before retrying after a connection loss
+#define ZOOTCL_RECIPE_RETRY_MS 250
+
+// a child of a recipe directory, named with a sequence suffix
+typedef struct zootcl_sequenceEntry
+{
+	long long seq;
+	char *name;
+} zootcl_sequenceEntry;
+
+// one acquisition of a lock, from creating our lock znode until we
+// hold the lock, give up or are released
+typedef struct zootcl_lockWaiter
+{
+	zootcl_objectClientData *zo;
+	char *dirPath;          // the lock directory
+	char *nodePath;         // our ephemeral sequential znode, once created
+	int async;              // waiting in the event loop rather than blocking
+	Tcl_Obj *callbackObj;   // async callback
+	Tcl_TimerToken timer;   // async -timeout or connection loss retry
+	int retrying;           // timer is a retry rather than the timeout
+	int hasDeadline;        // -timeout was given
+	Tcl_Time deadline;      // when -timeout runs out
+	int createUncertain;    // lost the connection while creating our znode
+	Tcl_Condition cond;     // a sync waiter sleeps on this
+	int watchPending;       // zookeeper holds a watch pointing to us
+	int fired;              // the predecessor changed since we last looked
+	int expired;            // the session expired out from under us
+	int done;               // acquired, released or given up
+} zootcl_lockWaiter;
+
+// one read in a pipelined batch of them
+typedef struct zootcl_getResult
+{
+	int rc;
+	char *data;             // ckalloc'ed, NULL if the znode has no data
+	int dataLen;
+	struct Stat stat;
+	struct zootcl_getBatch *batch;
+} zootcl_getResult;
+
+typedef struct zootcl_getBatch
+{
+	Tcl_Condition cond;
+	int outstanding;
+} zootcl_getBatch;
+
+// one children listing in a pipelined batch of them
+typedef struct zootcl_childrenResult
+{
+	int rc;
+	struct String_vector strings;   // freed with deallocate_String_vector
+	struct zootcl_getBatch *batch;
+} zootcl_childrenResult;
+
+// one multi of a snapshot load, filled from the file, then in flight
+// until its completion clears inFlight
+typedef struct zootcl_snapshotMulti
+{
+	int count;
+	zoo_op_t *ops;
+	zoo_op_result_t *results;
+	char **blocks;                  // ckalloc'ed path and data each op points into
+	int inFlight;
+	int rc;
+	struct zootcl_getBatch *window;
+} zootcl_snapshotMulti;
+
+enum zootcl_electionRole {ELECTION_CANDIDATE, ELECTION_FOLLOWER, ELECTION_LEADER, ELECTION_SUSPENDED, ELECTION_LOST};
+
+// one candidacy in a leader election, from joining until leaving or
+// losing the session.  only touched in the interpreter's thread.
+typedef struct zootcl_electionCandidate
+{
+	zootcl_objectClientData *zo;
+	char *dirPath;          // the election directory
+	char *nodePath;         // our ephemeral sequential znode
+	Tcl_Obj *callbackObj;   // told about role changes
+	char **ahead;           // cached names of the candidates ahead of us, in order
+	int aheadCount;
+	enum zootcl_electionRole role;
+	Tcl_TimerToken timer;   // first look, or retry after a connection loss
+	int watchPending;       // zookeeper holds a watch pointing to us
+	int done;               // left or lost
+} zootcl_electionCandidate;
+
+// the children of a znode as of a children -since call
+typedef struct zootcl_childSnapshot
+{
+	char *path;
+	int id;                 // from the token, the oldest are evicted first
+	Tcl_HashTable names;    // the children, the values are unused
+} zootcl_childSnapshot;
+
+// a child we know about in a registry
+typedef struct zootcl_registryEntry
+{
+	char *data;             // ckalloc'ed, NULL if the znode has no data
+	int dataLen;
+	struct Stat stat;
+} zootcl_registryEntry;
+
+// the in memory copy of a directory's children and their data, kept up
+// to date by one children watch and a data watch per child.  only
+// touched in the interpreter's thread.
+typedef struct zootcl_registry
+{
+	zootcl_objectClientData *zo;
+	char *path;             // the directory
+	Tcl_Obj *callbackObj;   // told about added, removed and changed children
+	Tcl_HashTable children; // zootcl_registryEntry keyed by child name
+	int childWatch;         // zookeeper holds our children watch
+	int watchPending;       // watches of ours zookeeper holds or we haven't handled
+	Tcl_TimerToken timer;   // first look, or retry after a connection loss
+	int closed;             // closed while watches were still pending
+	int expired;
+} zootcl_registry;
+
+// context of one registry watch, the directory's if name is NULL
+typedef struct zootcl_registryWatch
+{
+	zootcl_registry *reg;
+	char *name;
+} zootcl_registryWatch;
+
+// a znode in a mirror
+typedef struct zootcl_mirrorNode
+{
+	char *data;             // ckalloc'ed, NULL if the znode has no data
+	int dataLen;
+	struct Stat stat;
+	int childCount;
+	char **children;        // ckalloc'ed names, sorted
+	int dataWatch;          // zookeeper holds our data watch on it
+	int childWatch;         // and our children watch
+} zootcl_mirrorNode;
+
+// a subtree kept current by a data and a children watch on each znode
+// and written out to a file other processes map.  only touched in the
+// interpreter's thread.
+typedef struct zootcl_mirror
+{
+	zootcl_objectClientData *zo;
+	char *path;             // the top of the subtree
+	Tcl_Obj *fileObj;
+	Tcl_HashTable nodes;    // zootcl_mirrorNode keyed by full path
+	int rootWatch;          // an exists watch on a missing top is pending
+	int watchPending;       // watches of ours zookeeper holds or we haven't handled
+	Tcl_TimerToken timer;   // first look, or retry after a connection loss
+	Tcl_TimerToken writeTimer; // writes out the changes since the last write
+	int delay;              // ms to gather changes before writing
+	Tcl_WideInt generation; // number of times the file's been written
+	Tcl_Obj *errorObj;      // why the last write failed, or NULL
+	int closed;             // closed while watches were still pending
+	int expired;
+} zootcl_mirror;
+
+// context of one mirror watch
+typedef struct zootcl_mirrorWatch
+{
+	zootcl_mirror *mirror;
+	char *path;
+	int kind;               // ZOOTCL_MIRROR_DATA, _CHILDREN or _EXISTS
+} zootcl_mirrorWatch;
+
+#define ZOOTCL_MIRROR_DATA     0
+#define ZOOTCL_MIRROR_CHILDREN 1
+#define ZOOTCL_MIRROR_EXISTS   2
+
+// a process's read-only map of a mirror file, remapped when the
+// writer swaps in a new one
+typedef struct zootcl_mirrorReader
+{
+	Tcl_Obj *fileObj;
+	const unsigned char *map;
+	size_t mapSize;
+	Tcl_WideUInt device;    // of the file that's mapped
+	Tcl_WideUInt inode;
+	Tcl_Command cmdToken;
+} zootcl_mirrorReader;
+
+// computes the new data of a znode for the update loop.  data is NULL
+// if the znode doesn't exist.  returns a Tcl result code and on
+// TCL_OK stores the new data in *newDataPtr; the caller takes its own
+// reference to it.
+typedef int (zootcl_UpdateProc)(Tcl_Interp *interp, ClientData clientData, const char *data, int dataLen, Tcl_Obj **newDataPtr);
+
+#define ZOOTCL_UPDATE_MAX_RETRIES 10
+#define ZOOTCL_UPDATE_BACKOFF_MS 10
+#define ZOOTCL_UPDATE_BACKOFF_MAX_MS 1000
+
+// a blocking barrier call waiting on one watch.  if the call gives up
+// before the watch fires, the watcher frees it.
+typedef struct zootcl_barrierWaiter
+{
+	Tcl_Condition cond;
+	int fired;
+	int expired;
+	int abandoned;
+} zootcl_barrierWaiter;
+
+// what we know of the items in a queue.  names[head] is the oldest
+// item we haven't consumed; the list is only refetched when the
+// children watch says it changed or we run out.
+typedef struct zootcl_queueCache
+{
+	char *path;             // the queue directory
+	char **names;           // sorted item names
+	int count;
+	int head;
+	Tcl_Condition cond;     // an idle consumer sleeps on this
+	int stale;              // the children changed since we listed them
+	int watchPending;       // zookeeper holds our children watch
+} zootcl_queueCache;
 
 typedef struct zootcl_callbackContext
 {
 	zootcl_objectClientData *zo;
 	Tcl_Obj *callbackObj;
+	int requestId;
+	enum zootcl_requestKind kind;
+	Tcl_WideInt submitTime; // for the trace, 0 if not tracing
+	unsigned int pathHash;
 } zootcl_callbackContext;
 
+// our own status for a conditional read that found nothing newer
+#define ZOOTCL_UNCHANGED (-1000)
+
+// an async get or children -ifnewer waiting on its exists check
+typedef struct zootcl_ifNewerContext
+{
+	zootcl_objectClientData *zo;
+	Tcl_Obj *callbackObj;
+	int requestId;
+	Tcl_WideInt submitTime;
+	unsigned int pathHash;
+	Tcl_WideInt zxid;       // only read if the znode has changed since this
+	int children;           // children rather than get
+	char *path;
+} zootcl_ifNewerContext;
+
+// a -watch with a -watchfilter.  events the filter doesn't want are
+// dropped on the completion thread without waking the interpreter.
+typedef struct zootcl_watchFilter
+{
+	zhandle_t *zh;
+	Tcl_Obj *commandObj;    // the -watch code
+	char *path;
+	int typeMask;           // event types to deliver, by zootcl_eventTypeNames index
+	int stateMask;          // states to deliver session events for
+	int ifChanged;          // refetch on changed and drop it if the data's the same
+	int hashValid;
+	Tcl_WideInt hash;       // of the data last seen
+	int delivered;          // the watch event has gone to the interpreter
+	int refCount;           // the caller and the outstanding watch or refetch
+} zootcl_watchFilter;
+
 typedef struct zootcl_syncCallbackContext
 {
 	zootcl_objectClientData *zo;
@@ -59,6 +484,13 @@ typedef struct zootcl_callbackEvent
 	zootcl_objectClientData *zo;
 	Tcl_Obj *commandObj;
 	enum zootcl_CallbackType callbackType;
+	int requestId;          // of the -async request this answers
+	struct {
+		enum zootcl_requestKind kind;
+		Tcl_WideInt submitTime;
+		Tcl_WideInt completeTime;
+		unsigned int pathHash;
+	} trace;                // only filled in when tracing
 	union {
 		struct {
 			int type;
@@ -70,6 +502,12 @@ typedef struct zootcl_callbackEvent
 			Tcl_Obj *dataObj;
 			struct Stat stat;
 		} data;
+		struct {
+			zootcl_RecipeProc *proc;
+			ClientData clientData;
+			int type;
+			int state;
+		} recipe;
 	};
 } zootcl_callbackEvent;
 
@@ -8,6 +8,9 @@ package require sha1
 
 namespace eval ::zookeeper  {
 	variable zkwd "/"
+	variable follows
+	variable followCount 0
+	variable followRetryMs 1000
 
 	#
 	# mkpath - make all the znodes
@@ -17,13 +20,13 @@ namespace eval ::zookeeper  {
 		if {[$zk exists $path]} {
 			return
 		}
-		mkpath $zk [file dirname $path]
+		mkpath $zk [path parent $path]
 		$zk create $path
 	}
 
 	proc rmrf {zk path} {
 		foreach child [$zk children $path] {
-			rmrf $zk $path/$child
+			rmrf $zk [path join $path $child]
 		}
 		$zk delete $path -1
 	}
@@ -97,12 +100,13 @@ namespace eval ::zookeeper  {
 	}
 
 	#
-	# sync_znode_to_file - sync the data at zpath to
-	#   path/zpath/Zdata and Zversion, if there is
-	#   data at that znode.
+	# write_znode_files - write zdata and zversion to outpath/Zdata
+	#   and Zversion unless they already hold them.  Both files are
+	#   written out as .new before either is renamed in, so a reader
+	#   never sees a partly written file and the window where Zdata
+	#   and Zversion disagree is just the two renames.
 	#
-	proc sync_znode_to_file {zk zpath path} {
-		set outpath $path/$zpath
+	proc write_znode_files {outpath zdata zversion} {
 		set zdataFile $outpath/Zdata
 		set zversionFile $outpath/Zversion
 
@@ -113,38 +117,35 @@ namespace eval ::zookeeper  {
 			set exists 0
 		}
 
-		if {![$zk get $zpath -data zdata -version zversion] || ![info exists zdata]} {
-			# there is no data at the znode.  if there is a file,
-			# delete it.
-			if {$exists} {
-				file delete $zdataFile $zversionFile
-			}
-			return
-		}
-
-		# there was data at the znode.
 		# if it matches what we have, no need to write.
-		if {$exists && $stat(size) == [string length $zdata] && [read_file $zdataFile] eq $zdata && [read_file $zversionFile] eq $zversion} {
+		if {$exists && $stat(size) == [string length $zdata] && [file exists $zversionFile] && [read_file $zversionFile] eq $zversion && [read_file $zdataFile] eq $zdata} {
 			#puts stderr "skip writing $zdataFile, existing one matches"
 			return
 		}
 
 		file mkdir $outpath
-		if {!$exists} {
-			# files didn't exist, we can write them without renaming
-			write_file $zdataFile $zdata
-			write_file $zversionFile $zversion
-		} else {
-			# we need to write and the files exist, do it more cleanly
-			# so a reader won't see an empty file if they look at just
-			# the right time.
-			# NB still a race condition here where the zdata is updated
-			# but very briefly the zversion isn't.
-			write_file $zdataFile.new $zdata
-			write_file $zversionFile.new $zversion
-			file rename -force -- $zdataFile.new $zdataFile
-			file rename -force -- $zversionFile.new $zversionFile
+		write_file $zdataFile.new $zdata
+		write_file $zversionFile.new $zversion
+		file rename -force -- $zdataFile.new $zdataFile
+		file rename -force -- $zversionFile.new $zversionFile
+	}
+
+	#
+	# sync_znode_to_file - sync the data at zpath to
+	#   path/zpath/Zdata and Zversion, if there is
+	#   data at that znode.
+	#
+	proc sync_znode_to_file {zk zpath path} {
+		set outpath $path/$zpath
+
+		if {![$zk get $zpath -data zdata -version zversion] || ![info exists zdata]} {
+			# there is no data at the znode.  if there are files,
+			# delete them.
+			file delete $outpath/Zdata $outpath/Zversion
+			return
 		}
+
+		write_znode_files $outpath $zdata $zversion
 	}
 
 	#
@@ -152,17 +153,286 @@ namespace eval ::zookeeper  {
 	#
 	# zpath is prepended to the destination path
 	#
-	proc sync_ztree_to_directory {zk zpath path} {
+	# with -follow, the tree is copied once, pipelined a level at
+	# a time, and then kept up to date from watches until
+	# sync_ztree_unfollow is called
+	#
+	proc sync_ztree_to_directory {zk zpath path args} {
+		set follow 0
+		foreach arg $args {
+			switch -exact -- $arg {
+				-follow {
+					set follow 1
+				}
+
+				default {
+					error "bad option \"$arg\": must be -follow"
+				}
+			}
+		}
+
+		if {$follow} {
+			follow_ztree $zk $zpath $path
+			return
+		}
+
 		#puts stderr "sync_ztree_to_directory $zk $zpath $path"
 		sync_znode_to_file $zk $zpath $path
 
 		# recursively invoke ourself for all children of the current znode
 		set children [$zk children $zpath]
 		foreach znode $children {
-			sync_ztree_to_directory $zk [file join $zpath $znode] $path
+			sync_ztree_to_directory $zk [path join $zpath $znode] $path
+		}
+	}
+
+	#
+	# sync_ztree_unfollow - stop keeping a directory up to date
+	#   that sync_ztree_to_directory -follow copied to
+	#
+	proc sync_ztree_unfollow {zk zpath path} {
+		variable follows
+
+		set key [list $zk $zpath $path]
+		if {![info exists follows($key)]} {
+			error "$zpath isn't being followed into $path"
+		}
+		unset -nocomplain $follows($key)
+		unset follows($key)
+	}
+
+	#
+	# follow_ztree - the initial sync for -follow.  every znode gets
+	#   an async get and children with a watch; the children
+	#   callbacks start on the next level and await collects them.
+	#
+	# the state of each follow is kept in its own array, which the
+	#   callbacks are handed the name of, so unfollowing or an
+	#   expired session just has to unset it.
+	#
+	proc follow_ztree {zk zpath path} {
+		variable follows
+		variable followCount
+
+		set key [list $zk $zpath $path]
+		if {[info exists follows($key)]} {
+			error "$zpath is already being followed into $path"
+		}
+		set state ::zookeeper::follow[incr followCount]
+		set follows($key) $state
+		upvar #0 $state follow
+		array set follow [list zk $zk zpath $zpath path $path key $key ids {}]
+
+		follow_znode $state $zpath
+		while {[info exists follow(ids)] && [llength $follow(ids)] > 0} {
+			set ids $follow(ids)
+			set follow(ids) {}
+			$zk await $ids
+		}
+		unset -nocomplain follow(ids)
+	}
+
+	#
+	# follow_znode - fetch the data and children of zpath, leaving
+	#   watches on both
+	#
+	proc follow_znode {state zpath} {
+		follow_data $state $zpath
+		follow_children $state $zpath
+	}
+
+	proc follow_data {state zpath} {
+		upvar #0 $state follow
+
+		set id [$follow(zk) get $zpath -async [list ::zookeeper::follow_got_data $state $zpath] -watch [list ::zookeeper::follow_watch $state $zpath data]]
+		if {[info exists follow(ids)]} {
+			lappend follow(ids) $id
 		}
 	}
 
+	proc follow_children {state zpath} {
+		upvar #0 $state follow
+
+		set id [$follow(zk) children $zpath -async [list ::zookeeper::follow_got_children $state $zpath] -watch [list ::zookeeper::follow_watch $state $zpath children]]
+		if {[info exists follow(ids)]} {
+			lappend follow(ids) $id
+		}
+	}
+
+	proc follow_got_data {state zpath result} {
+		upvar #0 $state follow
+
+		if {![info exists follow]} {
+			return
+		}
+		if {[dict get $result status] ne "ZOK"} {
+			follow_failed $state $zpath data [dict get $result status]
+			return
+		}
+
+		set outpath $follow(path)/$zpath
+		if {![dict exists $result data]} {
+			file delete $outpath/Zdata $outpath/Zversion
+			file mkdir $outpath
+			return
+		}
+		write_znode_files $outpath [dict get $result data] [dict get $result version]
+	}
+
+	proc follow_got_children {state zpath result} {
+		upvar #0 $state follow
+
+		if {![info exists follow]} {
+			return
+		}
+		if {[dict get $result status] ne "ZOK"} {
+			follow_failed $state $zpath children [dict get $result status]
+			return
+		}
+
+		set children [dict get $result data]
+		if {[info exists follow(children,$zpath)]} {
+			set known $follow(children,$zpath)
+		} else {
+			set known {}
+		}
+		set follow(children,$zpath) $children
+
+		# the znodes that are already known have their own watches,
+		# only new ones need fetching.  ones that went away take
+		# their directories with them.
+		foreach znode $children {
+			if {$znode ni $known} {
+				follow_znode $state [path join $zpath $znode]
+			}
+		}
+		foreach znode $known {
+			if {$znode ni $children} {
+				file delete -force -- $follow(path)/[path join $zpath $znode]
+			}
+		}
+	}
+
+	#
+	# follow_watch - a watch set for a follow has fired.  re-fetch
+	#   whatever changed, which sets the watch again.
+	#
+	proc follow_watch {state zpath kind event} {
+		upvar #0 $state follow
+
+		if {![info exists follow]} {
+			return
+		}
+
+		switch -exact -- [dict get $event type] {
+			changed {
+				if {$kind eq "data"} {
+					follow_data $state $zpath
+				}
+			}
+
+			child {
+				follow_children $state $zpath
+			}
+
+			deleted {
+				if {$kind eq "children"} {
+					unset -nocomplain follow(children,$zpath)
+				} elseif {$kind eq "data" && $zpath eq $follow(zpath)} {
+					follow_top_gone $state
+				}
+			}
+
+			created {
+				follow_znode $state $zpath
+			}
+
+			session {
+				# the client sets the watches again itself after a
+				# reconnect, but not once the session has expired.
+				if {[dict get $event state] eq "expired"} {
+					follow_stop $state
+				}
+			}
+		}
+	}
+
+	#
+	# follow_failed - a get or children for a follow didn't work out,
+	#   so no watch was left.  a znode that's gone is noticed by its
+	#   parent's children watch, except for the top.  anything short
+	#   of the session being lost is tried again in a bit.
+	#
+	proc follow_failed {state zpath kind status} {
+		variable followRetryMs
+		upvar #0 $state follow
+
+		switch -exact -- $status {
+			ZNONODE {
+				if {$kind eq "data" && $zpath eq $follow(zpath)} {
+					follow_top_gone $state
+				}
+			}
+
+			ZSESSIONEXPIRED -
+			ZINVALIDSTATE -
+			ZCLOSING {
+				follow_stop $state
+			}
+
+			default {
+				after $followRetryMs [list ::zookeeper::follow_retry $state $zpath $kind]
+			}
+		}
+	}
+
+	proc follow_retry {state zpath kind} {
+		upvar #0 $state follow
+
+		if {[info exists follow]} {
+			follow_$kind $state $zpath
+		}
+	}
+
+	#
+	# follow_top_gone - the top of the tree has no parent to notice
+	#   it going away, so clear it out and wait for it to come back
+	#
+	proc follow_top_gone {state} {
+		upvar #0 $state follow
+
+		set zpath $follow(zpath)
+		file delete -force -- $follow(path)/$zpath
+		follow_exists $state $zpath
+	}
+
+	proc follow_exists {state zpath} {
+		upvar #0 $state follow
+
+		if {[catch {$follow(zk) exists $zpath -watch [list ::zookeeper::follow_watch $state $zpath exists]} exists]} {
+			if {[lindex $::errorCode 0] eq "ZOOKEEPER"} {
+				follow_failed $state $zpath exists [lindex $::errorCode 1]
+				return
+			}
+			return -code error -errorinfo $::errorInfo -errorcode $::errorCode $exists
+		}
+		if {$exists} {
+			follow_znode $state $zpath
+		}
+	}
+
+	#
+	# follow_stop - give up on a follow for good, so it can be
+	#   started over
+	#
+	proc follow_stop {state} {
+		variable follows
+		upvar #0 $state follow
+
+		unset -nocomplain follows($follow(key))
+		unset follow
+	}
+
 	proc zls {{where ""}} {
 		variable zkwd
 